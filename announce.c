@@ -49,9 +49,9 @@
 
 
 static void	announce_update(int, short, void *);
-static void	handle_announce_response(struct bufferevent *, void *);
-static void	handle_announce_error(struct bufferevent *, short, void *);
-static void	handle_announce_write(struct bufferevent *, void *);
+static void	announce_retry(struct session *);
+static void	announce_handle_response(struct http_response *, void *);
+
 /*
  * announce()
  *
@@ -61,12 +61,10 @@ int
 announce(struct session *sc, const char *event)
 {
 	int i, l;
-	size_t n;
-	char host[MAXHOSTNAMELEN], port[6], path[MAXPATHLEN], *c;
+	char host[MAXHOSTNAMELEN], port[6], path[MAXPATHLEN];
 	char *params, *tparams, *request;
 	char tbuf[3*SHA1_DIGEST_LENGTH+1];
 	char pbuf[3*PEER_ID_LEN+1];
-	struct bufferevent *bufev;
 
 	trace("announce");
 	sc->last_announce = time(NULL);
@@ -92,46 +90,20 @@ announce(struct session *sc, const char *event)
 	}
 	/* XXX: need support for announce-list */
 	/* separate out hostname, port and path */
-	if ((c = strstr(sc->tp->announce, "http://")) == NULL)
-		errx(1, "unsupported announce protocol: %s", sc->tp->announce);
-	c += HTTPLEN;
-	n = strcspn(c, ":/");
-	if (n > sizeof(host) - 1)
-		errx(1, "n is greater than sizeof(host) - 1");
-
-	memcpy(host, c, n);
-	host[n] = '\0';
-
-	c += n;
-	if (*c == ':') {
-		c++;
-		n = strcspn(c, "/");
-		if (n > sizeof(port)) {
-			errx(1, "n is greater than sizeof(port)");
-		}
-		memcpy(port, c, n);
-		port[n] = '\0';
-	} else {
-		if (strlcpy(port, "80", sizeof(port)) >= sizeof(port))
-			errx(1, "string truncation");
-		n = 0;
-	}
-	c += n;
-	if (strlcpy(path, c, sizeof(path)) >= sizeof(path))
-		errx(1, "string truncation");
-	/* strip trailing slash */
-	if (path[strlen(path) - 1] == '/')
-		path[strlen(path) - 1] = '\0';
+	if (http_parse_url(sc->tp->announce, host, sizeof(host), port,
+	    sizeof(port), path, sizeof(path)) == -1)
+		errx(1, "unsupported announce url: %s", sc->tp->announce);
 
-	/* build params string */
+	/* build params string; the announce url may carry a query already */
 	l = snprintf(params, GETSTRINGLEN,
-	    "?info_hash=%s"
+	    "%cinfo_hash=%s"
 	    "&peer_id=%s"
 	    "&port=%s"
 	    "&uploaded=%jd"
 	    "&downloaded=%jd"
 	    "&left=%jd"
 	    "&compact=1",
+	    strchr(path, '?') == NULL ? '?' : '&',
 	    tbuf,
 	    pbuf,
 	    sc->port,
@@ -161,14 +133,14 @@ announce(struct session *sc, const char *event)
 	}
 	if (sc->numwant != NULL) {
 		strlcpy(tparams, params, GETSTRINGLEN);
-		l = snprintf(params, GETSTRINGLEN, "%s&numwant=%s", params,
+		l = snprintf(params, GETSTRINGLEN, "%s&numwant=%s", tparams,
 		    sc->numwant);
 		if (l == -1 || l >= GETSTRINGLEN)
 			goto trunc;
 	}
 	if (sc->key != NULL) {
 		strlcpy(tparams, params, GETSTRINGLEN);
-		l = snprintf(params, GETSTRINGLEN, "%s&key=%s", params,
+		l = snprintf(params, GETSTRINGLEN, "%s&key=%s", tparams,
 		    sc->key);
 		if (l == -1 || l >= GETSTRINGLEN)
 			goto trunc;
@@ -176,38 +148,28 @@ announce(struct session *sc, const char *event)
 	if (sc->trackerid != NULL) {
 		strlcpy(tparams, params, GETSTRINGLEN);
 		l = snprintf(params, GETSTRINGLEN, "%s&trackerid=%s",
-		    params, sc->trackerid);
+		    tparams, sc->trackerid);
 		if (l == -1 || l >= GETSTRINGLEN)
 			goto trunc;
 	}
 
-	l = snprintf(request, GETSTRINGLEN,
-	    "GET %s%s HTTP/1.0\r\nHost: %s\r\nUser-agent: Unworkable/%s\r\n\r\n", path,
-	    params, host, UNWORKABLE_VERSION);
+	/* strip trailing slash */
+	if (path[strlen(path) - 1] == '/' && path[1] != '\0')
+		path[strlen(path) - 1] = '\0';
+	l = snprintf(request, GETSTRINGLEN, "%s%s", path, params);
 	if (l == -1 || l >= GETSTRINGLEN)
 		goto trunc;
 
 	trace("announce() to host: %s on port: %s", host, port);
 	trace("announce() request: %s", request);
-	/* non blocking connect ? */
-	if ((sc->connfd = network_connect_tracker(host, port)) == -1)
-		err(1, "tracker announce");
-
-	sc->request = request;
-	sc->res = xmalloc(sizeof *sc->res);
-	memset(sc->res, 0, sizeof *sc->res);
-	sc->res->rxmsg = xmalloc(RESBUFLEN);
-	sc->res->rxmsglen = RESBUFLEN;
 	sc->announce_underway = 1;
-	bufev = bufferevent_new(sc->connfd, handle_announce_response,
-	    handle_announce_write, handle_announce_error, sc);
-	if (bufev == NULL)
-		errx(1, "announce: bufferevent_new failure");
-	bufferevent_enable(bufev, EV_READ);
-	trace("announce() writing to socket");
-	if (bufferevent_write(bufev, request, strlen(request) + 1) != 0)
-		errx(1, "announce: bufferevent_write failure");
+	if (http_get(host, port, request, announce_handle_response, sc) == -1) {
+		warnx("announce: could not contact tracker %s", host);
+		sc->announce_underway = 0;
+		announce_retry(sc);
+	}
 	xfree(params);
+	xfree(tparams);
 	xfree(request);
 	trace("announce() done");
 	return (0);
@@ -215,117 +177,61 @@ announce(struct session *sc, const char *event)
 trunc:
 	trace("announce: string truncation detected");
 	xfree(params);
-	xfree(request);
 	xfree(tparams);
+	xfree(request);
 	return (-1);
 }
 
 /*
- * handle_announce_response()
+ * announce_handle_response()
  *
- * When data is ready on the announce socket, this is called to buffer it up.
+ * Called by the HTTP client with the tracker's complete response, or with
+ * NULL if the request failed.  Handles all the announce response parsing.
  */
 static void
-handle_announce_response(struct bufferevent *bufev, void *arg)
+announce_handle_response(struct http_response *res, void *arg)
 {
-	size_t len;
-	struct session *sc;
-
-	sc = arg;
-	trace("handle_announce_response() reading buffer");
-	/* within 256 bytes of filling up our buffer - grow it */
-	if (sc->res->rxmsglen <= sc->res->rxread + 256) {
-		sc->res->rxmsglen += RESBUFLEN;
-		sc->res->rxmsg = xrealloc(sc->res->rxmsg, sc->res->rxmsglen);
-	}
-	len = bufferevent_read(bufev, sc->res->rxmsg + sc->res->rxread, 256);
-	sc->res->rxread += len;
-	trace("handle_announce_response() read %u", len);
-}
-
-/*
- * handle_announce_error()
- *
- * Called when the announce request socket is closed by the other
- * side - ie when the HTTP request has completed.  Handles all the announce
- * response parsing.
- */
-static void
-handle_announce_error(struct bufferevent *bufev, short error, void *data)
-{
-	struct session *sc = data;
+	struct session *sc = arg;
 	struct benc_node *node, *troot;
 	struct torrent *tp;
-	struct bufferevent *bev;
 	struct timeval tv;
-	BUF *buf = NULL;
-	u_int32_t l;
-	size_t len;
-	u_int8_t *c, *dump;
-
-	trace("handle_announce_error() called");
-	/* shouldn't have to worry about this case */
-	if (sc->res == NULL) {
-		sc->announce_underway = 0;
-		return;
-	}
-	/* still could be data left for reading */
-	do {
-		l = sc->res->rxread;
-		handle_announce_response(bufev, sc);
-	}
-	while (sc->res->rxread - l > 0);
-
-	/* XXX: this shouldn't happen - need to look into why it does */
-	if (sc->res->rxread == 0) {
-		sc->announce_underway = 0;
-		return;
-	}
+	BUF *buf;
 
+	trace("announce_handle_response() called");
+	sc->announce_underway = 0;
 	tp = sc->tp;
+	troot = NULL;
 
-	if (error & EVBUFFER_TIMEOUT)
-		errx(1, "handle_announce_error() TIMOUT (unexpected)");
-
-	c = sc->res->rxmsg;
-	/* XXX: need HTTP/1.1 support - tricky part is chunked encoding I think */
-	if (strncmp(c, HTTP_1_0, strlen(HTTP_1_0)) != 0 && strncmp(c, HTTP_1_1, strlen(HTTP_1_1))) {
-		warnx("handle_announce_error: server did not send a valid HTTP/1.0 response");
+	if (res == NULL) {
+		warnx("announce_handle_response: tracker request failed");
 		goto err;
 	}
-	c += strlen(HTTP_1_0) + 1;
-	if (strncmp(c, HTTP_OK, strlen(HTTP_OK)) != 0) {
-		*(c + strlen(HTTP_OK)) = '\0';
-		warnx("handle_announce_error: HTTP response indicates error (code: %s)", c);
+	if (res->code != HTTP_OK) {
+		warnx("announce_handle_response: HTTP response indicates error"
+		    " (code: %d)", res->code);
 		goto err;
 	}
-	c = strstr(c, HTTP_END);
-	if (c == NULL) {
-		warnx("handle_announce_error: HTTP response had no content");
+	if (res->bodylen == 0) {
+		warnx("announce_handle_response: HTTP response had no content");
 		goto err;
 	}
-	c += strlen(HTTP_END);
 
-	if ((buf = buf_alloc(128, BUF_AUTOEXT)) == NULL)
-		errx(1,"handle_announce_error: could not allocate buffer");
-	len = sc->res->rxread - (c - sc->res->rxmsg);
-	buf_set(buf, c, len, 0);
-	dump = xmalloc(len + 1);
-	memcpy(dump, c, len);
-	dump[len] = '\0';
-	trace("announce response: %s", dump);
-	xfree(dump);
-
-	trace("handle_announce_error() bencode parsing buffer");
+	/* parse straight out of the HTTP client's buffer */
+	buf = buf_wrap(res->body, res->bodylen);
+	trace("announce_handle_response() bencode parsing %zu byte buffer",
+	    res->bodylen);
 	troot = benc_root_create();
-	if ((troot = benc_parse_buf(buf, troot)) == NULL)
-		errx(1,"handle_announce_error: HTTP response parsing failed (no peers?)");
+	if (benc_parse_buf(buf, troot) == NULL) {
+		warnx("announce_handle_response: HTTP response parsing failed");
+		goto err;
+	}
 
 	/* check for a b-encoded failure response */
 	if ((node = benc_node_find(troot, "failure reason")) != NULL) {
 		if (!(node->flags & BSTRING))
 			trace("unspecified tracker failure");
-		trace("tracker failure: %s", node->body.string.value);
+		else
+			trace("tracker failure: %s", node->body.string.value);
 		goto err;
 	}
 	if ((node = benc_node_find(troot, "interval")) == NULL) {
@@ -336,65 +242,58 @@ handle_announce_error(struct bufferevent *bufev, short error, void *data)
 		tp->interval = node->body.number;
 	}
 
-	if ((node = benc_node_find(troot, "complete")) != NULL) {
-		if (!(node->flags & BINT))
-			errx(1, "complete is not a number");
-		tp->complete = node->body.number;
-	}
-
-	if ((node = benc_node_find(troot, "incomplete")) != NULL) {
-		if (!(node->flags & BINT))
-			errx(1, "incomplete is not a number");
-		tp->incomplete = node->body.number;
-	}
+	torrent_swarm_update(tp, troot, time(NULL));
+	ctl_server_notify_swarm(sc);
 
-	if ((node = benc_node_find(troot, "peers")) == NULL) {
+	if ((node = benc_node_find(troot, "peers")) == NULL
+	    && benc_node_find(troot, "peers6") == NULL) {
 		trace("no peers field");
 		goto err;
 	}
-	trace("handle_announce_error() updating peerlist");
-	network_peerlist_update(sc, node);
-	benc_node_freeall(troot);
-	troot = NULL;
+	trace("announce_handle_response() updating peerlist");
+	if (node != NULL)
+		network_peerlist_update(sc, node);
+	if ((node = benc_node_find(troot, "peers6")) != NULL)
+		network_peerlist_update6(sc, node);
 
-	trace("handle_announce_error() setting announce timer");
+	trace("announce_handle_response() setting announce timer");
 	timerclear(&tv);
 	tv.tv_sec = tp->interval;
 	evtimer_del(&sc->announce_event);
 	evtimer_set(&sc->announce_event, announce_update, sc);
 	evtimer_add(&sc->announce_event, &tv);
-	if (sc->servfd == 0) {
-		trace("handle_announce_error() setting up server socket");
-		/* time to set up the server socket */
-		if (sc->port != NULL) {
-			sc->servfd = network_listen("0.0.0.0", sc->port);
-			bev = bufferevent_new(sc->servfd, NULL,
-			    NULL, network_handle_peer_connect, sc);
-			if (bufev == NULL)
-				errx(1,
-				     "handle_announce_error: bufferevent_new failure");
-			bufferevent_enable(bev, EV_PERSIST|EV_READ);
-		}
-		/* now that we've announced, kick off the scheduler */
-		trace("handle_announce_error() setting up scheduler");
-		timerclear(&tv);
-		tv.tv_sec = 1;
-		evtimer_set(&sc->scheduler_event, scheduler, sc);
-		evtimer_add(&sc->scheduler_event, &tv);
-	}
+	/* now that we've announced, kick off the scheduler */
+	network_session_start(sc);
+	benc_node_freeall(troot);
+	trace("announce_handle_response() done");
+	return;
 err:
-	bufferevent_free(bufev);
-	bufev = NULL;
-	if (buf != NULL)
-		buf_free(buf);
-	if (sc->res != NULL) {
-		xfree(sc->res->rxmsg);
-		xfree(sc->res);
-		sc->res = NULL;
-	}
-	(void) close(sc->connfd);
-	trace("handle_announce_error() done");
-	sc->announce_underway = 0;
+	if (troot != NULL)
+		benc_node_freeall(troot);
+	announce_retry(sc);
+}
+
+/*
+ * announce_retry()
+ *
+ * An announce failed; try again in a little while, unless an announce is
+ * already scheduled to happen sooner.
+ */
+static void
+announce_retry(struct session *sc)
+{
+	struct timeval tv;
+
+	if (sc->tp->interval != 0 && sc->tp->interval <= MIN_ANNOUNCE_INTERVAL
+	    && evtimer_pending(&sc->announce_event, NULL))
+		return;
+	trace("announce_retry() retrying in %d seconds", MIN_ANNOUNCE_INTERVAL);
+	timerclear(&tv);
+	tv.tv_sec = MIN_ANNOUNCE_INTERVAL;
+	if (sc->tp->interval != 0)
+		evtimer_del(&sc->announce_event);
+	evtimer_set(&sc->announce_event, announce_update, sc);
+	evtimer_add(&sc->announce_event, &tv);
 }
 
 /*
@@ -414,21 +313,11 @@ announce_update(int fd, short type, void *arg)
 		announce(sc, NULL);
 	else
 		trace("announce_update() announce already underway");
+	if (evtimer_pending(&sc->announce_event, NULL))
+		return;
 	timerclear(&tv);
-	tv.tv_sec = sc->tp->interval;
+	tv.tv_sec = sc->tp->interval != 0 ? sc->tp->interval
+	    : DEFAULT_ANNOUNCE_INTERVAL;
 	evtimer_set(&sc->announce_event, announce_update, sc);
 	evtimer_add(&sc->announce_event, &tv);
 }
-
-/*
- * announce_handle_write()
- *
- * Write handler for announce http request socket.
- */
-static void
-handle_announce_write(struct bufferevent *bufev, void *data)
-{
-	trace("handle_announce_write() called");
-}
-
-
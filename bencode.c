@@ -15,6 +15,9 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/param.h>
+
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,7 +27,17 @@
 #define IS_CONTAINER_TYPE(x) \
 	(x->flags & BDICT || x->flags & BLIST)
 
-struct benc_node *root;
+/* nodes in the first chunk of a tree, and most in any later one */
+#define BENC_CHUNK_MIN	32
+#define BENC_CHUNK_MAX	4096
+
+/* the nodes of a tree are handed out of chunks, and freed all together */
+struct benc_chunk {
+	struct benc_chunk	*next;
+	size_t			 used;
+	size_t			 size;
+	struct benc_node	*nodes;
+};
 
 /*
  * benc_node_add()
@@ -37,31 +50,32 @@ benc_node_add(struct benc_node *node, struct benc_node *new)
 	TAILQ_INSERT_TAIL(&node->children, new, benc_nodes);
 }
 
-/*
- * benc_node_add_head()
- *
- * Add new node to head of node's child queue
- */
-void
-benc_node_add_head(struct benc_node *node, struct benc_node *new)
-{
-	TAILQ_INSERT_HEAD(&node->children, new, benc_nodes);
-}
-
 /*
  * benc_node_create()
  *
- * Create and initialise a benc_node
+ * Create and initialise a benc_node in the tree under <root>.  It lives
+ * as long as the tree does.
  */
 struct benc_node *
-benc_node_create(void)
+benc_node_create(struct benc_node *root)
 {
+	struct benc_chunk *c;
 	struct benc_node *node;
+	size_t size;
 
-	node = xmalloc(sizeof(*node));
-
+	c = root->body.root.chunks;
+	if (c == NULL || c->used == c->size) {
+		size = c == NULL ? BENC_CHUNK_MIN
+		    : MIN(c->size * 2, BENC_CHUNK_MAX);
+		c = xmalloc(sizeof(*c) + size * sizeof(*node));
+		c->next = root->body.root.chunks;
+		c->used = 0;
+		c->size = size;
+		c->nodes = (struct benc_node *)(c + 1);
+		root->body.root.chunks = c;
+	}
+	node = &c->nodes[c->used++];
 	memset(node, 0, sizeof(*node));
-
 	TAILQ_INIT(&(node->children));
 
 	return (node);
@@ -96,6 +110,93 @@ benc_node_find(struct benc_node *node, char *key)
 	return (NULL);
 }
 
+/*
+ * benc_check()
+ *
+ * Make sure untrusted input is a single, well formed b-encoded dictionary,
+ * nested no deeper than <maxdepth>, before we let the parser near it.
+ * Returns 0 if it looks fine, -1 otherwise.
+ */
+int
+benc_check(const u_int8_t *b, size_t len, int maxdepth)
+{
+	size_t i, n;
+	int depth, digits;
+
+	if (len == 0 || b[0] != 'd')
+		return (-1);
+	i = 0;
+	depth = 0;
+	while (i < len) {
+		switch (b[i]) {
+		case 'd':
+		case 'l':
+			if (++depth > maxdepth)
+				return (-1);
+			i++;
+			break;
+		case 'e':
+			i++;
+			if (--depth == 0)
+				return (i == len ? 0 : -1);
+			break;
+		case 'i':
+			i++;
+			if (i < len && b[i] == '-')
+				i++;
+			for (digits = 0; i < len && isdigit(b[i]); i++)
+				digits++;
+			if (digits == 0 || digits > 18 || i == len
+			    || b[i] != 'e')
+				return (-1);
+			i++;
+			break;
+		default:
+			n = 0;
+			for (digits = 0; i < len && isdigit(b[i]); i++) {
+				n = n * 10 + (b[i] - '0');
+				if (n > len)
+					return (-1);
+				digits++;
+			}
+			if (digits == 0 || i == len || b[i] != ':')
+				return (-1);
+			i++;
+			if (n > len - i)
+				return (-1);
+			i += n;
+			break;
+		}
+	}
+
+	return (-1);
+}
+
+/*
+ * benc_dict_get()
+ *
+ * Look up <key> in a dictionary, without descending into its values as
+ * benc_node_find() would.  Returns NULL unless the value has type <type>.
+ */
+struct benc_node *
+benc_dict_get(struct benc_node *dict, const char *key, int type)
+{
+	struct benc_node *n;
+
+	if (dict == NULL)
+		return (NULL);
+	TAILQ_FOREACH(n, &dict->children, benc_nodes) {
+		if (!(n->flags & BDICT_ENTRY)
+		    || strcmp(n->body.dict_entry.key, key) != 0)
+			continue;
+		if (n->body.dict_entry.value->flags & type)
+			return (n->body.dict_entry.value);
+		return (NULL);
+	}
+
+	return (NULL);
+}
+
 /*
  * benc_node_print()
  *
@@ -134,29 +235,21 @@ benc_node_print(struct benc_node *node, int level)
 /*
  * benc_node_freeall()
  *
- * Walk the tree from this node down, freeing everything.
+ * Free a tree made by benc_root_create(), along with the buffer it was
+ * parsed from.
  */
 void
-benc_node_freeall(struct benc_node *node)
+benc_node_freeall(struct benc_node *root)
 {
-	struct benc_node *childnode;
-
-	if (node->flags & BDICT_ENTRY) {
-		xfree(node->body.dict_entry.key);
-		benc_node_freeall(node->body.dict_entry.value);
-	} else if (node->flags & BSTRING) {
-		xfree(node->body.string.value);
-	}
+	struct benc_chunk *c;
 
-	if (IS_CONTAINER_TYPE(node)) {
-		while ((childnode = TAILQ_FIRST(&node->children)) != NULL) {
-			TAILQ_REMOVE(&node->children, childnode, benc_nodes);
-			benc_node_freeall(childnode);
-		}
+	while ((c = root->body.root.chunks) != NULL) {
+		root->body.root.chunks = c->next;
+		xfree(c);
 	}
-
-	if (node != NULL)
-		xfree(node);
+	if (root->body.root.buf != NULL)
+		buf_free(root->body.root.buf);
+	xfree(root);
 }
 
 /*
@@ -167,8 +260,93 @@ benc_node_freeall(struct benc_node *node)
 struct benc_node *
 benc_root_create(void)
 {
-	struct benc_node *n = benc_node_create();
+	struct benc_node *n;
+
+	n = xmalloc(sizeof(*n));
+	memset(n, 0, sizeof(*n));
+	TAILQ_INIT(&(n->children));
 	n->flags = BLIST;
 
 	return (n);
 }
+
+/*
+ * benc_put_int()
+ *
+ * Append a b-encoded integer to <b>.  The benc_put_*() functions write
+ * straight into the buffer, without building a node tree first, so the
+ * caller must put dictionary keys in order.
+ */
+void
+benc_put_int(BUF *b, long long n)
+{
+	char num[32];
+	int l;
+
+	l = snprintf(num, sizeof(num), "i%llde", n);
+	if (l == -1 || l >= (int)sizeof(num))
+		errx(1, "benc_put_int: snprintf truncation");
+	buf_append(b, num, l);
+}
+
+/*
+ * benc_put_str()
+ *
+ * Append a b-encoded string of <len> bytes to <b>.
+ */
+void
+benc_put_str(BUF *b, const void *s, size_t len)
+{
+	char num[32];
+	int l;
+
+	l = snprintf(num, sizeof(num), "%zu:", len);
+	if (l == -1 || l >= (int)sizeof(num))
+		errx(1, "benc_put_str: snprintf truncation");
+	buf_append(b, num, l);
+	buf_append(b, s, len);
+}
+
+/*
+ * benc_put_key()
+ *
+ * Append a dictionary key to <b>.
+ */
+void
+benc_put_key(BUF *b, const char *key)
+{
+	benc_put_str(b, key, strlen(key));
+}
+
+/*
+ * benc_put_dict()
+ *
+ * Start a dictionary, to be ended with benc_put_end().
+ */
+void
+benc_put_dict(BUF *b)
+{
+	buf_append(b, "d", 1);
+}
+
+/*
+ * benc_put_list()
+ *
+ * Start a list, to be ended with benc_put_end().
+ */
+void
+benc_put_list(BUF *b)
+{
+	buf_append(b, "l", 1);
+}
+
+/*
+ * benc_put_end()
+ *
+ * End the innermost dictionary or list.
+ */
+void
+benc_put_end(BUF *b)
+{
+	buf_append(b, "e", 1);
+}
@@ -128,6 +128,29 @@ buf_load(const char *path, u_int flags)
 	return (buf);
 }
 
+/*
+ * buf_wrap()
+ *
+ * Create a read-only buffer structure around <len> bytes of existing data
+ * at <data>, without copying it.  The data is not freed by buf_free() and
+ * must stay valid for as long as the buffer is in use.
+ */
+BUF *
+buf_wrap(void *data, size_t len)
+{
+	BUF *b;
+
+	b = xmalloc(sizeof(*b));
+	b->cb_flags = BUF_WRAPPED;
+	b->cb_buf = data;
+	b->cb_size = len;
+	b->cb_cur = b->cb_buf;
+	b->cb_len = len;
+	b->cb_pos = 0;
+
+	return (b);
+}
+
 /*
  * buf_free()
  *
@@ -136,7 +159,7 @@ buf_load(const char *path, u_int flags)
 void
 buf_free(BUF *b)
 {
-	if (b->cb_buf != NULL)
+	if (b->cb_buf != NULL && !(b->cb_flags & BUF_WRAPPED))
 		xfree(b->cb_buf);
 	xfree(b);
 }
@@ -192,6 +215,45 @@ buf_set(BUF *b, const void *src, size_t len, size_t off)
 	return (rlen);
 }
 
+/*
+ * buf_append()
+ *
+ * Append <len> bytes of data pointed to by <data> to the buffer <b>.  If the
+ * buffer is too small to accept all data, it will attempt to append as much
+ * data as possible, or if the BUF_AUTOEXT flag is set for the buffer, it
+ * will get resized to an appropriate size to accept all data.
+ * Returns the number of bytes successfully appended to the buffer.
+ */
+ssize_t
+buf_append(BUF *b, const void *data, size_t len)
+{
+	size_t left, rlen, grow;
+	u_char *bp, *bep;
+
+	bp = b->cb_cur + b->cb_len;
+	bep = b->cb_buf + b->cb_size;
+	left = bep - bp;
+	rlen = len;
+
+	if (left < len) {
+		if (b->cb_flags & BUF_AUTOEXT) {
+			/* at least double, so appending stays cheap */
+			grow = b->cb_size > BUF_INCR ? b->cb_size : BUF_INCR;
+			if (grow < len - left)
+				grow = len - left;
+			buf_grow(b, grow);
+			bp = b->cb_cur + b->cb_len;
+		} else {
+			rlen = bep - bp;
+		}
+	}
+
+	memcpy(bp, data, rlen);
+	b->cb_len += rlen;
+
+	return (rlen);
+}
+
 /*
  * buf_getc()
  *
@@ -218,6 +280,17 @@ buf_ungetc(BUF *b)
 		b->cb_pos--;
 }
 
+/*
+ * buf_get()
+ *
+ * Return a pointer to the start of the data in buffer <b>.
+ */
+void *
+buf_get(BUF *b)
+{
+	return (b->cb_cur);
+}
+
 /*
  * buf_len()
  *
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Read cache for uploads.
+ *
+ * Peers fetching a piece usually ask for its blocks one after the other,
+ * so the first request for a block of a piece reads the whole piece into
+ * memory, and the rest are served from there.  Pieces are dropped least
+ * recently used first once the cache holds more than cache_size bytes.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "includes.h"
+
+/* most bytes of piece data the read cache may hold */
+u_int64_t cache_size = CACHE_DEFAULT_SIZE;
+
+static int	cache_piece_load(struct session *, struct torrent_piece *);
+static void	cache_piece_evict(struct session *, struct torrent_piece *);
+
+/*
+ * cache_piece_load()
+ *
+ * Read all of a good piece into the cache.  Returns -1 if it could not
+ * be read.
+ */
+static int
+cache_piece_load(struct session *sc, struct torrent_piece *tpp)
+{
+	u_int8_t *data;
+	int hint, mapped;
+
+	mapped = tpp->flags & TORRENT_PIECE_MAPPED;
+	if (!mapped)
+		torrent_piece_map(tpp);
+	if ((data = torrent_block_read(tpp, 0, tpp->len, &hint)) == NULL) {
+		if (!mapped)
+			torrent_piece_unmap(tpp);
+		return (-1);
+	}
+	tpp->cache = xmalloc(tpp->len);
+	memcpy(tpp->cache, data, tpp->len);
+	if (hint == 1)
+		xfree(data);
+	/* nobody else wanted it mapped, so don't keep it that way */
+	if (!mapped)
+		torrent_piece_unmap(tpp);
+	TAILQ_INSERT_HEAD(&sc->cache_lru, tpp, cached);
+	sc->cache_bytes += tpp->len;
+
+	return (0);
+}
+
+/*
+ * cache_piece_evict()
+ *
+ * Drop a piece from the cache.
+ */
+static void
+cache_piece_evict(struct session *sc, struct torrent_piece *tpp)
+{
+	TAILQ_REMOVE(&sc->cache_lru, tpp, cached);
+	sc->cache_bytes -= tpp->len;
+	xfree(tpp->cache);
+	tpp->cache = NULL;
+}
+
+/*
+ * cache_block_read()
+ *
+ * Return <len> bytes at offset <off> of good piece <tpp> from the cache,
+ * reading the whole piece in first if need be.  The data belongs to the
+ * cache.  Returns NULL if the piece can't be cached, in which case the
+ * caller must read the block itself.
+ */
+u_int8_t *
+cache_block_read(struct session *sc, struct torrent_piece *tpp, u_int32_t off,
+    u_int32_t len)
+{
+	struct torrent_piece *old;
+
+	if (tpp->len > cache_size || !(tpp->flags & TORRENT_PIECE_CKSUMOK))
+		return (NULL);
+	if (tpp->cache != NULL) {
+		sc->cache_hits++;
+		TAILQ_REMOVE(&sc->cache_lru, tpp, cached);
+		TAILQ_INSERT_HEAD(&sc->cache_lru, tpp, cached);
+		return (tpp->cache + off);
+	}
+	sc->cache_misses++;
+	while (sc->cache_bytes + tpp->len > cache_size
+	    && (old = TAILQ_LAST(&sc->cache_lru, cache_lru)) != NULL)
+		cache_piece_evict(sc, old);
+	if (cache_piece_load(sc, tpp) == -1)
+		return (NULL);
+	trace("cache_block_read() read piece %u, %llu bytes cached",
+	    tpp->index, (unsigned long long)sc->cache_bytes);
+
+	return (tpp->cache + off);
+}
@@ -25,6 +25,7 @@
 #include <errno.h>
 #include <event.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -47,6 +48,9 @@ static void ctl_server_broadcast_message(struct ctl_server *, char *);
 static void ctl_server_write_message(struct ctl_server_conn *, char *);
 static char * ctl_server_pieces(struct session *);
 static char * ctl_server_peers(struct session *);
+static char * ctl_server_swarm(struct session *);
+static char * ctl_server_bans(struct session *);
+static char * ctl_server_cache(struct session *);
 
 /*
  * ctl_server_start()
@@ -65,7 +69,8 @@ ctl_server_start(struct session *sc, char *port, off_t started)
 	sc->ctl_server = cs;
 	cs->started = started;
 	cs->sc = sc;
-	cs->fd = network_listen("0.0.0.0", port);
+	if ((cs->fd = network_listen("0.0.0.0", port)) == -1)
+		err(1, "could not listen on control port %s", port);
 	cs->bev = bufferevent_new(cs->fd, NULL, NULL,
 	    ctl_server_handle_connect, cs);
 	if (cs->bev == NULL)
@@ -131,6 +136,57 @@ ctl_server_notify_peers(struct session *sc)
 	xfree(msg);
 }
 
+/*
+ * ctl_server_notify_swarm()
+ *
+ * Notify control connections of the tracker's seeder and leecher counts.
+ */
+void
+ctl_server_notify_swarm(struct session *sc)
+{
+	char *msg;
+
+	if (sc->ctl_server == NULL)
+		return;
+	msg = ctl_server_swarm(sc);
+	ctl_server_broadcast_message(sc->ctl_server, msg);
+	xfree(msg);
+}
+
+/*
+ * ctl_server_notify_bans()
+ *
+ * Notify control connections of the hosts we have banned.
+ */
+void
+ctl_server_notify_bans(struct session *sc)
+{
+	char *msg;
+
+	if (sc->ctl_server == NULL)
+		return;
+	msg = ctl_server_bans(sc);
+	ctl_server_broadcast_message(sc->ctl_server, msg);
+	xfree(msg);
+}
+
+/*
+ * ctl_server_notify_cache()
+ *
+ * Notify control connections of how the read cache is doing.
+ */
+void
+ctl_server_notify_cache(struct session *sc)
+{
+	char *msg;
+
+	if (sc->ctl_server == NULL)
+		return;
+	msg = ctl_server_cache(sc);
+	ctl_server_broadcast_message(sc->ctl_server, msg);
+	xfree(msg);
+}
+
 /*
  * ctl_server_handle_connect()
  *
@@ -158,8 +214,8 @@ ctl_server_handle_connect(struct bufferevent *bufev, short error, void *data)
 		ctl_server_conn_free(csc);
 		return;
 	}
-	trace("ctl_server_handle_connectt() accepted connection: %s:%d",
-	    inet_ntoa(csc->sa.sin_addr), ntohs(csc->sa.sin_port));
+	trace("ctl_server_handle_connectt() accepted connection: %s",
+	    print_host(&csc->sa));
 
 	csc->bev = bufferevent_new(csc->fd, ctl_server_handle_conn_message,
 	    NULL, ctl_server_handle_conn_error, csc);
@@ -238,18 +294,65 @@ ctl_server_conn_bootstrap(struct ctl_server_conn *csc)
 	msg = ctl_server_peers(csc->cs->sc);
 	ctl_server_write_message(csc, msg);
 	xfree(msg);
+	msg = ctl_server_swarm(csc->cs->sc);
+	ctl_server_write_message(csc, msg);
+	xfree(msg);
+	msg = ctl_server_bans(csc->cs->sc);
+	ctl_server_write_message(csc, msg);
+	xfree(msg);
+	msg = ctl_server_cache(csc->cs->sc);
+	ctl_server_write_message(csc, msg);
+	xfree(msg);
 	trace("bootstrapped");
 }
 
 /*
  * ctl_server_handle_conn_message()
  *
- * Handle a message from a connection to the control server.
+ * Handle a message from a connection to the control server.  Messages
+ * are lines of the same "name:value" form as those we send:
+ * "seek:<offset>" moves the streaming mode playback position to byte
+ * <offset> of the torrent, and "priority:<spec>" changes file priorities
+ * as the -f option does.
  */
 static void
 ctl_server_handle_conn_message(struct bufferevent *bufev, void *data)
 {
-	/* TODO */
+	struct ctl_server_conn *csc;
+	const char *errstr;
+	char *line, msg[CTL_MESSAGE_LEN];
+	long long off;
+	int l;
+
+	csc = data;
+	while ((line = evbuffer_readline(EVBUFFER_INPUT(bufev))) != NULL) {
+		if (strncmp(line, "seek:", 5) == 0) {
+			off = strtonum(line + 5, 0, LLONG_MAX, &errstr);
+			if (errstr != NULL) {
+				trace("ctl_server_handle_conn_message() seek offset is %s: %s",
+				    errstr, line + 5);
+			} else {
+				scheduler_stream_seek(csc->cs->sc, off);
+				l = snprintf(msg, sizeof(msg), "stream:%jd\r\n",
+				    (intmax_t)csc->cs->sc->stream_pos);
+				if (l == -1 || l >= (int)sizeof(msg))
+					errx(1, "ctl_server_handle_conn_message() string truncation");
+				ctl_server_broadcast_message(csc->cs, msg);
+			}
+		} else if (strncmp(line, "priority:", 9) == 0) {
+			if (scheduler_priority_set(csc->cs->sc, line + 9) == -1)
+				trace("ctl_server_handle_conn_message() bad priorities: %s",
+				    line + 9);
+		} else {
+			trace("ctl_server_handle_conn_message() unknown message: %s",
+			    line);
+		}
+		free(line);
+	}
+	/* nobody sends lines this long */
+	if (EVBUFFER_LENGTH(EVBUFFER_INPUT(bufev)) > CTL_MESSAGE_LEN)
+		evbuffer_drain(EVBUFFER_INPUT(bufev),
+		    EVBUFFER_LENGTH(EVBUFFER_INPUT(bufev)));
 }
 
 /*
@@ -354,13 +457,11 @@ ctl_server_peers(struct session *sc)
 	TAILQ_FOREACH(p, &sc->peers, peer_list) {
 			count++;
 			if (count == sc->num_peers) {
-				snprintf(peer, sizeof(peer), "%s:%d\r\n",
-				    inet_ntoa(p->sa.sin_addr),
-				    ntohs(p->sa.sin_port));
+				snprintf(peer, sizeof(peer), "%s\r\n",
+				    print_host(&p->sa));
 			} else {
-				snprintf(peer, sizeof(peer), "%s:%d,",
-				    inet_ntoa(p->sa.sin_addr),
-				    ntohs(p->sa.sin_port));
+				snprintf(peer, sizeof(peer), "%s,",
+				    print_host(&p->sa));
 			}
 			if (strlcat(msg, peer, msglen) >= msglen)
 				errx(1, "ctl_server_peers() string truncation");
@@ -368,3 +469,88 @@ ctl_server_peers(struct session *sc)
 
 	return (msg);
 }
+
+/*
+ * ctl_server_swarm()
+ *
+ * Allocate and return string containing swarm message.
+ */
+static char *
+ctl_server_swarm(struct session *sc)
+{
+	char *msg;
+	int l;
+
+	msg = xmalloc(CTL_MESSAGE_LEN);
+	memset(msg, '\0', CTL_MESSAGE_LEN);
+	l = snprintf(msg, CTL_MESSAGE_LEN, "swarm:%u,%u\r\n",
+	    sc->tp->complete, sc->tp->incomplete);
+	if (l == -1 || l >= (int)CTL_MESSAGE_LEN)
+		errx(1, "ctl_server_swarm() string truncation");
+
+	return (msg);
+}
+
+/*
+ * ctl_server_bans()
+ *
+ * Allocate and return string containing bans message: the banned hosts,
+ * each with the number of good and bad pieces it sent, like
+ * "bans:10.0.0.1:6881/3/2,...".
+ */
+static char *
+ctl_server_bans(struct session *sc)
+{
+	struct peer_trust *t;
+	u_int32_t msglen, count;
+	char *msg, ban[64];
+	time_t now;
+
+	now = time(NULL);
+	count = 0;
+	RB_FOREACH(t, trust_by_host, &sc->trust_by_host)
+		if (t->banned > now)
+			count++;
+	msglen = CTL_MESSAGE_LEN + (sizeof(ban) * count);
+	msg = xmalloc(msglen);
+	memset(msg, '\0', msglen);
+	snprintf(msg, msglen, "bans:");
+
+	RB_FOREACH(t, trust_by_host, &sc->trust_by_host) {
+		if (t->banned <= now)
+			continue;
+		snprintf(ban, sizeof(ban), "%s%s/%u/%u",
+		    *(msg + 5) == '\0' ? "" : ",", print_host(&t->sa),
+		    t->good, t->bad);
+		if (strlcat(msg, ban, msglen) >= msglen)
+			errx(1, "ctl_server_bans() string truncation");
+	}
+	if (strlcat(msg, "\r\n", msglen) >= msglen)
+		errx(1, "ctl_server_bans() string truncation");
+
+	return (msg);
+}
+
+/*
+ * ctl_server_cache()
+ *
+ * Allocate and return string containing cache message: read cache hits,
+ * misses and bytes held, like "cache:120,8,2097152".
+ */
+static char *
+ctl_server_cache(struct session *sc)
+{
+	char *msg;
+	int l;
+
+	msg = xmalloc(CTL_MESSAGE_LEN);
+	memset(msg, '\0', CTL_MESSAGE_LEN);
+	l = snprintf(msg, CTL_MESSAGE_LEN, "cache:%llu,%llu,%llu\r\n",
+	    (unsigned long long)sc->cache_hits,
+	    (unsigned long long)sc->cache_misses,
+	    (unsigned long long)sc->cache_bytes);
+	if (l == -1 || l >= (int)CTL_MESSAGE_LEN)
+		errx(1, "ctl_server_cache() string truncation");
+
+	return (msg);
+}
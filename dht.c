@@ -0,0 +1,1481 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Mainline DHT node (BEP 5).
+ *
+ * A single node is shared by all sessions.  It listens on a UDP socket
+ * with the same port number as the peer listener.  The routing table has
+ * one bucket of up to DHT_K nodes for each possible length of the prefix
+ * shared with our id.
+ *
+ * Lookups are iterative.  Each one keeps the closest nodes seen so far,
+ * ordered by XOR distance to the target, and has at most DHT_ALPHA
+ * queries in flight.  A get_peers lookup ends with an announce_peer to
+ * the closest nodes which gave us a token.  Any peers found are handed
+ * to the session's peer list, just like a tracker response.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sha1.h>
+
+#include <openssl/rand.h>
+
+#include "includes.h"
+
+#define DHT_ID_LEN		SHA1_DIGEST_LENGTH
+#define DHT_NODE_LEN		(DHT_ID_LEN + COMPACT_LEN) /* compact node info */
+#define DHT_NODE_LEN6		(DHT_ID_LEN + COMPACT_LEN6)
+#define DHT_BUCKETS		(DHT_ID_LEN * 8)
+#define DHT_SEARCH_NODES	(DHT_K * 2)
+#define DHT_BOOT_MAX		64
+#define DHT_TOKEN_LEN		8
+#define DHT_TOKEN_MAX		64
+#define DHT_TID_MAX		32
+#define DHT_MAX_DEPTH		8
+#define DHT_MAX_FAILS		3
+#define DHT_CACHE_MAX		200
+
+/* routing table, and "want" bit, for an address family */
+#define DHT_AF(sa)		((sa)->ss_family == AF_INET6)
+#define DHT_WANT_N4		(1 << 0)
+#define DHT_WANT_N6		(1 << 1)
+
+/* query types */
+#define DHT_Q_PING		0
+#define DHT_Q_FIND_NODE		1
+#define DHT_Q_GET_PEERS		2
+#define DHT_Q_ANNOUNCE		3
+
+/* lookup node states */
+#define DHT_SN_NEW		0
+#define DHT_SN_QUERIED		1
+#define DHT_SN_REPLIED		2
+#define DHT_SN_FAILED		3
+
+struct dht_node {
+	TAILQ_ENTRY(dht_node)	nodes;
+	u_int8_t		id[DHT_ID_LEN];
+	struct sockaddr_storage	sa;
+	time_t			last_seen;
+	int			fails;
+};
+
+struct dht_bucket {
+	TAILQ_HEAD(dht_nodes, dht_node) nodes;
+	int			count;
+};
+
+struct dht_search_node {
+	u_int8_t		id[DHT_ID_LEN];
+	int			hasid;
+	struct sockaddr_storage	sa;
+	int			state;
+	u_int8_t		token[DHT_TOKEN_MAX];
+	size_t			tokenlen;
+};
+
+struct dht_search {
+	TAILQ_ENTRY(dht_search)	searches;
+	int			type;
+	struct session		*sc;
+	u_int8_t		target[DHT_ID_LEN];
+	struct dht_search_node	nodes[DHT_SEARCH_NODES];
+	int			count;
+	int			inflight;
+	u_int32_t		npeers;
+};
+
+struct dht_query {
+	TAILQ_ENTRY(dht_query)	queries;
+	u_int16_t		tid;
+	int			type;
+	struct sockaddr_storage	sa;
+	time_t			sent;
+	struct dht_search	*search;
+};
+
+/* a peer which announced itself to us */
+struct dht_stored {
+	TAILQ_ENTRY(dht_stored)	stored;
+	u_int8_t		info_hash[DHT_ID_LEN];
+	u_int8_t		addr[COMPACT_LEN6];
+	size_t			addrlen;
+	time_t			added;
+};
+
+/* outgoing message under construction */
+struct dht_msg {
+	u_int8_t		buf[DHT_MAX_MSG];
+	size_t			len;
+	int			overflow;
+};
+
+int dht_enabled = 0;
+
+static int			dht_running;
+static struct event		dht_timer;
+static u_int8_t			dht_id[DHT_ID_LEN];
+static u_int8_t			dht_secret[DHT_ID_LEN];
+static u_int8_t			dht_oldsecret[DHT_ID_LEN];
+static time_t			dht_secret_time;
+static time_t			dht_last_refresh;
+static time_t			dht_last_save;
+static u_int16_t		dht_tid;
+/* one routing table for IPv4 nodes and one for IPv6 (BEP 32) */
+static struct dht_bucket	dht_buckets[2][DHT_BUCKETS];
+static int			dht_num_nodes;
+static struct dht_search_node	dht_boot[DHT_BOOT_MAX];
+static int			dht_num_boot;
+static int			dht_num_queries;
+static int			dht_num_stored;
+static TAILQ_HEAD(dht_searches, dht_search) dht_searches =
+    TAILQ_HEAD_INITIALIZER(dht_searches);
+static TAILQ_HEAD(dht_queries, dht_query) dht_queries =
+    TAILQ_HEAD_INITIALIZER(dht_queries);
+static TAILQ_HEAD(dht_storage, dht_stored) dht_storage =
+    TAILQ_HEAD_INITIALIZER(dht_storage);
+
+static void	dht_random(u_int8_t *, size_t);
+static void	dht_boot_add(const u_int8_t *, const struct sockaddr_storage *);
+static void	dht_boot_resolve(const char *, const char *);
+static void	dht_load(struct session *);
+static int	dht_bucket_index(const u_int8_t *);
+static int	dht_closer(const u_int8_t *, const u_int8_t *,
+		    const u_int8_t *);
+static void	dht_node_heard(const u_int8_t *, const struct sockaddr_storage *);
+static void	dht_node_failed(const struct sockaddr_storage *);
+static int	dht_closest(int, const u_int8_t *, struct dht_node **, int);
+static void	dht_put(struct dht_msg *, const void *, size_t);
+static void	dht_put_str(struct dht_msg *, const void *, size_t);
+static void	dht_put_key(struct dht_msg *, const char *);
+static void	dht_put_int(struct dht_msg *, long long);
+static void	dht_send(struct dht_msg *, const struct sockaddr_storage *);
+static int	dht_query(int, const struct sockaddr_storage *,
+		    struct dht_search *, const u_int8_t *, const u_int8_t *,
+		    size_t);
+static void	dht_reply_begin(struct dht_msg *);
+static void	dht_reply_end(struct dht_msg *, struct benc_node *);
+static void	dht_reply_error(const struct sockaddr_storage *,
+		    struct benc_node *, int, const char *);
+static void	dht_reply_nodes(struct dht_msg *, const u_int8_t *, int);
+static int	dht_want(struct benc_node *, const struct sockaddr_storage *);
+static void	dht_token(const struct sockaddr_storage *, const u_int8_t *,
+		    u_int8_t *);
+static void	dht_process_query(struct benc_node *, struct benc_node *,
+		    const struct sockaddr_storage *);
+static void	dht_process_reply(struct benc_node *, struct benc_node *,
+		    const struct sockaddr_storage *, int);
+static void	dht_store(const u_int8_t *, const struct sockaddr_storage *,
+		    u_int16_t);
+static void	dht_search_start(int, const u_int8_t *, struct session *);
+static void	dht_search_add(struct dht_search *, const u_int8_t *,
+		    const struct sockaddr_storage *);
+static struct dht_search_node *dht_search_node_find(struct dht_search *,
+		    const struct sockaddr_storage *);
+static void	dht_search_add_nodes(struct dht_search *, struct benc_node *,
+		    size_t);
+static void	dht_search_step(struct dht_search *);
+static void	dht_search_finish(struct dht_search *);
+static void	dht_periodic(int, short, void *);
+
+/*
+ * dht_start()
+ *
+ * Start the DHT node if it isn't already running, and make sure the
+ * session's torrent gets looked up.
+ */
+void
+dht_start(struct session *sc)
+{
+	struct benc_node *nodes, *n, *host, *port;
+	struct timeval tv;
+	char portstr[6], *list, *entry, *p, *c;
+	int af, l;
+
+	sc->last_dht_search = 0;
+	/* nodes listed in the torrent itself make good bootstrap nodes */
+	if ((nodes = benc_node_find(sc->tp->broot, "nodes")) != NULL
+	    && nodes->flags & BLIST) {
+		TAILQ_FOREACH(n, &nodes->children, benc_nodes) {
+			if (!(n->flags & BLIST)
+			    || (host = TAILQ_FIRST(&n->children)) == NULL
+			    || (port = TAILQ_NEXT(host, benc_nodes)) == NULL
+			    || !(host->flags & BSTRING) || !(port->flags & BINT))
+				continue;
+			l = snprintf(portstr, sizeof(portstr), "%lld",
+			    port->body.number);
+			if (l == -1 || l >= (int)sizeof(portstr))
+				continue;
+			dht_boot_resolve(host->body.string.value, portstr);
+		}
+	}
+	if (dht_running)
+		return;
+
+	trace("dht_start() starting DHT node on port %s", sc->port);
+	if (udp_open(sc->port) == -1) {
+		warnx("dht_start: could not open DHT socket, DHT disabled");
+		dht_enabled = 0;
+		return;
+	}
+	dht_running = 1;
+	for (af = 0; af < 2; af++)
+		for (l = 0; l < DHT_BUCKETS; l++)
+			TAILQ_INIT(&dht_buckets[af][l].nodes);
+	dht_random(dht_id, sizeof(dht_id));
+	dht_random(dht_secret, sizeof(dht_secret));
+	memcpy(dht_oldsecret, dht_secret, sizeof(dht_oldsecret));
+	dht_secret_time = time(NULL);
+	/* may replace our id with the one we used last time */
+	dht_load(sc);
+	if (dht_num_boot < DHT_K) {
+		p = list = xstrdup(DHT_BOOTSTRAP_NODES);
+		while ((entry = strsep(&p, " ")) != NULL) {
+			if ((c = strrchr(entry, ':')) == NULL)
+				continue;
+			*c++ = '\0';
+			dht_boot_resolve(entry, c);
+		}
+		xfree(list);
+	}
+
+	evtimer_set(&dht_timer, dht_periodic, NULL);
+	timerclear(&tv);
+	tv.tv_sec = 1;
+	evtimer_add(&dht_timer, &tv);
+	/* populate the routing table */
+	dht_last_refresh = time(NULL);
+	dht_search_start(DHT_Q_FIND_NODE, dht_id, NULL);
+}
+
+/*
+ * dht_port()
+ *
+ * Port our DHT node listens on, in host byte order.
+ */
+u_int16_t
+dht_port(void)
+{
+	return (udp_port());
+}
+
+/*
+ * dht_ping()
+ *
+ * Ping a node we heard about (eg from a PORT message) at <addr> and
+ * <port>; if it answers, it goes in the routing table.  <port> is in
+ * network byte order.
+ */
+void
+dht_ping(const struct sockaddr_storage *addr, u_int16_t port)
+{
+	struct sockaddr_storage sa;
+
+	if (!dht_running || !udp_family(addr->ss_family))
+		return;
+	sa = *addr;
+	util_setport(&sa, port);
+	(void)dht_query(DHT_Q_PING, &sa, NULL, NULL, NULL, 0);
+}
+
+/*
+ * dht_random()
+ *
+ * Fill <buf> with random bytes.  Node ids and the token secret must not
+ * be guessable, so random() won't do where there is no arc4random().
+ */
+static void
+dht_random(u_int8_t *buf, size_t len)
+{
+#ifdef __OpenBSD__
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = arc4random() & 0xff;
+#else
+	if (RAND_bytes(buf, len) != 1)
+		errx(1, "dht_random: RAND_bytes() failure");
+#endif
+}
+
+/*
+ * dht_boot_add()
+ *
+ * Remember a node to bootstrap from.  <id> may be NULL if we don't know it.
+ */
+static void
+dht_boot_add(const u_int8_t *id, const struct sockaddr_storage *sa)
+{
+	struct dht_search_node *sn;
+	int i;
+
+	for (i = 0; i < dht_num_boot; i++)
+		if (util_addrcmp(&dht_boot[i].sa, sa) == 0)
+			return;
+	if (dht_num_boot == DHT_BOOT_MAX)
+		return;
+	sn = &dht_boot[dht_num_boot++];
+	memset(sn, 0, sizeof(*sn));
+	sn->sa = *sa;
+	if (id != NULL) {
+		memcpy(sn->id, id, DHT_ID_LEN);
+		sn->hasid = 1;
+	}
+}
+
+/*
+ * dht_boot_resolve()
+ *
+ * Look up a bootstrap node by name.
+ */
+static void
+dht_boot_resolve(const char *host, const char *port)
+{
+	struct sockaddr_storage sa;
+	struct addrinfo hints, *res, *ai;
+	int error;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	trace("dht_boot_resolve() resolving %s:%s", host, port);
+	if ((error = getaddrinfo(host, port, &hints, &res)) != 0) {
+		trace("dht_boot_resolve() %s: %s", host, gai_strerror(error));
+		return;
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+			continue;
+		memset(&sa, 0, sizeof(sa));
+		memcpy(&sa, ai->ai_addr, ai->ai_addrlen);
+		dht_boot_add(NULL, &sa);
+	}
+	freeaddrinfo(res);
+}
+
+/*
+ * dht_load()
+ *
+ * Load our id and the nodes we knew about last time from the node cache,
+ * so we don't have to bootstrap from scratch.
+ */
+static void
+dht_load(struct session *sc)
+{
+	struct sockaddr_storage sa;
+	struct benc_node *troot, *dict, *node;
+	const u_int8_t *p;
+	size_t i, nodelen;
+	int af;
+
+	troot = benc_root_create();
+	if ((dict = torrent_state_load(sc->tp, ".dhtnodes", troot)) == NULL)
+		goto out;
+	node = benc_dict_get(dict, "id", BSTRING);
+	if (node != NULL && node->body.string.len == DHT_ID_LEN)
+		memcpy(dht_id, node->body.string.value, DHT_ID_LEN);
+	for (af = 0; af < 2; af++) {
+		node = benc_dict_get(dict, af ? "nodes6" : "nodes", BSTRING);
+		if (node == NULL)
+			continue;
+		p = (const u_int8_t *)node->body.string.value;
+		nodelen = af ? DHT_NODE_LEN6 : DHT_NODE_LEN;
+		for (i = 0; i + nodelen <= node->body.string.len;
+		    i += nodelen)
+			if (util_addr_uncompact(&sa, p + i + DHT_ID_LEN,
+			    nodelen - DHT_ID_LEN) == 0)
+				dht_boot_add(p + i, &sa);
+	}
+out:
+	benc_node_freeall(troot);
+	trace("dht_load() loaded %d cached nodes", dht_num_boot);
+}
+
+/*
+ * dht_save()
+ *
+ * Save our id and the good nodes in the routing tables to each session's
+ * node cache, <torrent_file>.dhtnodes.
+ */
+void
+dht_save(void)
+{
+	struct session *sc;
+	struct dht_node *dn;
+	u_int8_t *nodes[2];
+	size_t len[2];
+	time_t now;
+	BUF *b;
+	int af, i, n;
+
+	if (!dht_running)
+		return;
+	now = time(NULL);
+	for (af = 0; af < 2; af++) {
+		nodes[af] = xcalloc(DHT_CACHE_MAX, DHT_NODE_LEN6);
+		len[af] = 0;
+		n = 0;
+		for (i = DHT_BUCKETS - 1; i >= 0 && n < DHT_CACHE_MAX; i--) {
+			TAILQ_FOREACH(dn, &dht_buckets[af][i].nodes, nodes) {
+				if (n == DHT_CACHE_MAX)
+					break;
+				if (dn->fails > 0
+				    || now - dn->last_seen > DHT_NODE_STALE)
+					continue;
+				memcpy(nodes[af] + len[af], dn->id, DHT_ID_LEN);
+				len[af] += DHT_ID_LEN;
+				len[af] += util_addr_compact(&dn->sa,
+				    nodes[af] + len[af]);
+				n++;
+			}
+		}
+	}
+	TAILQ_FOREACH(sc, &sessions, session_list) {
+		b = buf_alloc(len[0] + len[1] + 128, BUF_AUTOEXT);
+		benc_put_dict(b);
+		benc_put_key(b, "id");
+		benc_put_str(b, dht_id, DHT_ID_LEN);
+		benc_put_key(b, "info_hash");
+		benc_put_str(b, sc->tp->info_hash, SHA1_DIGEST_LENGTH);
+		for (af = 0; af < 2; af++) {
+			if (len[af] == 0)
+				continue;
+			benc_put_key(b, af ? "nodes6" : "nodes");
+			benc_put_str(b, nodes[af], len[af]);
+		}
+		benc_put_key(b, "version");
+		benc_put_int(b, STATE_VERSION);
+		benc_put_end(b);
+		if (torrent_state_save(sc->tp, ".dhtnodes", b) == -1)
+			trace("dht_save() %s.dhtnodes: %s", sc->tp->name,
+			    strerror(errno));
+		buf_free(b);
+	}
+	xfree(nodes[0]);
+	xfree(nodes[1]);
+	dht_last_save = now;
+}
+
+/*
+ * dht_bucket_index()
+ *
+ * Which bucket does a node id belong in?  That is, how many leading bits
+ * does it share with our id.  Returns -1 for our own id.
+ */
+static int
+dht_bucket_index(const u_int8_t *id)
+{
+	int i, j;
+	u_int8_t x;
+
+	for (i = 0; i < DHT_ID_LEN; i++) {
+		if ((x = id[i] ^ dht_id[i]) == 0)
+			continue;
+		for (j = 0; !(x & 0x80); j++)
+			x <<= 1;
+		return (i * 8 + j);
+	}
+
+	return (-1);
+}
+
+/*
+ * dht_closer()
+ *
+ * Is <a> closer to <target> than <b>?
+ * Returns 1 if true, zero if false.
+ */
+static int
+dht_closer(const u_int8_t *target, const u_int8_t *a, const u_int8_t *b)
+{
+	int i;
+	u_int8_t da, db;
+
+	for (i = 0; i < DHT_ID_LEN; i++) {
+		da = a[i] ^ target[i];
+		db = b[i] ^ target[i];
+		if (da != db)
+			return (da < db);
+	}
+
+	return (0);
+}
+
+/*
+ * dht_node_heard()
+ *
+ * A node talked to us, so it is alive.  Add it to the routing table or
+ * refresh it.  A full bucket only takes new nodes in place of bad ones;
+ * if the oldest node has gone quiet, ping it so it gets a chance to prove
+ * itself, or to fail.
+ */
+static void
+dht_node_heard(const u_int8_t *id, const struct sockaddr_storage *sa)
+{
+	struct dht_bucket *b;
+	struct dht_node *dn, *bad;
+	time_t now;
+	int i;
+
+	if ((i = dht_bucket_index(id)) == -1)
+		return;
+	b = &dht_buckets[DHT_AF(sa)][i];
+	now = time(NULL);
+	bad = NULL;
+	TAILQ_FOREACH(dn, &b->nodes, nodes) {
+		if (memcmp(dn->id, id, DHT_ID_LEN) == 0) {
+			dn->sa = *sa;
+			dn->last_seen = now;
+			dn->fails = 0;
+			TAILQ_REMOVE(&b->nodes, dn, nodes);
+			TAILQ_INSERT_TAIL(&b->nodes, dn, nodes);
+			return;
+		}
+		if (bad == NULL && dn->fails >= DHT_MAX_FAILS - 1)
+			bad = dn;
+	}
+	if (b->count == DHT_K) {
+		if (bad == NULL) {
+			dn = TAILQ_FIRST(&b->nodes);
+			if (now - dn->last_seen > DHT_NODE_STALE)
+				(void)dht_query(DHT_Q_PING, &dn->sa, NULL, NULL,
+				    NULL, 0);
+			return;
+		}
+		TAILQ_REMOVE(&b->nodes, bad, nodes);
+		xfree(bad);
+		b->count--;
+		dht_num_nodes--;
+	}
+	dn = xmalloc(sizeof(*dn));
+	memset(dn, 0, sizeof(*dn));
+	memcpy(dn->id, id, DHT_ID_LEN);
+	dn->sa = *sa;
+	dn->last_seen = now;
+	TAILQ_INSERT_TAIL(&b->nodes, dn, nodes);
+	b->count++;
+	dht_num_nodes++;
+}
+
+/*
+ * dht_node_failed()
+ *
+ * A query to this address timed out.  Nodes which keep failing are
+ * dropped from the routing table.
+ */
+static void
+dht_node_failed(const struct sockaddr_storage *sa)
+{
+	struct dht_bucket *b;
+	struct dht_node *dn;
+	int i;
+
+	for (i = 0; i < DHT_BUCKETS; i++) {
+		b = &dht_buckets[DHT_AF(sa)][i];
+		TAILQ_FOREACH(dn, &b->nodes, nodes) {
+			if (util_addrcmp(&dn->sa, sa) != 0)
+				continue;
+			if (++dn->fails >= DHT_MAX_FAILS) {
+				TAILQ_REMOVE(&b->nodes, dn, nodes);
+				xfree(dn);
+				b->count--;
+				dht_num_nodes--;
+			}
+			return;
+		}
+	}
+}
+
+/*
+ * dht_closest()
+ *
+ * Fill <out> with up to <max> good nodes from the routing table for
+ * family <af> (0 for IPv4, 1 for IPv6), closest to <target> first.
+ * Returns the number found.
+ */
+static int
+dht_closest(int af, const u_int8_t *target, struct dht_node **out, int max)
+{
+	struct dht_node *dn;
+	int i, j, n;
+
+	n = 0;
+	for (i = 0; i < DHT_BUCKETS; i++) {
+		TAILQ_FOREACH(dn, &dht_buckets[af][i].nodes, nodes) {
+			if (dn->fails > 0)
+				continue;
+			/* insertion sort, keeping the <max> closest */
+			for (j = n; j > 0
+			    && dht_closer(target, dn->id, out[j - 1]->id); j--)
+				if (j < max)
+					out[j] = out[j - 1];
+			if (j < max) {
+				out[j] = dn;
+				if (n < max)
+					n++;
+			}
+		}
+	}
+
+	return (n);
+}
+
+/*
+ * dht_put()
+ *
+ * Append raw bytes to an outgoing message.
+ */
+static void
+dht_put(struct dht_msg *m, const void *data, size_t len)
+{
+	if (m->overflow || len > sizeof(m->buf) - m->len) {
+		m->overflow = 1;
+		return;
+	}
+	memcpy(m->buf + m->len, data, len);
+	m->len += len;
+}
+
+/*
+ * dht_put_str()
+ *
+ * Append a b-encoded string to an outgoing message.
+ */
+static void
+dht_put_str(struct dht_msg *m, const void *s, size_t len)
+{
+	char num[24];
+	int l;
+
+	l = snprintf(num, sizeof(num), "%zu:", len);
+	dht_put(m, num, l);
+	dht_put(m, s, len);
+}
+
+/*
+ * dht_put_key()
+ *
+ * Append a b-encoded dictionary key to an outgoing message.
+ */
+static void
+dht_put_key(struct dht_msg *m, const char *key)
+{
+	dht_put_str(m, key, strlen(key));
+}
+
+/*
+ * dht_put_int()
+ *
+ * Append a b-encoded integer to an outgoing message.
+ */
+static void
+dht_put_int(struct dht_msg *m, long long n)
+{
+	char num[24];
+	int l;
+
+	l = snprintf(num, sizeof(num), "i%llde", n);
+	dht_put(m, num, l);
+}
+
+/*
+ * dht_send()
+ *
+ * Send a finished message.
+ */
+static void
+dht_send(struct dht_msg *m, const struct sockaddr_storage *sa)
+{
+	if (m->overflow) {
+		trace("dht_send() message too long, dropped");
+		return;
+	}
+	udp_send(m->buf, m->len, sa);
+}
+
+/*
+ * dht_query()
+ *
+ * Send a query to a node.  <target> is the target or info_hash, and
+ * <token> is only used by announce_peer.
+ * Returns 0 on success, -1 if too many queries are already in flight.
+ */
+static int
+dht_query(int type, const struct sockaddr_storage *sa, struct dht_search *ds,
+    const u_int8_t *target, const u_int8_t *token, size_t tokenlen)
+{
+	struct dht_query *dq;
+	struct dht_msg m;
+	const char *name = NULL;
+	u_int8_t tid[2];
+
+	if (dht_num_queries >= DHT_MAX_QUERIES)
+		return (-1);
+	memset(&m, 0, sizeof(m));
+	dht_put(&m, "d", 1);
+	dht_put_key(&m, "a");
+	dht_put(&m, "d", 1);
+	dht_put_key(&m, "id");
+	dht_put_str(&m, dht_id, DHT_ID_LEN);
+	switch (type) {
+	case DHT_Q_PING:
+		name = "ping";
+		break;
+	case DHT_Q_FIND_NODE:
+		name = "find_node";
+		dht_put_key(&m, "target");
+		dht_put_str(&m, target, DHT_ID_LEN);
+		break;
+	case DHT_Q_GET_PEERS:
+		name = "get_peers";
+		dht_put_key(&m, "info_hash");
+		dht_put_str(&m, target, DHT_ID_LEN);
+		break;
+	case DHT_Q_ANNOUNCE:
+		name = "announce_peer";
+		dht_put_key(&m, "info_hash");
+		dht_put_str(&m, target, DHT_ID_LEN);
+		dht_put_key(&m, "port");
+		dht_put_int(&m, udp_port());
+		dht_put_key(&m, "token");
+		dht_put_str(&m, token, tokenlen);
+		break;
+	}
+	/* with both families, ask for nodes of both (BEP 32) */
+	if ((type == DHT_Q_FIND_NODE || type == DHT_Q_GET_PEERS)
+	    && udp_family(AF_INET) && udp_family(AF_INET6)) {
+		dht_put_key(&m, "want");
+		dht_put(&m, "l", 1);
+		dht_put_key(&m, "n4");
+		dht_put_key(&m, "n6");
+		dht_put(&m, "e", 1);
+	}
+	dht_put(&m, "e", 1);
+	dht_put_key(&m, "q");
+	dht_put_key(&m, name);
+	dht_put_key(&m, "t");
+	dht_tid++;
+	tid[0] = dht_tid >> 8;
+	tid[1] = dht_tid & 0xff;
+	dht_put_str(&m, tid, sizeof(tid));
+	dht_put_key(&m, "y");
+	dht_put_key(&m, "q");
+	dht_put(&m, "e", 1);
+
+	dq = xmalloc(sizeof(*dq));
+	memset(dq, 0, sizeof(*dq));
+	dq->tid = dht_tid;
+	dq->type = type;
+	dq->sa = *sa;
+	dq->sent = time(NULL);
+	dq->search = ds;
+	TAILQ_INSERT_TAIL(&dht_queries, dq, queries);
+	dht_num_queries++;
+	trace("dht_query() %s to %s", name, print_host(sa));
+	dht_send(&m, sa);
+
+	return (0);
+}
+
+/*
+ * dht_reply_begin()
+ *
+ * Start a reply; the caller adds any fields after "id".
+ */
+static void
+dht_reply_begin(struct dht_msg *m)
+{
+	memset(m, 0, sizeof(*m));
+	dht_put(m, "d", 1);
+	dht_put_key(m, "r");
+	dht_put(m, "d", 1);
+	dht_put_key(m, "id");
+	dht_put_str(m, dht_id, DHT_ID_LEN);
+}
+
+/*
+ * dht_reply_end()
+ *
+ * Finish a reply to the query with transaction id <t>.
+ */
+static void
+dht_reply_end(struct dht_msg *m, struct benc_node *t)
+{
+	dht_put(m, "e", 1);
+	dht_put_key(m, "t");
+	dht_put_str(m, t->body.string.value, t->body.string.len);
+	dht_put_key(m, "y");
+	dht_put_key(m, "r");
+	dht_put(m, "e", 1);
+}
+
+/*
+ * dht_reply_error()
+ *
+ * Send an error reply.
+ */
+static void
+dht_reply_error(const struct sockaddr_storage *sa, struct benc_node *t, int code,
+    const char *msg)
+{
+	struct dht_msg m;
+
+	memset(&m, 0, sizeof(m));
+	dht_put(&m, "d", 1);
+	dht_put_key(&m, "e");
+	dht_put(&m, "l", 1);
+	dht_put_int(&m, code);
+	dht_put_key(&m, msg);
+	dht_put(&m, "e", 1);
+	dht_put_key(&m, "t");
+	dht_put_str(&m, t->body.string.value, t->body.string.len);
+	dht_put_key(&m, "y");
+	dht_put_key(&m, "e");
+	dht_put(&m, "e", 1);
+	dht_send(&m, sa);
+}
+
+/*
+ * dht_want()
+ *
+ * Which families' nodes does a query want, as DHT_WANT_* bits?  Without
+ * a "want" list, those of the family it came over.
+ */
+static int
+dht_want(struct benc_node *a, const struct sockaddr_storage *sa)
+{
+	struct benc_node *want, *n;
+	int bits = 0;
+
+	if ((want = benc_dict_get(a, "want", BLIST)) != NULL) {
+		TAILQ_FOREACH(n, &want->children, benc_nodes) {
+			if (!(n->flags & BSTRING) || n->body.string.len != 2)
+				continue;
+			if (memcmp(n->body.string.value, "n4", 2) == 0)
+				bits |= DHT_WANT_N4;
+			else if (memcmp(n->body.string.value, "n6", 2) == 0)
+				bits |= DHT_WANT_N6;
+		}
+	}
+	if (bits == 0)
+		bits = DHT_AF(sa) ? DHT_WANT_N6 : DHT_WANT_N4;
+
+	return (bits);
+}
+
+/*
+ * dht_reply_nodes()
+ *
+ * Add the nodes closest to <target> to a reply: IPv4 ones as "nodes" and
+ * IPv6 ones as "nodes6", as <want> asks.
+ */
+static void
+dht_reply_nodes(struct dht_msg *m, const u_int8_t *target, int want)
+{
+	struct dht_node *closest[DHT_K];
+	u_int8_t nodes[DHT_K * DHT_NODE_LEN6], *p;
+	int af, i, n;
+
+	for (af = 0; af < 2; af++) {
+		if (!(want & (af ? DHT_WANT_N6 : DHT_WANT_N4)))
+			continue;
+		n = dht_closest(af, target, closest, DHT_K);
+		for (i = 0, p = nodes; i < n; i++) {
+			memcpy(p, closest[i]->id, DHT_ID_LEN);
+			p += DHT_ID_LEN;
+			p += util_addr_compact(&closest[i]->sa, p);
+		}
+		dht_put_key(m, af ? "nodes6" : "nodes");
+		dht_put_str(m, nodes, p - nodes);
+	}
+}
+
+/*
+ * dht_token()
+ *
+ * Work out the announce token for an address, using <secret>.
+ */
+static void
+dht_token(const struct sockaddr_storage *sa, const u_int8_t *secret,
+    u_int8_t *token)
+{
+	SHA1_CTX sha;
+	u_int8_t result[SHA1_DIGEST_LENGTH];
+
+	SHA1Init(&sha);
+	SHA1Update(&sha, secret, DHT_ID_LEN);
+	if (sa->ss_family == AF_INET6)
+		SHA1Update(&sha, (const u_int8_t *)
+		    &((const struct sockaddr_in6 *)sa)->sin6_addr,
+		    sizeof(struct in6_addr));
+	else
+		SHA1Update(&sha, (const u_int8_t *)
+		    &((const struct sockaddr_in *)sa)->sin_addr,
+		    sizeof(struct in_addr));
+	SHA1Final(result, &sha);
+	memcpy(token, result, DHT_TOKEN_LEN);
+}
+
+/*
+ * dht_input()
+ *
+ * Parse an incoming datagram and dispatch it.
+ */
+void
+dht_input(u_int8_t *data, size_t len, const struct sockaddr_storage *sa)
+{
+	struct benc_node *troot, *msg, *t, *y;
+	BUF *buf;
+
+	if (benc_check(data, len, DHT_MAX_DEPTH) == -1) {
+		trace("dht_input() malformed message from %s",
+		    print_host(sa));
+		return;
+	}
+	buf = buf_wrap(data, len);
+	troot = benc_root_create();
+	if (benc_parse_buf(buf, troot) == NULL)
+		goto out;
+	msg = TAILQ_FIRST(&troot->children);
+	if ((t = benc_dict_get(msg, "t", BSTRING)) == NULL
+	    || t->body.string.len > DHT_TID_MAX
+	    || (y = benc_dict_get(msg, "y", BSTRING)) == NULL
+	    || y->body.string.len != 1)
+		goto out;
+	switch (y->body.string.value[0]) {
+	case 'q':
+		dht_process_query(msg, t, sa);
+		break;
+	case 'r':
+		dht_process_reply(msg, t, sa, 0);
+		break;
+	case 'e':
+		dht_process_reply(msg, t, sa, 1);
+		break;
+	}
+out:
+	benc_node_freeall(troot);
+}
+
+/*
+ * dht_process_query()
+ *
+ * Answer a query from another node.
+ */
+static void
+dht_process_query(struct benc_node *msg, struct benc_node *t,
+    const struct sockaddr_storage *sa)
+{
+	struct benc_node *q, *a, *id, *target, *token, *port, *implied;
+	struct dht_stored *ds;
+	struct dht_msg m;
+	u_int8_t tok[DHT_TOKEN_LEN], oldtok[DHT_TOKEN_LEN];
+	size_t addrlen;
+	int n;
+
+	if ((q = benc_dict_get(msg, "q", BSTRING)) == NULL
+	    || (a = benc_dict_get(msg, "a", BDICT)) == NULL
+	    || (id = benc_dict_get(a, "id", BSTRING)) == NULL
+	    || id->body.string.len != DHT_ID_LEN) {
+		dht_reply_error(sa, t, 203, "Protocol Error");
+		return;
+	}
+	dht_node_heard((u_int8_t *)id->body.string.value, sa);
+	trace("dht_process_query() %s from %s", q->body.string.value,
+	    print_host(sa));
+
+	if (strcmp(q->body.string.value, "ping") == 0) {
+		dht_reply_begin(&m);
+	} else if (strcmp(q->body.string.value, "find_node") == 0) {
+		if ((target = benc_dict_get(a, "target", BSTRING)) == NULL
+		    || target->body.string.len != DHT_ID_LEN)
+			goto protoerr;
+		dht_reply_begin(&m);
+		dht_reply_nodes(&m, (u_int8_t *)target->body.string.value,
+		    dht_want(a, sa));
+	} else if (strcmp(q->body.string.value, "get_peers") == 0) {
+		if ((target = benc_dict_get(a, "info_hash", BSTRING)) == NULL
+		    || target->body.string.len != DHT_ID_LEN)
+			goto protoerr;
+		dht_reply_begin(&m);
+		/* peers of the family the query came over */
+		addrlen = DHT_AF(sa) ? COMPACT_LEN6 : COMPACT_LEN;
+		n = 0;
+		TAILQ_FOREACH(ds, &dht_storage, stored)
+			if (ds->addrlen == addrlen
+			    && memcmp(ds->info_hash, target->body.string.value,
+			    DHT_ID_LEN) == 0)
+				n++;
+		if (n == 0)
+			dht_reply_nodes(&m,
+			    (u_int8_t *)target->body.string.value,
+			    dht_want(a, sa));
+		dht_token(sa, dht_secret, tok);
+		dht_put_key(&m, "token");
+		dht_put_str(&m, tok, sizeof(tok));
+		if (n > 0) {
+			dht_put_key(&m, "values");
+			dht_put(&m, "l", 1);
+			n = 0;
+			TAILQ_FOREACH_REVERSE(ds, &dht_storage, dht_storage,
+			    stored) {
+				if (ds->addrlen != addrlen
+				    || memcmp(ds->info_hash,
+				    target->body.string.value, DHT_ID_LEN) != 0)
+					continue;
+				dht_put_str(&m, ds->addr, ds->addrlen);
+				if (++n == DHT_MAX_VALUES)
+					break;
+			}
+			dht_put(&m, "e", 1);
+		}
+	} else if (strcmp(q->body.string.value, "announce_peer") == 0) {
+		if ((target = benc_dict_get(a, "info_hash", BSTRING)) == NULL
+		    || target->body.string.len != DHT_ID_LEN
+		    || (port = benc_dict_get(a, "port", BINT)) == NULL
+		    || (token = benc_dict_get(a, "token", BSTRING)) == NULL)
+			goto protoerr;
+		dht_token(sa, dht_secret, tok);
+		dht_token(sa, dht_oldsecret, oldtok);
+		if (token->body.string.len != DHT_TOKEN_LEN
+		    || (memcmp(token->body.string.value, tok, sizeof(tok)) != 0
+		    && memcmp(token->body.string.value, oldtok,
+		    sizeof(oldtok)) != 0)) {
+			dht_reply_error(sa, t, 203, "Bad Token");
+			return;
+		}
+		if ((implied = benc_dict_get(a, "implied_port", BINT)) != NULL
+		    && implied->body.number != 0)
+			dht_store((u_int8_t *)target->body.string.value, sa,
+			    util_addrport(sa));
+		else if (port->body.number > 0 && port->body.number < 65536)
+			dht_store((u_int8_t *)target->body.string.value, sa,
+			    htons(port->body.number));
+		else
+			goto protoerr;
+		dht_reply_begin(&m);
+	} else {
+		dht_reply_error(sa, t, 204, "Method Unknown");
+		return;
+	}
+	dht_reply_end(&m, t);
+	dht_send(&m, sa);
+	return;
+
+protoerr:
+	dht_reply_error(sa, t, 203, "Protocol Error");
+}
+
+/*
+ * dht_process_reply()
+ *
+ * Handle a reply (or error) to one of our queries.
+ */
+static void
+dht_process_reply(struct benc_node *msg, struct benc_node *t,
+    const struct sockaddr_storage *sa, int error)
+{
+	struct benc_node *r, *id, *nodes, *token, *values, *v;
+	struct dht_query *dq;
+	struct dht_search *ds;
+	struct dht_search_node *sn;
+	u_int8_t *p;
+	u_int16_t tid;
+	size_t len;
+
+	if (t->body.string.len != 2)
+		return;
+	p = (u_int8_t *)t->body.string.value;
+	tid = (p[0] << 8) | p[1];
+	TAILQ_FOREACH(dq, &dht_queries, queries)
+		if (dq->tid == tid && util_addrcmp(&dq->sa, sa) == 0)
+			break;
+	if (dq == NULL) {
+		trace("dht_process_reply() unexpected reply from %s",
+		    print_host(sa));
+		return;
+	}
+	TAILQ_REMOVE(&dht_queries, dq, queries);
+	dht_num_queries--;
+	ds = dq->search;
+	sn = ds != NULL ? dht_search_node_find(ds, sa) : NULL;
+	if (ds != NULL)
+		ds->inflight--;
+
+	r = benc_dict_get(msg, "r", BDICT);
+	id = benc_dict_get(r, "id", BSTRING);
+	if (error || id == NULL || id->body.string.len != DHT_ID_LEN) {
+		trace("dht_process_reply() error from %s", print_host(sa));
+		if (sn != NULL)
+			sn->state = DHT_SN_FAILED;
+		goto out;
+	}
+	dht_node_heard((u_int8_t *)id->body.string.value, sa);
+	if (ds == NULL)
+		goto out;
+	if (sn != NULL) {
+		sn->state = DHT_SN_REPLIED;
+		if ((token = benc_dict_get(r, "token", BSTRING)) != NULL
+		    && token->body.string.len <= DHT_TOKEN_MAX) {
+			memcpy(sn->token, token->body.string.value,
+			    token->body.string.len);
+			sn->tokenlen = token->body.string.len;
+		}
+	}
+	if ((nodes = benc_dict_get(r, "nodes", BSTRING)) != NULL)
+		dht_search_add_nodes(ds, nodes, DHT_NODE_LEN);
+	if ((nodes = benc_dict_get(r, "nodes6", BSTRING)) != NULL)
+		dht_search_add_nodes(ds, nodes, DHT_NODE_LEN6);
+	if (ds->type == DHT_Q_GET_PEERS && ds->sc != NULL
+	    && (values = benc_dict_get(r, "values", BLIST)) != NULL) {
+		TAILQ_FOREACH(v, &values->children, benc_nodes) {
+			if (!(v->flags & BSTRING))
+				continue;
+			len = v->body.string.len;
+			if (len != COMPACT_LEN && len != COMPACT_LEN6)
+				continue;
+			network_peerlist_add_compact(ds->sc,
+			    (u_int8_t *)v->body.string.value, len, len);
+			ds->npeers++;
+		}
+		trace("dht_process_reply() %u peers so far for %s",
+		    ds->npeers, ds->sc->tp->name);
+		network_session_start(ds->sc);
+		network_peerlist_connect(ds->sc);
+	}
+out:
+	xfree(dq);
+	if (ds != NULL)
+		dht_search_step(ds);
+}
+
+/*
+ * dht_store()
+ *
+ * Remember a peer which announced itself for <info_hash>.  <port> is in
+ * network byte order.
+ */
+static void
+dht_store(const u_int8_t *info_hash, const struct sockaddr_storage *sa,
+    u_int16_t port)
+{
+	struct sockaddr_storage psa;
+	struct dht_stored *ds;
+	u_int8_t addr[COMPACT_LEN6];
+	size_t len;
+
+	psa = *sa;
+	util_setport(&psa, port);
+	len = util_addr_compact(&psa, addr);
+	TAILQ_FOREACH(ds, &dht_storage, stored)
+		if (memcmp(ds->info_hash, info_hash, DHT_ID_LEN) == 0
+		    && ds->addrlen == len && memcmp(ds->addr, addr, len) == 0)
+			break;
+	if (ds != NULL) {
+		TAILQ_REMOVE(&dht_storage, ds, stored);
+	} else if (dht_num_stored == DHT_MAX_STORED) {
+		ds = TAILQ_FIRST(&dht_storage);
+		TAILQ_REMOVE(&dht_storage, ds, stored);
+	} else {
+		ds = xmalloc(sizeof(*ds));
+		dht_num_stored++;
+	}
+	memcpy(ds->info_hash, info_hash, DHT_ID_LEN);
+	memcpy(ds->addr, addr, len);
+	ds->addrlen = len;
+	ds->added = time(NULL);
+	TAILQ_INSERT_TAIL(&dht_storage, ds, stored);
+}
+
+/*
+ * dht_search_start()
+ *
+ * Start an iterative lookup for <target>, seeded with the closest nodes
+ * in our routing tables, plus the bootstrap nodes if they are sparse.
+ * Nodes of both families take part in the same lookup.
+ */
+static void
+dht_search_start(int type, const u_int8_t *target, struct session *sc)
+{
+	struct dht_search *ds;
+	struct dht_node *closest[DHT_SEARCH_NODES];
+	int af, i, n, total;
+
+	ds = xmalloc(sizeof(*ds));
+	memset(ds, 0, sizeof(*ds));
+	ds->type = type;
+	ds->sc = sc;
+	memcpy(ds->target, target, DHT_ID_LEN);
+	total = 0;
+	for (af = 0; af < 2; af++) {
+		n = dht_closest(af, target, closest, DHT_SEARCH_NODES);
+		for (i = 0; i < n; i++)
+			dht_search_add(ds, closest[i]->id, &closest[i]->sa);
+		total += n;
+	}
+	if (total < DHT_K)
+		for (i = 0; i < dht_num_boot; i++)
+			dht_search_add(ds,
+			    dht_boot[i].hasid ? dht_boot[i].id : NULL,
+			    &dht_boot[i].sa);
+	trace("dht_search_start() %s lookup with %d nodes",
+	    type == DHT_Q_GET_PEERS ? "get_peers" : "find_node", ds->count);
+	TAILQ_INSERT_TAIL(&dht_searches, ds, searches);
+	/* may finish, and free, the lookup straight away */
+	dht_search_step(ds);
+}
+
+/*
+ * dht_search_node_find()
+ *
+ * Find a lookup's entry for a node by address.
+ */
+static struct dht_search_node *
+dht_search_node_find(struct dht_search *ds, const struct sockaddr_storage *sa)
+{
+	int i;
+
+	for (i = 0; i < ds->count; i++)
+		if (util_addrcmp(&ds->nodes[i].sa, sa) == 0)
+			return (&ds->nodes[i]);
+
+	return (NULL);
+}
+
+/*
+ * dht_search_add()
+ *
+ * Add a candidate node to a lookup, keeping the list ordered by distance
+ * to the target.  Nodes without a known id sort last, and nodes of a
+ * family we have no socket for are left out.
+ */
+static void
+dht_search_add(struct dht_search *ds, const u_int8_t *id,
+    const struct sockaddr_storage *sa)
+{
+	int i;
+
+	if (!udp_family(sa->ss_family) || dht_search_node_find(ds, sa) != NULL)
+		return;
+	if (id != NULL && memcmp(id, dht_id, DHT_ID_LEN) == 0)
+		return;
+	for (i = ds->count; i > 0; i--) {
+		if (id == NULL || (ds->nodes[i - 1].hasid
+		    && !dht_closer(ds->target, id, ds->nodes[i - 1].id)))
+			break;
+	}
+	if (i == DHT_SEARCH_NODES)
+		return;
+	if (ds->count == DHT_SEARCH_NODES) {
+		/* don't push out a node we are waiting on */
+		if (ds->nodes[ds->count - 1].state == DHT_SN_QUERIED)
+			return;
+		ds->count--;
+	}
+	memmove(&ds->nodes[i + 1], &ds->nodes[i],
+	    (ds->count - i) * sizeof(ds->nodes[0]));
+	memset(&ds->nodes[i], 0, sizeof(ds->nodes[i]));
+	if (id != NULL) {
+		memcpy(ds->nodes[i].id, id, DHT_ID_LEN);
+		ds->nodes[i].hasid = 1;
+	}
+	ds->nodes[i].sa = *sa;
+	ds->nodes[i].state = DHT_SN_NEW;
+	ds->count++;
+}
+
+/*
+ * dht_search_add_nodes()
+ *
+ * Add the nodes from a reply's compact node info, of <nodelen> bytes
+ * each, to a lookup.
+ */
+static void
+dht_search_add_nodes(struct dht_search *ds, struct benc_node *nodes,
+    size_t nodelen)
+{
+	struct sockaddr_storage sa;
+	u_int8_t *p;
+	size_t i;
+
+	p = (u_int8_t *)nodes->body.string.value;
+	for (i = 0; i + nodelen <= nodes->body.string.len; i += nodelen)
+		if (util_addr_uncompact(&sa, p + i + DHT_ID_LEN,
+		    nodelen - DHT_ID_LEN) == 0)
+			dht_search_add(ds, p + i, &sa);
+}
+
+/*
+ * dht_search_step()
+ *
+ * Query the closest nodes we haven't asked yet, keeping DHT_ALPHA queries
+ * in flight.  The lookup is over once the DHT_K closest live nodes have
+ * all replied.
+ */
+static void
+dht_search_step(struct dht_search *ds)
+{
+	struct dht_search_node *sn;
+	int i, k, pending;
+
+	pending = 0;
+	for (i = 0, k = 0; i < ds->count && k < DHT_K; i++) {
+		sn = &ds->nodes[i];
+		if (sn->state == DHT_SN_FAILED)
+			continue;
+		k++;
+		if (sn->state == DHT_SN_NEW && ds->inflight < DHT_ALPHA
+		    && dht_query(ds->type, &sn->sa, ds, ds->target, NULL,
+		    0) == 0) {
+			sn->state = DHT_SN_QUERIED;
+			ds->inflight++;
+		}
+		if (sn->state != DHT_SN_REPLIED)
+			pending = 1;
+	}
+	if (!pending && ds->inflight == 0)
+		dht_search_finish(ds);
+}
+
+/*
+ * dht_search_finish()
+ *
+ * A lookup has converged.  For get_peers, announce ourselves to the
+ * closest nodes which gave us a token.
+ */
+static void
+dht_search_finish(struct dht_search *ds)
+{
+	struct dht_search_node *sn;
+	struct dht_query *dq;
+	int i, n;
+
+	n = 0;
+	if (ds->type == DHT_Q_GET_PEERS) {
+		for (i = 0; i < ds->count && n < DHT_K; i++) {
+			sn = &ds->nodes[i];
+			if (sn->state != DHT_SN_REPLIED || sn->tokenlen == 0)
+				continue;
+			if (dht_query(DHT_Q_ANNOUNCE, &sn->sa, NULL, ds->target,
+			    sn->token, sn->tokenlen) == 0)
+				n++;
+		}
+	}
+	trace("dht_search_finish() lookup done, %u peers, announced to %d "
+	    "nodes, %d nodes in routing table", ds->npeers, n, dht_num_nodes);
+	/* late replies are still welcome in the routing table */
+	TAILQ_FOREACH(dq, &dht_queries, queries)
+		if (dq->search == ds)
+			dq->search = NULL;
+	TAILQ_REMOVE(&dht_searches, ds, searches);
+	xfree(ds);
+}
+
+/*
+ * dht_periodic()
+ *
+ * Once a second: expire queries, start lookups which are due, rotate the
+ * token secret, expire stored peers and save the node cache.
+ */
+static void
+dht_periodic(int fd, short type, void *arg)
+{
+	struct dht_query *dq, *nxt;
+	struct dht_search *ds, *dsnxt;
+	struct dht_search_node *sn;
+	struct dht_stored *st;
+	struct session *sc;
+	struct timeval tv;
+	time_t now;
+
+	now = time(NULL);
+	for (dq = TAILQ_FIRST(&dht_queries); dq != NULL; dq = nxt) {
+		nxt = TAILQ_NEXT(dq, queries);
+		if (now - dq->sent < DHT_QUERY_TIMEOUT)
+			continue;
+		TAILQ_REMOVE(&dht_queries, dq, queries);
+		dht_num_queries--;
+		dht_node_failed(&dq->sa);
+		if ((ds = dq->search) != NULL) {
+			ds->inflight--;
+			if ((sn = dht_search_node_find(ds, &dq->sa)) != NULL)
+				sn->state = DHT_SN_FAILED;
+		}
+		xfree(dq);
+	}
+	/* lookups may have been held up by the query limit */
+	for (ds = TAILQ_FIRST(&dht_searches); ds != NULL; ds = dsnxt) {
+		dsnxt = TAILQ_NEXT(ds, searches);
+		dht_search_step(ds);
+	}
+
+	if (now - dht_last_refresh > DHT_REFRESH_INTERVAL
+	    || (dht_num_nodes < DHT_K
+	    && now - dht_last_refresh > MIN_ANNOUNCE_INTERVAL)) {
+		dht_last_refresh = now;
+		dht_search_start(DHT_Q_FIND_NODE, dht_id, NULL);
+	}
+	TAILQ_FOREACH(sc, &sessions, session_list) {
+		TAILQ_FOREACH(ds, &dht_searches, searches)
+			if (ds->sc == sc)
+				break;
+		if (ds != NULL || dht_num_nodes == 0)
+			continue;
+		if (now - sc->last_dht_search < DHT_SEARCH_INTERVAL
+		    && (sc->num_peers >= PEERS_WANTED
+		    || now - sc->last_dht_search < MIN_ANNOUNCE_INTERVAL))
+			continue;
+		sc->last_dht_search = now;
+		dht_search_start(DHT_Q_GET_PEERS, sc->tp->info_hash, sc);
+	}
+
+	if (now - dht_secret_time > DHT_TOKEN_ROTATE) {
+		memcpy(dht_oldsecret, dht_secret, sizeof(dht_oldsecret));
+		dht_random(dht_secret, sizeof(dht_secret));
+		dht_secret_time = now;
+	}
+	while ((st = TAILQ_FIRST(&dht_storage)) != NULL
+	    && now - st->added > DHT_PEER_TTL) {
+		TAILQ_REMOVE(&dht_storage, st, stored);
+		xfree(st);
+		dht_num_stored--;
+	}
+	if (now - dht_last_save > DHT_SAVE_INTERVAL && dht_num_nodes > 0)
+		dht_save();
+
+	timerclear(&tv);
+	tv.tv_sec = 1;
+	evtimer_add(&dht_timer, &tv);
+}
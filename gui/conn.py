@@ -43,6 +43,13 @@ class CTLconnection(threading.Thread):
 		self.pieces = []
 		self.peers = []
 		self.bytes = 0
+		self.seeders = 0
+		self.leechers = 0
+		self.stream_pos = 0
+		self.bans = []
+		self.cache_hits = 0
+		self.cache_misses = 0
+		self.cache_bytes = 0
 		self.done = False
 		self._socket = None
 		self._f = None
@@ -50,6 +57,12 @@ class CTLconnection(threading.Thread):
 	def stop(self):
 		self._f.close()
 		self._done = True
+	def seek(self, offset):
+		''' Move the streaming playback position to byte offset '''
+		self._socket.send("seek:%d\r\n" %(offset))
+	def set_priority(self, spec):
+		''' Change file priorities, e.g. "*=skip,3=high" '''
+		self._socket.send("priority:%s\r\n" %(spec))
 	def run(self):
 		try:
 			self._socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
@@ -93,6 +106,31 @@ class CTLconnection(threading.Thread):
 					except:
 						# no peers yet
 						continue
+				elif d[0] == 'swarm':
+					try:
+						s, l = d[1].split(',')
+						self.seeders = int(s)
+						self.leechers = int(l)
+					except:
+						continue
+				elif d[0] == 'bans':
+					if d[1] == '':
+						self.bans = []
+					else:
+						self.bans = d[1].split(',')
+				elif d[0] == 'cache':
+					try:
+						h, m, b = d[1].split(',')
+						self.cache_hits = int(h)
+						self.cache_misses = int(m)
+						self.cache_bytes = int(b)
+					except:
+						continue
+				elif d[0] == 'stream':
+					try:
+						self.stream_pos = int(d[1])
+					except:
+						continue
 				else:
 					print "unkown message: %s" %(l)
 		except socket.error, e:
@@ -0,0 +1,678 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Minimal non-blocking HTTP/1.1 client, used to talk to trackers.
+ *
+ * One connection is kept per tracker host and port.  Requests to the same
+ * host are queued on it and sent one at a time, and the connection is kept
+ * open between requests unless the server asks us to close it.  Responses
+ * are parsed incrementally straight out of the bufferevent input buffer:
+ * chunked bodies are decoded in place, and the body handed to the caller
+ * points into that same buffer.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "includes.h"
+
+/* response parser flags */
+#define HTTP_RES_HDRDONE	(1<<0)
+#define HTTP_RES_CHUNKED	(1<<1)
+#define HTTP_RES_LENGTH		(1<<2)
+#define HTTP_RES_KEEPALIVE	(1<<3)
+#define HTTP_RES_CRLF		(1<<4) /* expecting CRLF after chunk data */
+#define HTTP_RES_TRAILER	(1<<5) /* seen the last chunk */
+#define HTTP_RES_EOF		(1<<6) /* server closed the connection */
+
+/* a queued request */
+struct http_request {
+	TAILQ_ENTRY(http_request)	reqs;
+	char				*msg;
+	void				(*cb)(struct http_response *, void *);
+	void				*arg;
+	int				retried;
+};
+
+/* a connection to a single host:port */
+struct http_conn {
+	TAILQ_ENTRY(http_conn)		conns;
+	TAILQ_HEAD(http_reqs, http_request) queue;
+	char				*host;
+	char				*port;
+	int				fd;
+	struct bufferevent		*bev;
+	/* request currently awaiting a response, if any */
+	struct http_request		*req;
+	/* set once a response has been read on this connection */
+	int				reused;
+	struct http_response		res;
+};
+
+static TAILQ_HEAD(http_conns, http_conn) http_conns =
+    TAILQ_HEAD_INITIALIZER(http_conns);
+
+static struct http_conn	*http_conn_create(const char *, const char *);
+static void		 http_conn_free(struct http_conn *);
+static int		 http_conn_open(struct http_conn *);
+static void		 http_conn_close(struct http_conn *);
+static void		 http_conn_fail(struct http_conn *);
+static void		 http_conn_send(struct http_conn *);
+static int		 http_conn_input(struct http_conn *);
+static void		 http_handle_read(struct bufferevent *, void *);
+static void		 http_handle_write(struct bufferevent *, void *);
+static void		 http_handle_error(struct bufferevent *, short, void *);
+static int		 http_parse_headers(struct http_response *, u_int8_t *,
+			    size_t);
+static int		 http_parse_body(struct http_response *, u_int8_t *,
+			    size_t);
+static ssize_t		 http_find(const u_int8_t *, size_t, size_t,
+			    const char *);
+static int		 http_header_is(const u_int8_t *, size_t, const char *);
+
+/*
+ * http_parse_url()
+ *
+ * Split an http:// URL into host, port and path (which includes any query
+ * string).  Returns 0 on success, -1 if the URL is not usable.
+ */
+int
+http_parse_url(const char *url, char *host, size_t hostlen, char *port,
+    size_t portlen, char *path, size_t pathlen)
+{
+	const char *c;
+	size_t n;
+
+	if (strncmp(url, "http://", HTTPLEN) != 0)
+		return (-1);
+	c = url + HTTPLEN;
+	n = strcspn(c, ":/?");
+	if (n == 0 || n > hostlen - 1)
+		return (-1);
+	memcpy(host, c, n);
+	host[n] = '\0';
+	c += n;
+	if (*c == ':') {
+		c++;
+		n = strcspn(c, "/?");
+		if (n == 0 || n > portlen - 1)
+			return (-1);
+		memcpy(port, c, n);
+		port[n] = '\0';
+		c += n;
+	} else if (strlcpy(port, "80", portlen) >= portlen) {
+		return (-1);
+	}
+	if (*c == '\0')
+		c = "/";
+	if (strlcpy(path, c, pathlen) >= pathlen)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * http_get()
+ *
+ * Queue a GET request for <uri> on <host>:<port>.  <cb> is called exactly
+ * once, with the parsed response, or with NULL if the request failed.  The
+ * response and its body are only valid for the duration of the callback.
+ * Returns 0 if the request was queued, -1 on immediate failure (in which
+ * case <cb> is not called).
+ */
+int
+http_get(const char *host, const char *port, const char *uri,
+    void (*cb)(struct http_response *, void *), void *arg)
+{
+	struct http_conn *hc;
+	struct http_request *hr;
+	char *msg;
+	int l;
+
+	msg = xmalloc(GETSTRINGLEN);
+	l = snprintf(msg, GETSTRINGLEN,
+	    "GET %s HTTP/1.1\r\n"
+	    "Host: %s\r\n"
+	    "User-Agent: Unworkable/%s\r\n"
+	    "Accept-Encoding: identity\r\n"
+	    "Connection: keep-alive\r\n\r\n",
+	    uri, host, UNWORKABLE_VERSION);
+	if (l == -1 || l >= GETSTRINGLEN) {
+		trace("http_get() string truncation");
+		xfree(msg);
+		return (-1);
+	}
+
+	TAILQ_FOREACH(hc, &http_conns, conns)
+		if (strcmp(hc->host, host) == 0 && strcmp(hc->port, port) == 0)
+			break;
+	if (hc == NULL) {
+		hc = http_conn_create(host, port);
+		if (http_conn_open(hc) == -1) {
+			http_conn_free(hc);
+			xfree(msg);
+			return (-1);
+		}
+	}
+
+	hr = xmalloc(sizeof(*hr));
+	memset(hr, 0, sizeof(*hr));
+	hr->msg = msg;
+	hr->cb = cb;
+	hr->arg = arg;
+	TAILQ_INSERT_TAIL(&hc->queue, hr, reqs);
+	trace("http_get() queued request for %s:%s%s (%s connection)", host,
+	    port, uri, hc->reused ? "reused" : "new");
+	if (hc->req == NULL)
+		http_conn_send(hc);
+
+	return (0);
+}
+
+/*
+ * http_conn_create()
+ *
+ * Allocate a connection record and link it into the connection cache.
+ */
+static struct http_conn *
+http_conn_create(const char *host, const char *port)
+{
+	struct http_conn *hc;
+
+	hc = xmalloc(sizeof(*hc));
+	memset(hc, 0, sizeof(*hc));
+	TAILQ_INIT(&hc->queue);
+	hc->host = xstrdup(host);
+	hc->port = xstrdup(port);
+	hc->fd = -1;
+	TAILQ_INSERT_TAIL(&http_conns, hc, conns);
+
+	return (hc);
+}
+
+/*
+ * http_conn_open()
+ *
+ * Start a non-blocking connect to the connection's host.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+http_conn_open(struct http_conn *hc)
+{
+	if ((hc->fd = network_connect_tracker(hc->host, hc->port)) == -1) {
+		trace("http_conn_open() could not connect to %s:%s", hc->host,
+		    hc->port);
+		return (-1);
+	}
+	hc->bev = bufferevent_new(hc->fd, http_handle_read, http_handle_write,
+	    http_handle_error, hc);
+	if (hc->bev == NULL)
+		errx(1, "http_conn_open: bufferevent_new failure");
+	/* the write timeout covers the connect and sending of the request */
+	bufferevent_settimeout(hc->bev, HTTP_READ_TIMEOUT,
+	    HTTP_CONNECT_TIMEOUT);
+	bufferevent_enable(hc->bev, EV_READ|EV_WRITE);
+	hc->reused = 0;
+	memset(&hc->res, 0, sizeof(hc->res));
+
+	return (0);
+}
+
+/*
+ * http_conn_close()
+ *
+ * Close the socket of a connection, but keep its request queue.
+ */
+static void
+http_conn_close(struct http_conn *hc)
+{
+	if (hc->bev != NULL) {
+		bufferevent_free(hc->bev);
+		hc->bev = NULL;
+	}
+	if (hc->fd != -1) {
+		(void) close(hc->fd);
+		hc->fd = -1;
+	}
+}
+
+/*
+ * http_conn_free()
+ *
+ * Unlink and free a connection, which must have no requests left.
+ */
+static void
+http_conn_free(struct http_conn *hc)
+{
+	http_conn_close(hc);
+	TAILQ_REMOVE(&http_conns, hc, conns);
+	xfree(hc->host);
+	xfree(hc->port);
+	xfree(hc);
+}
+
+/*
+ * http_conn_fail()
+ *
+ * Fail every request on this connection and free it.
+ */
+static void
+http_conn_fail(struct http_conn *hc)
+{
+	struct http_request *hr;
+
+	http_conn_close(hc);
+	if (hc->req != NULL)
+		TAILQ_INSERT_HEAD(&hc->queue, hc->req, reqs);
+	hc->req = NULL;
+	/* unlink first, so callbacks which re-request get a new connection */
+	TAILQ_REMOVE(&http_conns, hc, conns);
+	while ((hr = TAILQ_FIRST(&hc->queue)) != NULL) {
+		TAILQ_REMOVE(&hc->queue, hr, reqs);
+		hr->cb(NULL, hr->arg);
+		xfree(hr->msg);
+		xfree(hr);
+	}
+	xfree(hc->host);
+	xfree(hc->port);
+	xfree(hc);
+}
+
+/*
+ * http_conn_send()
+ *
+ * Write the next queued request, if any, reconnecting if the previous
+ * response closed the connection.
+ */
+static void
+http_conn_send(struct http_conn *hc)
+{
+	struct http_request *hr;
+
+	if ((hr = TAILQ_FIRST(&hc->queue)) == NULL)
+		return;
+	if (hc->bev == NULL && http_conn_open(hc) == -1) {
+		http_conn_fail(hc);
+		return;
+	}
+	TAILQ_REMOVE(&hc->queue, hr, reqs);
+	hc->req = hr;
+	memset(&hc->res, 0, sizeof(hc->res));
+	if (bufferevent_write(hc->bev, hr->msg, strlen(hr->msg)) != 0)
+		errx(1, "http_conn_send: bufferevent_write failure");
+	bufferevent_enable(hc->bev, EV_READ|EV_WRITE);
+}
+
+/*
+ * http_handle_read()
+ *
+ * Data has arrived on a connection.  Parse as much of the response as we
+ * can, and hand it to the requester once it is complete.
+ */
+static void
+http_handle_read(struct bufferevent *bufev, void *arg)
+{
+	struct http_conn *hc = arg;
+
+	if (hc->req == NULL) {
+		/* nothing was asked for, so this can only be garbage */
+		trace("http_handle_read() unsolicited data from %s:%s",
+		    hc->host, hc->port);
+		http_conn_close(hc);
+		if (TAILQ_EMPTY(&hc->queue))
+			http_conn_free(hc);
+		return;
+	}
+	if (http_conn_input(hc) == -1)
+		http_conn_fail(hc);
+}
+
+/*
+ * http_conn_input()
+ *
+ * Run the response parser over the connection's input buffer.  Once the
+ * response is complete, pass it to the requester, then move on to the next
+ * queued request.  The connection may have been freed when this returns 1.
+ * Returns 1 when a response was delivered, 0 if more data is needed, -1 on
+ * error.
+ */
+static int
+http_conn_input(struct http_conn *hc)
+{
+	struct http_request *hr;
+	struct evbuffer *input;
+	int ret;
+
+	input = EVBUFFER_INPUT(hc->bev);
+	if (EVBUFFER_LENGTH(input) > HTTP_MAX_RESPONSE) {
+		trace("http_conn_input() response from %s:%s exceeds %u bytes",
+		    hc->host, hc->port, HTTP_MAX_RESPONSE);
+		return (-1);
+	}
+	if (!(hc->res.flags & HTTP_RES_HDRDONE)) {
+		ret = http_parse_headers(&hc->res, EVBUFFER_DATA(input),
+		    EVBUFFER_LENGTH(input));
+		if (ret != 1)
+			return (ret);
+	}
+	ret = http_parse_body(&hc->res, EVBUFFER_DATA(input),
+	    EVBUFFER_LENGTH(input));
+	if (ret != 1)
+		return (ret);
+
+	/* complete response; the request stays set while the callback
+	 * runs so that new requests on this host get queued behind it */
+	hr = hc->req;
+	hc->res.body = EVBUFFER_DATA(input) + hc->res.hdrlen;
+	trace("http_conn_input() %d response from %s:%s, %zu byte body",
+	    hc->res.code, hc->host, hc->port, hc->res.bodylen);
+	hr->cb(&hc->res, hr->arg);
+	hc->res.body = NULL;
+	xfree(hr->msg);
+	xfree(hr);
+	hc->req = NULL;
+	evbuffer_drain(input, hc->res.rawlen);
+	hc->reused = 1;
+	if (!(hc->res.flags & HTTP_RES_KEEPALIVE))
+		http_conn_close(hc);
+	if (TAILQ_EMPTY(&hc->queue)) {
+		/* idle connections are reaped by the read timeout */
+		if (hc->bev == NULL)
+			http_conn_free(hc);
+		return (1);
+	}
+	http_conn_send(hc);
+
+	return (1);
+}
+
+/*
+ * http_handle_write()
+ *
+ * Write handler for tracker sockets.  Nothing to do.
+ */
+static void
+http_handle_write(struct bufferevent *bufev, void *arg)
+{
+}
+
+/*
+ * http_handle_error()
+ *
+ * Called on EOF, error or timeout.  A close-delimited response is complete
+ * at EOF; a kept-alive connection which the server dropped before
+ * answering is retried once on a fresh connection.  Anything else fails.
+ */
+static void
+http_handle_error(struct bufferevent *bufev, short error, void *arg)
+{
+	struct http_conn *hc = arg;
+	struct http_request *hr;
+	struct evbuffer *input;
+
+	input = EVBUFFER_INPUT(bufev);
+	if (hc->req == NULL) {
+		trace("http_handle_error() idle connection to %s:%s closed",
+		    hc->host, hc->port);
+		http_conn_close(hc);
+		if (TAILQ_EMPTY(&hc->queue))
+			http_conn_free(hc);
+		else
+			http_conn_send(hc);
+		return;
+	}
+	if (error & EVBUFFER_TIMEOUT) {
+		trace("http_handle_error() timeout talking to %s:%s", hc->host,
+		    hc->port);
+		http_conn_fail(hc);
+		return;
+	}
+	if (error & EVBUFFER_EOF && hc->res.flags & HTTP_RES_HDRDONE) {
+		/* close-delimited body, or a complete response followed by
+		 * the server hanging up; either way we have all there is */
+		hc->res.flags |= HTTP_RES_EOF;
+		hc->res.flags &= ~HTTP_RES_KEEPALIVE;
+		if (http_conn_input(hc) != 1)
+			http_conn_fail(hc);
+		return;
+	}
+	if (hc->reused && EVBUFFER_LENGTH(input) == 0
+	    && !hc->req->retried) {
+		trace("http_handle_error() stale connection to %s:%s, retrying",
+		    hc->host, hc->port);
+		hr = hc->req;
+		hr->retried = 1;
+		hc->req = NULL;
+		TAILQ_INSERT_HEAD(&hc->queue, hr, reqs);
+		http_conn_close(hc);
+		http_conn_send(hc);
+		return;
+	}
+	trace("http_handle_error() error talking to %s:%s", hc->host,
+	    hc->port);
+	http_conn_fail(hc);
+}
+
+/*
+ * http_parse_headers()
+ *
+ * Parse the status line and headers, if they have all arrived.
+ * Returns 1 when done, 0 if more data is needed, -1 on error.
+ */
+static int
+http_parse_headers(struct http_response *res, u_int8_t *data, size_t len)
+{
+	ssize_t end, eol;
+	size_t off, n;
+	u_int8_t *h, *c;
+	int version;
+
+	if ((end = http_find(data, len, 0, HTTP_END)) == -1) {
+		if (len > HTTP_MAX_HEADERS) {
+			trace("http_parse_headers() headers too long");
+			return (-1);
+		}
+		return (0);
+	}
+	res->hdrlen = end + strlen(HTTP_END);
+
+	/* status line: HTTP/1.x NNN reason */
+	if (len < strlen(HTTP_1_1) + 4
+	    || (memcmp(data, HTTP_1_0, strlen(HTTP_1_0)) != 0
+	    && memcmp(data, HTTP_1_1, strlen(HTTP_1_1)) != 0)) {
+		trace("http_parse_headers() not an HTTP/1.x response");
+		return (-1);
+	}
+	version = data[strlen(HTTP_1_0) - 1] - '0';
+	c = data + strlen(HTTP_1_0) + 1;
+	if (!isdigit(c[0]) || !isdigit(c[1]) || !isdigit(c[2])) {
+		trace("http_parse_headers() bad status code");
+		return (-1);
+	}
+	res->code = (c[0] - '0') * 100 + (c[1] - '0') * 10 + (c[2] - '0');
+	/* HTTP/1.1 connections are persistent unless told otherwise */
+	if (version == 1)
+		res->flags |= HTTP_RES_KEEPALIVE;
+
+	off = http_find(data, len, 0, "\r\n") + 2;
+	while (off < (size_t)end + 2) {
+		eol = http_find(data, res->hdrlen, off, "\r\n");
+		h = data + off;
+		n = eol - off;
+		off = eol + 2;
+		if (http_header_is(h, n, "Content-Length")) {
+			c = (u_int8_t *)memchr(h, ':', n) + 1;
+			res->clen = 0;
+			for (; c < h + n && *c == ' '; c++)
+				;
+			for (; c < h + n && isdigit(*c); c++) {
+				res->clen = res->clen * 10 + (*c - '0');
+				if (res->clen > HTTP_MAX_RESPONSE) {
+					trace("http_parse_headers() body too"
+					    " long");
+					return (-1);
+				}
+			}
+			res->flags |= HTTP_RES_LENGTH;
+		} else if (http_header_is(h, n, "Transfer-Encoding")) {
+			if (http_find(h, n, 0, "chunked") != -1)
+				res->flags |= HTTP_RES_CHUNKED;
+		} else if (http_header_is(h, n, "Connection")) {
+			if (http_find(h, n, 0, "close") != -1)
+				res->flags &= ~HTTP_RES_KEEPALIVE;
+			else if (http_find(h, n, 0, "eep-") != -1)
+				res->flags |= HTTP_RES_KEEPALIVE;
+		}
+	}
+	/* a body we can only find the end of by EOF means no reuse */
+	if (!(res->flags & (HTTP_RES_LENGTH|HTTP_RES_CHUNKED)))
+		res->flags &= ~HTTP_RES_KEEPALIVE;
+	res->flags |= HTTP_RES_HDRDONE;
+	res->rawlen = res->hdrlen;
+
+	return (1);
+}
+
+/*
+ * http_parse_body()
+ *
+ * Advance the body parser over whatever has arrived.  Chunked bodies are
+ * decoded in place, so that the decoded body always starts right after
+ * the headers.  Returns 1 when the response is complete, 0 if more data is needed,
+ * -1 on error.
+ */
+static int
+http_parse_body(struct http_response *res, u_int8_t *data, size_t len)
+{
+	ssize_t eol;
+	size_t n;
+	u_int8_t *c;
+
+	if (res->flags & HTTP_RES_CHUNKED) {
+		for (;;) {
+			if (res->flags & HTTP_RES_CRLF) {
+				if (len - res->rawlen < 2)
+					return (0);
+				if (memcmp(data + res->rawlen, "\r\n", 2) != 0)
+					return (-1);
+				res->rawlen += 2;
+				res->flags &= ~HTTP_RES_CRLF;
+			}
+			if (res->chunkleft > 0) {
+				n = MIN(res->chunkleft, len - res->rawlen);
+				if (n == 0)
+					return (0);
+				memmove(data + res->hdrlen + res->bodylen,
+				    data + res->rawlen, n);
+				res->bodylen += n;
+				res->rawlen += n;
+				res->chunkleft -= n;
+				if (res->chunkleft == 0)
+					res->flags |= HTTP_RES_CRLF;
+				continue;
+			}
+			if ((eol = http_find(data, len, res->rawlen, "\r\n"))
+			    == -1)
+				return (0);
+			if (res->flags & HTTP_RES_TRAILER) {
+				/* skip trailers up to the empty line */
+				if ((size_t)eol == res->rawlen) {
+					res->rawlen += 2;
+					return (1);
+				}
+				res->rawlen = eol + 2;
+				continue;
+			}
+			/* chunk size line, possibly with extensions */
+			c = data + res->rawlen;
+			if (!isxdigit(*c))
+				return (-1);
+			for (n = 0; c < data + eol && isxdigit(*c); c++) {
+				n = n * 16 + (isdigit(*c) ? *c - '0'
+				    : tolower(*c) - 'a' + 10);
+				if (n > HTTP_MAX_RESPONSE)
+					return (-1);
+			}
+			if (res->bodylen + n > HTTP_MAX_RESPONSE)
+				return (-1);
+			res->rawlen = eol + 2;
+			if (n == 0)
+				res->flags |= HTTP_RES_TRAILER;
+			res->chunkleft = n;
+		}
+	}
+	if (res->flags & HTTP_RES_LENGTH) {
+		if (len - res->hdrlen < res->clen)
+			return (0);
+		res->bodylen = res->clen;
+		res->rawlen = res->hdrlen + res->clen;
+		return (1);
+	}
+	/* delimited by EOF */
+	if (!(res->flags & HTTP_RES_EOF))
+		return (0);
+	res->bodylen = len - res->hdrlen;
+	res->rawlen = len;
+
+	return (1);
+}
+
+/*
+ * http_find()
+ *
+ * Find string <s> in <data> starting at <off>.  Returns offset of the
+ * first match, or -1.
+ */
+static ssize_t
+http_find(const u_int8_t *data, size_t len, size_t off, const char *s)
+{
+	size_t n;
+
+	n = strlen(s);
+	for (; off + n <= len; off++)
+		if (data[off] == (u_int8_t)s[0] && memcmp(data + off, s, n) == 0)
+			return (off);
+
+	return (-1);
+}
+
+/*
+ * http_header_is()
+ *
+ * Is the header line <h> of length <len> the header named <name>?
+ */
+static int
+http_header_is(const u_int8_t *h, size_t len, const char *name)
+{
+	size_t n;
+
+	n = strlen(name);
+	if (len <= n || h[n] != ':')
+		return (0);
+
+	return (strncasecmp((const char *)h, name, n) == 0);
+}
@@ -29,6 +29,7 @@
 
 #include <openssl/bn.h>
 #include <openssl/dh.h>
+#include <openssl/rc4.h>
 #include <openssl/engine.h>
 
 #include <event.h>
@@ -44,6 +45,9 @@
 #define BLIST		(1 << 3)
 #define BDICT_ENTRY	(1 << 4)
 
+/* default limit on the nesting of parsed lists and dictionaries */
+#define BENC_MAX_DEPTH	64
+
 #define PEER_STATE_HANDSHAKE1		(1<<0)
 #define PEER_STATE_BITFIELD		(1<<1)
 #define PEER_STATE_ESTABLISHED		(1<<2)
@@ -57,6 +61,10 @@
 #define PEER_STATE_HANDSHAKE2		(1<<10)
 #define PEER_STATE_SENDBITFIELD		(1<<11)
 #define PEER_STATE_FAST			(1<<12)
+#define PEER_STATE_DHT			(1<<13)
+#define PEER_STATE_EXTENDED		(1<<14)
+#define PEER_STATE_INBOUND		(1<<15)
+#define PEER_STATE_UTP			(1<<16)
 
 #define PEER_MSG_ID_CHOKE		0x00
 #define PEER_MSG_ID_UNCHOKE		0x01
@@ -68,6 +76,7 @@
 #define PEER_MSG_ID_PIECE		0x07
 #define PEER_MSG_ID_CANCEL		0x08
 #define PEER_MSG_ID_PORT		0x09
+#define PEER_MSG_ID_EXTENDED		0x14
 /* Fast extension - see BEP 6 http://bittorrent.org/beps/bep_0006.html */
 #define PEER_MSG_ID_REJECT		0x10
 #define PEER_MSG_ID_ALLOWEDFAST		0x11
@@ -85,6 +94,75 @@
 #define MAX_MESSAGE_LEN 		0xffffff /* 16M */
 #define DEFAULT_ANNOUNCE_INTERVAL	1800/* */
 #define MAX_REQUESTS			100 /* max request queue length per peer */
+#define ENDGAME_MAX_REQUESTS		2 /* peers asked for one block in endgame */
+
+/* streaming mode: the pieces from the playback position on come first */
+#define STREAM_WINDOW			8 /* pieces */
+#define STREAM_PEERS			4 /* fastest peers the window goes to */
+#define STREAM_DEADLINE			4 /* seconds for first piece's blocks */
+#define STREAM_DEADLINE_STEP		2 /* more seconds for each later piece */
+#define STREAM_MAX_REQUESTS		3 /* peers asked for one window block */
+
+/*
+ * speed class of a partially downloaded piece, after the peers fetching
+ * it.  A peer is fast if it could fetch a whole piece in PIECE_FAST_TIME.
+ */
+#define PIECE_SPEED_NONE		0 /* nobody is, any peer may join in */
+#define PIECE_SPEED_SLOW		1
+#define PIECE_SPEED_FAST		2
+#define PIECE_FAST_TIME			10 /* seconds */
+
+/* hosts which send us bad data */
+#define TRUST_BAN_TIME			3600 /* seconds */
+#define TRUST_MAX_BAD			3 /* failed pieces before a suspect is banned */
+
+/* peer transfer rates are averaged over this many seconds */
+#define RATE_WINDOW			20
+
+/* choking: who we upload to, rechosen every CHOKE_INTERVAL seconds */
+#define CHOKE_INTERVAL			10 /* seconds */
+#define OPTIMISTIC_INTERVAL		30 /* seconds */
+#define UPLOAD_SLOTS			3 /* regular unchokes, or the first guess */
+#define UPLOAD_SLOTS_MIN		2
+#define UPLOAD_SLOTS_MAX		32
+
+/* uploading: peers' output buffers are topped up whenever they drain below
+ * UPLOAD_LOWAT, taking turns by deficit round robin */
+#define UPLOAD_LOWAT			(2 * BLOCK_SIZE)
+#define UPLOAD_QUANTUM			BLOCK_SIZE /* bytes a turn, unchoked */
+#define UPLOAD_QUANTUM_CHOKED		(BLOCK_SIZE / 4) /* allowed fast only */
+/* longest block a peer may request of us */
+#define MAX_REQUEST_LEN			(8 * BLOCK_SIZE)
+
+/* read cache of whole pieces for uploads */
+#define CACHE_DEFAULT_SIZE		(16 * 1024 * 1024) /* bytes */
+#define CACHE_NOTIFY_INTERVAL		10 /* seconds */
+
+/* fast resume journal of good pieces */
+#define RESUME_SYNC_PIECES		16 /* pieces logged between syncs */
+#define RESUME_SYNC_INTERVAL		5 /* seconds */
+#define RESUME_COMPACT_PIECES		1024 /* pieces logged between snapshots */
+
+/* most torrent files held open at once, fd limit permitting */
+#define FILE_CACHE_SIZE			64
+
+/* b-encoded state files: the fast resume snapshot, peer and DHT caches */
+#define STATE_VERSION			1
+#define STATE_MAX_DEPTH			3
+
+/* how room is made on disk for the files we download */
+#define ALLOC_SPARSE			0 /* set their length when first opened */
+#define ALLOC_FULL			1 /* reserve all of every wanted file at start */
+#define ALLOC_NONE			2 /* only as data is written */
+
+/* memory for assembling incoming pieces before they are hash checked */
+#define ASSEMBLY_POOL_SIZE		(32 * 1024 * 1024) /* bytes */
+
+/* super-seeding: what a peer has made of the last piece we showed it */
+#define SUPERSEED_NONE			0 /* nothing shown yet */
+#define SUPERSEED_SHOWN			1 /* waiting for it to get the piece */
+#define SUPERSEED_GOT			2 /* waiting for it to pass it on */
+#define SUPERSEED_WAIT			60 /* seconds before showing another anyway */
 
 /* MSE defines
  * see http://www.azureuswiki.com/index.php/Message_Stream_Encryption */
@@ -92,34 +170,115 @@
 #define CRYPTO_GENERATOR		2
 #define CRYPTO_PLAINTEXT		0x01
 #define CRYPTO_RC4			0x02
-#define CRYPTO_INT_LEN			160
+#define CRYPTO_INT_LEN			96
+#define CRYPTO_MAX_PAD			512
 #define CRYPTO_MAX_BYTES1		608
 #define CRYPTO_MIN_BYTES1		96
 
 #define BT_PROTOCOL			"BitTorrent protocol"
 #define BT_PSTRLEN			19
 #define BT_INITIAL_LEN 			20
+#define BT_HANDSHAKE_LEN		(1 + BT_PSTRLEN + 8 + 20 + 20)
+
+/* compact peer info: address then port */
+#define COMPACT_LEN			6
+#define COMPACT_LEN6			18
+
+/*
+ * connection setup time per address family, used to decide which family
+ * to connect to first: start, smoothing weight, and the time charged for
+ * a connection which fails before the handshake.
+ */
+#define CONNECT_TIME_INITIAL		1000 /* ms */
+#define CONNECT_TIME_WEIGHT		8
+#define CONNECT_TIME_FAILED		10000 /* ms */
 
 /* try to keep this many peer connections at all times */
 #define PEERS_WANTED			10
 
+/* peers saved for next time, so we needn't wait for the tracker */
+#define PEER_CACHE_MAX			100
+#define PEER_CACHE_INTERVAL		(5 * 60)
+
 /* when trying to fetch more peers, make sure we don't announce
  * more often than this interval allows */
 #define MIN_ANNOUNCE_INTERVAL		60
 
+/* peer exchange (BEP 10/11) parameters */
+#define PEX_INTERVAL			60 /* per peer, as BEP 11 asks */
+#define PEX_MAX_PEERS			50 /* added or dropped per message */
+#define PEX_PEERS_WANTED		40 /* stop connecting pex peers here */
+#define PEX_MAX_DEPTH			4
+/* re-announce interval once peers are exchanging peer lists */
+#define PEX_ANNOUNCE_INTERVAL		(5 * 60)
+
+/* DHT (BEP 5) parameters */
+#define DHT_K				8 /* bucket size */
+#define DHT_ALPHA			3 /* lookup parallelism */
+#define DHT_MAX_MSG			1500
+#define DHT_MAX_QUERIES			64 /* total in flight */
+#define DHT_QUERY_TIMEOUT		10
+#define DHT_NODE_STALE			(15 * 60)
+#define DHT_TOKEN_ROTATE		(5 * 60)
+#define DHT_SEARCH_INTERVAL		(10 * 60)
+#define DHT_REFRESH_INTERVAL		(15 * 60)
+#define DHT_SAVE_INTERVAL		(5 * 60)
+#define DHT_PEER_TTL			(30 * 60)
+#define DHT_MAX_STORED			4096 /* announced peers we remember */
+#define DHT_MAX_VALUES			50 /* peers per get_peers reply */
+#define DHT_BOOTSTRAP_NODES		"router.bittorrent.com:6881 " \
+					"dht.transmissionbt.com:6881"
+
+/* the UDP socket shared by the DHT and uTP */
+#define UDP_MAX_MSG			2048
+
+/* uTP (BEP 29) parameters */
+#define UTP_VERSION			1
+#define UTP_HEADER_LEN			20
+#define UTP_PACKET_SIZE			1400 /* header included */
+#define UTP_MAX_PACKETS			512 /* in flight, and reorder buffer */
+#define UTP_RCV_WINDOW			(1024 * 1024)
+#define UTP_TARGET_DELAY		100000 /* LEDBAT target, microseconds */
+#define UTP_MAX_CWND_INCREASE		3000 /* bytes per RTT */
+#define UTP_MIN_WINDOW			UTP_PACKET_SIZE
+#define UTP_INITIAL_RTO			1000 /* milliseconds */
+#define UTP_MIN_RTO			500
+#define UTP_MAX_RTO			60000
+#define UTP_SYN_RETRIES			2 /* then fall back to TCP */
+#define UTP_MAX_RETRIES			6
+#define UTP_DUP_ACKS			3 /* for fast retransmit */
+#define UTP_DELAY_HISTORY		2 /* minutes of base delay history */
+#define UTP_TICK			100 /* timer resolution, milliseconds */
+
+/* how often to scrape trackers for swarm counts, 0 disables */
+#define DEFAULT_SCRAPE_INTERVAL		900
+/* max info_hashes per scrape request, so it fits in GETSTRINGLEN */
+#define SCRAPE_MAX_HASHES		24
+
 #define PEER_ID_LEN			20
 /* these are used in the HTTP client */
 #define GETSTRINGLEN			2048
 #define HTTPLEN				7
-#define RESBUFLEN			1024
 #define HTTP_1_0			"HTTP/1.0"
 #define HTTP_1_1			"HTTP/1.1"
-#define HTTP_OK				"200"
+#define HTTP_OK				200
 #define HTTP_END			"\r\n\r\n"
+#define HTTP_MAX_HEADERS		8192
+#define HTTP_MAX_RESPONSE		(1024 * 1024) /* 1MB */
+#define HTTP_CONNECT_TIMEOUT		30
+/* also how long an idle keep-alive connection is kept around */
+#define HTTP_READ_TIMEOUT		60
 
 #define DEFAULT_PORT			"6668"
 
 #define PIECE_GIMME_NOCREATE		(1<<0)
+/* only pieces the peer lets us have while it chokes us */
+#define PIECE_GIMME_ALLOWEDFAST		(1<<1)
+
+/* pieces in the allowed fast sets we offer, as BEP 6 suggests */
+#define ALLOWED_FAST_SET		10
+/* most SUGGEST hints we remember per peer */
+#define SUGGEST_MAX			8
 
 #define CTL_MESSAGE_LEN			64
 
@@ -141,7 +300,13 @@ struct benc_node {
 		struct {
 			char *key;
 			struct benc_node *value;
+			size_t keylen;
 		}				dict_entry;
+		/* the root's node chunks and the buffer it was parsed from */
+		struct {
+			struct benc_chunk *chunks;
+			struct buf *buf;
+		}				root;
 	} body;
 	/* in dictionaries, absolute offset of dict end from start of input buffer */
 	size_t end;
@@ -154,35 +319,80 @@ struct torrent_mmap {
 	u_int8_t			*aligned_addr;
 	u_int32_t			len;
 	struct torrent_file		*tfp;
-	TAILQ_ENTRY(torrent_mmap)	mmaps;
+	/* where it starts in the piece */
+	u_int32_t			poff;
+};
+
+/* a run of a torrent's data which lies within one file */
+struct torrent_extent {
+	struct torrent_file		*tfp;
+	/* where it starts in the file */
+	off_t				off;
+	u_int32_t			len;
 };
 
 
 #define TORRENT_PIECE_CKSUMOK		(1<<0)
 #define TORRENT_PIECE_MAPPED		(1<<1)
+/* failed a hash check with blocks from several peers, fetch it from one */
+#define TORRENT_PIECE_SUSPECT		(1<<2)
+/* its files changed since the fast resume data was written, check it */
+#define TORRENT_PIECE_RECHECK		(1<<3)
+
+/* download priorities of files, and of the pieces overlapping them */
+#define TORRENT_PRIORITY_SKIP		0
+#define TORRENT_PRIORITY_LOW		1
+#define TORRENT_PRIORITY_NORMAL		2
+#define TORRENT_PRIORITY_HIGH		3
 
 struct torrent_piece {
 	/* misc info about the piece */
 	int				flags;
+	/* highest priority of the files it overlaps */
+	int				priority;
 	/* how many blocks we currently have */
 	u_int32_t                          blocks;
 	/* how long the piece actually is */
 	u_int32_t                          len;
 	/* index of this piece in the torrent */
 	u_int32_t                          index;
-	/* list of low-level mmaps containing the blocks */
-	TAILQ_HEAD(mmaps, torrent_mmap)	mmaps;
+	/* low-level mmaps containing the blocks, in piece order */
+	struct torrent_mmap		**mmaps;
+	u_int32_t			num_mmaps;
 	/* pointer to containing torrent */
 	struct torrent			*tp;
+	/* blocks with piece dls, and those of them PIECE_DL_COVERED */
+	u_int32_t			dl_blocks;
+	u_int32_t			covered;
+	/* PIECE_SPEED_* of the peers fetching it */
+	int				speed;
+	/* session list of pieces with dl_blocks */
+	TAILQ_ENTRY(torrent_piece)	partial;
+	/* its data, if it is in the read cache, and its place there */
+	u_int8_t			*cache;
+	TAILQ_ENTRY(torrent_piece)	cached;
+	/* assembly buffer its blocks are collected in, if it has one */
+	u_int8_t			*buf;
+	/* which of its blocks have arrived, while it is partial */
+	u_int8_t			*blockmap;
 };
 
+#define TORRENT_PIECE_BLOCKMAP_LEN(tpp) \
+	((((tpp)->len + BLOCK_SIZE - 1) / BLOCK_SIZE + 7u) / 8u)
+
 struct torrent_file {
 	TAILQ_ENTRY(torrent_file)		files;
 	off_t					file_length;
+	/* where it starts in the torrent's data */
+	off_t					offset;
 	char					*md5sum;
 	char					*path;
 	int					fd;
 	size_t					refs;
+	int					priority;
+	/* place among the open files, and whether it has writes to sync */
+	TAILQ_ENTRY(torrent_file)		open_files;
+	int					dirty;
 };
 
 struct torrent {
@@ -207,6 +417,8 @@ struct torrent {
 	u_int32_t				num_pieces;
 	u_int32_t				piece_length;
 	u_int32_t				good_pieces;
+	/* pieces we don't have which aren't skipped */
+	u_int32_t				wanted_left;
 	enum type				type;
 	off_t					uploaded;
 	off_t					downloaded;
@@ -215,10 +427,29 @@ struct torrent {
 	u_int32_t				interval;
 	char					*trackerid;
 	char					*name;
-	short					isnew;
 	u_int32_t				complete;
 	u_int32_t				incomplete;
+	/* when complete/incomplete were last heard from the tracker */
+	time_t					last_swarm_update;
 	struct torrent_piece			*piece_array;
+	/* fast resume journal, the pieces logged to it since the last
+	 * snapshot, and those waiting for their data to be synced first */
+	int					resume_fd;
+	u_int32_t				resume_logged;
+	u_int32_t				resume_unsynced;
+	u_int32_t				*resume_pending;
+	/* open files, least recently used first, and how many may be */
+	TAILQ_HEAD(open_files, torrent_file)	open_files;
+	u_int32_t				num_open_files;
+	u_int32_t				max_open_files;
+	/* non-empty files, in order, for finding them by offset */
+	struct torrent_file			**file_table;
+	u_int32_t				num_files;
+	/* assembly buffers: idle ones, and how many exist and may exist */
+	u_int8_t				**bufs_free;
+	u_int32_t				num_bufs_free;
+	u_int32_t				num_bufs;
+	u_int32_t				max_bufs;
 };
 
 /* Control server */
@@ -233,7 +464,7 @@ struct ctl_server {
 /* Connections to control server */
 struct ctl_server_conn {
 	struct bufferevent *bev;
-	struct sockaddr_in sa;
+	struct sockaddr_storage sa;
 	struct ctl_server *cs;
 	int fd;
 	TAILQ_ENTRY(ctl_server_conn) conn_list;
@@ -241,20 +472,58 @@ struct ctl_server_conn {
 
 /* data for a http response */
 struct http_response {
-	/* response buffer */
-	u_int8_t *rxmsg;
-	/* size of buffer so far */
-	u_int32_t rxread, rxmsglen;
+	/* status code */
+	int code;
+	int flags;
+	/* length of status line and headers */
+	size_t hdrlen;
+	/* Content-Length, if given */
+	size_t clen;
+	/* bytes left in the current chunk */
+	size_t chunkleft;
+	/* raw bytes consumed from the input buffer so far */
+	size_t rawlen;
+	/* decoded body, pointing into the connection's input buffer */
+	u_int8_t *body;
+	size_t bodylen;
 };
 
 
+/* message stream encryption state */
+struct mse {
+	int state;
+	/* our private key */
+	BIGNUM *x;
+	/* shared secret */
+	u_int8_t S[CRYPTO_INT_LEN];
+	/* what we are scanning for in the handshake */
+	u_int8_t sync[20];
+	u_int32_t provide;
+	u_int16_t padlen;
+	RC4_KEY rx;
+	RC4_KEY tx;
+	/* is output encrypted? */
+	int txcrypt;
+	/* how much more input is encrypted; SIZE_MAX for all of it */
+	size_t rxcrypt;
+	/* bytes at the head of the input buffer already decrypted */
+	size_t rxclear;
+};
+
+/* bytes moved in each of the last RATE_WINDOW seconds */
+struct rate {
+	u_int64_t bytes[RATE_WINDOW];
+	u_int64_t sum;
+	time_t last;
+};
+
 /* bittorrent peer */
 struct peer {
 	TAILQ_ENTRY(peer) peer_list;
 	RB_ENTRY(peer_idxnode) entry;
 	TAILQ_HEAD(peer_piece_dls, piece_dl) peer_piece_dls;
 	TAILQ_HEAD(peer_piece_uls, piece_ul) peer_piece_uls;
-	struct sockaddr_in sa;
+	struct sockaddr_storage sa;
 	int connfd;
 	int state;
 	u_int32_t rxpending;
@@ -285,6 +554,48 @@ struct peer {
 	u_int32_t ul_queue_len;
 	/* keep alive timer event */
 	struct event keepalive_event;
+	/* peer's listen port (network order), 0 if unknown */
+	u_int16_t listen_port;
+	/* peer's id for ut_pex messages, 0 if unsupported */
+	u_int8_t pex_id;
+	/* addresses we have told this peer about, 18 byte compact form */
+	u_int8_t *pex_sent;
+	u_int32_t pex_sent_num;
+	/* last time we sent this peer a ut_pex message */
+	time_t last_pex;
+	/* encryption state, NULL for plaintext connections */
+	struct mse *mse;
+	/* when we started connecting to it, if we did */
+	struct timeval connect_start;
+	/* pieces it lets us request while choked, NULL if none */
+	u_int8_t *allowed_fast;
+	/* pieces we let it request while we choke it */
+	u_int32_t fast_offered[ALLOWED_FAST_SET];
+	u_int32_t num_fast_offered;
+	/* bytes it may still be sent this upload round */
+	u_int32_t ul_deficit;
+	/* pieces it suggested we download, oldest first */
+	u_int32_t suggested[SUGGEST_MAX];
+	u_int32_t num_suggested;
+	/* record of the data its host has sent us, once it has sent some */
+	struct peer_trust *trust;
+	/* recent block payload rx'd from and tx'd to it */
+	struct rate rxwin;
+	struct rate txwin;
+	/* super-seeding: the piece we last showed it, and since when */
+	u_int32_t ss_piece;
+	int ss_state;
+	time_t ss_time;
+};
+
+/* what we know of a host from the pieces it sent blocks of, kept after it
+ * disconnects.  The port is ignored: it's the host we judge. */
+struct peer_trust {
+	RB_ENTRY(peer_trust) entry;
+	struct sockaddr_storage sa;
+	u_int32_t good;		/* pieces which passed their hash check */
+	u_int32_t bad;		/* pieces which failed */
+	time_t banned;		/* banned until when, 0 if not */
 };
 
 /* piece download transaction */
@@ -296,8 +607,14 @@ struct piece_dl {
 	u_int32_t off; /* offset within this piece */
 	u_int32_t len; /* length of this request */
 	u_int32_t bytes; /* how many bytes have we read so far */
+	time_t requested; /* when it was last handed to a peer */
+	struct piece_dl_idxnode *idxnode; /* the block it is for */
+	struct peer_trust *src; /* host whose data we wrote, if any */
 };
 
+/* is this piece dl's block in hand, or on its way from some peer? */
+#define PIECE_DL_COVERED(pd)	((pd)->pc != NULL || (pd)->bytes == (pd)->len)
+
 /* piece upload request */
 struct piece_ul {
 	TAILQ_ENTRY(piece_ul) peer_piece_ul_list;
@@ -316,11 +633,13 @@ struct piece_dl_idxnode {
 	u_int32_t idx; /* piece index */
 	u_int32_t off; /* offset within this piece */
 	TAILQ_HEAD(idxnode_piece_dls, piece_dl) idxnode_piece_dls;
+	u_int32_t covered; /* piece dls in the list which are PIECE_DL_COVERED */
 };
 
 struct piececounter {
 	u_int32_t count;
 	u_int32_t idx;
+	int priority;
 };
 
 struct peercounter {
@@ -330,24 +649,23 @@ struct peercounter {
 
 /* data associated with a bittorrent session */
 struct session {
+	TAILQ_ENTRY(session) session_list;
 	/* don't expect to have huge numbers of peers, or be searching very often, so linked list
 	 * should be fine for storage */
 	TAILQ_HEAD(peers, peer) peers;
 	/* index piece_dls by block index / offset */
 	RB_HEAD(piece_dl_by_idxoff, piece_dl_idxnode) piece_dl_by_idxoff;
-	int connfd;
 	int servfd;
+	int servfd6;
 	char *key;
 	char *ip;
 	char *numwant;
 	char *peerid;
 	char *port;
 	char *trackerid;
-	char *request;
 	struct event announce_event;
 	struct event scheduler_event;
 	struct torrent *tp;
-	struct http_response *res;
 	rlim_t maxfds;
 	int announce_underway;
 	u_int32_t tracker_num_peers;
@@ -358,30 +676,79 @@ struct session {
 	struct ctl_server *ctl_server;
 	u_int32_t txlimit;
 	u_int32_t rxlimit;
+	/* regular unchokes, tuned to fill txlimit, and the optimistic one */
+	u_int32_t upload_slots;
+	struct peer *optimistic;
+	/* upload token bucket, in bytes, and when it was last filled */
+	u_int64_t tx_tokens;
+	struct timeval tx_filled;
+	/* uploads wait on this when they run out of tokens */
+	struct event upload_event;
+	int upload_waiting;
+	int scrape_pending;
+	time_t last_dht_search;
+	/* smoothed connection setup time (ms) for IPv4 and IPv6 peers */
+	u_int32_t connect_time[2];
+	/* bytes of blocks which arrived after we already had them */
+	u_int64_t wasted;
+	/* blocks of incomplete pieces nobody is getting for us */
+	u_int32_t blocks_unassigned;
+	/* are we in endgame? */
+	int endgame;
+	/* streaming mode, and the byte offset being played */
+	int streaming;
+	off_t stream_pos;
+	/* slowest download rate which still gets window pieces */
+	u_int64_t stream_min_rate;
+	/* pieces we have some blocks of, or requests for */
+	TAILQ_HEAD(partial_pieces, torrent_piece) partial_pieces;
+	u_int32_t num_partial;
+	/* hosts which sent us blocks, and pieces which failed with them */
+	RB_HEAD(trust_by_host, peer_trust) trust_by_host;
+	TAILQ_HEAD(suspect_pieces, suspect_piece) suspect_pieces;
+	/* super-seeding, and the pieces peers have been seen to have */
+	int superseed;
+	u_int8_t *ss_seen;
+	u_int32_t ss_seen_num;
+	/* read cache, most recently used first */
+	TAILQ_HEAD(cache_lru, torrent_piece) cache_lru;
+	u_int64_t cache_bytes;
+	u_int64_t cache_hits;
+	u_int64_t cache_misses;
+	/* hits and misses when the control server was last told */
+	u_int64_t cache_notified;
 };
 
+/* all sessions, so trackers can be scraped in batches */
+TAILQ_HEAD(sessions, session);
+extern struct sessions sessions;
+
 void			 benc_node_add(struct benc_node *, struct benc_node *);
-void			 benc_node_add_head(struct benc_node *,
-			    struct benc_node *);
-struct benc_node	*benc_node_create(void);
+struct benc_node	*benc_node_create(struct benc_node *);
 struct benc_node	*benc_node_find(struct benc_node *node, char *);
+struct benc_node	*benc_dict_get(struct benc_node *, const char *, int);
+int			 benc_check(const u_int8_t *, size_t, int);
 void			 benc_node_print(struct benc_node *, int);
 struct benc_node	*benc_root_create(void);
 void			 benc_node_freeall(struct benc_node *);
 
-extern struct benc_node	*root;
+extern int		 benc_max_depth;
 
 /* flags */
 #define BUF_AUTOEXT	1	/* autoextend on append */
+#define BUF_WRAPPED	2	/* data belongs to someone else */
 
 typedef struct buf BUF;
 
 BUF		*buf_alloc(size_t, u_int);
 BUF		*buf_load(const char *, u_int);
+BUF		*buf_wrap(void *, size_t);
 void		 buf_free(BUF *);
 void		*buf_release(BUF *);
+void		*buf_get(BUF *);
 int		 buf_getc(BUF *);
 ssize_t		 buf_set(BUF *, const void *, size_t, size_t);
+ssize_t		 buf_append(BUF *, const void *, size_t);
 size_t		 buf_len(BUF *);
 int		 buf_write_fd(BUF *, int);
 int		 buf_write(BUF *, const char *, mode_t);
@@ -392,21 +759,36 @@ size_t		 buf_pos(BUF *);
 int		 mkpath(const char *, mode_t);
 void		 util_setbit(u_int8_t *, u_int32_t);
 int		 util_getbit(u_int8_t *, u_int32_t);
+const char	*print_host(const struct sockaddr_storage *);
+socklen_t	 util_addrlen(const struct sockaddr_storage *);
+u_int16_t	 util_addrport(const struct sockaddr_storage *);
+void		 util_setport(struct sockaddr_storage *, u_int16_t);
+int		 util_hostcmp(const struct sockaddr_storage *,
+		    const struct sockaddr_storage *);
+int		 util_addrcmp(const struct sockaddr_storage *,
+		    const struct sockaddr_storage *);
+size_t		 util_addr_compact(const struct sockaddr_storage *, u_int8_t *);
+int		 util_addr_uncompact(struct sockaddr_storage *, const u_int8_t *,
+		    size_t);
 
 void		 network_init(void);
 int		 network_start_torrent(struct torrent *, rlim_t);
-int				yyerror(const char *, ...);
-int				yyparse(void);
-int				yylex(void);
 struct benc_node		*benc_parse_buf(BUF *b, struct benc_node *);
+void				 benc_put_int(BUF *, long long);
+void				 benc_put_str(BUF *, const void *, size_t);
+void				 benc_put_key(BUF *, const char *);
+void				 benc_put_dict(BUF *);
+void				 benc_put_list(BUF *);
+void				 benc_put_end(BUF *);
 
-extern BUF			*in;
 void			*torrent_block_read(struct torrent_piece *, off_t,
 			    u_int32_t, int *);
 void			 torrent_block_write(struct torrent_piece *, off_t,
 			    u_int32_t, void *);
 struct torrent_mmap	*torrent_mmap_create(struct torrent *,
 			    struct torrent_file *, off_t, u_int32_t);
+u_int32_t		 torrent_extents(struct torrent *, off_t, u_int32_t,
+			    struct torrent_extent **);
 struct torrent		*torrent_parse_file(const char *);
 u_int8_t		*torrent_parse_infohash(const char *, size_t);
 int			 torrent_piece_checkhash(struct torrent *,
@@ -415,12 +797,34 @@ struct torrent_piece	*torrent_piece_find(struct torrent *, u_int32_t);
 struct torrent_piece	*torrent_pieces_create(struct torrent *);
 int			 torrent_piece_map(struct torrent_piece *);
 void			 torrent_piece_unmap(struct torrent_piece *);
+int			 torrent_piece_buffer(struct torrent_piece *);
+void			 torrent_piece_buffer_free(struct torrent_piece *);
+void			 torrent_piece_flush(struct torrent_piece *);
+void			 torrent_block_flush(struct torrent_piece *, off_t,
+			    u_int32_t);
+void			 torrent_piece_block_have(struct torrent_piece *,
+			    u_int32_t);
+void			 torrent_piece_blocks_clear(struct torrent_piece *);
+int			 torrent_piece_ondisk(struct torrent_piece *);
+void			 torrent_allocate(struct torrent *);
 void			 torrent_print(struct torrent *);
 u_int8_t		*torrent_bitfield_get(struct torrent *);
 int			 torrent_empty(struct torrent *);
 void			 torrent_piece_sync(struct torrent *, u_int32_t);
+void			 torrent_state_name(struct torrent *, const char *,
+			    char *, size_t);
+struct benc_node	*torrent_state_load(struct torrent *, const char *,
+			    struct benc_node *);
+int			 torrent_state_save(struct torrent *, const char *,
+			    BUF *);
 void			 torrent_fastresume_dump(struct torrent *);
+void			 torrent_fastresume_record(struct torrent *, u_int32_t);
+void			 torrent_fastresume_sync(struct torrent *);
 int			 torrent_fastresume_load(struct torrent *);
+void			 torrent_swarm_update(struct torrent *,
+			    struct benc_node *, time_t);
+int			 torrent_priority_set(struct torrent *, const char *);
+void			 torrent_priorities_update(struct torrent *);
 /*
  * Support for Boehm's garbage collector, useful for finding leaks.
  */
@@ -461,6 +865,15 @@ extern char *unworkable_trace;
 extern char *user_port;
 extern char *gui_port;
 extern int seed;
+extern u_int32_t upload_rate;
+extern int scrape_interval;
+extern int dht_enabled;
+extern int mse_enabled;
+extern int utp_enabled;
+extern int stream_enabled;
+extern int superseed_enabled;
+extern u_int64_t cache_size;
+extern int alloc_mode;
 
 
 static const u_int8_t mse_P[] = {
@@ -504,10 +917,43 @@ char *__progname;
 #endif
 
 int	announce(struct session *, const char *);
+void	scrape_start(void);
+void	dht_start(struct session *);
+void	dht_ping(const struct sockaddr_storage *, u_int16_t);
+u_int16_t dht_port(void);
+void	dht_save(void);
+void	dht_input(u_int8_t *, size_t, const struct sockaddr_storage *);
+int	udp_open(const char *);
+u_int16_t udp_port(void);
+int	udp_family(int);
+void	udp_send(const void *, size_t, const struct sockaddr_storage *);
+int	utp_connect(const struct sockaddr_storage *, void (*)(void *), void *);
+void	utp_listen(void (*)(int, const struct sockaddr_storage *, void *),
+	    void *);
+void	utp_input(u_int8_t *, size_t, const struct sockaddr_storage *);
+void	mse_connect(struct peer *);
+void	mse_accept(struct peer *);
+int	mse_read(struct peer *);
+void	mse_consumed(struct peer *, size_t);
+void	mse_encrypt(struct peer *, u_int8_t *, size_t);
+void	mse_free(struct mse *);
+void	pex_write_handshake(struct peer *);
+void	pex_process(struct peer *, u_int8_t, u_int8_t *, size_t);
+void	pex_update(struct peer *);
+int	http_get(const char *, const char *, const char *,
+	    void (*)(struct http_response *, void *), void *);
+int	http_parse_url(const char *, char *, size_t, char *, size_t, char *,
+	    size_t);
 int	network_listen(char *, char *);
+void	network_session_start(struct session *);
+void	network_peerlist_add_compact(struct session *, const u_int8_t *,
+	    size_t, size_t);
 void 	network_peerlist_add_peer(struct session *, struct peer *);
 void	network_peerlist_update(struct session *, struct benc_node *);
+void	network_peerlist_update6(struct session *, struct benc_node *);
 void 	network_peerlist_connect(struct session *);
+void	network_peercache_load(struct session *);
+void	network_peercache_save(struct session *);
 struct piece_dl *network_piece_dl_find(struct session *, struct peer *, u_int32_t, u_int32_t);
 int	network_connect_tracker(const char *, const char *);
 void	network_peer_write_piece(struct peer *, u_int32_t, u_int32_t, u_int32_t);
@@ -527,15 +973,27 @@ void	network_peer_write_have(struct peer *, u_int32_t);
 void	network_peer_write_keepalive(struct peer *);
 void	network_peer_write_havenone(struct peer *);
 void	network_peer_write_haveall(struct peer *);
+void	network_peer_handshake(struct session *, struct peer *);
+void	network_peer_write(struct peer *, u_int8_t *, u_int32_t);
+void	network_peer_write_port(struct peer *);
+void	network_peer_write_extended(struct peer *, u_int8_t, const void *,
+	    size_t);
 void	network_peer_reject_block(struct peer *, u_int32_t, u_int32_t, u_int32_t);
+void	network_peer_write_allowedfast(struct peer *, u_int32_t);
 void	network_peer_write_choke(struct peer *);
-DH	*network_crypto_dh(void);
 long	network_peer_lastcomms(struct peer *);
 u_int64_t network_peer_rxrate(struct peer *);
 u_int64_t network_peer_txrate(struct peer *);
+void	network_rate_add(struct rate *, u_int64_t);
+u_int64_t network_rate_get(struct rate *, time_t);
 struct piece_dl * network_piece_dl_create(struct peer *, u_int32_t,
     u_int32_t, u_int32_t);
 void	network_piece_dl_free(struct session *, struct piece_dl *);
+void	network_piece_dl_recount(struct session *);
+void	network_piece_dl_set_peer(struct session *, struct piece_dl *,
+	    struct peer *);
+u_int32_t network_piece_dl_requests(struct session *, u_int32_t, u_int32_t,
+	    int *, time_t *);
 int	piece_dl_idxnode_cmp(struct piece_dl_idxnode *, struct piece_dl_idxnode *);
 struct piece_ul *network_piece_ul_enqueue(struct peer *, u_int32_t, u_int32_t, u_int32_t);
 struct piece_ul *network_piece_ul_dequeue(struct peer *);
@@ -544,10 +1002,31 @@ RB_PROTOTYPE(piece_dl_by_idxoff, piece_dl_idxnode, entry, piece_dl_idxnode_cmp)
 
 void	scheduler(int, short, void *);
 struct piece_dl * scheduler_piece_gimme(struct peer *, int, int *);
+void	scheduler_stream_seek(struct session *, off_t);
+int	scheduler_priority_set(struct session *, const char *);
+void	scheduler_upload(struct session *);
+
+struct peer_trust *trust_get(struct session *, const struct sockaddr_storage *);
+int	trust_banned(struct session *, const struct sockaddr_storage *);
+void	trust_piece_checked(struct session *, struct torrent_piece *, int);
+int	trust_cmp(struct peer_trust *, struct peer_trust *);
+/* index of trust records by host */
+RB_PROTOTYPE(trust_by_host, peer_trust, entry, trust_cmp)
+
+u_int8_t *cache_block_read(struct session *, struct torrent_piece *, u_int32_t,
+	    u_int32_t);
+
+void	superseed_start(struct session *);
+void	superseed_have(struct peer *, u_int32_t);
+void	superseed_bitfield(struct peer *);
+void	superseed_update(struct session *);
 
 void ctl_server_start(struct session *, char *, off_t);
 void ctl_server_notify_bytes(struct session *, off_t);
 void ctl_server_notify_pieces(struct session *);
 void ctl_server_notify_peers(struct session *);
+void ctl_server_notify_swarm(struct session *);
+void ctl_server_notify_bans(struct session *);
+void ctl_server_notify_cache(struct session *);
 /* global needs to change when we have multi-torrent support */
 extern struct torrent *mytorrent;
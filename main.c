@@ -24,6 +24,7 @@
 #include <sys/termios.h>
 
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -49,7 +50,8 @@ extern int  optind;
 void
 usage(void)
 {
-	fprintf(stderr, "usage: unworkable [-s] [-g port] [-p port] [-t tracefile] torrent\n");
+	fprintf(stderr, "usage: unworkable [-desSUz] [-a mode] [-c megabytes] [-f priorities] "
+	    "[-g port] [-i seconds] [-p port] [-t tracefile] [-u kbytes] torrent\n");
 	exit(1);
 }
 
@@ -73,9 +75,13 @@ main(int argc, char **argv)
 	struct winsize winsize;
 	struct event	 ev_sigint;
 	struct event	 ev_sigterm;
+#ifndef __OpenBSD__
+	struct timeval	 tv;
+#endif
 	u_int32_t i;
 	int ch, j, win_size, percent;
-	char blurb[MAX_WINSIZE+1];
+	const char *errstr;
+	char blurb[MAX_WINSIZE+1], *priorities = NULL;
 
 	#if defined(USE_BOEHM_GC)
 	GC_INIT();
@@ -92,20 +98,70 @@ main(int argc, char **argv)
 	__progname = argv[0];
 	#endif
 
-	while ((ch = getopt(argc, argv, "sg:t:p:")) != -1) {
+	while ((ch = getopt(argc, argv, "desSUza:c:f:g:i:t:p:u:")) != -1) {
 		switch (ch) {
 		case 't':
 			unworkable_trace = xstrdup(optarg);
 			break;
+		case 'a':
+			if (strcmp(optarg, "sparse") == 0)
+				alloc_mode = ALLOC_SPARSE;
+			else if (strcmp(optarg, "full") == 0)
+				alloc_mode = ALLOC_FULL;
+			else if (strcmp(optarg, "none") == 0)
+				alloc_mode = ALLOC_NONE;
+			else
+				errx(1, "unknown allocation mode: %s", optarg);
+			break;
+		case 'c':
+			cache_size = strtonum(optarg, 0, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "cache size is %s: %s", errstr, optarg);
+			cache_size *= 1024 * 1024;
+			break;
+		case 'f':
+			priorities = optarg;
+			break;
 		case 'g':
 			gui_port = xstrdup(optarg);
 			break;
+		case 'i':
+			scrape_interval = strtonum(optarg, 0, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "scrape interval is %s: %s", errstr,
+				    optarg);
+			if (scrape_interval != 0
+			    && scrape_interval < MIN_ANNOUNCE_INTERVAL)
+				scrape_interval = MIN_ANNOUNCE_INTERVAL;
+			break;
 		case 'p':
 			user_port = xstrdup(optarg);
 			break;
+		case 'u':
+			upload_rate = strtonum(optarg, 1, UINT_MAX / 1024, &errstr);
+			if (errstr != NULL)
+				errx(1, "upload rate is %s: %s", errstr, optarg);
+			upload_rate *= 1024;
+			break;
 		case 's':
 			seed = 1;
 			break;
+		case 'd':
+			dht_enabled = 1;
+			break;
+		case 'e':
+			mse_enabled = 1;
+			break;
+		case 'S':
+			stream_enabled = 1;
+			break;
+		case 'U':
+			utp_enabled = 0;
+			break;
+		case 'z':
+			superseed_enabled = 1;
+			seed = 1;
+			break;
 		default:
 			usage();
 		}
@@ -133,39 +189,60 @@ main(int argc, char **argv)
 	torrent = torrent_parse_file(argv[0]);
 	mytorrent = torrent;
 	torrent_pieces_create(torrent);
+	if (priorities != NULL
+	    && torrent_priority_set(torrent, priorities) == -1)
+		errx(1, "bad file priorities: %s", priorities);
 	/* a little extra info? torrent_print(torrent); */
 	memset(&blurb, '\0', sizeof(blurb));
 	snprintf(blurb, sizeof(blurb), "%s ", MESSAGE);
 	atomicio(vwrite, STDOUT_FILENO, blurb, win_size - 1);
-	if (torrent_fastresume_load(torrent) == -1) {
-		for (i = 0; i < torrent->num_pieces; i++) {
-			tpp = torrent_piece_find(torrent, i);
-			if (tpp->index != i)
-				errx(1,
-				     "main: something went wrong, index is %u, should be %u", tpp->index, i);
+	/* check the pieces we can't vouch for from the fast resume data */
+	if (torrent_fastresume_load(torrent) == -1)
+		trace("main: no fast resume data, checking every piece");
+	for (i = 0; i < torrent->num_pieces; i++) {
+		tpp = torrent_piece_find(torrent, i);
+		if (tpp->index != i)
+			errx(1,
+			     "main: something went wrong, index is %u, should be %u", tpp->index, i);
+		if (!(tpp->flags & TORRENT_PIECE_RECHECK))
+			continue;
+		tpp->flags &= ~TORRENT_PIECE_RECHECK;
+		/* don't create files just to check pieces we skip */
+		if (tpp->priority == TORRENT_PRIORITY_SKIP)
+			continue;
+		/* nor those which can't have been written yet */
+		if (torrent_piece_ondisk(tpp)) {
 			torrent_piece_map(tpp);
-			if (!torrent->isnew) {
-				j = torrent_piece_checkhash(torrent, tpp);
-				if (j == 0) {
-					torrent->good_pieces++;
-					torrent->downloaded += tpp->len;
-				}
+			j = torrent_piece_checkhash(torrent, tpp);
+			if (j == 0) {
+				torrent->good_pieces++;
+				torrent->downloaded += tpp->len;
 			}
 			torrent_piece_unmap(tpp);
-			percent = (float)i / torrent->num_pieces * 100;
-			snprintf(blurb, sizeof(blurb), "\r%s [%3d%%] %c",
-			    MESSAGE, percent, METER[i % 3]);
-			atomicio(vwrite, STDOUT_FILENO, blurb, win_size - 1);
 		}
+		percent = (float)i / torrent->num_pieces * 100;
+		snprintf(blurb, sizeof(blurb), "\r%s [%3d%%] %c",
+		    MESSAGE, percent, METER[i % 3]);
+		atomicio(vwrite, STDOUT_FILENO, blurb, win_size - 1);
 	}
+	/* pieces just found good are no longer wanted */
+	torrent_priorities_update(torrent);
+	/*
+	 * start from a snapshot of what we just found, as the journal we
+	 * go on to write means the files' times aren't checked against it
+	 */
+	torrent_fastresume_dump(torrent);
 	/* do we already have everything? */
-	if (!seed && torrent->good_pieces == torrent->num_pieces) {
+	if (!seed && torrent->wanted_left == 0) {
 		printf("\rdownload already complete!\n");
 		exit(0);
 	}
+	torrent_allocate(torrent);
 
 #ifndef __OpenBSD__
-	srandom(time(NULL));
+	/* peer ids come from this, so two started together must differ */
+	gettimeofday(&tv, NULL);
+	srandom(tv.tv_sec ^ tv.tv_usec ^ (getpid() << 16));
 #endif
 	network_start_torrent(torrent, rlp.rlim_cur);
 
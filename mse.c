@@ -0,0 +1,640 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Message Stream Encryption, see
+ * http://www.azureuswiki.com/index.php/Message_Stream_Encryption
+ *
+ * The initiator (A) and the receiver (B) exchange D-H public keys, each
+ * followed by random padding.  A then proves it knows the shared secret
+ * and the torrent's info hash, and offers crypto methods; B picks one.
+ * Everything after the key exchange is RC4 encrypted, with a different
+ * key in each direction.  If B picks plaintext, only the rest of the
+ * handshake is.
+ *
+ * The handshake reads straight out of the peer's input buffer, so that the
+ * padding can be skipped without knowing its length.  Once it is done, new
+ * input is decrypted in place, all of it at once, before the regular
+ * message parser sees it; output is encrypted a message at a time.
+ */
+
+/*
+ * RC4 is deprecated in OpenSSL 3.0, and only the legacy provider offers
+ * it through EVP, so keep using the low-level calls without the warnings.
+ */
+#define OPENSSL_API_COMPAT	0x10100000L
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sha1.h>
+
+#include "includes.h"
+
+/* handshake states */
+#define MSE_STATE_YA		1	/* B: waiting for A's public key */
+#define MSE_STATE_REQ1		2	/* B: looking for HASH('req1', S) */
+#define MSE_STATE_REQ2		3	/* B: waiting for the info hash proof */
+#define MSE_STATE_PROVIDE	4	/* B: waiting for A's crypto_provide */
+#define MSE_STATE_PADC		5	/* B: skipping PadC */
+#define MSE_STATE_YB		6	/* A: waiting for B's public key */
+#define MSE_STATE_VC		7	/* A: looking for B's encrypted VC */
+#define MSE_STATE_SELECT	8	/* A: waiting for B's crypto_select */
+#define MSE_STATE_PADD		9	/* A: skipping PadD */
+#define MSE_STATE_DONE		10
+#define MSE_STATE_FAILED	11
+
+/* private key size, in bits */
+#define MSE_PRIVKEY_BITS	160
+/* RC4 keystream discarded at start, in bytes */
+#define MSE_RC4_DISCARD		1024
+
+int mse_enabled = 0;
+
+static struct mse	*mse_create(int);
+static void		 mse_random(u_int8_t *, size_t);
+static void		 mse_hash(u_int8_t *, const char *, const u_int8_t *,
+			    size_t, const u_int8_t *, size_t);
+static void		 mse_bn2bin(const BIGNUM *, u_int8_t *);
+static int		 mse_secret(struct mse *, const u_int8_t *);
+static void		 mse_rc4_init(struct mse *, struct session *, int);
+static void		 mse_write_pubkey(struct peer *);
+static int		 mse_sync(struct peer *, const u_int8_t *, size_t);
+static u_int8_t		*mse_need(struct peer *, size_t);
+static int		 mse_read_initiator(struct peer *);
+static int		 mse_read_receiver(struct peer *);
+
+/*
+ * mse_create()
+ *
+ * Allocate handshake state, and pick a private key.
+ */
+static struct mse *
+mse_create(int state)
+{
+	struct mse *m;
+
+	m = xmalloc(sizeof(*m));
+	memset(m, 0, sizeof(*m));
+	m->state = state;
+	if ((m->x = BN_new()) == NULL)
+		errx(1, "mse_create: BN_new() failure");
+	if (BN_rand(m->x, MSE_PRIVKEY_BITS, -1, 0) == 0)
+		errx(1, "mse_create: BN_rand() failure");
+
+	return (m);
+}
+
+/*
+ * mse_free()
+ *
+ * Free encryption state.
+ */
+void
+mse_free(struct mse *m)
+{
+	BN_clear_free(m->x);
+	memset(m, 0, sizeof(*m));
+	xfree(m);
+}
+
+/*
+ * mse_connect()
+ *
+ * Start an encrypted handshake with a peer we have connected to.  The
+ * BitTorrent handshake is sent once the key exchange is done.
+ */
+void
+mse_connect(struct peer *p)
+{
+	trace("mse_connect() to peer %s", print_host(&p->sa));
+	p->mse = mse_create(MSE_STATE_YB);
+	mse_write_pubkey(p);
+}
+
+/*
+ * mse_accept()
+ *
+ * A peer which connected to us sent something other than a plaintext
+ * handshake; treat it as the start of an encrypted handshake.
+ */
+void
+mse_accept(struct peer *p)
+{
+	trace("mse_accept() from peer %s", print_host(&p->sa));
+	p->mse = mse_create(MSE_STATE_YA);
+}
+
+/*
+ * mse_random()
+ *
+ * Fill <buf> with random bytes, for padding.
+ */
+static void
+mse_random(u_int8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+#ifdef __OpenBSD__
+		buf[i] = arc4random() & 0xff;
+#else
+		buf[i] = random() & 0xff;
+#endif
+}
+
+/*
+ * mse_hash()
+ *
+ * <out> = SHA1(<tag>, <a>, <b>).
+ */
+static void
+mse_hash(u_int8_t *out, const char *tag, const u_int8_t *a, size_t alen,
+    const u_int8_t *b, size_t blen)
+{
+	SHA1_CTX ctx;
+
+	SHA1Init(&ctx);
+	SHA1Update(&ctx, (const u_int8_t *)tag, strlen(tag));
+	SHA1Update(&ctx, a, alen);
+	if (b != NULL)
+		SHA1Update(&ctx, b, blen);
+	SHA1Final(out, &ctx);
+}
+
+/*
+ * mse_bn2bin()
+ *
+ * Store a number as CRYPTO_INT_LEN big-endian bytes, zero padded on the
+ * left as the protocol requires.
+ */
+static void
+mse_bn2bin(const BIGNUM *n, u_int8_t *buf)
+{
+	int len;
+
+	len = BN_num_bytes(n);
+	if (len > CRYPTO_INT_LEN)
+		errx(1, "mse_bn2bin: number too large");
+	memset(buf, 0, CRYPTO_INT_LEN - len);
+	BN_bn2bin(n, buf + CRYPTO_INT_LEN - len);
+}
+
+/*
+ * mse_secret()
+ *
+ * Work out the shared secret from the other side's public key.
+ * Returns -1 if the public key is bogus.
+ */
+static int
+mse_secret(struct mse *m, const u_int8_t *pubkey)
+{
+	BIGNUM *prime, *y, *s;
+	BN_CTX *ctx;
+	int ret = -1;
+
+	if ((ctx = BN_CTX_new()) == NULL)
+		errx(1, "mse_secret: BN_CTX_new() failure");
+	prime = BN_bin2bn(mse_P, sizeof(mse_P), NULL);
+	y = BN_bin2bn(pubkey, CRYPTO_INT_LEN, NULL);
+	s = BN_new();
+	if (prime == NULL || y == NULL || s == NULL)
+		errx(1, "mse_secret: BN allocation failure");
+	/* 1 and P-1 would give away the secret */
+	if (BN_cmp(y, BN_value_one()) <= 0 || !BN_sub_word(prime, 1)
+	    || BN_cmp(y, prime) >= 0 || !BN_add_word(prime, 1))
+		goto out;
+	if (BN_mod_exp(s, y, m->x, prime, ctx) == 0)
+		errx(1, "mse_secret: BN_mod_exp() failure");
+	mse_bn2bin(s, m->S);
+	ret = 0;
+out:
+	BN_clear_free(s);
+	BN_free(y);
+	BN_free(prime);
+	BN_CTX_free(ctx);
+
+	return (ret);
+}
+
+/*
+ * mse_rc4_init()
+ *
+ * Set up both RC4 streams from the shared secret and the info hash.  The
+ * initiator sends with keyA, the receiver with keyB.
+ */
+static void
+mse_rc4_init(struct mse *m, struct session *sc, int initiator)
+{
+	u_int8_t keya[SHA1_DIGEST_LENGTH], keyb[SHA1_DIGEST_LENGTH];
+	u_int8_t discard[MSE_RC4_DISCARD];
+
+	mse_hash(keya, "keyA", m->S, sizeof(m->S), sc->tp->info_hash,
+	    SHA1_DIGEST_LENGTH);
+	mse_hash(keyb, "keyB", m->S, sizeof(m->S), sc->tp->info_hash,
+	    SHA1_DIGEST_LENGTH);
+	RC4_set_key(&m->tx, sizeof(keya), initiator ? keya : keyb);
+	RC4_set_key(&m->rx, sizeof(keyb), initiator ? keyb : keya);
+	memset(discard, 0, sizeof(discard));
+	RC4(&m->tx, sizeof(discard), discard, discard);
+	RC4(&m->rx, sizeof(discard), discard, discard);
+	memset(keya, 0, sizeof(keya));
+	memset(keyb, 0, sizeof(keyb));
+}
+
+/*
+ * mse_write_pubkey()
+ *
+ * Send our public key, followed by a random amount of random padding.
+ */
+static void
+mse_write_pubkey(struct peer *p)
+{
+	BIGNUM *prime, *g, *y;
+	BN_CTX *ctx;
+	u_int8_t *msg;
+	u_int32_t len;
+
+	if ((ctx = BN_CTX_new()) == NULL)
+		errx(1, "mse_write_pubkey: BN_CTX_new() failure");
+	prime = BN_bin2bn(mse_P, sizeof(mse_P), NULL);
+	g = BN_bin2bn(mse_G, sizeof(mse_G), NULL);
+	y = BN_new();
+	if (prime == NULL || g == NULL || y == NULL)
+		errx(1, "mse_write_pubkey: BN allocation failure");
+	if (BN_mod_exp(y, g, p->mse->x, prime, ctx) == 0)
+		errx(1, "mse_write_pubkey: BN_mod_exp() failure");
+
+#ifdef __OpenBSD__
+	len = CRYPTO_INT_LEN + arc4random_uniform(CRYPTO_MAX_PAD + 1);
+#else
+	len = CRYPTO_INT_LEN + random() % (CRYPTO_MAX_PAD + 1);
+#endif
+	msg = xmalloc(len);
+	mse_bn2bin(y, msg);
+	mse_random(msg + CRYPTO_INT_LEN, len - CRYPTO_INT_LEN);
+	network_peer_write(p, msg, len);
+
+	BN_free(y);
+	BN_free(g);
+	BN_free(prime);
+	BN_CTX_free(ctx);
+}
+
+/*
+ * mse_need()
+ *
+ * Returns the start of the peer's input if at least <len> bytes are
+ * waiting, otherwise NULL.
+ */
+static u_int8_t *
+mse_need(struct peer *p, size_t len)
+{
+	struct evbuffer *input = EVBUFFER_INPUT(p->bufev);
+
+	if (EVBUFFER_LENGTH(input) < len)
+		return (NULL);
+	return (EVBUFFER_DATA(input));
+}
+
+/*
+ * mse_sync()
+ *
+ * Look for <pat> in the peer's input, after at most CRYPTO_MAX_PAD bytes
+ * of padding, and drain everything up to and including it.  Returns 1 if
+ * found, 0 if more input is needed and -1 if it isn't there.
+ */
+static int
+mse_sync(struct peer *p, const u_int8_t *pat, size_t len)
+{
+	struct evbuffer *input = EVBUFFER_INPUT(p->bufev);
+	u_int8_t *data;
+	size_t avail, i;
+
+	avail = MIN(EVBUFFER_LENGTH(input), CRYPTO_MAX_PAD + len);
+	if (avail < len)
+		return (0);
+	data = EVBUFFER_DATA(input);
+	for (i = 0; i + len <= avail; i++) {
+		if (memcmp(data + i, pat, len) == 0) {
+			evbuffer_drain(input, i + len);
+			return (1);
+		}
+	}
+	return (avail == CRYPTO_MAX_PAD + len ? -1 : 0);
+}
+
+/*
+ * mse_read_initiator()
+ *
+ * Run our side of the handshake for a connection we started.
+ */
+static int
+mse_read_initiator(struct peer *p)
+{
+	struct mse *m = p->mse;
+	struct evbuffer *input = EVBUFFER_INPUT(p->bufev);
+	u_int32_t provide, select;
+	u_int16_t padlen, ialen;
+	u_int8_t *data, *msg, req3[SHA1_DIGEST_LENGTH];
+	int i;
+
+	for (;;) {
+		switch (m->state) {
+		case MSE_STATE_YB:
+			if ((data = mse_need(p, CRYPTO_INT_LEN)) == NULL)
+				return (0);
+			if (mse_secret(m, data) == -1) {
+				trace("mse_read_initiator() bad public key");
+				return (-1);
+			}
+			evbuffer_drain(input, CRYPTO_INT_LEN);
+			mse_rc4_init(m, p->sc, 1);
+
+			/* prove we know S and which torrent we want */
+			msg = xmalloc(2 * SHA1_DIGEST_LENGTH);
+			mse_hash(msg, "req1", m->S, sizeof(m->S), NULL, 0);
+			mse_hash(msg + SHA1_DIGEST_LENGTH, "req2",
+			    p->sc->tp->info_hash, SHA1_DIGEST_LENGTH,
+			    NULL, 0);
+			mse_hash(req3, "req3", m->S, sizeof(m->S), NULL, 0);
+			for (i = 0; i < SHA1_DIGEST_LENGTH; i++)
+				msg[SHA1_DIGEST_LENGTH + i] ^= req3[i];
+			network_peer_write(p, msg, 2 * SHA1_DIGEST_LENGTH);
+
+			/* VC, crypto_provide, len(PadC), len(IA), then IA */
+			m->txcrypt = 1;
+			msg = xmalloc(sizeof(mse_VC) + sizeof(provide)
+			    + sizeof(padlen) + sizeof(ialen));
+			memcpy(msg, mse_VC, sizeof(mse_VC));
+			provide = htonl(CRYPTO_RC4);
+			memcpy(msg + sizeof(mse_VC), &provide, sizeof(provide));
+			padlen = 0;
+			memcpy(msg + sizeof(mse_VC) + sizeof(provide), &padlen,
+			    sizeof(padlen));
+			ialen = htons(BT_HANDSHAKE_LEN);
+			memcpy(msg + sizeof(mse_VC) + sizeof(provide)
+			    + sizeof(padlen), &ialen, sizeof(ialen));
+			network_peer_write(p, msg, sizeof(mse_VC)
+			    + sizeof(provide) + sizeof(padlen) + sizeof(ialen));
+			network_peer_handshake(p->sc, p);
+
+			/* the receiver's reply starts with VC, encrypted */
+			memcpy(m->sync, mse_VC, sizeof(mse_VC));
+			RC4(&m->rx, sizeof(mse_VC), m->sync, m->sync);
+			m->state = MSE_STATE_VC;
+			break;
+		case MSE_STATE_VC:
+			if ((i = mse_sync(p, m->sync, sizeof(mse_VC))) != 1) {
+				if (i == -1)
+					trace("mse_read_initiator() no VC");
+				return (i);
+			}
+			m->state = MSE_STATE_SELECT;
+			break;
+		case MSE_STATE_SELECT:
+			if ((data = mse_need(p, sizeof(select) + sizeof(padlen)))
+			    == NULL)
+				return (0);
+			RC4(&m->rx, sizeof(select) + sizeof(padlen), data, data);
+			memcpy(&select, data, sizeof(select));
+			memcpy(&padlen, data + sizeof(select), sizeof(padlen));
+			evbuffer_drain(input, sizeof(select) + sizeof(padlen));
+			m->padlen = ntohs(padlen);
+			if (ntohl(select) != CRYPTO_RC4
+			    || m->padlen > CRYPTO_MAX_PAD) {
+				trace("mse_read_initiator() bad crypto_select");
+				return (-1);
+			}
+			m->state = MSE_STATE_PADD;
+			break;
+		case MSE_STATE_PADD:
+			if ((data = mse_need(p, m->padlen)) == NULL)
+				return (0);
+			RC4(&m->rx, m->padlen, data, data);
+			evbuffer_drain(input, m->padlen);
+			m->rxcrypt = SIZE_MAX;
+			m->state = MSE_STATE_DONE;
+			return (1);
+		default:
+			errx(1, "mse_read_initiator: bad state %d", m->state);
+		}
+	}
+}
+
+/*
+ * mse_read_receiver()
+ *
+ * Run our side of the handshake for a connection the peer started.
+ */
+static int
+mse_read_receiver(struct peer *p)
+{
+	struct mse *m = p->mse;
+	struct evbuffer *input = EVBUFFER_INPUT(p->bufev);
+	u_int32_t provide, select;
+	u_int16_t padlen, ialen;
+	u_int8_t *data, *msg, req[SHA1_DIGEST_LENGTH];
+	int i;
+
+	for (;;) {
+		switch (m->state) {
+		case MSE_STATE_YA:
+			if ((data = mse_need(p, CRYPTO_INT_LEN)) == NULL)
+				return (0);
+			if (mse_secret(m, data) == -1) {
+				trace("mse_read_receiver() bad public key");
+				return (-1);
+			}
+			evbuffer_drain(input, CRYPTO_INT_LEN);
+			mse_write_pubkey(p);
+			mse_hash(m->sync, "req1", m->S, sizeof(m->S), NULL, 0);
+			m->state = MSE_STATE_REQ1;
+			break;
+		case MSE_STATE_REQ1:
+			if ((i = mse_sync(p, m->sync, SHA1_DIGEST_LENGTH)) != 1) {
+				if (i == -1)
+					trace("mse_read_receiver() no req1");
+				return (i);
+			}
+			m->state = MSE_STATE_REQ2;
+			break;
+		case MSE_STATE_REQ2:
+			if ((data = mse_need(p, SHA1_DIGEST_LENGTH)) == NULL)
+				return (0);
+			/* connections are per torrent, so there is one SKEY */
+			mse_hash(m->sync, "req2", p->sc->tp->info_hash,
+			    SHA1_DIGEST_LENGTH, NULL, 0);
+			mse_hash(req, "req3", m->S, sizeof(m->S), NULL, 0);
+			for (i = 0; i < SHA1_DIGEST_LENGTH; i++)
+				req[i] ^= m->sync[i];
+			if (memcmp(data, req, SHA1_DIGEST_LENGTH) != 0) {
+				trace("mse_read_receiver() info hash mismatch");
+				return (-1);
+			}
+			evbuffer_drain(input, SHA1_DIGEST_LENGTH);
+			mse_rc4_init(m, p->sc, 0);
+			m->state = MSE_STATE_PROVIDE;
+			break;
+		case MSE_STATE_PROVIDE:
+			if ((data = mse_need(p, sizeof(mse_VC) + sizeof(provide)
+			    + sizeof(padlen))) == NULL)
+				return (0);
+			RC4(&m->rx, sizeof(mse_VC) + sizeof(provide)
+			    + sizeof(padlen), data, data);
+			memcpy(&provide, data + sizeof(mse_VC), sizeof(provide));
+			memcpy(&padlen, data + sizeof(mse_VC) + sizeof(provide),
+			    sizeof(padlen));
+			m->provide = ntohl(provide);
+			m->padlen = ntohs(padlen);
+			if (memcmp(data, mse_VC, sizeof(mse_VC)) != 0
+			    || m->padlen > CRYPTO_MAX_PAD) {
+				trace("mse_read_receiver() bad VC or PadC");
+				return (-1);
+			}
+			evbuffer_drain(input, sizeof(mse_VC) + sizeof(provide)
+			    + sizeof(padlen));
+			m->state = MSE_STATE_PADC;
+			break;
+		case MSE_STATE_PADC:
+			if ((data = mse_need(p, m->padlen + sizeof(ialen)))
+			    == NULL)
+				return (0);
+			RC4(&m->rx, m->padlen + sizeof(ialen), data, data);
+			memcpy(&ialen, data + m->padlen, sizeof(ialen));
+			evbuffer_drain(input, m->padlen + sizeof(ialen));
+			if (m->provide & CRYPTO_RC4) {
+				select = CRYPTO_RC4;
+			} else if (m->provide & CRYPTO_PLAINTEXT) {
+				select = CRYPTO_PLAINTEXT;
+			} else {
+				trace("mse_read_receiver() no crypto in common");
+				return (-1);
+			}
+
+			/* VC, crypto_select, len(PadD) */
+			m->txcrypt = 1;
+			msg = xmalloc(sizeof(mse_VC) + sizeof(select)
+			    + sizeof(padlen));
+			memcpy(msg, mse_VC, sizeof(mse_VC));
+			provide = htonl(select);
+			memcpy(msg + sizeof(mse_VC), &provide, sizeof(provide));
+			padlen = 0;
+			memcpy(msg + sizeof(mse_VC) + sizeof(provide), &padlen,
+			    sizeof(padlen));
+			network_peer_write(p, msg, sizeof(mse_VC)
+			    + sizeof(provide) + sizeof(padlen));
+
+			/* with plaintext, only the initial payload is encrypted */
+			if (select == CRYPTO_RC4) {
+				m->rxcrypt = SIZE_MAX;
+			} else {
+				m->rxcrypt = ntohs(ialen);
+				m->txcrypt = 0;
+			}
+			m->state = MSE_STATE_DONE;
+			return (1);
+		default:
+			errx(1, "mse_read_receiver: bad state %d", m->state);
+		}
+	}
+}
+
+/*
+ * mse_read()
+ *
+ * Called whenever there is input from an encrypting peer.  Until the
+ * handshake is over, it consumes the input itself; after that it
+ * decrypts all new input in place for the regular message parser.
+ * Returns 1 once the stream is ready, 0 if the handshake needs more
+ * input and -1 if it failed.
+ */
+int
+mse_read(struct peer *p)
+{
+	struct mse *m = p->mse;
+	struct evbuffer *input = EVBUFFER_INPUT(p->bufev);
+	size_t len;
+	int ret;
+
+	if (m->state == MSE_STATE_FAILED)
+		return (-1);
+	if (m->state != MSE_STATE_DONE) {
+		p->lastrecv = time(NULL);
+		if (m->state >= MSE_STATE_YB)
+			ret = mse_read_initiator(p);
+		else
+			ret = mse_read_receiver(p);
+		if (ret == -1) {
+			trace("mse_read() handshake with peer %s failed",
+			    print_host(&p->sa));
+			m->state = MSE_STATE_FAILED;
+		}
+		if (ret != 1)
+			return (ret);
+		trace("mse_read() %s stream with peer %s",
+		    m->txcrypt ? "encrypted" : "plaintext",
+		    print_host(&p->sa));
+		m->rxclear = 0;
+	}
+
+	len = MIN(EVBUFFER_LENGTH(input) - m->rxclear, m->rxcrypt);
+	if (len > 0) {
+		RC4(&m->rx, len, EVBUFFER_DATA(input) + m->rxclear,
+		    EVBUFFER_DATA(input) + m->rxclear);
+		if (m->rxcrypt != SIZE_MAX)
+			m->rxcrypt -= len;
+	}
+	m->rxclear = EVBUFFER_LENGTH(input);
+
+	return (1);
+}
+
+/*
+ * mse_consumed()
+ *
+ * The message parser took <len> bytes of already decrypted input.
+ */
+void
+mse_consumed(struct peer *p, size_t len)
+{
+	p->mse->rxclear -= len;
+}
+
+/*
+ * mse_encrypt()
+ *
+ * Encrypt an outgoing message in place, if the stream is encrypted.
+ */
+void
+mse_encrypt(struct peer *p, u_int8_t *msg, size_t len)
+{
+	if (p->mse->txcrypt)
+		RC4(&p->mse->tx, len, msg, msg);
+}
@@ -42,16 +42,32 @@
 
 char *user_port = NULL;
 int   seed = 0;
+/* upload capacity in bytes per second, 0 if unknown */
+u_int32_t upload_rate = 0;
+struct sessions sessions = TAILQ_HEAD_INITIALIZER(sessions);
 
-static void network_peer_write(struct peer *, u_int8_t *, u_int32_t);
 static void network_peerlist_update_dict(struct session *, struct benc_node *);
 static void network_peerlist_update_string(struct session *, struct benc_node *);
 static char *network_peer_id_create(void);
 static int network_connect(int, int, int, const struct sockaddr *, socklen_t);
 static int network_connect_peer(struct peer *);
+static int network_peer_connect(struct session *, struct peer *, int);
+static void network_peer_connect_time(struct peer *, int);
+static void network_peer_offer_allowedfast(struct peer *);
+static int network_peer_fast_offered(struct peer *, u_int32_t);
+static void network_piece_dl_cancel_dups(struct session *, struct piece_dl *);
+static struct piece_dl *network_piece_dl_new(struct session *, u_int32_t,
+    u_int32_t, u_int32_t);
+static void network_piece_dl_resume(struct session *);
+static void network_piece_dl_cover(struct session *, struct piece_dl *, int,
+    int);
+static void network_peer_utp_failed(void *);
+static void network_peer_setup(struct peer *);
+static void network_peer_accept(struct session *, struct peer *);
+static void network_handle_utp_connect(int, const struct sockaddr_storage *,
+    void *);
 static void network_handle_peer_response(struct bufferevent *, void *);
 static void network_peer_process_message(u_int8_t, struct peer *);
-static void network_peer_handshake(struct session *, struct peer *);
 static void network_peer_keepalive(int, short, void *);
 
 /* index of piece dls by block index and offset */
@@ -101,9 +117,11 @@ network_peer_id_create()
  *
  * Write data to a peer.
  */
-static void
+void
 network_peer_write(struct peer *p, u_int8_t *msg, u_int32_t len)
 {
+	if (p->mse != NULL)
+		mse_encrypt(p, msg, len);
 	if (bufferevent_write(p->bufev, msg, len) != 0)
 		errx(1, "network_peer_write() failure");
 	xfree(msg);
@@ -152,64 +170,180 @@ static int
 network_connect_peer(struct peer *p)
 {
 	p->state |= PEER_STATE_HANDSHAKE1;
-	return (network_connect(PF_INET, SOCK_STREAM, 0,
-	    (const struct sockaddr *) &p->sa, sizeof(p->sa)));
+	return (network_connect(p->sa.ss_family, SOCK_STREAM, 0,
+	    (const struct sockaddr *) &p->sa, util_addrlen(&p->sa)));
 }
 
 /*
  * network_peerlist_connect()
  *
- * Connect any new peers in our peer list.
+ * Connect any new peers in our peer list.  Peers of whichever address
+ * family has lately been quicker to get through the handshake are tried
+ * first.
  */
 void
 network_peerlist_connect(struct session *sc)
 {
 	struct peer *ep, *nxt;
-	struct timeval tv;
+	int af[2], i;
 
 	for (ep = TAILQ_FIRST(&sc->peers); ep != TAILQ_END(&sc->peers) ; ep = nxt) {
 		nxt = TAILQ_NEXT(ep, peer_list);
-		/* stay within our limits */
-		if (sc->num_peers >= sc->maxfds - 5) {
+		/* stay within our limits, leaving room for open files */
+		if (sc->num_peers
+		    >= sc->maxfds - 5 - sc->tp->max_open_files) {
+				TAILQ_REMOVE(&sc->peers, ep, peer_list);
 				network_peer_free(ep);
 				sc->num_peers--;
-				TAILQ_REMOVE(&sc->peers, ep, peer_list);
-				continue;
 		}
-		trace("network_peerlist_update() we have a peer: %s:%d", inet_ntoa(ep->sa.sin_addr),
-		    ntohs(ep->sa.sin_port));
-		if (ep->connfd != 0) {
-			/* XXX */
-		} else {
-			trace("network_peerlist_update() connecting to peer: %s:%d",
-			    inet_ntoa(ep->sa.sin_addr), ntohs(ep->sa.sin_port));
+	}
+	if (sc->connect_time[1] <= sc->connect_time[0]) {
+		af[0] = AF_INET6;
+		af[1] = AF_INET;
+	} else {
+		af[0] = AF_INET;
+		af[1] = AF_INET6;
+	}
+	for (i = 0; i < 2; i++) {
+		for (ep = TAILQ_FIRST(&sc->peers); ep != TAILQ_END(&sc->peers) ; ep = nxt) {
+			nxt = TAILQ_NEXT(ep, peer_list);
+			if (ep->sa.ss_family != af[i] || ep->connfd != 0)
+				continue;
+			trace("network_peerlist_update() connecting to peer: %s",
+			    print_host(&ep->sa));
+			/* we connect to its listen port, so we know it */
+			ep->listen_port = util_addrport(&ep->sa);
+			gettimeofday(&ep->connect_start, NULL);
 			/* XXX does this failure case do anything worthwhile? */
-			if ((ep->connfd = network_connect_peer(ep)) == -1) {
-				trace("network_peerlist_update() failure connecting to peer: %s:%d - removing",
-				    inet_ntoa(ep->sa.sin_addr), ntohs(ep->sa.sin_port));
+			if (network_peer_connect(sc, ep, utp_enabled) == -1) {
+				trace("network_peerlist_update() failure connecting to peer: %s - removing",
+				    print_host(&ep->sa));
+				network_peer_connect_time(ep, 1);
 				TAILQ_REMOVE(&sc->peers, ep, peer_list);
 				network_peer_free(ep);
 				sc->num_peers--;
 				continue;
 			}
-			trace("network_peerlist_update() connected fd %d to peer: %s:%d",
-			    ep->connfd, inet_ntoa(ep->sa.sin_addr), ntohs(ep->sa.sin_port));
-			ep->bufev = bufferevent_new(ep->connfd, network_handle_peer_response,
-			    network_handle_peer_write, network_handle_peer_error, ep);
-			if (ep->bufev == NULL)
-				errx(1, "network_peerlist_update: bufferevent_new failure");
-			bufferevent_enable(ep->bufev, EV_READ|EV_WRITE);
-			/* set up keep-alive timer */
-			timerclear(&tv);
-			tv.tv_sec = 1;
-			evtimer_set(&ep->keepalive_event, network_peer_keepalive, ep);
-			evtimer_add(&ep->keepalive_event, &tv);
-			trace("network_peerlist_update() initiating handshake");
-			network_peer_handshake(sc, ep);
 		}
 	}
 }
 
+/*
+ * network_peer_connect_time()
+ *
+ * Fold how long an outgoing connection took to get through the
+ * handshake, or a penalty if it <failed>, into the running average for
+ * the address family of the peer.
+ */
+static void
+network_peer_connect_time(struct peer *p, int failed)
+{
+	struct timeval now, tv;
+	u_int32_t ms, *avg;
+
+	if (!timerisset(&p->connect_start))
+		return;
+	if (failed) {
+		ms = CONNECT_TIME_FAILED;
+	} else {
+		gettimeofday(&now, NULL);
+		timersub(&now, &p->connect_start, &tv);
+		ms = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+		if (ms > CONNECT_TIME_FAILED)
+			ms = CONNECT_TIME_FAILED;
+	}
+	timerclear(&p->connect_start);
+	avg = &p->sc->connect_time[p->sa.ss_family == AF_INET6];
+	*avg = (*avg * (CONNECT_TIME_WEIGHT - 1) + ms) / CONNECT_TIME_WEIGHT;
+	trace("network_peer_connect_time() %s took %ums, average now %ums",
+	    print_host(&p->sa), ms, *avg);
+}
+
+/*
+ * network_peer_connect()
+ *
+ * Connect to a peer, over uTP if <utp> is set, otherwise or failing that
+ * over TCP, and start the handshake.  Returns -1 on failure.
+ */
+static int
+network_peer_connect(struct session *sc, struct peer *p, int utp)
+{
+	if (utp && (p->connfd = utp_connect(&p->sa, network_peer_utp_failed,
+	    p)) != -1) {
+		p->state |= PEER_STATE_HANDSHAKE1|PEER_STATE_UTP;
+	} else if ((p->connfd = network_connect_peer(p)) == -1) {
+		p->connfd = 0;
+		return (-1);
+	}
+	trace("network_peer_connect() connected fd %d to peer: %s%s",
+	    p->connfd, print_host(&p->sa),
+	    p->state & PEER_STATE_UTP ? " over uTP" : "");
+	network_peer_setup(p);
+	trace("network_peer_connect() initiating handshake");
+	if (mse_enabled)
+		mse_connect(p);
+	else
+		network_peer_handshake(sc, p);
+
+	return (0);
+}
+
+/*
+ * network_peer_utp_failed()
+ *
+ * The peer didn't answer over uTP.  Forget everything we sent it, and try
+ * again over TCP.
+ */
+static void
+network_peer_utp_failed(void *arg)
+{
+	struct peer *p = arg;
+
+	trace("network_peer_utp_failed() peer %s, falling back to TCP",
+	    print_host(&p->sa));
+	evtimer_del(&p->keepalive_event);
+	bufferevent_free(p->bufev);
+	p->bufev = NULL;
+	(void)close(p->connfd);
+	p->connfd = 0;
+	if (p->rxmsg != NULL) {
+		xfree(p->rxmsg);
+		p->rxmsg = NULL;
+	}
+	p->rxpending = p->rxmsglen = 0;
+	if (p->mse != NULL) {
+		mse_free(p->mse);
+		p->mse = NULL;
+	}
+	p->state = 0;
+	if (network_peer_connect(p->sc, p, 0) == -1)
+		p->state |= PEER_STATE_DEAD;
+}
+
+/*
+ * network_peer_setup()
+ *
+ * Set up the bufferevent and keep-alive timer of a newly connected peer.
+ */
+static void
+network_peer_setup(struct peer *p)
+{
+	struct timeval tv;
+
+	p->bufev = bufferevent_new(p->connfd, network_handle_peer_response,
+	    network_handle_peer_write, network_handle_peer_error, p);
+	if (p->bufev == NULL)
+		errx(1, "network_peer_setup: bufferevent_new failure");
+	bufferevent_enable(p->bufev, EV_READ|EV_WRITE);
+	/* ask for more uploads before the output runs dry */
+	bufferevent_setwatermark(p->bufev, EV_WRITE, UPLOAD_LOWAT, 0);
+	/* set up keep-alive timer */
+	timerclear(&tv);
+	tv.tv_sec = 1;
+	evtimer_set(&p->keepalive_event, network_peer_keepalive, p);
+	evtimer_add(&p->keepalive_event, &tv);
+}
+
 /*
  * Adds a prepared struct peer to the peer list if it isn't already there
  *
@@ -222,15 +356,18 @@ network_peerlist_add_peer(struct session *sc, struct peer *p)
 	/* Is this peer already in the list? */
 	int found = 0;
 	TAILQ_FOREACH(ep, &sc->peers, peer_list) {
-		if (memcmp(&ep->sa.sin_addr, &p->sa.sin_addr, sizeof(ep->sa.sin_addr)) == 0
-		    && memcmp(&ep->sa.sin_port, &p->sa.sin_port, sizeof(ep->sa.sin_port)) == 0) {
+		if (util_addrcmp(&ep->sa, &p->sa) == 0) {
 			found = 1;
 			break;
 		}
 	}
-	if (found == 0) {
-		trace("network_peerlist_add_peer() adding peer to list: %s:%d",
-		    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+	if (found == 0 && trust_banned(sc, &p->sa)) {
+		trace("network_peerlist_add_peer() %s is banned",
+		    print_host(&p->sa));
+		network_peer_free(p);
+	} else if (found == 0) {
+		trace("network_peerlist_add_peer() adding peer to list: %s",
+		    print_host(&p->sa));
 		TAILQ_INSERT_TAIL(&sc->peers, p, peer_list);
 		sc->num_peers++;
 	} else {
@@ -247,31 +384,124 @@ network_peerlist_add_peer(struct session *sc, struct peer *p)
 static void
 network_peerlist_update_string(struct session *sc, struct benc_node *peers)
 {
-	char *peerlist;
-	size_t len, i;
-	struct peer *p;
+	if (peers->body.string.len == 0)
+		trace("network_peerlist_update() peer list is zero in length");
 
-	len = peers->body.string.len;
-	peerlist = peers->body.string.value;
-	p = NULL;
+	network_peerlist_add_compact(sc, (u_int8_t *)peers->body.string.value,
+	    peers->body.string.len, COMPACT_LEN);
+	network_peerlist_connect(sc);
+}
 
-	if (len == 0)
-		trace("network_peerlist_update() peer list is zero in length");
+/*
+ * network_peerlist_add_compact()
+ *
+ * Add peers from a compact address list, as used by trackers, PEX and
+ * the DHT.  Each entry is <entrylen> bytes: COMPACT_LEN for IPv4 and
+ * COMPACT_LEN6 for IPv6.
+ */
+void
+network_peerlist_add_compact(struct session *sc, const u_int8_t *peerlist,
+    size_t len, size_t entrylen)
+{
+	size_t i;
+	struct peer *p;
 
-	/* check for peers to add */
-	for (i = 0; i < len; i++) {
-		if (i % 6 == 0) {
-			p = network_peer_create();
-			p->sc = sc;
-			p->sa.sin_family = AF_INET;
-			memcpy(&p->sa.sin_addr, peerlist + i, 4);
-			memcpy(&p->sa.sin_port, peerlist + i + 4, 2);
-			network_peerlist_add_peer(sc, p);
+	for (i = 0; i + entrylen <= len; i += entrylen) {
+		p = network_peer_create();
+		p->sc = sc;
+		if (util_addr_uncompact(&p->sa, peerlist + i, entrylen) == -1) {
+			network_peer_free(p);
 			continue;
 		}
+		network_peerlist_add_peer(sc, p);
 	}
+}
 
-	network_peerlist_connect(sc);
+/*
+ * network_peercache_load()
+ *
+ * Add the peers saved by network_peercache_save() last time, so we can
+ * get going again before the tracker answers.
+ */
+void
+network_peercache_load(struct session *sc)
+{
+	struct benc_node *troot, *dict, *node;
+	int af;
+
+	troot = benc_root_create();
+	if ((dict = torrent_state_load(sc->tp, ".funpeers", troot)) != NULL) {
+		for (af = 0; af < 2; af++) {
+			node = benc_dict_get(dict, af ? "peers6" : "peers",
+			    BSTRING);
+			if (node == NULL)
+				continue;
+			trace("network_peercache_load() %zu cached %s peers",
+			    node->body.string.len / (af ? COMPACT_LEN6
+			    : COMPACT_LEN), af ? "IPv6" : "IPv4");
+			network_peerlist_add_compact(sc,
+			    (u_int8_t *)node->body.string.value,
+			    node->body.string.len,
+			    af ? COMPACT_LEN6 : COMPACT_LEN);
+		}
+	}
+	benc_node_freeall(troot);
+}
+
+/*
+ * network_peercache_save()
+ *
+ * Save the listen addresses of up to PEER_CACHE_MAX peers we are talking
+ * to, to the state file <torrent_file>.funpeers.
+ */
+void
+network_peercache_save(struct session *sc)
+{
+	struct sockaddr_storage ss;
+	struct peer *p;
+	u_int8_t *peers[2], c[COMPACT_LEN6];
+	size_t len[2], l;
+	int af, n;
+	BUF *b;
+
+	peers[0] = xcalloc(PEER_CACHE_MAX, COMPACT_LEN);
+	peers[1] = xcalloc(PEER_CACHE_MAX, COMPACT_LEN6);
+	len[0] = len[1] = 0;
+	n = 0;
+	TAILQ_FOREACH(p, &sc->peers, peer_list) {
+		if (p->connfd == 0 || p->listen_port == 0
+		    || p->state & (PEER_STATE_DEAD|PEER_STATE_HANDSHAKE1
+		    |PEER_STATE_HANDSHAKE2))
+			continue;
+		ss = p->sa;
+		util_setport(&ss, p->listen_port);
+		l = util_addr_compact(&ss, c);
+		af = l == COMPACT_LEN6;
+		memcpy(peers[af] + len[af], c, l);
+		len[af] += l;
+		if (++n == PEER_CACHE_MAX)
+			break;
+	}
+
+	b = buf_alloc(len[0] + len[1] + 128, BUF_AUTOEXT);
+	benc_put_dict(b);
+	benc_put_key(b, "info_hash");
+	benc_put_str(b, sc->tp->info_hash, SHA1_DIGEST_LENGTH);
+	for (af = 0; af < 2; af++) {
+		if (len[af] == 0)
+			continue;
+		benc_put_key(b, af ? "peers6" : "peers");
+		benc_put_str(b, peers[af], len[af]);
+	}
+	benc_put_key(b, "version");
+	benc_put_int(b, STATE_VERSION);
+	benc_put_end(b);
+	if (torrent_state_save(sc->tp, ".funpeers", b) == -1)
+		trace("network_peercache_save() %s.funpeers: %s", sc->tp->name,
+		    strerror(errno));
+	buf_free(b);
+	xfree(peers[0]);
+	xfree(peers[1]);
 }
 
 /*
@@ -286,7 +516,6 @@ network_peerlist_update_dict(struct session *sc, struct benc_node *peers)
 	struct benc_node *dict, *n;
 	struct peer *p = NULL;
 	struct addrinfo hints, *res;
-	struct sockaddr_in sa;
 	int port, error, l;
 	char *ip, portstr[6];
 
@@ -316,18 +545,14 @@ network_peerlist_update_dict(struct session *sc, struct benc_node *peers)
 		memcpy(&p->id, n->body.string.value, sizeof(p->id));
 
 		memset(&hints, 0, sizeof(hints));
-		hints.ai_family = PF_INET;
+		hints.ai_family = PF_UNSPEC;
 		hints.ai_socktype = SOCK_STREAM;
 		trace("network_peerlist_update_dict() calling getaddrinfo()");
 		error = getaddrinfo(ip, portstr, &hints, &res);
 		if (error != 0)
 			errx(1, "\"%s\" - %s", ip, gai_strerror(error));
 
-		p->sa.sin_family = AF_INET;
-		sa.sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
-		sa.sin_port = ((struct sockaddr_in *)res->ai_addr)->sin_port;
-		memcpy(&p->sa.sin_addr, &sa.sin_addr, 4);
-		memcpy(&p->sa.sin_port, &sa.sin_port, 2);
+		memcpy(&p->sa, res->ai_addr, res->ai_addrlen);
 		freeaddrinfo(res);
 
 		network_peerlist_add_peer(sc, p);
@@ -343,7 +568,7 @@ network_peerlist_update_dict(struct session *sc, struct benc_node *peers)
  *
  * Build and write a handshake message to remote peer.
  */
-static void
+void
 network_peer_handshake(struct session *sc, struct peer *p)
 {
 	u_int8_t *msg;
@@ -363,17 +588,21 @@ network_peer_handshake(struct session *sc, struct peer *p)
 	* In version 1.0 of the BitTorrent protocol, pstrlen = 19, and pstr = "BitTorrent protocol".
 	*/
 	p->connected = time(NULL);
-	#define HANDSHAKELEN (1 + 19 + 8 + 20 + 20)
-	msg = xmalloc(HANDSHAKELEN);
-	memset(msg, 0, HANDSHAKELEN);
+	msg = xmalloc(BT_HANDSHAKE_LEN);
+	memset(msg, 0, BT_HANDSHAKE_LEN);
 	msg[0] = 19;
 	memcpy(msg + 1, "BitTorrent protocol", 19);
 	/* set reserved bit to indicate we support the fast extension */
 	msg[27] |= 0x04;
+	/* and another if we run a DHT node */
+	if (dht_enabled)
+		msg[27] |= 0x01;
+	/* we speak the extension protocol, for peer exchange */
+	msg[25] |= 0x10;
 	memcpy(msg + 28, sc->tp->info_hash, 20);
 	memcpy(msg + 48, sc->peerid, 20);
 
-	network_peer_write(p, msg, HANDSHAKELEN);
+	network_peer_write(p, msg, BT_HANDSHAKE_LEN);
 }
 
 /*
@@ -390,6 +619,29 @@ network_handle_peer_response(struct bufferevent *bufev, void *data)
 	size_t len;
 	u_int32_t msglen;
 	u_int8_t *base, id = 0;
+	int ret;
+
+	/*
+	 * a peer connecting to us which doesn't start with a plain
+	 * handshake is trying to set up an encrypted stream.
+	 */
+	if (p->state & PEER_STATE_INBOUND && p->state & PEER_STATE_HANDSHAKE1
+	    && p->rxpending == 0 && p->mse == NULL) {
+		if (EVBUFFER_LENGTH(EVBUFFER_INPUT(bufev)) < BT_INITIAL_LEN)
+			return;
+		base = EVBUFFER_DATA(EVBUFFER_INPUT(bufev));
+		if (base[0] != BT_PSTRLEN
+		    || memcmp(base + 1, BT_PROTOCOL, BT_PSTRLEN) != 0)
+			mse_accept(p);
+	}
+	/* until the encryption handshake is over, it eats all input */
+	if (p->mse != NULL && (ret = mse_read(p)) != 1) {
+		if (ret == -1) {
+			p->state = 0;
+			p->state |= PEER_STATE_DEAD;
+		}
+		return;
+	}
 
 	/* the complicated thing here is the non-blocking IO, which
 	 * means we have to be prepared to come back later and add more
@@ -414,6 +666,8 @@ network_handle_peer_response(struct bufferevent *bufev, void *data)
 		read:
 			base = p->rxmsg + (p->rxmsglen - p->rxpending);
 			len = bufferevent_read(bufev, base, p->rxpending);
+			if (p->mse != NULL)
+				mse_consumed(p, len);
 			p->totalrx += len;
 			p->rxpending -= len;
 			/* more rx data pending, come back later */
@@ -433,11 +687,13 @@ network_handle_peer_response(struct bufferevent *bufev, void *data)
 					p->rxmsg = xmalloc(p->rxmsglen);
 					p->state &= ~PEER_STATE_HANDSHAKE1;
 					p->state |= PEER_STATE_HANDSHAKE2;
+					/* peers connecting to us go first */
+					if (p->state & PEER_STATE_INBOUND)
+						network_peer_handshake(p->sc, p);
 					goto out;
 
 				} else {
-				/* XXX: try D-H key exchange */
-					trace("network_handle_peer_response: crypto, killing peer for now");
+					trace("network_handle_peer_response: bad handshake, killing peer");
 					p->state = 0;
 					p->state |= PEER_STATE_DEAD;
 					goto out;
@@ -449,15 +705,29 @@ network_handle_peer_response(struct bufferevent *bufev, void *data)
 				memcpy(&p->info_hash, p->rxmsg + 8, 20);
 				memcpy(&p->id, p->rxmsg + 8 + 20, 20);
 				/* does this peer support fast extension? */
-				if (p->rxmsg[27] & 0x04) {
+				if (p->rxmsg[7] & 0x04) {
 					p->state |= PEER_STATE_FAST;
-					trace("network_handle_peer_response() fast peer %s:%d", inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+					trace("network_handle_peer_response() fast peer %s", print_host(&p->sa));
 				} else {
-					trace("network_handle_peer_response() slow peer %s:%d", inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+					trace("network_handle_peer_response() slow peer %s", print_host(&p->sa));
 				}
 
+				/* does it run a DHT node? */
+				if (p->rxmsg[7] & 0x01)
+					p->state |= PEER_STATE_DHT;
+				/* or the extension protocol? */
+				if (p->rxmsg[5] & 0x10)
+					p->state |= PEER_STATE_EXTENDED;
+
 				if (memcmp(p->info_hash, p->sc->tp->info_hash, 20) != 0) {
-					trace("network_handle_peer_response() info hash mismatch for peer %s:%d", inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+					trace("network_handle_peer_response() info hash mismatch for peer %s", print_host(&p->sa));
+					p->state = 0;
+					p->state |= PEER_STATE_DEAD;
+					goto out;
+				}
+				/* a tracker or PEX gave us our own address */
+				if (memcmp(p->id, p->sc->peerid, PEER_ID_LEN) == 0) {
+					trace("network_handle_peer_response() connected to ourselves via %s", print_host(&p->sa));
 					p->state = 0;
 					p->state |= PEER_STATE_DEAD;
 					goto out;
@@ -469,6 +739,7 @@ network_handle_peer_response(struct bufferevent *bufev, void *data)
 				p->state |= PEER_STATE_SENDBITFIELD;
 				p->state &= ~PEER_STATE_HANDSHAKE2;
 				p->rxpending = 0;
+				network_peer_connect_time(p, 0);
 				goto out;
 			}
 			if (!(p->state & PEER_STATE_GOTLEN)) {
@@ -476,7 +747,7 @@ network_handle_peer_response(struct bufferevent *bufev, void *data)
 				memcpy(&msglen, p->rxmsg, sizeof(msglen));
 				p->rxmsglen = ntohl(msglen);
 				if (p->rxmsglen > MAX_MESSAGE_LEN) {
-					trace("network_handle_peer_response() got a message %u bytes long, longer than %u bytes, assuming its malicious and killing peer %s:%d", p->rxmsglen, MAX_MESSAGE_LEN, inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+					trace("network_handle_peer_response() got a message %u bytes long, longer than %u bytes, assuming its malicious and killing peer %s", p->rxmsglen, MAX_MESSAGE_LEN, print_host(&p->sa));
 					p->state = 0;
 					p->state |= PEER_STATE_DEAD;
 					goto out;
@@ -510,8 +781,12 @@ out:
 	 * send the bitfield.
 	 */
 	if (p->state & PEER_STATE_SENDBITFIELD) {
+		/* super-seeding shows pieces one at a time, later */
+		if (p->sc->superseed) {
+			if (p->state & PEER_STATE_FAST)
+				network_peer_write_havenone(p);
 		/* fast extension gives us a couple more options */
-		if (p->state & PEER_STATE_FAST) {
+		} else if (p->state & PEER_STATE_FAST) {
 			if (torrent_empty(p->sc->tp)) {
 				network_peer_write_havenone(p);
 			} else if (p->sc->tp->good_pieces == p->sc->tp->num_pieces) {
@@ -522,6 +797,11 @@ out:
 		} else if (!torrent_empty(p->sc->tp)) {
 			network_peer_write_bitfield(p);
 		}
+		/* tell DHT-capable peers where our node is */
+		if (dht_enabled && p->state & PEER_STATE_DHT)
+			network_peer_write_port(p);
+		if (p->state & PEER_STATE_EXTENDED)
+			pex_write_handshake(p);
 		p->state &= ~PEER_STATE_SENDBITFIELD;
 	}
 	if (EVBUFFER_LENGTH(EVBUFFER_INPUT(bufev)))
@@ -544,42 +824,43 @@ network_peer_process_message(u_int8_t id, struct peer *p)
 	int res = 0;
 	int found = 0;
 	u_int32_t bitfieldlen, idx, blocklen, off;
+	u_int16_t port;
 
 	/* XXX: safety-check for correct message lengths */
 	switch (id) {
 		case PEER_MSG_ID_CHOKE:
-			trace("CHOKE message from peer %s:%d",
-			    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+			trace("CHOKE message from peer %s",
+			    print_host(&p->sa));
 			p->state |= PEER_STATE_CHOKED;
 			if (!(p->state & PEER_STATE_FAST)) {
 				for (pd = TAILQ_FIRST(&p->peer_piece_dls); pd; pd = nxtpd) {
 					nxtpd = TAILQ_NEXT(pd, peer_piece_dl_list);
-					pd->pc = NULL;
+					network_piece_dl_set_peer(p->sc, pd, NULL);
 					TAILQ_REMOVE(&p->peer_piece_dls, pd, peer_piece_dl_list);
 					p->dl_queue_len--;
 				}
 			}
 			break;
 		case PEER_MSG_ID_UNCHOKE:
-			trace("UNCHOKE message from peer %s:%d",
-			    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+			trace("UNCHOKE message from peer %s",
+			    print_host(&p->sa));
 			p->state &= ~PEER_STATE_CHOKED;
 			break;
 		case PEER_MSG_ID_INTERESTED:
-			trace("INTERESTED message from peer %s:%d",
-			    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+			trace("INTERESTED message from peer %s",
+			    print_host(&p->sa));
 			p->state |= PEER_STATE_INTERESTED;
 			break;
 		case PEER_MSG_ID_NOTINTERESTED:
-			trace("NOTINTERESTED message from peer %s:%d",
-			    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+			trace("NOTINTERESTED message from peer %s",
+			    print_host(&p->sa));
 			p->state &= ~PEER_STATE_INTERESTED;
 			break;
 		case PEER_MSG_ID_HAVE:
 			memcpy(&idx, p->rxmsg+sizeof(id), sizeof(idx));
 			idx = ntohl(idx);
-			trace("HAVE message from peer %s:%d (idx=%u)",
-			    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port), idx);
+			trace("HAVE message from peer %s (idx=%u)",
+			    print_host(&p->sa), idx);
 			if (idx > p->sc->tp->num_pieces - 1) {
 				trace("have index overflow, ignoring");
 				break;
@@ -592,14 +873,16 @@ network_peer_process_message(u_int8_t id, struct peer *p)
 				p->state |= PEER_STATE_ESTABLISHED;
 			}
 			util_setbit(p->bitfield, idx);
+			if (p->sc->superseed)
+				superseed_have(p, idx);
 			/* does this peer have anything we want? */
 			scheduler_piece_gimme(p, PIECE_GIMME_NOCREATE, &res);
 			if (res && !(p->state & PEER_STATE_AMINTERESTED))
 				network_peer_write_interested(p);
 			break;
 		case PEER_MSG_ID_BITFIELD:
-			trace("BITFIELD message from peer %s:%d",
-			    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+			trace("BITFIELD message from peer %s",
+			    print_host(&p->sa));
 			if (!(p->state & PEER_STATE_BITFIELD)) {
 				trace("not expecting bitfield!");
 				break;
@@ -616,6 +899,9 @@ network_peer_process_message(u_int8_t id, struct peer *p)
 			memcpy(p->bitfield, p->rxmsg+sizeof(id), bitfieldlen);
 			p->state &= ~PEER_STATE_BITFIELD;
 			p->state |= PEER_STATE_ESTABLISHED;
+			if (p->sc->superseed)
+				superseed_bitfield(p);
+			network_peer_offer_allowedfast(p);
 			/* does this peer have anything we want? */
 			scheduler_piece_gimme(p, PIECE_GIMME_NOCREATE, &res);
 			if (res && !(p->state & PEER_STATE_AMINTERESTED))
@@ -632,28 +918,41 @@ network_peer_process_message(u_int8_t id, struct peer *p)
 			off = ntohl(off);
 			tpp = torrent_piece_find(p->sc->tp, idx);
 			if (off > tpp->len) {
-				trace("REQUEST offset out of bounds (%u)"), off;
+				trace("REQUEST offset out of bounds (%u)", off);
 				break;
 			}
 			memcpy(&blocklen, p->rxmsg+sizeof(id)+sizeof(idx)+sizeof(off), sizeof(blocklen));
 			blocklen = ntohl(blocklen);
+			if (blocklen == 0 || blocklen > MAX_REQUEST_LEN
+			    || blocklen > tpp->len - off) {
+				trace("REQUEST length out of bounds (%u)", blocklen);
+				break;
+			}
 			if (!(tpp->flags & TORRENT_PIECE_CKSUMOK)) {
-				trace("REQUEST for data we don't have from peer %s:%d idx=%u off=%u len=%u", inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port), idx, off, blocklen);
+				trace("REQUEST for data we don't have from peer %s idx=%u off=%u len=%u", print_host(&p->sa), idx, off, blocklen);
+				if (p->state & PEER_STATE_FAST)
+					network_peer_reject_block(p, idx, off, blocklen);
+				break;
+			}
+			/* while choked, only the allowed fast set may be had */
+			if (p->state & PEER_STATE_AMCHOKING
+			    && !network_peer_fast_offered(p, idx)) {
+				trace("REQUEST while choked from peer %s idx=%u off=%u len=%u", print_host(&p->sa), idx, off, blocklen);
 				if (p->state & PEER_STATE_FAST)
 					network_peer_reject_block(p, idx, off, blocklen);
 				break;
 			}
-			trace("REQUEST message from peer %s:%d idx=%u off=%u len=%u", inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port), idx, off, blocklen);
-			/* network_peer_write_piece(p, idx, off, blocklen); */
+			trace("REQUEST message from peer %s idx=%u off=%u len=%u", print_host(&p->sa), idx, off, blocklen);
 			network_piece_ul_enqueue(p, idx, off, blocklen);
+			scheduler_upload(p->sc);
 			break;
 		case PEER_MSG_ID_PIECE:
 			memcpy(&idx, p->rxmsg+sizeof(id), sizeof(idx));
 			idx = ntohl(idx);
 			memcpy(&off, p->rxmsg+sizeof(id)+sizeof(idx), sizeof(off));
 			off = ntohl(off);
-			trace("PIECE message (idx=%u off=%u len=%u) from peer %s:%d", idx,
-			    off, p->rxmsglen - (sizeof(id)+sizeof(off)+sizeof(idx)), inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+			trace("PIECE message (idx=%u off=%u len=%u) from peer %s", idx,
+			    off, p->rxmsglen - (sizeof(id)+sizeof(off)+sizeof(idx)), print_host(&p->sa));
 			if (idx > p->sc->tp->num_pieces - 1) {
 				trace("PIECE index out of bounds");
 				break;
@@ -664,11 +963,23 @@ network_peer_process_message(u_int8_t id, struct peer *p)
 				break;
 			}
 			pd = network_piece_dl_find(p->sc, p, idx, off);
-			if (pd != NULL
-			    && p->rxmsglen-(sizeof(id)+sizeof(off)+sizeof(idx)) != pd->len) {
+			blocklen = p->rxmsglen-(sizeof(id)+sizeof(off)+sizeof(idx));
+			if (pd != NULL && blocklen != pd->len) {
 				trace("PIECE len incorrect, should be %u", pd->len);
 				break;
 			}
+			/*
+			 * a block someone else beat this peer to, which we
+			 * cancelled too late or which was a duplicate anyway
+			 */
+			if (tpp->flags & TORRENT_PIECE_CKSUMOK
+			    || (pd != NULL && pd->bytes == pd->len)) {
+				p->sc->wasted += blocklen;
+				trace("PIECE message for data we already have, %llu bytes wasted",
+				    (unsigned long long)p->sc->wasted);
+				p->lastrecv = time(NULL);
+				break;
+			}
 			if (pd == NULL) {
 				trace("PIECE message for data we didn't request - killing peer");
 				p->state = 0;
@@ -677,12 +988,17 @@ network_peer_process_message(u_int8_t id, struct peer *p)
 			}
 			/* Only read if we don't already have it */
 			if (!(tpp->flags & TORRENT_PIECE_CKSUMOK)) {
-				p->dl_queue_len--;
-				if (!(tpp->flags & TORRENT_PIECE_MAPPED))
+				if (pd->pc == p)
+					p->dl_queue_len--;
+				/* assemble it in memory if we can, else on disk */
+				if (tpp->buf == NULL
+				    && !(tpp->flags & TORRENT_PIECE_MAPPED)
+				    && torrent_piece_buffer(tpp) == -1)
 					torrent_piece_map(tpp);
-				network_peer_read_piece(p, idx, off,
-				    p->rxmsglen-(sizeof(id)+sizeof(off)+sizeof(idx)),
+				network_peer_read_piece(p, idx, off, blocklen,
 				    p->rxmsg+sizeof(id)+sizeof(off)+sizeof(idx));
+				/* anyone else asked for this block needn't bother */
+				network_piece_dl_cancel_dups(p->sc, pd);
 				/* only checksum if we think we have every block of this piece */
 				found = 1;
 				for (off = 0; off < tpp->len; off += BLOCK_SIZE) {
@@ -697,21 +1013,33 @@ network_peer_process_message(u_int8_t id, struct peer *p)
 				}
 				if (found) {
 					res = torrent_piece_checkhash(p->sc->tp, tpp);
-					torrent_piece_unmap(tpp);
+					/* judge who sent it, while we still can */
+					trust_piece_checked(p->sc, tpp, res == 0);
+					/* only good data goes to disk */
+					if (res == 0 && tpp->buf != NULL)
+						torrent_piece_flush(tpp);
+					torrent_piece_buffer_free(tpp);
+					torrent_piece_blocks_clear(tpp);
+					if (tpp->flags & TORRENT_PIECE_MAPPED)
+						torrent_piece_unmap(tpp);
 					if (res == 0) {
 						trace("hash check success for piece %d", idx);
-						/* dump fastresume data  */
-						torrent_fastresume_dump(p->sc->tp);
+						torrent_fastresume_record(p->sc->tp, idx);
 						p->sc->tp->good_pieces++;
 						p->sc->tp->left -= tpp->len;
-						if (p->sc->tp->good_pieces == p->sc->tp->num_pieces) {
-							if (!seed) {
-								refresh_progress_meter();
-								exit(0);
-							} else if (!p->sc->announce_underway) {
-								/* tell tracker we're done */
-								announce(p->sc, "completed");
-							}
+						if (tpp->priority != TORRENT_PRIORITY_SKIP)
+							p->sc->tp->wanted_left--;
+						/* got everything we wanted? */
+						if (p->sc->tp->wanted_left == 0 && !seed) {
+							refresh_progress_meter();
+							torrent_fastresume_dump(p->sc->tp);
+							network_peercache_save(p->sc);
+							exit(0);
+						}
+						if (p->sc->tp->good_pieces == p->sc->tp->num_pieces
+						    && !p->sc->announce_underway) {
+							/* tell tracker we're done */
+							announce(p->sc, "completed");
 						}
 						/* send HAVE messages to all peers */
 						TAILQ_FOREACH(tp, &p->sc->peers, peer_list)
@@ -757,8 +1085,8 @@ network_peer_process_message(u_int8_t id, struct peer *p)
 			off = ntohl(off);
 			memcpy(&blocklen, p->rxmsg+sizeof(id)+sizeof(idx)+sizeof(off), sizeof(blocklen));
 			blocklen = ntohl(blocklen);
-			trace("CANCEL message idx=%u off=%u len=%u from peer %s:%d", idx, off, blocklen, 
-			    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+			trace("CANCEL message idx=%u off=%u len=%u from peer %s", idx, off, blocklen, 
+			    print_host(&p->sa));
 			for (pu = TAILQ_FIRST(&p->peer_piece_uls); pu; pu = nxtpu) {
 				nxtpu = TAILQ_NEXT(pu, peer_piece_ul_list);
 				if (pu->idx == idx
@@ -769,12 +1097,29 @@ network_peer_process_message(u_int8_t id, struct peer *p)
 				}
 			}
 			break;
+		case PEER_MSG_ID_PORT:
+			if (p->rxmsglen != sizeof(id) + sizeof(port))
+				break;
+			memcpy(&port, p->rxmsg+sizeof(id), sizeof(port));
+			trace("PORT message (port=%u) from peer %s",
+			    ntohs(port), print_host(&p->sa));
+			/* the peer runs a DHT node; see if it wants to talk */
+			if (dht_enabled && port != 0)
+				dht_ping(&p->sa, port);
+			break;
+		case PEER_MSG_ID_EXTENDED:
+			if (!(p->state & PEER_STATE_EXTENDED)
+			    || p->rxmsglen < sizeof(id) + 1)
+				break;
+			pex_process(p, p->rxmsg[1], p->rxmsg + sizeof(id) + 1,
+			    p->rxmsglen - sizeof(id) - 1);
+			break;
 		case PEER_MSG_ID_REJECT:
-			trace("REJECT message from peer %s:%d",
-			    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+			trace("REJECT message from peer %s",
+			    print_host(&p->sa));
 			if (!(p->state & PEER_STATE_FAST)) {
-				trace("peer %s:%d does not support fast extension, closing",
-				    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+				trace("peer %s does not support fast extension, closing",
+				    print_host(&p->sa));
 				p->state = 0;
 				p->state |= PEER_STATE_DEAD;
 				break;
@@ -789,17 +1134,17 @@ network_peer_process_message(u_int8_t id, struct peer *p)
 			off = ntohl(off);
 			memcpy(&blocklen, p->rxmsg+sizeof(id)+sizeof(idx)+sizeof(off), sizeof(blocklen));
 			blocklen = ntohl(blocklen);
-			trace("REJECT message from peer %s:%d idx=%u off=%u len=%u", inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port), idx, off, blocklen);
+			trace("REJECT message from peer %s idx=%u off=%u len=%u", print_host(&p->sa), idx, off, blocklen);
 			if ((pd = network_piece_dl_find(p->sc, p, idx, off)) == NULL) {
-				trace("could not find piece dl for reject from peer %s:%d idx=%u off=%u len=%u", inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port), idx, off, blocklen);
+				trace("could not find piece dl for reject from peer %s idx=%u off=%u len=%u", print_host(&p->sa), idx, off, blocklen);
 				break;
 			}
 			network_piece_dl_free(p->sc, pd);
 			p->dl_queue_len--;
 			break;
 		case PEER_MSG_ID_HAVENONE:
-			trace("HAVENONE message from peer %s:%d",
-			    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+			trace("HAVENONE message from peer %s",
+			    print_host(&p->sa));
 			if (!(p->state & PEER_STATE_BITFIELD)) {
 				trace("not expecting HAVENONE!");
 				break;
@@ -809,14 +1154,15 @@ network_peer_process_message(u_int8_t id, struct peer *p)
 			memset(p->bitfield, 0, bitfieldlen);
 			p->state &= ~PEER_STATE_BITFIELD;
 			p->state |= PEER_STATE_ESTABLISHED;
+			network_peer_offer_allowedfast(p);
 			/* does this peer have anything we want? */
 			scheduler_piece_gimme(p, PIECE_GIMME_NOCREATE, &res);
 			if (res && !(p->state & PEER_STATE_AMINTERESTED))
 				network_peer_write_interested(p);
 			break;
 		case PEER_MSG_ID_HAVEALL:
-			trace("HAVEALL message from peer %s:%d",
-			    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+			trace("HAVEALL message from peer %s",
+			    print_host(&p->sa));
 			if (!(p->state & PEER_STATE_BITFIELD)) {
 				trace("not expecting HAVEALL");
 				break;
@@ -826,6 +1172,8 @@ network_peer_process_message(u_int8_t id, struct peer *p)
 			memset(p->bitfield, 0xFF, bitfieldlen);
 			p->state &= ~PEER_STATE_BITFIELD;
 			p->state |= PEER_STATE_ESTABLISHED;
+			if (p->sc->superseed)
+				superseed_bitfield(p);
 			/* does this peer have anything we want? */
 			scheduler_piece_gimme(p, PIECE_GIMME_NOCREATE, &res);
 			if (res && !(p->state & PEER_STATE_AMINTERESTED))
@@ -834,28 +1182,48 @@ network_peer_process_message(u_int8_t id, struct peer *p)
 		case PEER_MSG_ID_ALLOWEDFAST:
 			memcpy(&idx, p->rxmsg+sizeof(id), sizeof(idx));
 			idx = ntohl(idx);
-			trace("ALLOWEDFAST message (idx=%u) from peer %s:%d", idx,
-			    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+			trace("ALLOWEDFAST message (idx=%u) from peer %s", idx,
+			    print_host(&p->sa));
 			if (idx > p->sc->tp->num_pieces - 1) {
 				trace("ALLOWEDFAST index out of bounds");
 				break;
 			}
-			/* ignore these for now */
-
+			if (!(p->state & PEER_STATE_FAST))
+				break;
+			/* scheduler_fill_requests() asks for these when choked */
+			if (p->allowed_fast == NULL)
+				p->allowed_fast =
+				    xcalloc((p->sc->tp->num_pieces + 7) / 8, 1);
+			util_setbit(p->allowed_fast, idx);
+			break;
 		case PEER_MSG_ID_SUGGEST:
 			memcpy(&idx, p->rxmsg+sizeof(id), sizeof(idx));
 			idx = ntohl(idx);
-			trace("SUGGEST message (idx=%u) from peer %s:%d", idx,
-			    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+			trace("SUGGEST message (idx=%u) from peer %s", idx,
+			    print_host(&p->sa));
 			if (idx > p->sc->tp->num_pieces - 1) {
 				trace("SUGGEST index out of bounds");
 				break;
 			}
-			/* ignore these for now */
+			if (!(p->state & PEER_STATE_FAST))
+				break;
+			/* remember the newest few, forgetting the oldest */
+			for (off = 0; off < p->num_suggested; off++)
+				if (p->suggested[off] == idx)
+					break;
+			if (off < p->num_suggested)
+				break;
+			if (p->num_suggested == SUGGEST_MAX) {
+				memmove(p->suggested, p->suggested + 1,
+				    (SUGGEST_MAX - 1) * sizeof(*p->suggested));
+				p->num_suggested--;
+			}
+			p->suggested[p->num_suggested++] = idx;
+			break;
 
 		default:
-			trace("Unknown message from peer %s:%d",
-			    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+			trace("Unknown message from peer %s",
+			    print_host(&p->sa));
 			break;
 	}
 }
@@ -873,17 +1241,19 @@ network_handle_peer_error(struct bufferevent *bufev, short error, void *data)
 
 	p = data;
 	if (error & EVBUFFER_TIMEOUT) {
-		trace("network_handle_peer_error() TIMEOUT for peer %s:%d",
-		    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+		trace("network_handle_peer_error() TIMEOUT for peer %s",
+		    print_host(&p->sa));
 	}
+	/* an outgoing connection which never got through the handshake */
+	network_peer_connect_time(p, 1);
 	if (error & EVBUFFER_EOF) {
 		p->state = 0;
 		p->state |= PEER_STATE_DEAD;
-		trace("network_handle_peer_error() EOF for peer %s:%d",
-		    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+		trace("network_handle_peer_error() EOF for peer %s",
+		    print_host(&p->sa));
 	} else {
-		trace("network_handle_peer_error() error for peer %s:%d",
-		    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+		trace("network_handle_peer_error() error for peer %s",
+		    print_host(&p->sa));
 		p->state = 0;
 		p->state |= PEER_STATE_DEAD;
 	}
@@ -913,12 +1283,16 @@ network_peer_keepalive(int fd, short type, void *arg)
 /*
  * network_handle_peer_write()
  *
- * Handle write events.  Mostly involves cleanup.
+ * Handle write events.  The peer's output has drained below UPLOAD_LOWAT,
+ * so there may be room to upload more.
  */
 void
 network_handle_peer_write(struct bufferevent *bufev, void *data)
 {
-	/* do nothing */
+	struct peer *p = data;
+
+	if (p->sc != NULL)
+		scheduler_upload(p->sc);
 }
 
 /*
@@ -960,21 +1334,23 @@ network_peer_write_piece(struct peer *p, u_int32_t idx, u_int32_t offset, u_int3
 	u_int8_t *data, *msg, id;
 	int hint = 0;
 
-	trace("network_peer_write_piece() idx=%u off=%u len=%u for peer %s:%d",
-	    idx, offset, len, inet_ntoa(p->sa.sin_addr),
-	    ntohs(p->sa.sin_port));
+	trace("network_peer_write_piece() idx=%u off=%u len=%u for peer %s",
+	    idx, offset, len, print_host(&p->sa));
 
 	if ((tpp = torrent_piece_find(p->sc->tp, idx)) == NULL) {
 		trace("network_peer_write_piece() piece %u - failed at torrent_piece_find(), returning",
 		    idx);
 		return;
 	}
-	if (!(tpp->flags & TORRENT_PIECE_MAPPED))
-		torrent_piece_map(tpp);
-	if ((data = torrent_block_read(tpp, offset, len, &hint)) == NULL) {
-		trace("network_peer_write_piece() piece %u - failed at torrent_block_read(), returning",
-		    idx);
-		return;
+	/* peers tend to want the rest of the piece next, so cache it */
+	if ((data = cache_block_read(p->sc, tpp, offset, len)) == NULL) {
+		if (!(tpp->flags & TORRENT_PIECE_MAPPED))
+			torrent_piece_map(tpp);
+		if ((data = torrent_block_read(tpp, offset, len, &hint)) == NULL) {
+			trace("network_peer_write_piece() piece %u - failed at torrent_block_read(), returning",
+			    idx);
+			return;
+		}
 	}
 	/* construct PIECE message response */
 	msglen = sizeof(msglen) + sizeof(id) + sizeof(idx) + sizeof(offset) + len;
@@ -994,6 +1370,7 @@ network_peer_write_piece(struct peer *p, u_int32_t idx, u_int32_t offset, u_int3
 	if (hint == 1)
 		xfree(data);
 	p->totaltx += msglen;
+	network_rate_add(&p->txwin, len);
 }
 
 /*
@@ -1007,6 +1384,7 @@ network_peer_read_piece(struct peer *p, u_int32_t idx, off_t offset, u_int32_t l
 {
 	struct torrent_piece *tpp;
 	struct piece_dl *pd;
+	int was;
 
 	if ((tpp = torrent_piece_find(p->sc->tp, idx)) == NULL) {
 		trace("network_peer_read_piece: piece %u - failed at torrent_piece_find(), returning",
@@ -1016,11 +1394,19 @@ network_peer_read_piece(struct peer *p, u_int32_t idx, off_t offset, u_int32_t l
 	trace("network_peer_read_piece() at index %u offset %u length %u", idx, offset, len);
 	if ((pd = network_piece_dl_find(p->sc, p, idx, offset)) == NULL)
 		return;
+	if (p->trust == NULL)
+		p->trust = trust_get(p->sc, &p->sa);
+	pd->src = p->trust;
 	torrent_block_write(tpp, offset, len, data);
+	was = PIECE_DL_COVERED(pd);
 	pd->bytes += len;
+	network_piece_dl_cover(p->sc, pd, was, PIECE_DL_COVERED(pd));
+	if (pd->bytes == pd->len)
+		torrent_piece_block_have(tpp, pd->off);
 	/* XXX not really accurate measure of progress since the data could be bad */
 	p->sc->tp->downloaded += len;
 	p->totalrx += len;
+	network_rate_add(&p->rxwin, len);
 	ctl_server_notify_bytes(p->sc, p->sc->tp->downloaded);
 }
 
@@ -1034,8 +1420,8 @@ network_peer_request_block(struct peer *p, u_int32_t idx, u_int32_t off, u_int32
 	u_int32_t msglen, msglen2, blocklen;
 	u_int8_t  *msg, id;
 
-	trace("network_peer_request_block, index: %u offset: %u len: %u to peer %s:%d", idx, off, len,
-	    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+	trace("network_peer_request_block, index: %u offset: %u len: %u to peer %s", idx, off, len,
+	    print_host(&p->sa));
 	msglen = sizeof(msglen) + sizeof(id) + sizeof(idx) + sizeof(off) + sizeof(blocklen);
 	msg = xmalloc(msglen);
 
@@ -1065,9 +1451,9 @@ network_peer_cancel_piece(struct piece_dl *pd)
 	u_int32_t msglen, msglen2, blocklen, off, idx;
 	u_int8_t  *msg, id;
 
-	trace("network_peer_cancel_piece, index: %u offset: %u to peer %s:%d",
+	trace("network_peer_cancel_piece, index: %u offset: %u to peer %s",
 	     pd->idx, pd->off,
-	    inet_ntoa(pd->pc->sa.sin_addr), ntohs(pd->pc->sa.sin_port));
+	    print_host(&pd->pc->sa));
 	msglen = sizeof(msglen) + sizeof(id) + sizeof(idx) + sizeof(off) + sizeof(blocklen);
 	msg = xmalloc(msglen);
 	msglen2 = htonl(msglen - sizeof(msglen));
@@ -1096,7 +1482,7 @@ network_peer_write_interested(struct peer *p)
 	u_int32_t len;
 	u_int8_t *msg, id;
 
-	trace("network_peer_write_interested() to peer %s:%d", inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+	trace("network_peer_write_interested() to peer %s", print_host(&p->sa));
 	len = htonl(sizeof(id));
 	id = PEER_MSG_ID_INTERESTED;
 
@@ -1122,7 +1508,7 @@ network_peer_write_bitfield(struct peer *p)
 
 	bitfieldlen = (p->sc->tp->num_pieces + 7) / 8;
 
-	trace("network_peer_write_bitfield() to peer %s:%d len: %u", inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port), bitfieldlen);
+	trace("network_peer_write_bitfield() to peer %s len: %u", print_host(&p->sa), bitfieldlen);
 	id = PEER_MSG_ID_BITFIELD;
 	bitfield = torrent_bitfield_get(p->sc->tp);
 
@@ -1148,7 +1534,7 @@ network_peer_write_unchoke(struct peer *p)
 	u_int32_t len;
 	u_int8_t *msg, id;
 
-	trace("network_peer_write_unchoke() to peer %s:%d", inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+	trace("network_peer_write_unchoke() to peer %s", print_host(&p->sa));
 	len = htonl(sizeof(id));
 	id = PEER_MSG_ID_UNCHOKE;
 
@@ -1169,10 +1555,11 @@ network_peer_write_unchoke(struct peer *p)
 void
 network_peer_write_choke(struct peer *p)
 {
+	struct piece_ul *pu, *nxtpu;
 	u_int32_t len;
 	u_int8_t *msg, id;
 
-	trace("network_peer_write_choke() to peer %s:%d", inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+	trace("network_peer_write_choke() to peer %s", print_host(&p->sa));
 	len = htonl(sizeof(id));
 	id = PEER_MSG_ID_CHOKE;
 
@@ -1182,6 +1569,16 @@ network_peer_write_choke(struct peer *p)
 
 	p->state |= PEER_STATE_AMCHOKING;
 	network_peer_write(p, msg, sizeof(len) + sizeof(id));
+	/* its queued requests go, bar those in its allowed fast set */
+	for (pu = TAILQ_FIRST(&p->peer_piece_uls); pu; pu = nxtpu) {
+		nxtpu = TAILQ_NEXT(pu, peer_piece_ul_list);
+		if (network_peer_fast_offered(p, pu->idx))
+			continue;
+		if (p->state & PEER_STATE_FAST)
+			network_peer_reject_block(p, pu->idx, pu->off, pu->len);
+		TAILQ_REMOVE(&p->peer_piece_uls, pu, peer_piece_ul_list);
+		xfree(pu);
+	}
 }
 
 /*
@@ -1195,7 +1592,7 @@ network_peer_write_keepalive(struct peer *p)
 	u_int32_t len;
 	u_int8_t *msg;
 
-	trace("network_peer_write_keepalive() to peer %s:%d", inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+	trace("network_peer_write_keepalive() to peer %s", print_host(&p->sa));
 
 	msg = xmalloc(sizeof(len));
 	memset(msg, 0, sizeof(len));
@@ -1214,7 +1611,7 @@ network_peer_write_haveall(struct peer *p)
 	u_int32_t len;
 	u_int8_t *msg, id;
 
-	trace("network_peer_write_haveall() to peer %s:%d", inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+	trace("network_peer_write_haveall() to peer %s", print_host(&p->sa));
 	len = htonl(sizeof(id));
 	id = PEER_MSG_ID_HAVEALL;
 
@@ -1225,6 +1622,59 @@ network_peer_write_haveall(struct peer *p)
 	network_peer_write(p, msg, sizeof(len) + sizeof(id));
 }
 
+/*
+ * network_peer_write_port()
+ *
+ * Send a PORT message, with our DHT node's port, to remote peer.
+ */
+void
+network_peer_write_port(struct peer *p)
+{
+	u_int32_t len;
+	u_int16_t port;
+	u_int8_t *msg, id;
+
+	trace("network_peer_write_port() to peer %s", print_host(&p->sa));
+	len = htonl(sizeof(id) + sizeof(port));
+	id = PEER_MSG_ID_PORT;
+	port = htons(dht_port());
+
+	msg = xmalloc(sizeof(len) + sizeof(id) + sizeof(port));
+	memcpy(msg, &len, sizeof(len));
+	memcpy(msg+sizeof(len), &id, sizeof(id));
+	memcpy(msg+sizeof(len)+sizeof(id), &port, sizeof(port));
+
+	network_peer_write(p, msg, sizeof(len) + sizeof(id) + sizeof(port));
+}
+
+/*
+ * network_peer_write_extended()
+ *
+ * Send an extended message, with extended message id <extid>, to remote
+ * peer.
+ */
+void
+network_peer_write_extended(struct peer *p, u_int8_t extid,
+    const void *payload, size_t payloadlen)
+{
+	u_int32_t len;
+	u_int8_t *msg, id;
+
+	trace("network_peer_write_extended() id %u to peer %s", extid,
+	    print_host(&p->sa));
+	len = htonl(sizeof(id) + sizeof(extid) + payloadlen);
+	id = PEER_MSG_ID_EXTENDED;
+
+	msg = xmalloc(sizeof(len) + sizeof(id) + sizeof(extid) + payloadlen);
+	memcpy(msg, &len, sizeof(len));
+	memcpy(msg+sizeof(len), &id, sizeof(id));
+	memcpy(msg+sizeof(len)+sizeof(id), &extid, sizeof(extid));
+	memcpy(msg+sizeof(len)+sizeof(id)+sizeof(extid), payload, payloadlen);
+
+	network_peer_write(p, msg,
+	    sizeof(len) + sizeof(id) + sizeof(extid) + payloadlen);
+}
+
 /*
  * network_peer_write_havenone()
  *
@@ -1236,7 +1686,7 @@ network_peer_write_havenone(struct peer *p)
 	u_int32_t len;
 	u_int8_t *msg, id;
 
-	trace("network_peer_write_havenone() to peer %s:%d", inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+	trace("network_peer_write_havenone() to peer %s", print_host(&p->sa));
 	len = htonl(sizeof(id));
 	id = PEER_MSG_ID_HAVENONE;
 
@@ -1257,8 +1707,8 @@ network_peer_reject_block(struct peer *p, u_int32_t idx, u_int32_t off, u_int32_
 	u_int32_t msglen, msglen2, blocklen;
 	u_int8_t  *msg, id;
 
-	trace("network_peer_reject_block, index: %u offset: %u len: %u to peer %s:%d", idx, off, len,
-	    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+	trace("network_peer_reject_block, index: %u offset: %u len: %u to peer %s", idx, off, len,
+	    print_host(&p->sa));
 	msglen = sizeof(msglen) + sizeof(id) + sizeof(idx) + sizeof(off) + sizeof(blocklen);
 	msg = xmalloc(msglen);
 
@@ -1278,25 +1728,110 @@ network_peer_reject_block(struct peer *p, u_int32_t idx, u_int32_t off, u_int32_
 }
 
 /*
- * network_crypto_dh()
+ * network_peer_write_allowedfast()
+ *
+ * Send an ALLOWEDFAST message to remote peer.
+ */
+void
+network_peer_write_allowedfast(struct peer *p, u_int32_t idx)
+{
+	u_int32_t msglen, msglen2;
+	u_int8_t *msg, id;
+
+	trace("network_peer_write_allowedfast() idx %u to peer %s", idx,
+	    print_host(&p->sa));
+	msglen = sizeof(msglen) + sizeof(id) + sizeof(idx);
+	msg = xmalloc(msglen);
+
+	msglen2 = htonl(msglen - sizeof(msglen));
+	id = PEER_MSG_ID_ALLOWEDFAST;
+	idx = htonl(idx);
+
+	memcpy(msg, &msglen2, sizeof(msglen2));
+	memcpy(msg+sizeof(msglen2), &id, sizeof(id));
+	memcpy(msg+sizeof(msglen2)+sizeof(id), &idx, sizeof(idx));
+
+	network_peer_write(p, msg, msglen);
+}
+
+/*
+ * network_peer_offer_allowedfast()
+ *
+ * Once we know what a fast extension peer has, and it is a newcomer with
+ * fewer pieces than there are in an allowed fast set, tell it which of
+ * the pieces in its set we have.  It may request those even while we
+ * choke it, which gets it its first pieces quickly.
  *
- * Generate a DH key object.
+ * The set is worked out from the peer's IPv4 address and the info hash
+ * as BEP 6 describes, so it stays the same across reconnections.  BEP 6
+ * defines no such set for IPv6 peers.
  */
-DH *
-network_crypto_dh()
+static void
+network_peer_offer_allowedfast(struct peer *p)
 {
-	DH *dhp;
+	struct torrent *tp = p->sc->tp;
+	struct torrent_piece *tpp;
+	SHA1_CTX sha;
+	u_int8_t x[SHA1_DIGEST_LENGTH];
+	u_int32_t set[ALLOWED_FAST_SET], i, j, n, k, y, have;
 
-	if ((dhp = DH_new()) == NULL)
-		errx(1, "network_crypto_pubkey: DH_new() failure");
-	if ((dhp->p = BN_bin2bn(mse_P, CRYPTO_INT_LEN, NULL)) == NULL)
-		errx(1, "network_crypto_pubkey: BN_bin2bn(P) failure");
-	if ((dhp->g = BN_bin2bn(mse_G, CRYPTO_INT_LEN, NULL)) == NULL)
-		errx(1, "network_crypto_pubkey: BN_bin2bn(G) failure");
-	if (DH_generate_key(dhp) == 0)
-		errx(1, "network_crypto_pubkey: DH_generate_key() failure");
+	if (!(p->state & PEER_STATE_FAST) || p->sa.ss_family != AF_INET
+	    || torrent_empty(tp) || p->sc->superseed)
+		return;
+	for (i = have = 0; i < tp->num_pieces && have < ALLOWED_FAST_SET; i++)
+		if (util_getbit(p->bitfield, i))
+			have++;
+	if (have >= ALLOWED_FAST_SET)
+		return;
 
-	return (dhp);
+	k = MIN(ALLOWED_FAST_SET, tp->num_pieces);
+	memcpy(x, &((struct sockaddr_in *)&p->sa)->sin_addr, 4);
+	x[3] = 0;
+	SHA1Init(&sha);
+	SHA1Update(&sha, x, 4);
+	SHA1Update(&sha, tp->info_hash, SHA1_DIGEST_LENGTH);
+	SHA1Final(x, &sha);
+	for (n = 0; ; ) {
+		for (i = 0; i < 5 && n < k; i++) {
+			memcpy(&y, x + i * 4, sizeof(y));
+			y = ntohl(y) % tp->num_pieces;
+			for (j = 0; j < n; j++)
+				if (set[j] == y)
+					break;
+			if (j == n)
+				set[n++] = y;
+		}
+		if (n == k)
+			break;
+		SHA1Init(&sha);
+		SHA1Update(&sha, x, SHA1_DIGEST_LENGTH);
+		SHA1Final(x, &sha);
+	}
+	p->num_fast_offered = 0;
+	for (i = 0; i < k; i++) {
+		tpp = torrent_piece_find(tp, set[i]);
+		if (tpp->flags & TORRENT_PIECE_CKSUMOK) {
+			network_peer_write_allowedfast(p, set[i]);
+			p->fast_offered[p->num_fast_offered++] = set[i];
+		}
+	}
+}
+
+/*
+ * network_peer_fast_offered()
+ *
+ * Is piece <idx> in the allowed fast set we offered this peer?
+ */
+static int
+network_peer_fast_offered(struct peer *p, u_int32_t idx)
+{
+	u_int32_t i;
+
+	for (i = 0; i < p->num_fast_offered; i++)
+		if (p->fast_offered[i] == idx)
+			return (1);
+
+	return (0);
 }
 
 /*
@@ -1311,57 +1846,104 @@ network_peer_lastcomms(struct peer *p)
 }
 
 /*
- * network_peer_rxrate()
+ * network_rate_roll()
+ *
+ * Move a rate window on to <now>, forgetting seconds which have dropped
+ * out of it.
+ */
+static void
+network_rate_roll(struct rate *r, time_t now)
+{
+	u_int64_t *b;
+
+	if (now - r->last >= RATE_WINDOW) {
+		memset(r->bytes, 0, sizeof(r->bytes));
+		r->sum = 0;
+	} else {
+		while (r->last < now) {
+			r->last++;
+			b = &r->bytes[r->last % RATE_WINDOW];
+			r->sum -= *b;
+			*b = 0;
+		}
+	}
+	r->last = now;
+}
+
+/*
+ * network_rate_add()
+ *
+ * Count <n> bytes moved just now in a rate window.
+ */
+void
+network_rate_add(struct rate *r, u_int64_t n)
+{
+	time_t now;
+
+	now = time(NULL);
+	network_rate_roll(r, now);
+	r->bytes[now % RATE_WINDOW] += n;
+	r->sum += n;
+}
+
+/*
+ * network_rate_get()
  *
- * Return the average rx transfer rate of a given peer.
+ * Bytes per second over the last RATE_WINDOW seconds, or since <since> if
+ * that is more recent.
  */
 u_int64_t
-network_peer_rxrate(struct peer *p)
+network_rate_get(struct rate *r, time_t since)
 {
-	u_int64_t rate;
+	time_t now, secs;
 
-	rate = time(NULL) - p->connected;
+	now = time(NULL);
+	network_rate_roll(r, now);
+	secs = MIN(now - since, RATE_WINDOW);
 	/* prevent divide by zero */
-	if (rate == 0)
+	if (secs <= 0)
 		return (0);
-	return (p->totalrx / rate);
+	return (r->sum / secs);
+}
 
+/*
+ * network_peer_rxrate()
+ *
+ * Return the recent rx transfer rate of a given peer.
+ */
+u_int64_t
+network_peer_rxrate(struct peer *p)
+{
+	return (network_rate_get(&p->rxwin, p->connected));
 }
 
 /*
  * network_peer_txrate()
  *
- * Return the average tx transfer rate of a given peer.
+ * Return the recent tx transfer rate of a given peer.
  */
 u_int64_t
 network_peer_txrate(struct peer *p)
 {
-	u_int64_t rate;
-
-	rate = time(NULL) - p->connected;
-	/* prevent divide by zero */
-	if (rate == 0)
-		return (0);
-	return (p->totaltx / rate);
-
+	return (network_rate_get(&p->txwin, p->connected));
 }
 
 /*
- * network_piece_dl_create()
+ * network_piece_dl_new()
  *
- * Create a piece dl, and also insert into the per-peer list and global
- * btree index.
+ * Create a piece dl, belonging to no peer yet, and insert it into the
+ * global btree index.
  */
-struct piece_dl *
-network_piece_dl_create(struct peer *p, u_int32_t idx, u_int32_t off,
+static struct piece_dl *
+network_piece_dl_new(struct session *sc, u_int32_t idx, u_int32_t off,
     u_int32_t len)
 {
+	struct torrent_piece *tpp;
 	struct piece_dl *pd;
 	struct piece_dl_idxnode find, *res;
 
 	pd = xmalloc(sizeof(*pd));
 	memset(pd, 0, sizeof(*pd));
-	pd->pc = p;
 	pd->idx = idx;
 	pd->off = off;
 	pd->len = len;
@@ -1369,7 +1951,7 @@ network_piece_dl_create(struct peer *p, u_int32_t idx, u_int32_t off,
 	/* check for an existing piece_dl_idxnode */
 	find.off = off;
 	find.idx = idx;
-	if ((res = RB_FIND(piece_dl_by_idxoff, &p->sc->piece_dl_by_idxoff, &find)) == NULL) {
+	if ((res = RB_FIND(piece_dl_by_idxoff, &sc->piece_dl_by_idxoff, &find)) == NULL) {
 		/* need to create one */
 		res = xmalloc(sizeof(*res));
 		memset(res, 0, sizeof(*res));
@@ -1377,16 +1959,77 @@ network_piece_dl_create(struct peer *p, u_int32_t idx, u_int32_t off,
 		res->idx = idx;
 		TAILQ_INIT(&res->idxnode_piece_dls);
 		TAILQ_INSERT_TAIL(&res->idxnode_piece_dls, pd, idxnode_piece_dl_list);
-		RB_INSERT(piece_dl_by_idxoff, &p->sc->piece_dl_by_idxoff, res);
+		RB_INSERT(piece_dl_by_idxoff, &sc->piece_dl_by_idxoff, res);
+		tpp = torrent_piece_find(sc->tp, idx);
+		if (tpp->dl_blocks++ == 0) {
+			TAILQ_INSERT_TAIL(&sc->partial_pieces, tpp, partial);
+			sc->num_partial++;
+		}
 	} else {
 		/* found a pre-existing one, just append this to its list */
 		TAILQ_INSERT_TAIL(&res->idxnode_piece_dls, pd, idxnode_piece_dl_list);
 	}
+	pd->idxnode = res;
+	pd->requested = time(NULL);
+
+	return (pd);
+}
+
+/*
+ * network_piece_dl_create()
+ *
+ * Create a piece dl, and also insert into the per-peer list and global
+ * btree index.
+ */
+struct piece_dl *
+network_piece_dl_create(struct peer *p, u_int32_t idx, u_int32_t off,
+    u_int32_t len)
+{
+	struct piece_dl *pd;
+
+	pd = network_piece_dl_new(p->sc, idx, off, len);
+	pd->pc = p;
+	network_piece_dl_cover(p->sc, pd, 0, 1);
 	TAILQ_INSERT_TAIL(&p->peer_piece_dls, pd, peer_piece_dl_list);
 
 	return (pd);
 }
 
+/*
+ * network_piece_dl_resume()
+ *
+ * Pick up partial pieces where we left off.  The blocks the fast resume
+ * data says we have get completed piece dls, so they are not fetched
+ * again, and the piece is mapped, so the rest land beside them on disk.
+ */
+static void
+network_piece_dl_resume(struct session *sc)
+{
+	struct torrent_piece *tpp;
+	struct piece_dl *pd;
+	u_int32_t i, off, n;
+
+	n = 0;
+	for (i = 0; i < sc->tp->num_pieces; i++) {
+		tpp = torrent_piece_find(sc->tp, i);
+		if (tpp->blockmap == NULL)
+			continue;
+		if (!(tpp->flags & TORRENT_PIECE_MAPPED))
+			torrent_piece_map(tpp);
+		for (off = 0; off < tpp->len; off += BLOCK_SIZE) {
+			if (!util_getbit(tpp->blockmap, off / BLOCK_SIZE))
+				continue;
+			pd = network_piece_dl_new(sc, i, off,
+			    MIN(BLOCK_SIZE, tpp->len - off));
+			pd->bytes = pd->len;
+			network_piece_dl_cover(sc, pd, 0, 1);
+		}
+		n++;
+	}
+	if (n > 0)
+		trace("network_piece_dl_resume() resuming %u partial pieces", n);
+}
+
 /*
  * network_piece_dl_free()
  *
@@ -1395,7 +2038,10 @@ network_piece_dl_create(struct peer *p, u_int32_t idx, u_int32_t off,
 void
 network_piece_dl_free(struct session *sc, struct piece_dl *pd)
 {
+	struct torrent_piece *tpp;
 	struct piece_dl_idxnode find, *res;
+
+	network_piece_dl_cover(sc, pd, PIECE_DL_COVERED(pd), 0);
 	find.off = pd->off;
 	find.idx = pd->idx;
 	/* remove from index/offset btree */
@@ -1406,12 +2052,172 @@ network_piece_dl_free(struct session *sc, struct piece_dl *pd)
 		TAILQ_REMOVE(&pd->pc->peer_piece_dls, pd, peer_piece_dl_list);
 	}
 	if (res != NULL
-	    && TAILQ_EMPTY(&res->idxnode_piece_dls))
+	    && TAILQ_EMPTY(&res->idxnode_piece_dls)) {
 		RB_REMOVE(piece_dl_by_idxoff, &sc->piece_dl_by_idxoff, res);
+		xfree(res);
+		tpp = torrent_piece_find(sc->tp, pd->idx);
+		if (--tpp->dl_blocks == 0) {
+			TAILQ_REMOVE(&sc->partial_pieces, tpp, partial);
+			sc->num_partial--;
+			tpp->speed = PIECE_SPEED_NONE;
+			/* nobody is fetching it, so its blocks are gone */
+			torrent_piece_buffer_free(tpp);
+			torrent_piece_blocks_clear(tpp);
+		}
+	}
 	xfree(pd);
 	pd = NULL;
 }
 
+/*
+ * network_piece_dl_set_peer()
+ *
+ * Hand a piece dl to peer <p>, or orphan it if <p> is NULL.  Callers move
+ * it between per-peer lists themselves.
+ */
+void
+network_piece_dl_set_peer(struct session *sc, struct piece_dl *pd,
+    struct peer *p)
+{
+	int was;
+
+	was = PIECE_DL_COVERED(pd);
+	pd->pc = p;
+	if (p != NULL)
+		pd->requested = time(NULL);
+	else
+		/* the piece is up for grabs by peers of any speed */
+		torrent_piece_find(sc->tp, pd->idx)->speed = PIECE_SPEED_NONE;
+	network_piece_dl_cover(sc, pd, was, PIECE_DL_COVERED(pd));
+}
+
+/*
+ * network_piece_dl_cover()
+ *
+ * A piece dl went from <was> to <now> being PIECE_DL_COVERED.  Keep count
+ * of how many do for each block, of the blocks each piece has covered,
+ * which is how the picker tells a piece is fully requested, and of the
+ * blocks of incomplete pieces none do for, which is all endgame detection
+ * has to look at.
+ */
+static void
+network_piece_dl_cover(struct session *sc, struct piece_dl *pd, int was,
+    int now)
+{
+	struct torrent_piece *tpp;
+
+	if (was == now)
+		return;
+	tpp = torrent_piece_find(sc->tp, pd->idx);
+	if (now) {
+		if (pd->idxnode->covered++ != 0)
+			return;
+		tpp->covered++;
+		if (!(tpp->flags & TORRENT_PIECE_CKSUMOK)
+		    && tpp->priority != TORRENT_PRIORITY_SKIP)
+			sc->blocks_unassigned--;
+	} else {
+		if (--pd->idxnode->covered != 0)
+			return;
+		tpp->covered--;
+		if (!(tpp->flags & TORRENT_PIECE_CKSUMOK)
+		    && tpp->priority != TORRENT_PRIORITY_SKIP)
+			sc->blocks_unassigned++;
+	}
+}
+
+/*
+ * network_piece_dl_recount()
+ *
+ * Count the blocks of wanted, incomplete pieces which no piece dl covers
+ * from scratch, for when which pieces are wanted changes.
+ */
+void
+network_piece_dl_recount(struct session *sc)
+{
+	struct torrent_piece *tpp;
+	struct piece_dl_idxnode find, *res;
+	u_int32_t i, off;
+
+	sc->blocks_unassigned = 0;
+	for (i = 0; i < sc->tp->num_pieces; i++) {
+		tpp = torrent_piece_find(sc->tp, i);
+		if (tpp->flags & TORRENT_PIECE_CKSUMOK
+		    || tpp->priority == TORRENT_PRIORITY_SKIP)
+			continue;
+		for (off = 0; off < tpp->len; off += BLOCK_SIZE) {
+			find.idx = i;
+			find.off = off;
+			res = RB_FIND(piece_dl_by_idxoff,
+			    &sc->piece_dl_by_idxoff, &find);
+			if (res == NULL || res->covered == 0)
+				sc->blocks_unassigned++;
+		}
+	}
+}
+
+/*
+ * network_piece_dl_cancel_dups()
+ *
+ * The block of <pd> has arrived.  Cancel and free every other request for
+ * it, as made in endgame.
+ */
+static void
+network_piece_dl_cancel_dups(struct session *sc, struct piece_dl *pd)
+{
+	struct piece_dl_idxnode find, *res;
+	struct piece_dl *dup, *nxt;
+
+	find.off = pd->off;
+	find.idx = pd->idx;
+	if ((res = RB_FIND(piece_dl_by_idxoff, &sc->piece_dl_by_idxoff, &find)) == NULL)
+		return;
+	for (dup = TAILQ_FIRST(&res->idxnode_piece_dls); dup != NULL; dup = nxt) {
+		nxt = TAILQ_NEXT(dup, idxnode_piece_dl_list);
+		if (dup == pd)
+			continue;
+		if (dup->pc != NULL) {
+			network_peer_cancel_piece(dup);
+			dup->pc->dl_queue_len--;
+		}
+		network_piece_dl_free(sc, dup);
+	}
+}
+
+/*
+ * network_piece_dl_requests()
+ *
+ * How many peers is the block at index <idx>, offset <off> still
+ * requested from?  Sets <done> if one of them has already sent it, and
+ * <newest>, unless NULL, to when the latest request was made.
+ */
+u_int32_t
+network_piece_dl_requests(struct session *sc, u_int32_t idx, u_int32_t off,
+    int *done, time_t *newest)
+{
+	struct piece_dl_idxnode find, *res;
+	struct piece_dl *pd;
+	u_int32_t n = 0;
+
+	*done = 0;
+	if (newest != NULL)
+		*newest = 0;
+	find.off = off;
+	find.idx = idx;
+	if ((res = RB_FIND(piece_dl_by_idxoff, &sc->piece_dl_by_idxoff, &find)) == NULL)
+		return (0);
+	TAILQ_FOREACH(pd, &res->idxnode_piece_dls, idxnode_piece_dl_list) {
+		if (pd->bytes == pd->len) {
+			*done = 1;
+		} else if (pd->pc != NULL) {
+			n++;
+			if (newest != NULL && pd->requested > *newest)
+				*newest = pd->requested;
+		}
+	}
+	return (n);
+}
+
 /* public functions */
 
 /*
@@ -1428,43 +2234,57 @@ network_init()
 /*
  * network_listen()
  *
- * Create a listening server socket.
+ * Create a listening server socket, of whichever address family <host>
+ * is in.  IPv6 sockets only take IPv6, so that an IPv4 one can listen on
+ * the same port.  Returns -1 on failure, with errno set.
  */
 int
 network_listen(char *host, char *port)
 {
 	int error = 0;
-	int fd;
+	int fd = -1;
 	int option_value = 1;
 	struct addrinfo hints, *res;
 
-	trace("network_listen() creating socket");
-	if ((fd = socket(PF_INET, SOCK_STREAM, 0)) == -1)
-		err(1, "could not create server socket");
-	trace("network_listen() setting socket non-blocking");
-	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
-		err(1, "network_listen: fcntl");
 	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = PF_INET;
+	hints.ai_family = PF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST;
 	trace("network_listen() calling getaddrinfo()");
 	error = getaddrinfo(host, port, &hints, &res);
 	if (error != 0)
 		errx(1, "\"%s\" - %s", host, gai_strerror(error));
+	trace("network_listen() creating socket");
+	if ((fd = socket(res->ai_family, SOCK_STREAM, 0)) == -1)
+		goto err;
+	trace("network_listen() setting socket non-blocking");
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+		goto err;
 	trace("network_listen() settings socket options");
-	error = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
-		    &option_value, sizeof(option_value));
-	if (error == -1)
-		err(1, "could not set socket options");
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+	    &option_value, sizeof(option_value)) == -1)
+		goto err;
+	if (res->ai_family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6,
+	    IPV6_V6ONLY, &option_value, sizeof(option_value)) == -1)
+		goto err;
 	trace("network_listen() binding socket to address");
 	if (bind(fd, res->ai_addr, res->ai_addrlen) == -1)
-		err(1, "could not bind to port %s", port);
+		goto err;
 	trace("network_listen() listening on socket");
 	if (listen(fd, MAX_BACKLOG) == -1)
-		err(1, "could not listen on server socket");
+		goto err;
 	freeaddrinfo(res);
 	trace("network_listen() done");
 	return fd;
+
+err:
+	error = errno;
+	trace("network_listen() %s port %s: %s", host, port, strerror(error));
+	if (fd != -1)
+		(void)close(fd);
+	freeaddrinfo(res);
+	errno = error;
+	return (-1);
 }
 
 /*
@@ -1483,8 +2303,23 @@ network_start_torrent(struct torrent *tp, rlim_t maxfds)
 	memset(sc, 0, sizeof(*sc));
 
 	TAILQ_INIT(&sc->peers);
+	TAILQ_INIT(&sc->partial_pieces);
+	TAILQ_INIT(&sc->cache_lru);
+	RB_INIT(&sc->trust_by_host);
+	TAILQ_INIT(&sc->suspect_pieces);
+	TAILQ_INSERT_TAIL(&sessions, sc, session_list);
 	sc->tp = tp;
 	sc->maxfds = maxfds;
+	/* keep most descriptors for peers */
+	tp->max_open_files = MAX(1, MIN(FILE_CACHE_SIZE, maxfds / 8));
+	sc->connect_time[0] = sc->connect_time[1] = CONNECT_TIME_INITIAL;
+	sc->streaming = stream_enabled;
+	sc->txlimit = upload_rate;
+	sc->upload_slots = UPLOAD_SLOTS;
+	superseed_start(sc);
+	network_piece_dl_resume(sc);
+	/* nobody is getting any of the other blocks we need yet */
+	network_piece_dl_recount(sc);
 	if (tp->good_pieces == tp->num_pieces)
 		tp->left = 0;
 	if (user_port == NULL) {
@@ -1508,7 +2343,22 @@ network_start_torrent(struct torrent *tp, rlim_t maxfds)
 	}
 
 	start_progress_meter(tp->name, len, &tp->downloaded, &tp->good_pieces, tp->num_pieces, started);
+	/* don't wait for the tracker to find peers we knew last time */
+	network_peercache_load(sc);
+	network_peerlist_connect(sc);
 	ret = announce(sc, "started");
+	scrape_start();
+	if (dht_enabled)
+		dht_start(sc);
+	if (utp_enabled) {
+		if (udp_open(sc->port) == 0)
+			utp_listen(network_handle_utp_connect, sc);
+		else {
+			warnx("could not open UDP port %s, not using uTP",
+			    sc->port);
+			utp_enabled = 0;
+		}
+	}
 
 	event_dispatch();
 	trace("network_start_torrent() returning name %s good pieces %u", tp->name, tp->good_pieces);
@@ -1516,6 +2366,45 @@ network_start_torrent(struct torrent *tp, rlim_t maxfds)
 	return (ret);
 }
 
+/*
+ * network_session_start()
+ *
+ * Once we have found some peers, set up the server socket and kick off the
+ * scheduler.  Safe to call more than once.
+ */
+void
+network_session_start(struct session *sc)
+{
+	struct bufferevent *bev;
+	struct timeval tv;
+
+	if (sc->servfd != 0)
+		return;
+	trace("network_session_start() setting up server socket");
+	if (sc->port != NULL) {
+		if ((sc->servfd = network_listen("0.0.0.0", sc->port)) == -1)
+			err(1, "could not listen on port %s", sc->port);
+		bev = bufferevent_new(sc->servfd, NULL,
+		    NULL, network_handle_peer_connect, sc);
+		if (bev == NULL)
+			errx(1, "network_session_start: bufferevent_new failure");
+		bufferevent_enable(bev, EV_PERSIST|EV_READ);
+		/* IPv6 too, if this host has it */
+		if ((sc->servfd6 = network_listen("::", sc->port)) != -1) {
+			bev = bufferevent_new(sc->servfd6, NULL,
+			    NULL, network_handle_peer_connect, sc);
+			if (bev == NULL)
+				errx(1, "network_session_start: bufferevent_new failure");
+			bufferevent_enable(bev, EV_PERSIST|EV_READ);
+		}
+	}
+	trace("network_session_start() setting up scheduler");
+	timerclear(&tv);
+	tv.tv_sec = 1;
+	evtimer_set(&sc->scheduler_event, scheduler, sc);
+	evtimer_add(&sc->scheduler_event, &tv);
+}
+
 /*
  * network_peerlist_update()
  *
@@ -1533,6 +2422,25 @@ network_peerlist_update(struct session *sc, struct benc_node *peers)
 	ctl_server_notify_peers(sc);
 }
 
+/*
+ * network_peerlist_update6()
+ *
+ * Add peers from the compact IPv6 peer list of a tracker response, the
+ * "peers6" key.
+ */
+void
+network_peerlist_update6(struct session *sc, struct benc_node *peers)
+{
+	if (!(peers->flags & BSTRING)) {
+		trace("network_peerlist_update6() peers6 is not a string");
+		return;
+	}
+	network_peerlist_add_compact(sc, (u_int8_t *)peers->body.string.value,
+	    peers->body.string.len, COMPACT_LEN6);
+	network_peerlist_connect(sc);
+	ctl_server_notify_peers(sc);
+}
+
 /*
  * network_handle_peer_connect()
  *
@@ -1543,7 +2451,6 @@ network_handle_peer_connect(struct bufferevent *bufev, short error, void *data)
 {
 	struct session *sc;
 	struct peer *p;
-	struct timeval tv;
 	socklen_t addrlen;
 
 	trace("network_handle_peer_connect() called");
@@ -1557,33 +2464,62 @@ network_handle_peer_connect(struct bufferevent *bufev, short error, void *data)
 	addrlen = sizeof(p->sa);
 
 	trace("network_handle_peer_connect() accepting connection");
-	if ((p->connfd = accept(sc->servfd, (struct sockaddr *) &p->sa, &addrlen)) == -1) {
+	if ((p->connfd = accept(EVENT_FD(&bufev->ev_read),
+	    (struct sockaddr *) &p->sa, &addrlen)) == -1) {
 		trace("network_handle_peer_connect() accept error");
 		network_peer_free(p);
 		return;
 	}
-	trace("network_handle_peer_connect() accepted peer: %s:%d",
-	    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+	trace("network_handle_peer_connect() accepted peer: %s",
+	    print_host(&p->sa));
 
-	p->state |= PEER_STATE_HANDSHAKE1;
-	p->bufev = bufferevent_new(p->connfd, network_handle_peer_response,
-	    network_handle_peer_write, network_handle_peer_error, p);
-	if (p->bufev == NULL)
-		errx(1, "network_announce: bufferevent_new failure");
-	bufferevent_enable(p->bufev, EV_READ|EV_WRITE);
-	/* set up keep-alive timer */
-	timerclear(&tv);
-	tv.tv_sec = 1;
-	evtimer_set(&p->keepalive_event, network_peer_keepalive, p);
-	evtimer_add(&p->keepalive_event, &tv);
-	trace("network_handle_peer_connect() initiating handshake");
-	TAILQ_INSERT_TAIL(&sc->peers, p, peer_list);
-	sc->num_peers++;
-	network_peer_handshake(sc, p);
+	network_peer_accept(sc, p);
 
 	bufferevent_enable(bufev, EV_READ);
 }
 
+/*
+ * network_handle_utp_connect()
+ *
+ * Handle incoming uTP connections.
+ */
+static void
+network_handle_utp_connect(int fd, const struct sockaddr_storage *sa,
+    void *data)
+{
+	struct session *sc = data;
+	struct peer *p;
+
+	trace("network_handle_utp_connect() accepted peer: %s",
+	    print_host(sa));
+	p = network_peer_create();
+	p->sc = sc;
+	p->sa = *sa;
+	p->connfd = fd;
+	p->state |= PEER_STATE_UTP;
+	network_peer_accept(sc, p);
+}
+
+/*
+ * network_peer_accept()
+ *
+ * Start talking to a peer which connected to us.
+ */
+static void
+network_peer_accept(struct session *sc, struct peer *p)
+{
+	p->state |= PEER_STATE_HANDSHAKE1|PEER_STATE_INBOUND;
+	network_peer_setup(p);
+	/* we reply to its handshake, once we know if it is encrypted */
+	TAILQ_INSERT_TAIL(&sc->peers, p, peer_list);
+	sc->num_peers++;
+	if (trust_banned(sc, &p->sa)) {
+		trace("network_peer_accept() %s is banned", print_host(&p->sa));
+		p->state = 0;
+		p->state |= PEER_STATE_DEAD;
+	}
+}
+
 /*
  * network_connect_tracker()
  *
@@ -1599,7 +2535,7 @@ network_connect_tracker(const char *host, const char *port)
 	/* I think that this is the only place where we should actually
 	 * have to resolve host names.  The getaddrinfo() calls elsewhere
 	 * should be very fast. */
-	hints.ai_family = PF_INET;
+	hints.ai_family = PF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 	trace("network_connect_tracker() calling getaddrinfo() for host: %s port: %s", host, port);
 	/* XXX cache thiS, OR PERhaps use evdns */
@@ -1688,7 +2624,7 @@ network_peer_free(struct peer *p)
 	/* search the piece dl list for any dls associated with this peer */
 	for (pd = TAILQ_FIRST(&p->peer_piece_dls); pd; pd = nxtpd) {
 		nxtpd = TAILQ_NEXT(pd, peer_piece_dl_list);
-		pd->pc = NULL;
+		network_piece_dl_set_peer(p->sc, pd, NULL);
 		TAILQ_REMOVE(&p->peer_piece_dls, pd, peer_piece_dl_list);
 		/* unless this is completed, remove it from the btree */
 		if (pd->len != pd->bytes)
@@ -1710,11 +2646,19 @@ network_peer_free(struct peer *p)
 		xfree(p->rxmsg);
 	if (p->bitfield != NULL)
 		xfree(p->bitfield);
+	if (p->allowed_fast != NULL)
+		xfree(p->allowed_fast);
+	if (p->mse != NULL)
+		mse_free(p->mse);
+	if (p->pex_sent != NULL)
+		xfree(p->pex_sent);
 	if (p->connfd != 0) {
 		(void)  close(p->connfd);
 		p->connfd = 0;
 	}
 
+	if (p->sc != NULL && p->sc->optimistic == p)
+		p->sc->optimistic = NULL;
 	evtimer_del(&p->keepalive_event);
 	xfree(p);
 	p = NULL;
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Parser for BitTorrent `bencode' format.
+ * See http://wiki.theory.org/BitTorrentSpecification
+ *
+ * The input is parsed where it lies.  String nodes point into the buffer
+ * instead of holding copies, and are NUL-terminated by overwriting the
+ * byte after them, which is kept aside until the parser gets to it.  So
+ * the buffer is changed, and is handed over to the tree, which must not
+ * outlive its data.  Open lists and dictionaries are kept on a stack of
+ * our own rather than by recursion, so nesting is limited only by
+ * benc_max_depth.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "includes.h"
+
+#ifndef LLONG_MAX
+ #define LLONG_MAX 9223372036854775807LL
+#endif
+
+/* deepest nesting of lists and dictionaries we accept */
+int benc_max_depth = BENC_MAX_DEPTH;
+
+static int	benc_parse_number(const u_int8_t *, size_t, size_t *, int, int,
+		    long long *);
+
+/*
+ * benc_parse_number()
+ *
+ * Read the decimal number at <*pos>, whose first byte is <c>, up to the
+ * byte <end>, and leave <*pos> just past that.  Returns -1 if there is no
+ * such number, or it doesn't fit in a long long.
+ */
+static int
+benc_parse_number(const u_int8_t *p, size_t len, size_t *pos, int c, int end,
+    long long *num)
+{
+	unsigned long long n;
+	size_t i;
+	int neg, digits;
+
+	i = *pos;
+	neg = 0;
+	if (c == '-') {
+		neg = 1;
+		if (++i == len)
+			return (-1);
+		c = p[i];
+	}
+	n = 0;
+	for (digits = 0; isdigit(c); digits++) {
+		if (n > (unsigned long long)(LLONG_MAX - (c - '0')) / 10)
+			return (-1);
+		n = n * 10 + (c - '0');
+		if (++i == len)
+			return (-1);
+		c = p[i];
+	}
+	if (digits == 0 || c != end)
+		return (-1);
+	*num = neg ? -(long long)n : (long long)n;
+	*pos = i + 1;
+
+	return (0);
+}
+
+/*
+ * benc_parse_buf()
+ *
+ * Parse the b-encoded data in <b>, adding each value found at the top
+ * level to <root>, which must come from benc_root_create().  The tree
+ * takes over <b>, and frees it along with everything else in
+ * benc_node_freeall().  Data that has been wrapped with buf_wrap() stays
+ * the caller's, but must last as long as the tree does.  A string can't
+ * be terminated if it runs to the end of the buffer, but in well formed
+ * input the only such string is a lone one at the top level, which
+ * nobody sends.  Returns <root>, or NULL if the data is malformed.
+ */
+struct benc_node *
+benc_parse_buf(BUF *b, struct benc_node *root)
+{
+	struct benc_node **stack, *node, *parent, *entry;
+	char *key;
+	u_int8_t *p, held;
+	size_t len, pos, hole, slen, keylen;
+	long long num;
+	int c, depth, stacksize;
+
+	root->body.root.buf = b;
+	p = buf_get(b);
+	len = buf_len(b);
+
+	stacksize = 16;
+	stack = xcalloc(stacksize, sizeof(*stack));
+	depth = 0;
+	key = NULL;
+	keylen = 0;
+	/* where the byte after the last string was, and what it was */
+	hole = (size_t)-1;
+	held = 0;
+
+	for (pos = 0; pos < len; ) {
+		c = pos == hole ? held : p[pos];
+		parent = depth > 0 ? stack[depth - 1] : root;
+		if (c == 'e') {
+			if (depth == 0 || key != NULL) {
+				trace("benc_parse_buf() unexpected end at %zu",
+				    pos);
+				goto err;
+			}
+			if (parent->flags & BDICT)
+				parent->end = pos + 1;
+			depth--;
+			pos++;
+			continue;
+		}
+		switch (c) {
+		case 'i':
+			if (++pos == len || benc_parse_number(p, len, &pos,
+			    p[pos], 'e', &num) == -1) {
+				trace("benc_parse_buf() bad integer at %zu",
+				    pos);
+				goto err;
+			}
+			node = benc_node_create(root);
+			node->flags = BINT;
+			node->body.number = num;
+			break;
+		case 'd':
+		case 'l':
+			if (depth == benc_max_depth) {
+				trace("benc_parse_buf() nested too deep at %zu",
+				    pos);
+				goto err;
+			}
+			if (depth == stacksize) {
+				stacksize *= 2;
+				stack = xrealloc(stack,
+				    stacksize * sizeof(*stack));
+			}
+			node = benc_node_create(root);
+			node->flags = c == 'd' ? BDICT : BLIST;
+			pos++;
+			break;
+		default:
+			if (benc_parse_number(p, len, &pos, c, ':', &num) == -1
+			    || num < 0
+			    || (unsigned long long)num >= len - pos) {
+				trace("benc_parse_buf() bad string at %zu",
+				    pos);
+				goto err;
+			}
+			slen = num;
+			hole = pos + slen;
+			held = p[hole];
+			p[hole] = '\0';
+			if (parent->flags & BDICT && key == NULL) {
+				key = (char *)p + pos;
+				keylen = slen;
+				pos = hole;
+				continue;
+			}
+			node = benc_node_create(root);
+			node->flags = BSTRING;
+			node->body.string.value = (char *)p + pos;
+			node->body.string.len = slen;
+			pos = hole;
+			break;
+		}
+		if (parent->flags & BDICT) {
+			if (key == NULL) {
+				trace("benc_parse_buf() key is not a string at"
+				    " %zu", pos);
+				goto err;
+			}
+			entry = benc_node_create(root);
+			entry->flags = node->flags | BDICT_ENTRY;
+			entry->body.dict_entry.key = key;
+			entry->body.dict_entry.value = node;
+			entry->body.dict_entry.keylen = keylen;
+			benc_node_add(parent, entry);
+			key = NULL;
+		} else {
+			benc_node_add(parent, node);
+		}
+		if (node->flags & (BDICT|BLIST))
+			stack[depth++] = node;
+	}
+	if (depth > 0) {
+		trace("benc_parse_buf() data ends inside %d containers", depth);
+		goto err;
+	}
+	xfree(stack);
+
+	return (root);
+err:
+	xfree(stack);
+
+	return (NULL);
+}
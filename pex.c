@@ -0,0 +1,388 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Extension protocol (BEP 10) handshake and peer exchange (BEP 11).
+ *
+ * Peers which set the extension bit in their handshake are sent an
+ * extended handshake advertising ut_pex.  Once a peer tells us its own
+ * ut_pex message id, it is sent, at most once a minute, the compact
+ * addresses of peers we have connected to or lost since the last message.
+ * Peers learned the same way from others are added to the peer list.
+ * IPv6 peers go in the "added6" and "dropped6" lists.
+ *
+ * Internally every address is kept in the 18 byte IPv6 compact form, with
+ * IPv4 addresses mapped into it, so that both families share one list.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "includes.h"
+
+/* the message id we ask peers to use for ut_pex */
+#define PEX_ID		1
+#define PEX_MAX_MSG	4096
+/* IPv4-mapped IPv6 address prefix */
+#define PEX_V4MAPPED	"\0\0\0\0\0\0\0\0\0\0\377\377"
+
+struct pex_msg {
+	u_int8_t	buf[PEX_MAX_MSG];
+	size_t		len;
+};
+
+static void	pex_put(struct pex_msg *, const void *, size_t);
+static void	pex_put_str(struct pex_msg *, const char *, const void *,
+		    size_t);
+static void	pex_handshake_process(struct peer *, struct benc_node *);
+static void	pex_added_process(struct peer *, struct benc_node *);
+static void	pex_entry(const struct peer *, u_int8_t *);
+static int	pex_find(const u_int8_t *, u_int32_t, const u_int8_t *);
+static void	pex_put_list(struct pex_msg *, const char *, const u_int8_t *,
+		    u_int32_t, int);
+
+/*
+ * pex_put()
+ *
+ * Append raw bytes to an outgoing message.  Messages are built from
+ * bounded lists, so running out of room is a bug.
+ */
+static void
+pex_put(struct pex_msg *m, const void *data, size_t len)
+{
+	if (len > sizeof(m->buf) - m->len)
+		errx(1, "pex_put: message too long");
+	memcpy(m->buf + m->len, data, len);
+	m->len += len;
+}
+
+/*
+ * pex_put_str()
+ *
+ * Append a dictionary key and b-encoded string value to an outgoing message.
+ */
+static void
+pex_put_str(struct pex_msg *m, const char *key, const void *s, size_t len)
+{
+	char num[24];
+	int l;
+
+	l = snprintf(num, sizeof(num), "%zu:", strlen(key));
+	pex_put(m, num, l);
+	pex_put(m, key, strlen(key));
+	l = snprintf(num, sizeof(num), "%zu:", len);
+	pex_put(m, num, l);
+	pex_put(m, s, len);
+}
+
+/*
+ * pex_write_handshake()
+ *
+ * Send the extended handshake, telling the peer our ut_pex message id and
+ * the port we listen on.
+ */
+void
+pex_write_handshake(struct peer *p)
+{
+	char msg[128];
+	int l;
+
+	trace("pex_write_handshake() to peer %s", print_host(&p->sa));
+	l = snprintf(msg, sizeof(msg), "d1:md6:ut_pexi%de"
+	    "e1:pi%se1:v%zu:Unworkable %se", PEX_ID, p->sc->port,
+	    strlen("Unworkable ") + strlen(UNWORKABLE_VERSION),
+	    UNWORKABLE_VERSION);
+	if (l == -1 || l >= (int)sizeof(msg))
+		errx(1, "pex_write_handshake: string truncation");
+	network_peer_write_extended(p, 0, msg, l);
+}
+
+/*
+ * pex_process()
+ *
+ * Handle an extended message from a peer.  <extid> is 0 for the extended
+ * handshake, otherwise the id we gave for one of our extensions.
+ */
+void
+pex_process(struct peer *p, u_int8_t extid, u_int8_t *data, size_t len)
+{
+	struct benc_node *troot, *msg;
+	BUF *buf;
+
+	if (extid != 0 && extid != PEX_ID) {
+		trace("pex_process() unknown extended message %u from peer %s",
+		    extid, print_host(&p->sa));
+		return;
+	}
+	if (benc_check(data, len, PEX_MAX_DEPTH) == -1) {
+		trace("pex_process() malformed message from peer %s",
+		    print_host(&p->sa));
+		return;
+	}
+	buf = buf_wrap(data, len);
+	troot = benc_root_create();
+	if (benc_parse_buf(buf, troot) == NULL)
+		goto out;
+	msg = TAILQ_FIRST(&troot->children);
+	if (extid == 0)
+		pex_handshake_process(p, msg);
+	else
+		pex_added_process(p, msg);
+out:
+	benc_node_freeall(troot);
+}
+
+/*
+ * pex_handshake_process()
+ *
+ * Note the peer's ut_pex id and listen port from its extended handshake.
+ * A later handshake may change or disable either.
+ */
+static void
+pex_handshake_process(struct peer *p, struct benc_node *msg)
+{
+	struct benc_node *m, *node;
+
+	if ((m = benc_dict_get(msg, "m", BDICT)) != NULL) {
+		node = benc_dict_get(m, "ut_pex", BINT);
+		if (node != NULL && node->body.number >= 0
+		    && node->body.number <= 255)
+			p->pex_id = node->body.number;
+	}
+	if ((node = benc_dict_get(msg, "p", BINT)) != NULL
+	    && node->body.number > 0 && node->body.number <= 65535)
+		p->listen_port = htons(node->body.number);
+	trace("pex_handshake_process() peer %s ut_pex id %u port %u",
+	    print_host(&p->sa), p->pex_id,
+	    ntohs(p->listen_port));
+}
+
+/*
+ * pex_added_process()
+ *
+ * Add peers from a ut_pex message's "added" and "added6" lists, as long
+ * as we are short of peers.  Dropped peers are of no interest; we notice
+ * ourselves when a connection goes away.
+ */
+static void
+pex_added_process(struct peer *p, struct benc_node *msg)
+{
+	struct session *sc = p->sc;
+	struct benc_node *added;
+	size_t len, max, entrylen;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if ((added = benc_dict_get(msg, i ? "added6" : "added",
+		    BSTRING)) == NULL)
+			continue;
+		if (sc->num_peers >= PEX_PEERS_WANTED)
+			break;
+		entrylen = i ? COMPACT_LEN6 : COMPACT_LEN;
+		len = added->body.string.len - added->body.string.len % entrylen;
+		max = MIN(PEX_MAX_PEERS, PEX_PEERS_WANTED - sc->num_peers)
+		    * entrylen;
+		if (len > max)
+			len = max;
+		trace("pex_added_process() %zu %s peers from peer %s",
+		    len / entrylen, i ? "IPv6" : "IPv4", print_host(&p->sa));
+		network_peerlist_add_compact(sc,
+		    (u_int8_t *)added->body.string.value, len, entrylen);
+	}
+	network_peerlist_connect(sc);
+}
+
+/*
+ * pex_entry()
+ *
+ * Write the address and listen port of <ep> to <addr>, in the 18 byte
+ * form we keep all addresses in.
+ */
+static void
+pex_entry(const struct peer *ep, u_int8_t *addr)
+{
+	struct sockaddr_storage ss;
+	u_int8_t c[COMPACT_LEN6];
+
+	ss = ep->sa;
+	util_setport(&ss, ep->listen_port);
+	if (util_addr_compact(&ss, c) == COMPACT_LEN6) {
+		memcpy(addr, c, COMPACT_LEN6);
+	} else {
+		memcpy(addr, PEX_V4MAPPED, 12);
+		memcpy(addr + 12, c, COMPACT_LEN);
+	}
+}
+
+/*
+ * pex_find()
+ *
+ * Is the address <addr> in the array <list> of <num> entries?
+ */
+static int
+pex_find(const u_int8_t *list, u_int32_t num, const u_int8_t *addr)
+{
+	u_int32_t i;
+
+	for (i = 0; i < num; i++)
+		if (memcmp(list + i * COMPACT_LEN6, addr, COMPACT_LEN6) == 0)
+			return (1);
+	return (0);
+}
+
+/*
+ * pex_put_list()
+ *
+ * Append those of the <num> addresses in <list> which are IPv6, if <v6>
+ * is set, or IPv4 otherwise, as a compact address list with the given
+ * key.  An "added" list also gets its flags list, one zero byte per
+ * peer, since we have nothing to say about encryption or seeding.
+ */
+static void
+pex_put_list(struct pex_msg *m, const char *key, const u_int8_t *list,
+    u_int32_t num, int v6)
+{
+	u_int8_t buf[PEX_MAX_PEERS * COMPACT_LEN6], flags[PEX_MAX_PEERS];
+	char fkey[16];
+	const u_int8_t *addr;
+	u_int32_t i, n;
+	size_t len;
+	int l;
+
+	len = n = 0;
+	for (i = 0; i < num; i++) {
+		addr = list + i * COMPACT_LEN6;
+		if ((memcmp(addr, PEX_V4MAPPED, 12) != 0) != v6)
+			continue;
+		if (v6) {
+			memcpy(buf + len, addr, COMPACT_LEN6);
+			len += COMPACT_LEN6;
+		} else {
+			memcpy(buf + len, addr + 12, COMPACT_LEN);
+			len += COMPACT_LEN;
+		}
+		n++;
+	}
+	/* the IPv4 lists are sent even when empty, as they always were */
+	if (n == 0 && v6)
+		return;
+	pex_put_str(m, key, buf, len);
+	if (strncmp(key, "added", 5) == 0) {
+		memset(flags, 0, n);
+		l = snprintf(fkey, sizeof(fkey), "%s.f", key);
+		if (l == -1 || l >= (int)sizeof(fkey))
+			errx(1, "pex_put_list: string truncation");
+		pex_put_str(m, fkey, flags, n);
+	}
+}
+
+/*
+ * pex_update()
+ *
+ * Called by the scheduler for each ut_pex capable peer.  Once every
+ * PEX_INTERVAL seconds, tell the peer which of our connected peers are new
+ * to it, and which of those we told it about have since gone away.
+ */
+void
+pex_update(struct peer *p)
+{
+	struct peer *ep;
+	struct pex_msg m;
+	u_int8_t *cur, *sent, *addr_p, addr[COMPACT_LEN6];
+	u_int8_t added[PEX_MAX_PEERS * COMPACT_LEN6];
+	u_int8_t dropped[PEX_MAX_PEERS * COMPACT_LEN6];
+	u_int32_t i, ncur, nsent, nadded, ndropped;
+	time_t now;
+
+	now = time(NULL);
+	if (p->pex_id == 0 || now - p->last_pex < PEX_INTERVAL)
+		return;
+	p->last_pex = now;
+
+	/* everyone we are talking to and who can take connections */
+	cur = xcalloc(p->sc->num_peers, COMPACT_LEN6);
+	ncur = 0;
+	TAILQ_FOREACH(ep, &p->sc->peers, peer_list) {
+		if (ep == p || ep->connfd == 0 || ep->listen_port == 0
+		    || ep->state & (PEER_STATE_DEAD|PEER_STATE_HANDSHAKE1
+		    |PEER_STATE_HANDSHAKE2) || ncur == p->sc->num_peers)
+			continue;
+		pex_entry(ep, addr);
+		if (pex_find(cur, ncur, addr))
+			continue;
+		memcpy(cur + ncur * COMPACT_LEN6, addr, COMPACT_LEN6);
+		ncur++;
+	}
+
+	/*
+	 * Work out the new set of peers the other side knows about: what it
+	 * knew before minus whatever we drop now, plus whatever we add now.
+	 * Changes which don't fit in this message wait for the next one.
+	 */
+	sent = xcalloc(p->pex_sent_num + PEX_MAX_PEERS, COMPACT_LEN6);
+	nsent = ndropped = nadded = 0;
+	for (i = 0; i < p->pex_sent_num; i++) {
+		addr_p = p->pex_sent + i * COMPACT_LEN6;
+		if (ndropped < PEX_MAX_PEERS && !pex_find(cur, ncur, addr_p)) {
+			memcpy(dropped + ndropped * COMPACT_LEN6, addr_p,
+			    COMPACT_LEN6);
+			ndropped++;
+			continue;
+		}
+		memcpy(sent + nsent * COMPACT_LEN6, addr_p, COMPACT_LEN6);
+		nsent++;
+	}
+	for (i = 0; i < ncur && nadded < PEX_MAX_PEERS; i++) {
+		addr_p = cur + i * COMPACT_LEN6;
+		if (pex_find(p->pex_sent, p->pex_sent_num, addr_p))
+			continue;
+		memcpy(added + nadded * COMPACT_LEN6, addr_p, COMPACT_LEN6);
+		memcpy(sent + nsent * COMPACT_LEN6, addr_p, COMPACT_LEN6);
+		nadded++;
+		nsent++;
+	}
+	xfree(cur);
+	if (p->pex_sent != NULL)
+		xfree(p->pex_sent);
+	p->pex_sent = sent;
+	p->pex_sent_num = nsent;
+	if (nadded == 0 && ndropped == 0)
+		return;
+
+	/* keys in sorted order */
+	m.len = 0;
+	pex_put(&m, "d", 1);
+	pex_put_list(&m, "added", added, nadded, 0);
+	pex_put_list(&m, "added6", added, nadded, 1);
+	pex_put_list(&m, "dropped", dropped, ndropped, 0);
+	pex_put_list(&m, "dropped6", dropped, ndropped, 1);
+	pex_put(&m, "e", 1);
+	trace("pex_update() %u added %u dropped to peer %s", nadded,
+	    ndropped, print_host(&p->sa));
+	network_peer_write_extended(p, p->pex_id, m.buf, m.len);
+}
@@ -28,41 +28,87 @@
 #include "includes.h"
 
 static int	 scheduler_piece_assigned(struct session *, struct torrent_piece *);
+static int	 scheduler_piece_suspect_busy(struct peer *,
+		    struct torrent_piece *);
+static int	 scheduler_peer_speed(struct peer *);
 static u_int32_t scheduler_piece_find_rarest(struct peer *, int, int *);
 static int	 scheduler_is_endgame(struct session *);
 static int	 scheduler_threshold_kill(struct peer *);
-static void	 scheduler_dequeue_uploads(struct peer *);
+static void	 scheduler_upload_fill(struct session *);
+static void	 scheduler_upload_wait(int, short, void *);
 static int	 scheduler_reap_dead(struct session *, struct peer *);
 static void	 scheduler_fill_requests(struct session *, struct peer *);
+static struct peercounter *scheduler_peer_speedrank(struct session *,
+		    u_int32_t *);
+static void	 scheduler_upload_slots(struct session *, struct peercounter *,
+		    u_int32_t);
+static void	 scheduler_optimistic_unchoke(struct session *,
+		    struct peercounter *, u_int32_t, u_int32_t);
 static void	 scheduler_choke_algorithm(struct session *, time_t *);
 static void	 scheduler_endgame_algorithm(struct session *);
+static int	 scheduler_swarm_exhausted(struct session *);
+static struct peercounter *scheduler_peer_rxrank(struct session *,
+		    u_int32_t *);
+static void	 scheduler_request_block(struct session *, struct peercounter *,
+		    u_int32_t, struct torrent_piece *, u_int32_t, u_int32_t);
+static u_int32_t scheduler_stream_window(struct session *, u_int32_t *);
+static void	 scheduler_stream_algorithm(struct session *);
+
+/* fetch pieces in playback order, for watching while downloading */
+int stream_enabled = 0;
 
 /*
  * scheduler_is_endgame()
  *
- * Are we in the end game?
+ * Are we in the end game?  That is, is every block we still need being
+ * fetched from some peer?  The piece dl code keeps count of the blocks
+ * which aren't.
  * Returns 1 if true, zero if false.
  */
 static int
 scheduler_is_endgame(struct session *sc)
 {
-	struct torrent_piece *tpp;
-	u_int32_t i;
-	int not_queued = 0;
+	int endgame;
 
-	for (i = 0; i < sc->tp->num_pieces; i++) {
-		if ((tpp = torrent_piece_find(sc->tp, i)) == NULL)
-			errx(1, "scheduler_is_endgame(): torrent_piece_find");
-		if (!(tpp->flags & TORRENT_PIECE_CKSUMOK)) {
-			/* are all the blocks in the queue? */
-			if (!scheduler_piece_assigned(sc, tpp)) {
-				not_queued = 1;
-				break;
-			}
-		}
+	endgame = sc->blocks_unassigned == 0 && sc->tp->wanted_left > 0;
+	if (endgame != sc->endgame) {
+		trace("scheduler_is_endgame() %s endgame",
+		    endgame ? "entering" : "leaving");
+		sc->endgame = endgame;
 	}
 
-	return (!not_queued);
+	return (endgame);
+}
+
+/*
+ * scheduler_swarm_exhausted()
+ *
+ * Going by the tracker's latest seeder and leecher counts, are we already
+ * connected to everyone in the swarm?  If so, asking the tracker for more
+ * peers is pointless.
+ * Returns 1 if true, zero if false.
+ */
+static int
+scheduler_swarm_exhausted(struct session *sc)
+{
+	u_int32_t others;
+	time_t maxage;
+
+	if (sc->tp->last_swarm_update == 0)
+		return (0);
+	/* counts older than an announce interval aren't worth trusting */
+	maxage = sc->tp->interval != 0 ? sc->tp->interval
+	    : DEFAULT_ANNOUNCE_INTERVAL;
+	if (time(NULL) - sc->tp->last_swarm_update > maxage)
+		return (0);
+	/* an empty swarm is just a tracker that doesn't know yet */
+	others = sc->tp->complete + sc->tp->incomplete;
+	if (others == 0)
+		return (0);
+	/* the tracker counts us as a leecher */
+	others--;
+
+	return (sc->num_peers >= others);
 }
 
 /*
@@ -74,27 +120,28 @@ scheduler_is_endgame(struct session *sc)
 static int
 scheduler_piece_assigned(struct session *sc, struct torrent_piece *tpp)
 {
-	u_int32_t off;
-	struct piece_dl *pd;
-
-	/* if this piece and all its blocks are already in our download queue,
-	 * skip it */
-	for (off = 0; ; off += BLOCK_SIZE) {
-		if (off >= tpp->len)
-			return (1);
-		pd = network_piece_dl_find(sc, NULL, tpp->index, off);
+	return (tpp->covered == (tpp->len + BLOCK_SIZE - 1) / BLOCK_SIZE);
+}
 
-		/* if a piece doesn't exist, or has been orphaned, then its not
-		 * done */
-		if (pd == NULL || (pd->bytes != pd->len && pd->pc == NULL))
-			return (0);
-	}
+/*
+ * scheduler_peer_speed()
+ *
+ * Speed class of a peer: fast if it could fetch a whole piece within
+ * PIECE_FAST_TIME seconds at its current rate.
+ */
+static int
+scheduler_peer_speed(struct peer *p)
+{
+	if (network_peer_rxrate(p) * PIECE_FAST_TIME >= p->sc->tp->piece_length)
+		return (PIECE_SPEED_FAST);
+	return (PIECE_SPEED_SLOW);
 }
 
 /*
  * scheduler_piece_cmp()
  *
- * Used by qsort()
+ * Used by qsort().  Higher priority pieces first, rarest first within
+ * each priority.
  */
 static int
 scheduler_piece_cmp(const void *a, const void *b)
@@ -104,6 +151,8 @@ scheduler_piece_cmp(const void *a, const void *b)
 	x = a;
 	y = b;
 
+	if (x->priority != y->priority)
+		return (y->priority - x->priority);
 	return (x->count - y->count);
 
 }
@@ -121,38 +170,41 @@ scheduler_peer_cmp(const void *a, const void *b)
 	x = a;
 	y = b;
 
-	return (y->rate - x->rate);
+	/* rates are 64 bit, so the difference may not fit in an int */
+	if (x->rate == y->rate)
+		return (0);
+	return (y->rate > x->rate ? 1 : -1);
 
 }
 
 /*
  * scheduler_peer_speedrank()
  *
- * For a given session return an array of peers sorted by their download speeds.
+ * Return an array of the live peers interested in our pieces, sorted by how
+ * fast they send to us, or by how fast we send to them if we are just
+ * seeding, and their number in <npeers>.
  */
 static struct peercounter *
-scheduler_peer_speedrank(struct session *sc)
+scheduler_peer_speedrank(struct session *sc, u_int32_t *npeers)
 {
 	struct peer *p;
 	struct peercounter *peers;
-	u_int32_t i = 0;
+	u_int32_t n = 0;
+	int seeding;
 
+	seeding = sc->tp->wanted_left == 0;
 	peers = xcalloc(sc->num_peers, sizeof(*peers));
 	TAILQ_FOREACH(p, &sc->peers, peer_list) {
-		peers[i].peer = p;
-		if (p->state & PEER_STATE_INTERESTED) {
-			peers[i].rate = network_peer_rxrate(p);
-			/* kind of a hack so we don't unchoke
-			 * un-interested peers */
-			if (peers[i].rate == 0)
-				peers[i].rate = 1;
-		}
-		i++;
+		if (!(p->state & PEER_STATE_INTERESTED)
+		    || p->state & PEER_STATE_DEAD)
+			continue;
+		peers[n].peer = p;
+		peers[n].rate = seeding ? network_peer_txrate(p)
+		    : network_peer_rxrate(p);
+		n++;
 	}
-	if (i != sc->num_peers)
-		errx(1, "scheduler_peer_speedrank: peer number mismatch (i: %u num_peers: %u)", i, sc->num_peers);
-
-	qsort(peers, sc->num_peers, sizeof(*peers), scheduler_peer_cmp);
+	qsort(peers, n, sizeof(*peers), scheduler_peer_cmp);
+	*npeers = n;
 
 	return (peers);
 }
@@ -190,6 +242,7 @@ scheduler_piece_rarityarray(struct session *sc)
 
 		pieces[pos].count = count;
 		pieces[pos].idx = i;
+		pieces[pos].priority = torrent_piece_find(sc->tp, i)->priority;
 		pos++;
 	}
 	/* sort the rarity array */
@@ -202,8 +255,32 @@ scheduler_piece_rarityarray(struct session *sc)
 	sc->rarity_array = pieces;
 }
 
+/*
+ * scheduler_piece_suspect_busy()
+ *
+ * Is <tpp> a suspect piece which some peer other than <peer> is fetching?
+ * Only one peer may be on a suspect piece, so that we know who to blame
+ * if it fails again.
+ * Returns 1 if true, zero if false.
+ */
+static int
+scheduler_piece_suspect_busy(struct peer *peer, struct torrent_piece *tpp)
+{
+	struct piece_dl *pd;
+
+	if (!(tpp->flags & TORRENT_PIECE_SUSPECT) || tpp->dl_blocks == 0
+	    || tpp->speed == PIECE_SPEED_NONE)
+		return (0);
+	TAILQ_FOREACH(pd, &peer->peer_piece_dls, peer_piece_dl_list)
+		if (pd->idx == tpp->index)
+			return (0);
+
+	return (1);
+}
+
 #define FIND_RAREST_IGNORE_ASSIGNED	0
 #define FIND_RAREST_ABSOLUTE		1
+#define FIND_RAREST_UNSTARTED		2
 /*
  * scheduler_piece_find_rarest()
  *
@@ -228,14 +305,25 @@ scheduler_piece_find_rarest(struct peer *p, int flag, int *res)
 	for (i = 0; i < p->sc->tp->num_pieces; i++) {
 		/* if this peer doesn't have this piece, skip it */
 		if (p->bitfield != NULL
-		    && !util_getbit(p->bitfield, i))
+		    && !util_getbit(p->bitfield, pieces[i].idx))
 			continue;
 		tpp = torrent_piece_find(p->sc->tp, pieces[i].idx);
-		/* if we have this piece, skip it */
-		if (tpp->flags & TORRENT_PIECE_CKSUMOK) {
+		/* if we have this piece, or don't want it, skip it */
+		if (tpp->flags & TORRENT_PIECE_CKSUMOK
+		    || tpp->priority == TORRENT_PRIORITY_SKIP) {
 			continue;
 		}
-		if (flag == FIND_RAREST_IGNORE_ASSIGNED) {
+		if (scheduler_piece_suspect_busy(p, tpp))
+			continue;
+		if (flag == FIND_RAREST_UNSTARTED) {
+			/* skip pieces anyone has asked for blocks of */
+			if (tpp->dl_blocks > 0) {
+				continue;
+			} else {
+				found = 1;
+				break;
+			}
+		} else if (flag == FIND_RAREST_IGNORE_ASSIGNED) {
 			/* if this piece and all its blocks are already
 			 * assigned to a peer and worked on skip it */
 			if (scheduler_piece_assigned(p->sc, tpp)) {
@@ -267,8 +355,8 @@ scheduler_threshold_kill(struct peer *p)
 {
 	if ((p->state & PEER_STATE_BITFIELD || p->state & PEER_STATE_ESTABLISHED)
 	    && network_peer_lastcomms(p) >= PEER_COMMS_THRESHOLD) {
-		trace("comms threshold exceeded for peer %s:%d",
-		    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+		trace("comms threshold exceeded for peer %s",
+		    print_host(&p->sa));
 		p->state = 0;
 		p->state |= PEER_STATE_DEAD;
 		return (0);
@@ -278,22 +366,113 @@ scheduler_threshold_kill(struct peer *p)
 }
 
 /*
- * scheduler_dequeue_uploads()
+ * scheduler_upload_fill()
  *
- * Dequeue a piece to peer, if there is one waiting.
+ * Top up the upload token bucket for the time since it was last filled.
+ * It holds a second's worth, or at least a block.  Time which did not add
+ * up to a whole token is left to count towards the next.
  */
 static void
-scheduler_dequeue_uploads(struct peer *p)
+scheduler_upload_fill(struct session *sc)
 {
-	struct piece_ul *pu;
-	/* honour one upload */
-	if ((pu = network_piece_ul_dequeue(p)) != NULL) {
-		trace("dequeuing piece to peer %s:%d",
-		    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
-		network_peer_write_piece(p, pu->idx, pu->off, pu->len);
-		xfree(pu);
-		pu = NULL;
+	struct timeval now, diff;
+	u_int64_t usec, add;
+
+	gettimeofday(&now, NULL);
+	if (!timerisset(&sc->tx_filled)) {
+		sc->tx_filled = now;
+		sc->tx_tokens = BLOCK_SIZE;
+		return;
 	}
+	timersub(&now, &sc->tx_filled, &diff);
+	usec = (u_int64_t)diff.tv_sec * 1000000 + diff.tv_usec;
+	if ((add = usec * sc->txlimit / 1000000) == 0)
+		return;
+	usec = add * 1000000 / sc->txlimit;
+	diff.tv_sec = usec / 1000000;
+	diff.tv_usec = usec % 1000000;
+	timeradd(&sc->tx_filled, &diff, &sc->tx_filled);
+	sc->tx_tokens = MIN(sc->tx_tokens + add, MAX(sc->txlimit, BLOCK_SIZE));
+}
+
+/*
+ * scheduler_upload_wait()
+ *
+ * There should be tokens enough for the next block by now.
+ */
+static void
+scheduler_upload_wait(int fd, short type, void *arg)
+{
+	struct session *sc = arg;
+
+	sc->upload_waiting = 0;
+	scheduler_upload(sc);
+}
+
+/*
+ * scheduler_upload()
+ *
+ * Send queued blocks to the peers whose output buffers have drained below
+ * UPLOAD_LOWAT, by deficit round robin: on each turn a peer may send
+ * another UPLOAD_QUANTUM bytes, or UPLOAD_QUANTUM_CHOKED if we choke it and
+ * it only gets its allowed fast pieces, keeping what it doesn't use for
+ * as long as it has requests waiting.  Under an upload limit each block
+ * also takes tokens, and once they run out we wait for enough to build up.
+ */
+void
+scheduler_upload(struct session *sc)
+{
+	struct peer *p;
+	struct piece_ul *pu;
+	struct timeval tv;
+	u_int64_t usec;
+	int busy;
+
+	if (sc->upload_waiting)
+		return;
+	if (sc->txlimit != 0)
+		scheduler_upload_fill(sc);
+	do {
+		busy = 0;
+		TAILQ_FOREACH(p, &sc->peers, peer_list) {
+			if (TAILQ_EMPTY(&p->peer_piece_uls) || p->bufev == NULL
+			    || p->state & PEER_STATE_DEAD) {
+				p->ul_deficit = 0;
+				continue;
+			}
+			if (EVBUFFER_LENGTH(EVBUFFER_OUTPUT(p->bufev))
+			    >= UPLOAD_LOWAT)
+				continue;
+			busy = 1;
+			p->ul_deficit += p->state & PEER_STATE_AMCHOKING
+			    ? UPLOAD_QUANTUM_CHOKED : UPLOAD_QUANTUM;
+			while ((pu = TAILQ_FIRST(&p->peer_piece_uls)) != NULL
+			    && pu->len <= p->ul_deficit
+			    && EVBUFFER_LENGTH(EVBUFFER_OUTPUT(p->bufev))
+			    < UPLOAD_LOWAT) {
+				if (sc->txlimit != 0 && sc->tx_tokens < pu->len) {
+					usec = (pu->len - sc->tx_tokens) * 1000000
+					    / sc->txlimit + 1;
+					tv.tv_sec = usec / 1000000;
+					tv.tv_usec = usec % 1000000;
+					evtimer_set(&sc->upload_event,
+					    scheduler_upload_wait, sc);
+					evtimer_add(&sc->upload_event, &tv);
+					sc->upload_waiting = 1;
+					return;
+				}
+				pu = network_piece_ul_dequeue(p);
+				network_peer_write_piece(p, pu->idx, pu->off,
+				    pu->len);
+				p->ul_deficit -= pu->len;
+				if (sc->txlimit != 0)
+					sc->tx_tokens -= pu->len;
+				xfree(pu);
+			}
+			if (TAILQ_EMPTY(&p->peer_piece_uls))
+				p->ul_deficit = 0;
+		}
+	} while (busy);
 }
 
 /*
@@ -318,6 +497,8 @@ scheduler_reap_dead(struct session *sc, struct peer *p)
  * scheduler_fill_requests()
  *
  * If peer is not choked, make sure it has enough requests in its queue.
+ * A choked peer which gave us an allowed fast set gets requests for the
+ * pieces in that set.
  */
 static void
 scheduler_fill_requests(struct session *sc, struct peer *p)
@@ -325,11 +506,13 @@ scheduler_fill_requests(struct session *sc, struct peer *p)
 	struct piece_dl *pd;
 	u_int64_t peer_rate;
 	u_int32_t pieces_left, queue_len, i;
-	int hint = 0;
+	int hint = 0, flags = 0;
 
-	pieces_left = sc->tp->num_pieces - sc->tp->good_pieces;
+	pieces_left = sc->tp->wanted_left;
 
-	if (!(p->state & PEER_STATE_CHOKED)
+	if (p->state & PEER_STATE_CHOKED && p->allowed_fast != NULL)
+		flags = PIECE_GIMME_ALLOWEDFAST;
+	if ((!(p->state & PEER_STATE_CHOKED) || flags != 0)
 	    && pieces_left > 0) {
 		peer_rate = network_peer_rxrate(p);
 		/* for each 10k/sec on this peer, add a request. */
@@ -351,7 +534,7 @@ scheduler_fill_requests(struct session *sc, struct peer *p)
 		}
 
 		for (i = 0; i < queue_len; i++) {
-			pd = scheduler_piece_gimme(p, 0, &hint);
+			pd = scheduler_piece_gimme(p, flags, &hint);
 			/* probably means no bitfield from this peer yet, or all requests are in transit. give it some time. */
 			if (pd == NULL)
 				continue;
@@ -362,135 +545,384 @@ scheduler_fill_requests(struct session *sc, struct peer *p)
 }
 
 /*
- * scheduler_choke_algorithm()
+ * scheduler_upload_slots()
  *
- * Every 10 seconds, sort peers by speed and unchoke the 3 fastest.
+ * With a known upload capacity, tune the number of regular unchokes to fill
+ * it: open another slot while there is capacity to spare and someone to
+ * give it to, and close one when we are full and the slowest unchoked peer
+ * gets less than half its share, which means the capacity is spread too thin.
  */
 static void
-scheduler_choke_algorithm(struct session *sc, time_t *now)
+scheduler_upload_slots(struct session *sc, struct peercounter *pc,
+    u_int32_t npeers)
 {
-	struct peer *p, *p2;
-	struct peercounter *pc;
-	u_int32_t i;
-	int j, k, num_interested;
-
-	p = p2 = NULL;
+	struct peer *p;
+	u_int64_t total;
+	u_int32_t n;
 
-	if ((*now % 10) != 0)
+	if (sc->txlimit == 0)
 		return;
-	pc = scheduler_peer_speedrank(sc);
-	for (i = 0; i < MIN(3, sc->num_peers); i++) {
-		/* if this peer is already unchoked, leave it */
-		if (!(pc[i].peer->state & PEER_STATE_AMCHOKING))
-			continue;
-		/* don't unchoke peers who have not expressed interest */
-		if (!(pc[i].peer->state & PEER_STATE_INTERESTED))
-			continue;
-		/* now we can unchoke this one */
-		trace("fastest unchoke");
-		network_peer_write_unchoke(pc[i].peer);
+	total = 0;
+	TAILQ_FOREACH(p, &sc->peers, peer_list)
+		total += network_peer_txrate(p);
+	n = MIN(sc->upload_slots, npeers);
+	if (total < (u_int64_t)sc->txlimit * 9 / 10) {
+		if (npeers > sc->upload_slots
+		    && sc->upload_slots < UPLOAD_SLOTS_MAX)
+			sc->upload_slots++;
+	} else if (n > 0 && sc->upload_slots > UPLOAD_SLOTS_MIN
+	    && network_peer_txrate(pc[n - 1].peer)
+	    < sc->txlimit / sc->upload_slots / 2) {
+		sc->upload_slots--;
 	}
-	if ((*now % 30) == 0 ) {
-		num_interested = 0;
-		TAILQ_FOREACH(p2, &sc->peers, peer_list) {
-			if (p2->state & PEER_STATE_INTERESTED)
-				num_interested++;
-		}
-		if (num_interested > 0) {
+	trace("scheduler_upload_slots() %llu of %u bytes/sec, %u slots",
+	    (unsigned long long)total, sc->txlimit, sc->upload_slots);
+}
+
+/*
+ * scheduler_optimistic_unchoke()
+ *
+ * Pick a new optimistic unchoke at random from the interested peers which
+ * aren't in the first <nslots> of <pc>, preferring one we have been choking.
+ */
+static void
+scheduler_optimistic_unchoke(struct session *sc, struct peercounter *pc,
+    u_int32_t npeers, u_int32_t nslots)
+{
+	struct peer *choked, *unchoked;
+	u_int32_t i, nchoked, nunchoked;
+
+	choked = unchoked = NULL;
+	nchoked = nunchoked = 0;
+	for (i = nslots; i < npeers; i++) {
+		if (pc[i].peer == sc->optimistic)
+			continue;
+		/* reservoir sample one of each kind */
+		if (pc[i].peer->state & PEER_STATE_AMCHOKING) {
 #ifdef __OpenBSD__
-			j = arc4random_uniform(num_interested);
+			if (arc4random_uniform(++nchoked) == 0)
 #else
-			j = random() % num_interested;
+			if (random() % ++nchoked == 0)
 #endif
-			p2 = TAILQ_FIRST(&sc->peers);
-			for (k = 0; k < j; k++) {
-				if (p2 == NULL)
-					errx(1, "NULL peer");
-				if (!(pc->peer->state & PEER_STATE_INTERESTED)) {
-					p2 = TAILQ_NEXT(p2, peer_list);
-					continue;
-				}
-			}
-			trace("opportunistic unchoke");
-			network_peer_write_unchoke(p2);
+				choked = pc[i].peer;
+		} else {
+#ifdef __OpenBSD__
+			if (arc4random_uniform(++nunchoked) == 0)
+#else
+			if (random() % ++nunchoked == 0)
+#endif
+				unchoked = pc[i].peer;
 		}
 	}
-	/* choke any peers except for three fastest, and the one randomly selected */
+	if (choked != NULL)
+		sc->optimistic = choked;
+	else if (unchoked != NULL)
+		sc->optimistic = unchoked;
+	if (sc->optimistic != NULL)
+		trace("scheduler_optimistic_unchoke() %s",
+		    print_host(&sc->optimistic->sa));
+}
+
+/*
+ * scheduler_choke_algorithm()
+ *
+ * Every CHOKE_INTERVAL seconds, unchoke the upload_slots interested peers
+ * which have been fastest lately, plus one more picked at random, which
+ * moves on every OPTIMISTIC_INTERVAL seconds.  Choke everyone else.
+ */
+static void
+scheduler_choke_algorithm(struct session *sc, time_t *now)
+{
+	struct peer *p;
+	struct peercounter *pc;
+	u_int32_t i, npeers, nslots;
+	int keep;
+
+	if ((*now % CHOKE_INTERVAL) != 0)
+		return;
+	pc = scheduler_peer_speedrank(sc, &npeers);
+	scheduler_upload_slots(sc, pc, npeers);
+	nslots = MIN(sc->upload_slots, npeers);
+	/* the optimistic unchoke goes if it lost interest or earned a slot */
+	if (sc->optimistic != NULL) {
+		for (i = 0; i < npeers; i++)
+			if (pc[i].peer == sc->optimistic)
+				break;
+		if (i < nslots || i == npeers)
+			sc->optimistic = NULL;
+	}
+	if (sc->optimistic == NULL || (*now % OPTIMISTIC_INTERVAL) == 0)
+		scheduler_optimistic_unchoke(sc, pc, npeers, nslots);
+
+	TAILQ_FOREACH(p, &sc->peers, peer_list) {
+		keep = p == sc->optimistic;
+		for (i = 0; i < nslots && !keep; i++)
+			if (p == pc[i].peer)
+				keep = 1;
+		if (keep && p->state & PEER_STATE_AMCHOKING) {
+			trace("scheduler_choke_algorithm() unchoking %s",
+			    print_host(&p->sa));
+			network_peer_write_unchoke(p);
+		} else if (!keep && !(p->state & PEER_STATE_AMCHOKING)) {
+			network_peer_write_choke(p);
+		}
+	}
+	xfree(pc);
+}
+
+/*
+ * scheduler_peer_rxrank()
+ *
+ * Return an array of the unchoked peers we know the pieces of, sorted by
+ * how fast they send to us, and their number in <npeers>.
+ */
+static struct peercounter *
+scheduler_peer_rxrank(struct session *sc, u_int32_t *npeers)
+{
+	struct peercounter *peers;
+	struct peer *p;
+	u_int32_t n = 0;
+
+	peers = xcalloc(sc->num_peers, sizeof(*peers));
 	TAILQ_FOREACH(p, &sc->peers, peer_list) {
-		int c = 0;
-		/* don't try to choke any of the peers
-		 * we just unchoked above */
-		for (i = 0; i < MIN(3, sc->num_peers); i++) {
-			if (p == pc[i].peer || p == p2) {
-				c = 1;
+		if (p->bitfield == NULL
+		    || p->state & (PEER_STATE_CHOKED|PEER_STATE_DEAD))
+			continue;
+		peers[n].peer = p;
+		peers[n].rate = network_peer_rxrate(p);
+		n++;
+	}
+	qsort(peers, n, sizeof(*peers), scheduler_peer_cmp);
+	*npeers = n;
+
+	return (peers);
+}
+
+/*
+ * scheduler_request_block()
+ *
+ * Request the block at offset <off> of piece <tpp> from more of the
+ * <npeers> peers in <peers> which have it, in order, until it is
+ * requested from <max> of them.  Whichever copy arrives first wins, and
+ * the other requests for it are cancelled.
+ */
+static void
+scheduler_request_block(struct session *sc, struct peercounter *peers,
+    u_int32_t npeers, struct torrent_piece *tpp, u_int32_t off, u_int32_t max)
+{
+	struct peer *p;
+	struct piece_dl *pd;
+	u_int32_t j, len, reqs;
+	int done, found;
+
+	/* skipped pieces are never fetched, whoever asks */
+	if (tpp->priority == TORRENT_PRIORITY_SKIP)
+		return;
+	reqs = network_piece_dl_requests(sc, tpp->index, off, &done, NULL);
+	for (j = 0; j < npeers && !done && reqs < max; j++) {
+		p = peers[j].peer;
+		if (!util_getbit(p->bitfield, tpp->index)
+		    || p->dl_queue_len >= MAX_REQUESTS
+		    || scheduler_piece_suspect_busy(p, tpp))
+			continue;
+		/* is this block offset already queued on this peer? */
+		found = 0;
+		TAILQ_FOREACH(pd, &p->peer_piece_dls, peer_piece_dl_list) {
+			if (pd->idx == tpp->index && pd->off == off) {
+				found = 1;
 				break;
 			}
 		}
-		if (c)
+		if (found)
 			continue;
-		if (!(p->state & PEER_STATE_AMCHOKING))
-			network_peer_write_choke(p);
+		if (BLOCK_SIZE > tpp->len - off) {
+			len = tpp->len - off;
+		} else {
+			len = BLOCK_SIZE;
+		}
+		pd = network_piece_dl_create(p, tpp->index, off, len);
+		trace("choosing extra dl (tpp->len %u) len %u idx %u off %u from peer %s",
+		    tpp->len, len, tpp->index, off, print_host(&p->sa));
+		network_peer_request_block(pd->pc, pd->idx, pd->off, pd->len);
+		p->dl_queue_len++;
+		reqs++;
 	}
-	xfree(pc);
 }
 
 /*
  * scheduler_endgame_algorithm()
  *
- * Endgame handling.
+ * Endgame handling.  Every block still missing is requested from up to
+ * ENDGAME_MAX_REQUESTS peers which have it, the fastest unchoked ones
+ * first.
  */
 static void
 scheduler_endgame_algorithm(struct session *sc)
 {
 	struct torrent_piece *tpp;
-	struct peer *p;
-	struct piece_dl *pd;
-	u_int32_t i, off, len;
-	int found;
+	struct peercounter *peers;
+	u_int32_t i, npeers, off;
 
+	peers = scheduler_peer_rxrank(sc, &npeers);
 	/* find incomplete pieces */
-	for (i = 0; i < sc->tp->num_pieces; i++) {
+	for (i = 0; i < sc->tp->num_pieces && npeers > 0; i++) {
 		if ((tpp = torrent_piece_find(sc->tp, i)) == NULL)
 			errx(1, "scheduler(): torrent_piece_find");
-		if (tpp->flags & TORRENT_PIECE_CKSUMOK)
+		if (tpp->flags & TORRENT_PIECE_CKSUMOK
+		    || tpp->priority == TORRENT_PRIORITY_SKIP)
 			continue;
-		/* which peers have it? */
 		trace("we still need piece idx %u", i);
-		TAILQ_FOREACH(p, &sc->peers, peer_list) {
-			if (p->bitfield == NULL
-			    || util_getbit(p->bitfield, i))
+		for (off = 0; off < tpp->len; off += BLOCK_SIZE)
+			scheduler_request_block(sc, peers, npeers, tpp, off,
+			    ENDGAME_MAX_REQUESTS);
+	}
+	xfree(peers);
+}
+
+/*
+ * scheduler_stream_seek()
+ *
+ * Move the playback position to byte <off> of the torrent, turning on
+ * streaming mode if it isn't already.
+ */
+void
+scheduler_stream_seek(struct session *sc, off_t off)
+{
+	off_t len;
+
+	len = (off_t)sc->tp->piece_length * (sc->tp->num_pieces - 1)
+	    + torrent_piece_find(sc->tp, sc->tp->num_pieces - 1)->len;
+	if (off < 0)
+		off = 0;
+	else if (off >= len)
+		off = len - 1;
+	trace("scheduler_stream_seek() to offset %jd, piece %u", (intmax_t)off,
+	    (u_int32_t)(off / sc->tp->piece_length));
+	sc->streaming = 1;
+	sc->stream_pos = off;
+}
+
+/*
+ * scheduler_stream_window()
+ *
+ * Fill <window> with the first STREAM_WINDOW pieces we still need from
+ * the playback position on, in order, and return how many there are.
+ * The window slides along as its first pieces come in.
+ */
+static u_int32_t
+scheduler_stream_window(struct session *sc, u_int32_t *window)
+{
+	struct torrent_piece *tpp;
+	u_int32_t i, n = 0;
+
+	for (i = sc->stream_pos / sc->tp->piece_length;
+	    i < sc->tp->num_pieces && n < STREAM_WINDOW; i++) {
+		tpp = torrent_piece_find(sc->tp, i);
+		if (!(tpp->flags & TORRENT_PIECE_CKSUMOK)
+		    && tpp->priority != TORRENT_PRIORITY_SKIP)
+			window[n++] = i;
+	}
+
+	return (n);
+}
+
+/*
+ * scheduler_stream_algorithm()
+ *
+ * Streaming mode deadlines.  The blocks of the first piece in the window
+ * are due STREAM_DEADLINE seconds after they are requested, those of each
+ * later piece STREAM_DEADLINE_STEP seconds after that.  A block which
+ * misses its deadline is requested again from the fastest unchoked peer
+ * not already asked for it.
+ *
+ * Also work out how fast a peer has to be to get window pieces at all.
+ */
+static void
+scheduler_stream_algorithm(struct session *sc)
+{
+	struct torrent_piece *tpp;
+	struct peercounter *peers;
+	u_int32_t window[STREAM_WINDOW], i, n, npeers, off, reqs;
+	time_t now, newest;
+	int done;
+
+	peers = scheduler_peer_rxrank(sc, &npeers);
+	sc->stream_min_rate = npeers >= STREAM_PEERS
+	    ? peers[STREAM_PEERS - 1].rate : 0;
+	now = time(NULL);
+	n = scheduler_stream_window(sc, window);
+	for (i = 0; i < n; i++) {
+		tpp = torrent_piece_find(sc->tp, window[i]);
+		for (off = 0; off < tpp->len; off += BLOCK_SIZE) {
+			reqs = network_piece_dl_requests(sc, window[i], off,
+			    &done, &newest);
+			/* not asked for yet, the picker sees to those */
+			if (done || reqs == 0 || reqs >= STREAM_MAX_REQUESTS)
 				continue;
-			if (p->state & PEER_STATE_CHOKED) {
-				trace("    (choked) peer %s:%d has it",
-				    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
+			if (now - newest < STREAM_DEADLINE
+			    + (time_t)i * STREAM_DEADLINE_STEP)
 				continue;
-			}
-			trace("    (unchoked) peer %s:%d has it",
-			    inet_ntoa(p->sa.sin_addr), ntohs(p->sa.sin_port));
-			/* find the un-queued pieces */
-			for (off = 0; off < tpp->len; off += BLOCK_SIZE) {
-				found = 0;
-				/* is this block offset already queued on this peer? */
-				TAILQ_FOREACH(pd, &p->peer_piece_dls, peer_piece_dl_list) {
-					if (pd->idx == i && pd->off == off) {
-						found = 1;
-						break;
-					}
-				}
-				if (found)
-					continue;
-				if (BLOCK_SIZE > tpp->len - off) {
-					len = tpp->len - off;
-				} else {
-					len = BLOCK_SIZE;
-				}
-				pd = network_piece_dl_create(p, i, off, len);
-				trace("choosing endgame dl (tpp->len %u) len %u idx %u off %u", tpp->len, len, i, off);
-				network_peer_request_block(pd->pc, pd->idx, pd->off, pd->len);
-				p->dl_queue_len++;
-			}
+			trace("scheduler_stream_algorithm() idx %u off %u is late",
+			    window[i], off);
+			scheduler_request_block(sc, peers, npeers, tpp, off,
+			    reqs + 1);
 		}
 	}
+	xfree(peers);
+}
+
+/*
+ * scheduler_priority_set()
+ *
+ * Change file priorities as torrent_priority_set() does, and bring what
+ * the scheduler knows about wanted pieces up to date.  Returns -1 if
+ * <spec> is malformed, 0 otherwise.
+ */
+int
+scheduler_priority_set(struct session *sc, const char *spec)
+{
+	int ret;
+
+	if ((ret = torrent_priority_set(sc->tp, spec)) == -1) {
+		trace("scheduler_priority_set() %s (malformed)", spec);
+		return (-1);
+	}
+	trace("scheduler_priority_set() %s, %u pieces wanted", spec,
+	    sc->tp->wanted_left);
+	network_piece_dl_recount(sc);
+	/* re-sort the rarity array before it is next used */
+	sc->last_rarity = 0;
+
+	return (ret);
+}
+
+/*
+ * scheduler_piece_usable()
+ *
+ * Could we request blocks of piece <idx> from <peer>?  It has to have the
+ * piece, we must not, and want it, and not all its blocks may be requested
+ * already, nor may it be a suspect piece some other peer is fetching.
+ * With PIECE_GIMME_ALLOWEDFAST, the piece must also be in the peer's
+ * allowed fast set.
+ */
+static int
+scheduler_piece_usable(struct peer *peer, int flags, u_int32_t idx)
+{
+	struct torrent_piece *tpp;
+
+	if (peer->bitfield == NULL || !util_getbit(peer->bitfield, idx))
+		return (0);
+	if (flags & PIECE_GIMME_ALLOWEDFAST
+	    && (peer->allowed_fast == NULL
+	    || !util_getbit(peer->allowed_fast, idx)))
+		return (0);
+	tpp = torrent_piece_find(peer->sc->tp, idx);
+	if (tpp->flags & TORRENT_PIECE_CKSUMOK
+	    || tpp->priority == TORRENT_PRIORITY_SKIP)
+		return (0);
+	if (scheduler_piece_suspect_busy(peer, tpp))
+		return (0);
+	return (!scheduler_piece_assigned(peer->sc, tpp));
 }
 
 /*
@@ -503,28 +935,71 @@ scheduler_piece_gimme(struct peer *peer, int flags, int *hint)
 {
 	struct torrent_piece *tpp;
 	struct piece_dl *pd;
-	struct piece_dl_idxnode *pdin;
 	u_int32_t i, j, idx, len, off, *pieces, peerpieces;
-	int res;
+	u_int32_t window[STREAM_WINDOW];
+	int res, speed;
 
 	res = 0;
 	idx = off = 0;
 	tpp = NULL;
 
-	/* if we have some blocks in a piece, try to complete that same piece */
-	RB_FOREACH(pdin, piece_dl_by_idxoff, &peer->sc->piece_dl_by_idxoff) {
-		tpp = torrent_piece_find(peer->sc->tp, pdin->idx);
-		if (!(tpp->flags & TORRENT_PIECE_CKSUMOK)) {
-			/* if not all this piece's blocks are in the download
-			 * queue and this peer actually has this piece */
-			if (!scheduler_piece_assigned(peer->sc, tpp)
-			    && peer->bitfield != NULL
-			    && util_getbit(peer->bitfield, pdin->idx)) {
-				idx = pdin->idx;
+	/* streaming mode: the fastest peers get the window pieces, in order */
+	if (peer->sc->streaming && !(flags & PIECE_GIMME_ALLOWEDFAST)
+	    && network_peer_rxrate(peer) >= peer->sc->stream_min_rate) {
+		len = scheduler_stream_window(peer->sc, window);
+		for (i = 0; i < len; i++) {
+			if (scheduler_piece_usable(peer, flags, window[i])) {
+				idx = window[i];
+				tpp = torrent_piece_find(peer->sc->tp, idx);
 				goto get_block;
 			}
 		}
 	}
+	/* carry on with the pieces this peer has started, so that each
+	 * piece comes from as few peers as possible */
+	TAILQ_FOREACH(pd, &peer->peer_piece_dls, peer_piece_dl_list) {
+		if (scheduler_piece_usable(peer, flags, pd->idx)) {
+			idx = pd->idx;
+			tpp = torrent_piece_find(peer->sc->tp, idx);
+			goto get_block;
+		}
+	}
+	/*
+	 * then other partial pieces: ones nobody is fetching any more, and
+	 * for a slow peer, ones other slow peers are on.  A fast peer would
+	 * rather start a piece of its own than hold up someone else's.
+	 */
+	speed = scheduler_peer_speed(peer);
+	TAILQ_FOREACH(tpp, &peer->sc->partial_pieces, partial) {
+		if (tpp->speed != PIECE_SPEED_NONE
+		    && (speed == PIECE_SPEED_FAST
+		    || tpp->speed != PIECE_SPEED_SLOW))
+			continue;
+		if (scheduler_piece_usable(peer, flags, tpp->index)) {
+			idx = tpp->index;
+			goto get_block;
+		}
+	}
+	/* a choked peer only lets us have its allowed fast pieces */
+	if (flags & PIECE_GIMME_ALLOWEDFAST) {
+		for (i = 0; i < peer->sc->tp->num_pieces; i++) {
+			if (scheduler_piece_usable(peer, flags, i)) {
+				idx = i;
+				tpp = torrent_piece_find(peer->sc->tp, idx);
+				goto get_block;
+			}
+		}
+		return (NULL);
+	}
+	/* then whatever the peer suggested, newest suggestion first */
+	for (i = peer->num_suggested; i > 0; i--) {
+		if (scheduler_piece_usable(peer, flags,
+		    peer->suggested[i - 1])) {
+			idx = peer->suggested[i - 1];
+			tpp = torrent_piece_find(peer->sc->tp, idx);
+			goto get_block;
+		}
+	}
 	/* first 4 pieces should be chosen randomly */
 	if (peer->sc->tp->good_pieces < 4 && peer->sc->tp->num_pieces > 4) {
 		/* check how many useful pieces this peer has */
@@ -533,18 +1008,19 @@ scheduler_piece_gimme(struct peer *peer, int flags, int *hint)
 			if (peer->bitfield != NULL
 			    && util_getbit(peer->bitfield, i)) {
 				tpp = torrent_piece_find(peer->sc->tp, i);
-				/* do we already have this piece? */
-				if (tpp->flags & TORRENT_PIECE_CKSUMOK)
+				/* do we already have, or not want, this piece? */
+				if (tpp->flags & TORRENT_PIECE_CKSUMOK
+				    || tpp->priority == TORRENT_PRIORITY_SKIP)
 					continue;
-				/* is it already assigned? */
-				if (scheduler_piece_assigned(peer->sc, tpp))
+				/* has anyone started on it? */
+				if (tpp->dl_blocks > 0)
 					continue;
 				peerpieces++;
 			}
 		}
-		/* peer has no pieces */
+		/* peer has no pieces nobody has started */
 		if (peerpieces == 0)
-			return (NULL);
+			goto share;
 		/* build array of pieces this peer has */
 		pieces = xcalloc(peerpieces, sizeof(*pieces));
 		j = 0;
@@ -552,11 +1028,12 @@ scheduler_piece_gimme(struct peer *peer, int flags, int *hint)
 			if (peer->bitfield != NULL
 			    && util_getbit(peer->bitfield, i)) {
 				tpp = torrent_piece_find(peer->sc->tp, i);
-				/* do we already have this piece? */
-				if (tpp->flags & TORRENT_PIECE_CKSUMOK)
+				/* do we already have, or not want, this piece? */
+				if (tpp->flags & TORRENT_PIECE_CKSUMOK
+				    || tpp->priority == TORRENT_PRIORITY_SKIP)
 					continue;
-				/* is it already assigned? */
-				if (scheduler_piece_assigned(peer->sc, tpp))
+				/* has anyone started on it? */
+				if (tpp->dl_blocks > 0)
 					continue;
 				pieces[j] = i;
 				j++;
@@ -570,20 +1047,30 @@ scheduler_piece_gimme(struct peer *peer, int flags, int *hint)
 #endif
 		xfree(pieces);
 		tpp = torrent_piece_find(peer->sc->tp, idx);
+		goto get_block;
 	} else {
-		/* find the rarest piece that does not have all its blocks
-		 * already in the download queue */
-		idx = scheduler_piece_find_rarest(peer, FIND_RAREST_IGNORE_ASSIGNED, &res);
-		/* there are no more pieces right now */
-		if (!res)
-			return (NULL);
-		tpp = torrent_piece_find(peer->sc->tp, idx);
+		/* find the rarest piece nobody has started */
+		idx = scheduler_piece_find_rarest(peer, FIND_RAREST_UNSTARTED, &res);
+		if (res) {
+			tpp = torrent_piece_find(peer->sc->tp, idx);
+			goto get_block;
+		}
 	}
+share:
+	/* failing that, the rarest piece that does not have all its blocks
+	 * already in the download queue, whoever else is on it */
+	idx = scheduler_piece_find_rarest(peer, FIND_RAREST_IGNORE_ASSIGNED, &res);
+	/* there are no more pieces right now */
+	if (!res)
+		return (NULL);
+	tpp = torrent_piece_find(peer->sc->tp, idx);
 get_block:
 	if (flags & PIECE_GIMME_NOCREATE) {
 		*hint = 1;
 		return (NULL);
 	}
+	if (tpp->speed == PIECE_SPEED_NONE)
+		tpp->speed = scheduler_peer_speed(peer);
 	/* find the next block (by offset) in the piece, which is not already
 	 * assigned to a peer */
 	for (off = 0; ; off += BLOCK_SIZE) {
@@ -597,7 +1084,7 @@ get_block:
 			/* piece dl exists, but it has been orphaned -> recycle
 			 * it */
 			trace("recycling dl (tpp->len %u) len %u idx %u off %u", tpp->len, pd->len, pd->idx, pd->off);
-			pd->pc = peer;
+			network_piece_dl_set_peer(peer->sc, pd, peer);
 			/* put it in this peer's list */
 			TAILQ_INSERT_TAIL(&peer->peer_piece_dls, pd, peer_piece_dl_list);
 			return (pd);
@@ -630,11 +1117,12 @@ scheduler(int fd, short type, void *arg)
 	struct piece_dl *pd;
 	struct piece_dl_idxnode *pdin;
 	u_int32_t pieces_left, reqs_outstanding, reqs_completed, reqs_orphaned;
-	u_int32_t choked, unchoked;
+	u_int32_t choked, unchoked, pex;
 	char tbuf[64];
 	time_t now;
 
 	reqs_outstanding = reqs_completed = reqs_orphaned = choked = unchoked = 0;
+	pex = 0;
 	p = NULL;
 	pd = NULL;
 	timerclear(&tv);
@@ -642,7 +1130,7 @@ scheduler(int fd, short type, void *arg)
 	evtimer_set(&sc->scheduler_event, scheduler, sc);
 	evtimer_add(&sc->scheduler_event, &tv);
 
-	pieces_left = sc->tp->num_pieces - sc->tp->good_pieces;
+	pieces_left = sc->tp->wanted_left;
 	if (!TAILQ_EMPTY(&sc->peers)) {
 		for (p = TAILQ_FIRST(&sc->peers); p; p = nxt) {
 			nxt = TAILQ_NEXT(p, peer_list);
@@ -655,27 +1143,51 @@ scheduler(int fd, short type, void *arg)
 				continue;
 			if (scheduler_threshold_kill(p) == 0)
 				continue;
-			scheduler_dequeue_uploads(p);
 			scheduler_fill_requests(sc, p);
+			if (p->pex_id != 0) {
+				pex_update(p);
+				pex++;
+			}
 		}
 	}
 	now = time(NULL);
 
 	scheduler_choke_algorithm(sc, &now);
+	/* should the write callbacks have missed anything */
+	scheduler_upload(sc);
+
+	if (sc->superseed)
+		superseed_update(sc);
+
+	if ((now % RESUME_SYNC_INTERVAL) == 0)
+		torrent_fastresume_sync(sc->tp);
+
+	if ((now % PEER_CACHE_INTERVAL) == 0)
+		network_peercache_save(sc);
+
+	if ((now % CACHE_NOTIFY_INTERVAL) == 0
+	    && sc->cache_hits + sc->cache_misses != sc->cache_notified) {
+		sc->cache_notified = sc->cache_hits + sc->cache_misses;
+		ctl_server_notify_cache(sc);
+	}
+
+	if (sc->streaming && pieces_left > 0)
+		scheduler_stream_algorithm(sc);
 
 	if (scheduler_is_endgame(sc))
 		scheduler_endgame_algorithm(sc);
 
-	/* try to get some more peers */
+	/*
+	 * try to get some more peers.  peers which exchange peer lists
+	 * should keep us supplied, so go easy on the tracker if we have any.
+	 */
 	if (sc->num_peers < PEERS_WANTED
 	    && pieces_left > 0
 	    && !sc->announce_underway
-	    && (now - sc->last_announce) > MIN_ANNOUNCE_INTERVAL) {
-		/* XXX: But what if the tracker really only has a small number of peers?
-		 * We will keep asking over and over, wasting resources.
-		 * This should be fixed */
+	    && (now - sc->last_announce) > (pex > 0 ? PEX_ANNOUNCE_INTERVAL
+	    : MIN_ANNOUNCE_INTERVAL)
+	    && !scheduler_swarm_exhausted(sc))
 		announce(sc, NULL);
-	}
 	/* print some trace info, if trace is enabled */
 	if (unworkable_trace == NULL)
 		return;
@@ -685,8 +1197,8 @@ scheduler(int fd, short type, void *arg)
 			reqs_orphaned++;
 			strlcpy(tbuf, " [orphaned] ", sizeof(tbuf));
 		} else if (pd->pc->connfd != 0) {
-			snprintf(tbuf, sizeof(tbuf), "assigned to: %s:%d",
-			    inet_ntoa(pd->pc->sa.sin_addr), ntohs(pd->pc->sa.sin_port));
+			snprintf(tbuf, sizeof(tbuf), "assigned to: %s",
+			    print_host(&pd->pc->sa));
 		}
 		if (pd->bytes != pd->len) {
 			reqs_outstanding++;
@@ -698,8 +1210,11 @@ scheduler(int fd, short type, void *arg)
 			trace("piece_dl: idx %u off: %u len: %u %s", pd->idx, pd->off, pd->len, tbuf);
 		}
 	}
-	trace("Peers: %u (c %u/u %u) Good pieces: %u/%u Reqs outstanding/orphaned/completed: %u/%u/%u",
+	trace("Peers: %u (c %u/u %u) Good pieces: %u/%u Partial: %u Reqs outstanding/orphaned/completed: %u/%u/%u Wasted: %llu Slots: %u Cache hits/misses: %llu/%llu",
 	      sc->num_peers, choked, unchoked, sc->tp->good_pieces, sc->tp->num_pieces,
-	      reqs_outstanding, reqs_orphaned, reqs_completed);
+	      sc->num_partial, reqs_outstanding, reqs_orphaned, reqs_completed,
+	      (unsigned long long)sc->wasted, sc->upload_slots,
+	      (unsigned long long)sc->cache_hits,
+	      (unsigned long long)sc->cache_misses);
 }
 
@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Periodic tracker scrape.
+ *
+ * Every scrape_interval seconds, all sessions whose swarm counts are stale
+ * are grouped by scrape URL, and each group is sent to its tracker as a
+ * single request carrying one info_hash parameter per torrent.  The
+ * seeder and leecher counts which come back are stored in the torrent.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include <event.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sha1.h>
+
+#include "includes.h"
+
+int scrape_interval = DEFAULT_SCRAPE_INTERVAL;
+
+static struct event	scrape_event;
+static int		scrape_running;
+/* minimum interval requested by trackers, if any */
+static int		scrape_min_interval;
+
+static void	scrape_update(int, short, void *);
+static void	scrape_schedule(void);
+static int	scrape_url(struct session *, char *, size_t, char *, size_t,
+		    char *, size_t);
+static void	scrape_handle_response(struct http_response *, void *);
+
+/*
+ * scrape_start()
+ *
+ * Start scraping, if it is enabled and not already running.  Called for
+ * each new session; all sessions share the one timer.
+ */
+void
+scrape_start(void)
+{
+	if (scrape_interval == 0 || scrape_running)
+		return;
+	scrape_running = 1;
+	evtimer_set(&scrape_event, scrape_update, NULL);
+	scrape_schedule();
+}
+
+/*
+ * scrape_schedule()
+ *
+ * Arm the scrape timer.
+ */
+static void
+scrape_schedule(void)
+{
+	struct timeval tv;
+
+	timerclear(&tv);
+	tv.tv_sec = MAX(scrape_interval, scrape_min_interval);
+	evtimer_add(&scrape_event, &tv);
+}
+
+/*
+ * scrape_url()
+ *
+ * Work out the scrape URL for a session from its announce URL, following
+ * the convention that the last path component starts with "announce",
+ * which is replaced by "scrape".  Returns -1 if the tracker does not
+ * support scrape.
+ */
+static int
+scrape_url(struct session *sc, char *host, size_t hostlen, char *port,
+    size_t portlen, char *path, size_t pathlen)
+{
+	char tail[MAXPATHLEN], query[MAXPATHLEN], *c, *q;
+
+	if (http_parse_url(sc->tp->announce, host, hostlen, port, portlen,
+	    path, pathlen) == -1)
+		return (-1);
+	/* only look at the path, keeping the query string for later */
+	query[0] = '\0';
+	if ((q = strchr(path, '?')) != NULL) {
+		if (strlcpy(query, q, sizeof(query)) >= sizeof(query))
+			return (-1);
+		*q = '\0';
+	}
+	/* as in announce(), ignore a trailing slash */
+	if ((c = strrchr(path, '/')) != NULL && c[1] == '\0' && c != path) {
+		*c = '\0';
+		c = strrchr(path, '/');
+	}
+	if (c == NULL)
+		return (-1);
+	c++;
+	if (strncmp(c, "announce", strlen("announce")) != 0)
+		return (-1);
+	if (strlcpy(tail, c + strlen("announce"), sizeof(tail))
+	    >= sizeof(tail))
+		return (-1);
+	*c = '\0';
+	if (strlcat(path, "scrape", pathlen) >= pathlen
+	    || strlcat(path, tail, pathlen) >= pathlen
+	    || strlcat(path, query, pathlen) >= pathlen)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * scrape_update()
+ *
+ * Called at scrape interval.  Batches up info_hashes of sessions which
+ * share a scrape URL, and fires off one request per batch.
+ */
+static void
+scrape_update(int fd, short type, void *arg)
+{
+	struct session *sc, *nsc;
+	char host[MAXHOSTNAMELEN], port[6], path[MAXPATHLEN];
+	char nhost[MAXHOSTNAMELEN], nport[6], npath[MAXPATHLEN];
+	char *request, hbuf[3*SHA1_DIGEST_LENGTH+1];
+	size_t len;
+	time_t now;
+	int i, l, n;
+
+	trace("scrape_update() called");
+	now = time(NULL);
+	request = xmalloc(GETSTRINGLEN);
+
+	/* decide what needs scraping this round */
+	TAILQ_FOREACH(sc, &sessions, session_list)
+		sc->scrape_pending = !sc->announce_underway
+		    && now - sc->last_announce >= scrape_interval
+		    && now - sc->tp->last_swarm_update >= scrape_interval;
+
+	TAILQ_FOREACH(sc, &sessions, session_list) {
+		if (!sc->scrape_pending)
+			continue;
+		if (scrape_url(sc, host, sizeof(host), port, sizeof(port),
+		    path, sizeof(path)) == -1) {
+			trace("scrape_update() no scrape url for %s",
+			    sc->tp->announce);
+			sc->scrape_pending = 0;
+			continue;
+		}
+		len = strlcpy(request, path, GETSTRINGLEN);
+		if (len >= GETSTRINGLEN)
+			continue;
+		n = 0;
+		for (nsc = sc; nsc != NULL && n < SCRAPE_MAX_HASHES;
+		    nsc = TAILQ_NEXT(nsc, session_list)) {
+			if (nsc != sc && (!nsc->scrape_pending
+			    || scrape_url(nsc, nhost, sizeof(nhost), nport,
+			    sizeof(nport), npath, sizeof(npath)) == -1
+			    || strcmp(host, nhost) != 0
+			    || strcmp(port, nport) != 0
+			    || strcmp(path, npath) != 0))
+				continue;
+			for (i = 0; i < SHA1_DIGEST_LENGTH; i++)
+				snprintf(&hbuf[3*i], sizeof(hbuf) - 3*i,
+				    "%%%02x", nsc->tp->info_hash[i]);
+			l = snprintf(request + len, GETSTRINGLEN - len,
+			    "%cinfo_hash=%s",
+			    n == 0 && strchr(path, '?') == NULL ? '?' : '&',
+			    hbuf);
+			/* no room; leave the rest for another request */
+			if (l == -1 || (size_t)l >= GETSTRINGLEN - len) {
+				request[len] = '\0';
+				break;
+			}
+			len += l;
+			nsc->scrape_pending = 0;
+			n++;
+		}
+		if (n == 0)
+			continue;
+		trace("scrape_update() scraping %d torrents from %s:%s", n,
+		    host, port);
+		if (http_get(host, port, request, scrape_handle_response,
+		    NULL) == -1)
+			trace("scrape_update() could not contact %s", host);
+	}
+	xfree(request);
+	scrape_schedule();
+}
+
+/*
+ * scrape_handle_response()
+ *
+ * Parse a scrape response, and update the swarm counts of every session
+ * it mentions.
+ */
+static void
+scrape_handle_response(struct http_response *res, void *arg)
+{
+	struct benc_node *node, *files, *troot;
+	struct session *sc;
+	time_t now;
+	BUF *buf;
+
+	if (res == NULL || res->code != HTTP_OK || res->bodylen == 0) {
+		trace("scrape_handle_response() scrape failed");
+		return;
+	}
+	buf = buf_wrap(res->body, res->bodylen);
+	troot = benc_root_create();
+	if (benc_parse_buf(buf, troot) == NULL) {
+		trace("scrape_handle_response() parsing failed");
+		goto out;
+	}
+	if ((node = benc_node_find(troot, "failure reason")) != NULL) {
+		if (node->flags & BSTRING)
+			trace("scrape failure: %s", node->body.string.value);
+		goto out;
+	}
+	if ((node = benc_node_find(troot, "min_request_interval")) != NULL
+	    && node->flags & BINT && node->body.number > 0
+	    && node->body.number < INT_MAX)
+		scrape_min_interval = node->body.number;
+	if ((files = benc_node_find(troot, "files")) == NULL
+	    || !(files->flags & BDICT)) {
+		trace("scrape_handle_response() no files dictionary");
+		goto out;
+	}
+
+	now = time(NULL);
+	/*
+	 * info_hash keys are binary, so benc_node_find() is no use here.
+	 * Compare the raw bytes, once the key is known to be long enough.
+	 */
+	TAILQ_FOREACH(node, &files->children, benc_nodes) {
+		if (!(node->flags & BDICT_ENTRY)
+		    || !(node->body.dict_entry.value->flags & BDICT)
+		    || node->body.dict_entry.keylen != SHA1_DIGEST_LENGTH)
+			continue;
+		TAILQ_FOREACH(sc, &sessions, session_list)
+			if (memcmp(node->body.dict_entry.key,
+			    sc->tp->info_hash, SHA1_DIGEST_LENGTH) == 0)
+				break;
+		if (sc == NULL)
+			continue;
+		torrent_swarm_update(sc->tp, node->body.dict_entry.value, now);
+		trace("scrape_handle_response() %s: %u seeders %u leechers",
+		    sc->tp->name, sc->tp->complete, sc->tp->incomplete);
+		ctl_server_notify_swarm(sc);
+	}
+out:
+	benc_node_freeall(troot);
+}
@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Super-seeding (BEP 16), for the first seed of a torrent.
+ *
+ * Rather than a bitfield, each peer is sent a HAVE for just one piece,
+ * the one fewest other peers have.  It is shown another once some other
+ * peer says it has the piece too, so that peers which pass pieces on are
+ * fed and peers which don't are not.  Once every piece has turned up in
+ * the swarm, we go back to seeding as usual.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+
+#include <event.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "includes.h"
+
+/* hide our pieces from the swarm while we are its only seed */
+int superseed_enabled = 0;
+
+static int	superseed_ready(struct peer *);
+static int	superseed_pick(struct peer *, u_int32_t *);
+static void	superseed_seen(struct session *, u_int32_t);
+static void	superseed_show(struct peer *);
+static void	superseed_stop(struct session *);
+
+/*
+ * superseed_start()
+ *
+ * Start super-seeding, if it is asked for and we have every piece.
+ */
+void
+superseed_start(struct session *sc)
+{
+	if (!superseed_enabled || sc->tp->good_pieces != sc->tp->num_pieces)
+		return;
+	trace("superseed_start() super-seeding %u pieces", sc->tp->num_pieces);
+	sc->superseed = 1;
+	sc->ss_seen = xcalloc((sc->tp->num_pieces + 7) / 8, 1);
+	sc->ss_seen_num = 0;
+}
+
+/*
+ * superseed_ready()
+ *
+ * Has this peer finished its handshake, so we can show it pieces?
+ */
+static int
+superseed_ready(struct peer *p)
+{
+	return (!(p->state & (PEER_STATE_HANDSHAKE1|PEER_STATE_HANDSHAKE2
+	    |PEER_STATE_SENDBITFIELD|PEER_STATE_DEAD)));
+}
+
+/*
+ * superseed_pick()
+ *
+ * Choose a piece to show peer <p>: one it lacks, which the fewest other
+ * peers have or have been shown, and which nobody has reported yet if
+ * there is a choice.  Returns 0 if there is nothing to show it.
+ */
+static int
+superseed_pick(struct peer *p, u_int32_t *idx)
+{
+	struct session *sc = p->sc;
+	struct peer *q;
+	u_int32_t i, j, n, start, score, best;
+
+	best = UINT_MAX;
+#ifdef __OpenBSD__
+	start = arc4random_uniform(sc->tp->num_pieces);
+#else
+	start = random() % sc->tp->num_pieces;
+#endif
+	for (j = 0; j < sc->tp->num_pieces && best > 0; j++) {
+		i = (start + j) % sc->tp->num_pieces;
+		if (p->bitfield != NULL && util_getbit(p->bitfield, i))
+			continue;
+		if (p->ss_state != SUPERSEED_NONE && p->ss_piece == i)
+			continue;
+		n = 0;
+		TAILQ_FOREACH(q, &sc->peers, peer_list) {
+			if (q->bitfield != NULL && util_getbit(q->bitfield, i))
+				n++;
+			else if (q->ss_state == SUPERSEED_SHOWN
+			    && q->ss_piece == i)
+				n++;
+		}
+		score = n * 2 + util_getbit(sc->ss_seen, i);
+		if (score < best) {
+			best = score;
+			*idx = i;
+		}
+	}
+
+	return (best != UINT_MAX);
+}
+
+/*
+ * superseed_show()
+ *
+ * Tell peer <p> we have one more piece.
+ */
+static void
+superseed_show(struct peer *p)
+{
+	u_int32_t idx;
+
+	if (!superseed_pick(p, &idx))
+		return;
+	trace("superseed_show() piece %u to peer %s", idx, print_host(&p->sa));
+	p->ss_piece = idx;
+	p->ss_state = SUPERSEED_SHOWN;
+	p->ss_time = time(NULL);
+	network_peer_write_have(p, idx);
+}
+
+/*
+ * superseed_seen()
+ *
+ * Some peer has piece <idx>.  Once every piece has been seen, the swarm
+ * has a full copy between them, and we can stop hiding ours.
+ */
+static void
+superseed_seen(struct session *sc, u_int32_t idx)
+{
+	if (util_getbit(sc->ss_seen, idx))
+		return;
+	util_setbit(sc->ss_seen, idx);
+	if (++sc->ss_seen_num == sc->tp->num_pieces)
+		superseed_stop(sc);
+}
+
+/*
+ * superseed_stop()
+ *
+ * Go back to seeding as usual: tell every peer about the pieces it lacks.
+ */
+static void
+superseed_stop(struct session *sc)
+{
+	struct peer *p;
+	u_int32_t i;
+
+	trace("superseed_stop() every piece is out, seeding as usual");
+	sc->superseed = 0;
+	xfree(sc->ss_seen);
+	sc->ss_seen = NULL;
+	TAILQ_FOREACH(p, &sc->peers, peer_list) {
+		if (!superseed_ready(p))
+			continue;
+		for (i = 0; i < sc->tp->num_pieces; i++) {
+			if (p->bitfield != NULL && util_getbit(p->bitfield, i))
+				continue;
+			if (p->ss_state != SUPERSEED_NONE && p->ss_piece == i)
+				continue;
+			network_peer_write_have(p, i);
+		}
+		p->ss_state = SUPERSEED_NONE;
+	}
+}
+
+/*
+ * superseed_have()
+ *
+ * Peer <p> says it has piece <idx>.  Anyone else we showed that piece to
+ * has passed it on, so is shown another.
+ */
+void
+superseed_have(struct peer *p, u_int32_t idx)
+{
+	struct session *sc = p->sc;
+	struct peer *q;
+
+	TAILQ_FOREACH(q, &sc->peers, peer_list) {
+		if (q == p || q->ss_state == SUPERSEED_NONE
+		    || q->ss_piece != idx || !superseed_ready(q))
+			continue;
+		trace("superseed_have() peer %s passed on piece %u",
+		    print_host(&q->sa), idx);
+		superseed_show(q);
+	}
+	if (p->ss_state == SUPERSEED_SHOWN && p->ss_piece == idx) {
+		p->ss_state = SUPERSEED_GOT;
+		p->ss_time = time(NULL);
+	}
+	/* this may end super-seeding, so do it last */
+	superseed_seen(sc, idx);
+}
+
+/*
+ * superseed_bitfield()
+ *
+ * Note the pieces a peer had when it connected.
+ */
+void
+superseed_bitfield(struct peer *p)
+{
+	struct session *sc = p->sc;
+	u_int32_t i;
+
+	for (i = 0; i < sc->tp->num_pieces && sc->superseed; i++)
+		if (util_getbit(p->bitfield, i))
+			superseed_seen(sc, i);
+}
+
+/*
+ * superseed_update()
+ *
+ * Called once a second.  Show a piece to peers which have seen none yet,
+ * and another to those whose last one has gone nowhere for SUPERSEED_WAIT
+ * seconds, so that a quiet swarm does not stall.
+ */
+void
+superseed_update(struct session *sc)
+{
+	struct peer *p;
+	time_t now;
+
+	now = time(NULL);
+	TAILQ_FOREACH(p, &sc->peers, peer_list) {
+		if (!superseed_ready(p))
+			continue;
+		if (p->ss_state == SUPERSEED_NONE
+		    || now - p->ss_time >= SUPERSEED_WAIT)
+			superseed_show(p);
+	}
+}
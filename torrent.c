@@ -20,6 +20,8 @@
 #include <sys/param.h>
 #include <sys/stat.h>
 
+#include <netinet/in.h>
+
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
@@ -44,6 +46,30 @@
 
 #include "includes.h"
 
+static struct torrent_file	*torrent_file_first(struct torrent *);
+static void			 torrent_files_index(struct torrent *);
+static u_int32_t		 torrent_mmap_find(struct torrent_piece *, off_t);
+static void			 torrent_file_allocate(struct torrent_file *);
+static void			 torrent_file_close(struct torrent *,
+				    struct torrent_file *);
+static void			 torrent_file_get(struct torrent *,
+				    struct torrent_file *);
+static void			 torrent_file_open(struct torrent *,
+				    struct torrent_file *);
+static void			 torrent_files_sync(struct torrent *);
+static void			 torrent_file_path(struct torrent *,
+				    struct torrent_file *, char *, size_t);
+static struct torrent_file	*torrent_file_next(struct torrent *,
+				    struct torrent_file *);
+static int			 torrent_priority_level(const char *);
+static int			 torrent_fastresume_changed(struct torrent *,
+				    struct benc_node *, u_int8_t *);
+static void			 torrent_fastresume_partial(struct torrent *,
+				    struct benc_node *, u_int8_t *);
+static void			 torrent_piece_blocks_sync(struct torrent_piece *);
+
+/* how space is found for the files we download, one of ALLOC_* */
+int alloc_mode = ALLOC_SPARSE;
 
 /*
  * torrent_parse_infohash()
@@ -105,6 +131,10 @@ torrent_parse_file(const char *file)
 
 	memset(torrent, 0, sizeof(*torrent));
 	torrent->name = xstrdup(file);
+	TAILQ_INIT(&torrent->open_files);
+	torrent->max_open_files = FILE_CACHE_SIZE;
+	torrent->resume_pending = xcalloc(RESUME_SYNC_PIECES,
+	    sizeof(*torrent->resume_pending));
 
 	/* XXX need a way to free torrents and their node trees */
 	torrent->broot = benc_root_create();
@@ -112,10 +142,10 @@ torrent_parse_file(const char *file)
 	if ((buf = buf_load(file, 0)) == NULL)
 		err(1, "torrent_parse_file: buf_load");
 
+	/* the tree keeps the buffer, as its strings point into it */
 	if ((troot = benc_parse_buf(buf, torrent->broot)) == NULL)
-		errx(1, "torrent_parse_file: yyparse of %s", file);
+		errx(1, "torrent_parse_file: could not parse %s", file);
 
-	buf_free(in);
 	if ((node = benc_node_find(troot, "info")) == NULL)
 		errx(1, "no info data found in torrent");
 	torrent->info_hash = torrent_parse_infohash(file, node->end);
@@ -150,6 +180,7 @@ torrent_parse_file(const char *file)
 			errx(1, "name is not a string");
 
 		torrent->body.singlefile.tfp.path = node->body.string.value;
+		torrent->body.singlefile.tfp.priority = TORRENT_PRIORITY_NORMAL;
 
 		if ((node = benc_node_find(troot, "piece length")) == NULL)
 			errx(1, "no piece length field");
@@ -210,6 +241,7 @@ torrent_parse_file(const char *file)
 			multi_file = xmalloc(sizeof(*multi_file));
 
 			memset(multi_file, 0, sizeof(*multi_file));
+			multi_file->priority = TORRENT_PRIORITY_NORMAL;
 			if ((tnode = benc_node_find(childnode, "length")) == NULL)
 				errx(1, "no length field");
 			if (!(tnode->flags & BINT))
@@ -330,6 +362,29 @@ torrent_print(struct torrent *torrent)
 	}
 }
 
+/*
+ * torrent_mmap_find()
+ *
+ * Index of the mapping of the supplied piece which holds offset <off>.
+ */
+static u_int32_t
+torrent_mmap_find(struct torrent_piece *tpp, off_t off)
+{
+	u_int32_t lo, hi, mid;
+
+	lo = 0;
+	hi = tpp->num_mmaps;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (tpp->mmaps[mid]->poff <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return (lo);
+}
+
 /*
  * torrent_block_write()
  *
@@ -339,48 +394,25 @@ void
 torrent_block_write(struct torrent_piece *tpp, off_t off, u_int32_t len, void *d)
 {
 	struct torrent_mmap *tmmp;
-	off_t cntlen = 0, cntbase = 0;
-	u_int8_t *aptr;
-	u_int32_t tlen, bytesleft = len, diff = 0;
+	u_int8_t *src = d;
+	u_int32_t i, skip, tlen;
 
 	trace("torrent_block_write tpp->idx: %u off: %u len: %u", tpp->index, off, len);
-	TAILQ_FOREACH(tmmp, &tpp->mmaps, mmaps) {
-		if (bytesleft < len) {
-			diff = len - bytesleft;
-			/* write as much as we can here and jump to next
-			 * mapping if required*/
-			if (bytesleft > tmmp->len) {
-				memcpy(tmmp->addr, (u_int8_t *)d + diff,
-				    tmmp->len);
-				bytesleft -= tmmp->len;
-				continue;
-			}
-			/* done once we make it here */
-			memcpy(tmmp->addr, (u_int8_t *)d + diff, bytesleft);
-			return;
-
-		}
-		cntlen += tmmp->len;
-		if (cntlen < off) {
-			cntbase += tmmp->len;
-			continue;
-		} else {
-			aptr = tmmp->addr;
-			for (; cntbase < off; cntbase++)
-				aptr++;
-			tlen = tmmp->len - (aptr - (u_int8_t *)tmmp->addr);
-			/* its possible that we are writing more bytes than
-			 * remain in this single mapping.  in this case,
-			 * we need to write the remainder to the next
-			 * mapping(s)*/
-			if (len > tlen) {
-				memcpy(aptr, d, tlen);
-				bytesleft -= tlen;
-				continue;
-			}
-			memcpy(aptr, d, len);
-			return;
-		}
+	if (off + len > tpp->len)
+		return;
+	if (tpp->buf != NULL) {
+		memcpy(tpp->buf + off, d, len);
+		return;
+	}
+	/* the block may run on into the mappings after the one it starts in */
+	for (i = torrent_mmap_find(tpp, off); i < tpp->num_mmaps && len > 0; i++) {
+		tmmp = tpp->mmaps[i];
+		skip = off - tmmp->poff;
+		tlen = MIN(len, tmmp->len - skip);
+		memcpy(tmmp->addr + skip, src, tlen);
+		src += tlen;
+		off += tlen;
+		len -= tlen;
 	}
 }
 
@@ -395,74 +427,39 @@ torrent_block_write(struct torrent_piece *tpp, off_t off, u_int32_t len, void *d
 void *
 torrent_block_read(struct torrent_piece *tpp, off_t off, u_int32_t len, int *hint)
 {
-	void *block;
-	u_int8_t *aptr, *bptr;
 	struct torrent_mmap *tmmp;
-	off_t cntlen = 0, cntbase = 0;
-	u_int32_t tlen = len, ilen;
+	u_int8_t *block;
+	u_int32_t i, skip, tlen, done;
 
 	*hint = 0;
-	block = NULL;
-	bptr = NULL;
 
 	trace("torrent_block_read tpp->idx: %u off: %u len: %u", tpp->index, off, len);
-	TAILQ_FOREACH(tmmp, &tpp->mmaps, mmaps) {
-		/* sum the lengths of the mappings we visit. if the offset is
-		   greater than the current sum, then the requested data is
-		   not within this mapping so continue to next mapping */
-		cntlen += tmmp->len;
-		if (cntlen < off) {
-			/* we need to maintain a base length so that we
-			   know how far we need to move the pointer to reach
-			   the offset */
-			cntbase += tmmp->len;
-			continue;
-		} else {
-			/* our offset is within this mapping, but we still
-			   might need to bring the pointer up to it */
-			aptr = tmmp->addr;
-			/* (off - cntbase) is the distance from the start of
-			 * mapping that we need to traverse to get to the
-			 * offset. */
-			/* ilen is the length remaining in the mapping, after
-			 * the walk */
-			ilen = tmmp->len - (off - cntbase);
-			if (ilen > tmmp->len)
-				errx(1, "overflow: ilen > tmmp->len");
-			for(; cntbase < off; cntbase++)
-				aptr++;
-
-			trace("torrent_block_read: off: %jd len: %u ilen: %u (off - cntbase): %jd tmmp->len: %u tlen: %u file: %s md5sum: %s", off, len, ilen, off - cntbase, tmmp->len, tlen, tmmp->tfp->path, tmmp->tfp->md5sum);
-			/* this mapping might not contain as many bytes as
-			   we requested.  in that case, copy as many as
-			   possible and continue to next mapping */
-			if (ilen < tlen) {
-				/* make sure we only malloc once */
-				if (*hint == 0) {
-					block = xmalloc(len);
-					bptr = block;
-					*hint = 1;
-				}
-				memcpy(bptr, aptr, ilen);
-				bptr += ilen;
-				tlen -= ilen;
-			} else {
-				/* if possible, do not do a buffer copy,
-				 * but return the mmaped base address directly
-				 */
-				if (*hint == 0) {
-					return (aptr);
-				}
-				memcpy(bptr, aptr, tlen);
-				return (block);
-			}
-		}
-	}
-	if (*hint == 1) {
-		return (block);
+	if (off + len > tpp->len)
+		return (NULL);
+	/* still being assembled, so it is all in one place */
+	if (tpp->buf != NULL)
+		return (tpp->buf + off);
+	if (tpp->num_mmaps == 0)
+		return (NULL);
+	i = torrent_mmap_find(tpp, off);
+	tmmp = tpp->mmaps[i];
+	skip = off - tmmp->poff;
+	/* if possible, do not do a buffer copy, but return the mmaped address
+	 * directly */
+	if (tmmp->len - skip >= len)
+		return (tmmp->addr + skip);
+	/* it spans several mappings, so it has to be copied together */
+	block = xmalloc(len);
+	*hint = 1;
+	for (done = 0; done < len; i++) {
+		tmmp = tpp->mmaps[i];
+		skip = off + done - tmmp->poff;
+		tlen = MIN(len - done, tmmp->len - skip);
+		memcpy(block + done, tmmp->addr + skip, tlen);
+		done += tlen;
 	}
 
-	return (NULL);
+	return (block);
 }
 
 /*
@@ -493,59 +490,20 @@ torrent_mmap_create(struct torrent *tp, struct torrent_file *tfp, off_t off,
 {
 	struct torrent_mmap *tmmp;
 	struct stat sb;
-	char buf[MAXPATHLEN], *buf2, zero = 0x00, *basedir;
-	int openflags, mmapflags, fd = 0, l;
+	int mmapflags;
 	long pagesize;
 	u_int8_t *nearest_page = NULL;
 	off_t page_off = 0;
 
 	if ((pagesize = sysconf(_SC_PAGESIZE)) == -1)
 		err(1, "torrent_mmap_create: sysconf");
-	open:
-	if (tfp->fd == 0) {
-		if (tp->type == SINGLEFILE)
-			l = snprintf(buf, sizeof(buf), "%s", tfp->path);
-		else {
-			l = snprintf(buf, sizeof(buf), "%s/%s",
-			    tp->body.multifile.name, tfp->path);
-			if (l == -1 || l >= (int)sizeof(buf))
-				errx(1, "torrent_mmap_create: path too long");
-			/* Linux dirname() modifies the buffer, so make a copy */
-			buf2 = xstrdup(buf);
-			if ((basedir = dirname(buf2)) == NULL)
-				err(1, "torrent_mmap_create: basename");
-			if (mkpath(basedir, 0755) == -1)
-				if (errno != EEXIST)
-					err(1, "torrent_mmap_create \"%s\": mkdir", basedir);
-			xfree(buf2);
-			basedir = NULL;
-		}
-		openflags = (tp->good_pieces == tp->num_pieces ? O_RDONLY : O_RDWR|O_CREAT);
-		if ((fd = open(buf, openflags, 0600)) == -1)
-			err(1, "torrent_mmap_create: open `%s'", buf);
-
-		if (flock(fd, LOCK_EX | LOCK_NB) == -1)
-			err(1, "torrent_mmap_create: flock()");
-		tfp->fd = fd;
-	}
+	torrent_file_get(tp, tfp);
 	if (fstat(tfp->fd, &sb) == -1)
 		err(1, "torrent_mmap_create: fstat `%d'", tfp->fd);
-	/* trace("size: %u vs. len+off: %u", sb.st_size, (off_t)len + off); */
-	if (sb.st_size < ((off_t)len + off)) {
-		/* trace("%llu offset zeroed, len %u, size: %u", off, len, sb.st_size); */
-		tp->isnew = 1;
-		/* seek to the expected size of file ... */
-		if (lseek(tfp->fd, (off_t)len + off - 1, SEEK_SET) == -1)
-			err(1, "torrent_mmap_create: lseek() failure");
-		/* and write a byte there */
-		if (write(tfp->fd, &zero, 1) < 1)
-			err(1, "torrent_mmap_create: write() failure");
-		if (flock(tfp->fd, LOCK_UN) == -1)
-			err(1, "torrent_mmap_create: flock()");
-		close(tfp->fd);
-		tfp->fd = 0;
-		goto open;
-	}
+	/* files allocated only as they are written may not reach this far */
+	if (sb.st_size < ((off_t)len + off)
+	    && ftruncate(tfp->fd, (off_t)len + off) == -1)
+		err(1, "torrent_mmap_create: ftruncate `%s'", tfp->path);
 	/* OpenBSD does not require us to align our mmap to page-size boundaries,
 	 * but Linux and no doubt other platforms do.
 	 */
@@ -589,11 +547,14 @@ torrent_pieces_create(struct torrent *tp)
 	u_int32_t len, i;
 	off_t off;
 
+	torrent_files_index(tp);
 	tpp = xcalloc(tp->num_pieces, sizeof(*tpp));
 	for (i = 0; i < tp->num_pieces; i++) {
 		tpp[i].tp = tp;
 		tpp[i].index = i;
-		TAILQ_INIT(&tpp[i].mmaps);
+		tpp[i].mmaps = NULL;
+		tpp[i].num_mmaps = 0;
+		tpp[i].buf = NULL;
 
 		off = tp->piece_length * (off_t)i;
 		/* nice and simple */
@@ -619,125 +580,86 @@ torrent_pieces_create(struct torrent *tp)
 	}
 
 	tp->piece_array = tpp;
+	/* pieces bigger than the whole pool are always mapped instead */
+	tp->max_bufs = ASSEMBLY_POOL_SIZE / tp->piece_length;
+	tp->bufs_free = NULL;
+	if (tp->max_bufs > 0)
+		tp->bufs_free = xcalloc(tp->max_bufs, sizeof(*tp->bufs_free));
+	tp->num_bufs_free = tp->num_bufs = 0;
+	torrent_priorities_update(tp);
+
 	return (tpp);
 }
 
 /*
  * torrent_piece_map()
  *
- * Creates the mmap region(s) corresponding to this piece.  For multi-file
- * torrents, this can be quite complicated.
+ * Creates the mmap region(s) corresponding to this piece, one for each
+ * file it overlaps.
  *
- * Returns 1 on success, 0 on failure.
+ * Returns 0.
  */
 int
 torrent_piece_map(struct torrent_piece *tpp)
 {
-	struct torrent_file  *tfp, *nxttfp;
-	struct torrent_mmap  *tmmp;
-	u_int32_t len;
-	off_t off;
+	struct torrent_extent *ext;
+	struct torrent_mmap *tmmp;
+	u_int32_t i, n, poff;
+
+	n = torrent_extents(tpp->tp, tpp->tp->piece_length * (off_t)tpp->index,
+	    tpp->len, &ext);
+	tpp->mmaps = xcalloc(MAX(n, 1), sizeof(*tpp->mmaps));
+	poff = 0;
+	for (i = 0; i < n; i++) {
+		tmmp = torrent_mmap_create(tpp->tp, ext[i].tfp, ext[i].off,
+		    ext[i].len);
+		tmmp->poff = poff;
+		poff += tmmp->len;
+		tpp->mmaps[i] = tmmp;
+	}
+	tpp->num_mmaps = n;
+	tpp->flags |= TORRENT_PIECE_MAPPED;
+	xfree(ext);
 
-	off = tpp->tp->piece_length * (off_t)tpp->index;
-	/* nice and simple */
-	if (tpp->tp->type == SINGLEFILE) {
-		tmmp = torrent_mmap_create(tpp->tp, &tpp->tp->body.singlefile.tfp, off, tpp->len);
-		TAILQ_INSERT_TAIL(&tpp->mmaps, tmmp, mmaps);
-		tpp->flags |= TORRENT_PIECE_MAPPED;
+	return (0);
+}
 
-		return (0);
-	} else {
-		/*
-		 * From: http://wiki.theory.org/BitTorrentSpecification
-		 *
-		 * "For the purposes of piece boundaries in the multi-file case,
-		 * consider the file data as one long continuous stream,
-		 * composed of the concatenation of each file in the order
-		 * listed in the files list. The number of pieces and their
-		 * boundaries are then determined in the same manner as the
-		 * case of a single file. Pieces may overlap file boundaries."
-		 *
-		 * So, find which file(s) this piece should be mapped within.
-		 * Or, if files are too small to make up a whole piece, which
-		 * files should be mapped within the piece.
-		 * This is kind of complicated.
-		 */
-
-		len = tpp->len;
-		tpp->len = 0;
-		TAILQ_FOREACH(tfp, &tpp->tp->body.multifile.files, files) {
-			/* piece offset puts it outside the current
-			   file, may be mapped to next file */
-			if (off > tfp->file_length) {
-				off -= tfp->file_length;
-				continue;
-			}
-			/* file is too small for one piece
-			   and this piece is not yet full */
-			if (tfp->file_length < (off_t)len
-			    && tpp->len < len) {
-				if (tfp->file_length - off == 0)
-					continue;
-				tmmp = torrent_mmap_create(tpp->tp, tfp, off,
-				    tfp->file_length - off);
-				TAILQ_INSERT_TAIL(&tpp->mmaps, tmmp, mmaps);
-				tpp->len += tfp->file_length - off;
-				len -= tfp->file_length - off;
-				off = 0;
-				continue;
-			}
-			if (off + (off_t)len > tfp->file_length) {
-				if (tfp->file_length == off) {
-					off = 0;
-					continue;
-				}
-				if (tfp->file_length - off == 0)
-					continue;
-				tmmp = torrent_mmap_create(tpp->tp, tfp, off,
-				    tfp->file_length - off);
-				tpp->len += tmmp->len;
-				TAILQ_INSERT_TAIL(&tpp->mmaps, tmmp, mmaps);
-				nxttfp = TAILQ_NEXT(tfp, files);
-				len -= tmmp->len;
-				off++;
-				if (nxttfp->file_length < (off_t)len) {
-					if (nxttfp->file_length == 0)
-						continue;
-					tmmp = torrent_mmap_create(tpp->tp, nxttfp,
-					    0, nxttfp->file_length);
-					tpp->len += tmmp->len;
-					TAILQ_INSERT_TAIL(&tpp->mmaps, tmmp,
-					    mmaps);
-					off++;
-					len -= tmmp->len;
-					tfp = nxttfp;
-					off = 0;
-					continue;
-				} else {
-					if (len == 0)
-						continue;
-					tmmp = torrent_mmap_create(tpp->tp, nxttfp,
-					    0, len);
-				}
-				tpp->len += tmmp->len;
-				TAILQ_INSERT_TAIL(&tpp->mmaps, tmmp, mmaps);
-				off++;
-				break;
-			} else if (off < tfp->file_length) {
-				/* piece lies within this file */
-				if (len == 0)
-					continue;
-				tmmp = torrent_mmap_create(tpp->tp, tfp, off, len);
-				off++;
-				TAILQ_INSERT_TAIL(&tpp->mmaps, tmmp, mmaps);
-				tpp->len += len;
+/*
+ * torrent_piece_ondisk()
+ *
+ * Is there room on disk for all of the supplied piece?  If not, we can't
+ * have it, so there is no need to check it, or to create its files to do
+ * so.
+ */
+int
+torrent_piece_ondisk(struct torrent_piece *tpp)
+{
+	struct torrent_extent *ext;
+	struct stat sb;
+	char buf[MAXPATHLEN];
+	u_int32_t i, n;
+	int res;
+
+	n = torrent_extents(tpp->tp, tpp->tp->piece_length * (off_t)tpp->index,
+	    tpp->len, &ext);
+	res = 1;
+	for (i = 0; i < n && res; i++) {
+		if (ext[i].tfp->fd != 0) {
+			if (fstat(ext[i].tfp->fd, &sb) == -1)
+				err(1, "torrent_piece_ondisk: fstat");
+		} else {
+			torrent_file_path(tpp->tp, ext[i].tfp, buf, sizeof(buf));
+			if (stat(buf, &sb) == -1) {
+				res = 0;
 				break;
 			}
 		}
-		tpp->flags |= TORRENT_PIECE_MAPPED;
-		return (0);
+		if (sb.st_size < ext[i].off + (off_t)ext[i].len)
+			res = 0;
 	}
-	return (1);
+	xfree(ext);
+
+	return (res);
 }
 
 /*
@@ -753,7 +675,7 @@ torrent_piece_checkhash(struct torrent *tp, struct torrent_piece *tpp)
 	u_int8_t *d, *s, results[SHA1_DIGEST_LENGTH];
 	int hint, res;
 
-	if (!(tpp->flags & TORRENT_PIECE_MAPPED))
+	if (tpp->buf == NULL && !(tpp->flags & TORRENT_PIECE_MAPPED))
 		errx(1, "torrent_piece_checkhash: unmapped piece: %u", tpp->index);
 	d = torrent_block_read(tpp, 0, tpp->len, &hint);
 	if (d == NULL)
@@ -791,48 +713,192 @@ torrent_piece_sync(struct torrent *tp, u_int32_t idx)
 {
 	struct torrent_piece *tpp;
 	struct torrent_mmap *tmmp;
+	u_int32_t i;
 
 	tpp = torrent_piece_find(tp, idx);
 
 	if (tpp == NULL)
 		errx(1, "torrent_piece_sync: NULL piece");
 
-	TAILQ_FOREACH(tmmp, &tpp->mmaps, mmaps)
+	for (i = 0; i < tpp->num_mmaps; i++) {
+		tmmp = tpp->mmaps[i];
 		if (msync(tmmp->aligned_addr, tmmp->len, MS_SYNC) == -1)
 			err(1, "torrent_piece_sync: msync");
+	}
 
 }
 
 /*
  * torrent_piece_unmap()
  *
- * Unmap the supplied piece, flushing it to disk and
- * closing the file descriptor if necessary.
+ * Unmap the supplied piece, flushing it to disk.  Its files stay open
+ * until something else needs the descriptors.
  */
 void
 torrent_piece_unmap(struct torrent_piece *tpp)
 {
 	struct torrent_mmap *tmmp;
+	u_int32_t i;
 
-	TAILQ_FOREACH(tmmp, &tpp->mmaps, mmaps) {
+	for (i = 0; i < tpp->num_mmaps; i++) {
+		tmmp = tpp->mmaps[i];
 		tmmp->tfp->refs--;
-		if (tmmp->tfp->refs == 0) {
-			flock(tmmp->tfp->fd, LOCK_UN);
-			(void)  close(tmmp->tfp->fd);
-			tmmp->tfp->fd = 0;
-		}
 		if (msync(tmmp->aligned_addr, tmmp->len, MS_SYNC) == -1)
 			err(1, "torrent_piece_unmap: msync");
 		if (munmap(tmmp->aligned_addr, tmmp->len) == -1)
 			err(1, "torrent_piece_unmap: munmap");
-	}
-	while ((tmmp = TAILQ_FIRST(&tpp->mmaps))) {
-		TAILQ_REMOVE(&tpp->mmaps, tmmp, mmaps);
 		xfree(tmmp);
 	}
+	if (tpp->mmaps != NULL)
+		xfree(tpp->mmaps);
+	tpp->mmaps = NULL;
+	tpp->num_mmaps = 0;
 	tpp->flags &= ~TORRENT_PIECE_MAPPED;
 }
 
+/*
+ * torrent_piece_buffer()
+ *
+ * Give the supplied piece an assembly buffer, so that its blocks are
+ * collected in memory rather than written straight into the file.  There
+ * are only so many; returns -1 if they are all in use, in which case the
+ * piece must be mapped instead.
+ */
+int
+torrent_piece_buffer(struct torrent_piece *tpp)
+{
+	struct torrent *tp = tpp->tp;
+
+	if (tp->num_bufs_free > 0) {
+		tpp->buf = tp->bufs_free[--tp->num_bufs_free];
+	} else if (tp->num_bufs < tp->max_bufs) {
+		tpp->buf = xmalloc(tp->piece_length);
+		tp->num_bufs++;
+	} else {
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * torrent_piece_buffer_free()
+ *
+ * Put the supplied piece's assembly buffer, if it has one, back in the pool.
+ * Whatever was in it is lost, so flush it first if need be.
+ */
+void
+torrent_piece_buffer_free(struct torrent_piece *tpp)
+{
+	struct torrent *tp = tpp->tp;
+
+	if (tpp->buf == NULL)
+		return;
+	tp->bufs_free[tp->num_bufs_free++] = tpp->buf;
+	tpp->buf = NULL;
+}
+
+/*
+ * torrent_block_flush()
+ *
+ * Write <len> bytes at offset <off> of the supplied piece's assembly
+ * buffer out to disk, with a single write to each file they overlap.  The
+ * files are synced later, in batches, by torrent_files_sync().
+ */
+void
+torrent_block_flush(struct torrent_piece *tpp, off_t off, u_int32_t len)
+{
+	struct torrent *tp = tpp->tp;
+	struct torrent_extent *ext;
+	struct torrent_file *tfp;
+	u_int32_t done, i, n;
+
+	n = torrent_extents(tp, tp->piece_length * (off_t)tpp->index + off, len,
+	    &ext);
+	done = off;
+	for (i = 0; i < n; i++) {
+		tfp = ext[i].tfp;
+		torrent_file_get(tp, tfp);
+		if (pwrite(tfp->fd, tpp->buf + done, ext[i].len, ext[i].off)
+		    != (ssize_t)ext[i].len)
+			err(1, "torrent_block_flush: pwrite `%s'", tfp->path);
+		tfp->dirty = 1;
+		done += ext[i].len;
+	}
+	xfree(ext);
+}
+
+/*
+ * torrent_piece_flush()
+ *
+ * Write the supplied piece's assembly buffer out to disk.
+ */
+void
+torrent_piece_flush(struct torrent_piece *tpp)
+{
+	torrent_block_flush(tpp, 0, tpp->len);
+}
+
+/*
+ * torrent_piece_block_have()
+ *
+ * Note that the block at offset <off> of the supplied piece has arrived,
+ * so that it need not be fetched again if we are restarted before the
+ * piece is done.
+ */
+void
+torrent_piece_block_have(struct torrent_piece *tpp, u_int32_t off)
+{
+	if (tpp->blockmap == NULL)
+		tpp->blockmap = xcalloc(TORRENT_PIECE_BLOCKMAP_LEN(tpp), 1);
+	util_setbit(tpp->blockmap, off / BLOCK_SIZE);
+}
+
+/*
+ * torrent_piece_blocks_clear()
+ *
+ * Forget which blocks of the supplied piece have arrived, once it is
+ * checked or abandoned.
+ */
+void
+torrent_piece_blocks_clear(struct torrent_piece *tpp)
+{
+	if (tpp->blockmap == NULL)
+		return;
+	xfree(tpp->blockmap);
+	tpp->blockmap = NULL;
+}
+
+/*
+ * torrent_piece_blocks_sync()
+ *
+ * Make sure the blocks of a partial piece noted by
+ * torrent_piece_block_have() are on disk, writing runs of them out of its
+ * assembly buffer if it has one.
+ */
+static void
+torrent_piece_blocks_sync(struct torrent_piece *tpp)
+{
+	u_int32_t b, start, nblocks;
+
+	if (tpp->flags & TORRENT_PIECE_MAPPED) {
+		torrent_piece_sync(tpp->tp, tpp->index);
+		return;
+	}
+	if (tpp->buf == NULL)
+		return;
+	nblocks = (tpp->len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	for (b = 0; b < nblocks; b++) {
+		if (!util_getbit(tpp->blockmap, b))
+			continue;
+		for (start = b; b + 1 < nblocks
+		    && util_getbit(tpp->blockmap, b + 1); b++)
+			;
+		torrent_block_flush(tpp, start * BLOCK_SIZE,
+		    MIN(tpp->len, (b + 1) * BLOCK_SIZE) - start * BLOCK_SIZE);
+	}
+}
+
 /*
  * torrent_bitfield_get()
  *
@@ -878,84 +944,864 @@ torrent_empty(struct torrent *tp)
 	return (1);
 }
 
+/*
+ * torrent_state_name()
+ *
+ * Name of the state file with suffix <ext>, in the same dir as the torrent
+ * file.
+ */
+void
+torrent_state_name(struct torrent *tp, const char *ext, char *buf, size_t len)
+{
+	int l;
+
+	l = snprintf(buf, len, "%s%s", tp->name, ext);
+	if (l == -1 || l >= (int)len)
+		errx(1, "torrent_state_name: snprintf truncation");
+}
+
+/*
+ * torrent_state_load()
+ *
+ * Parse the state file with suffix <ext> into a tree under <troot>, and
+ * return its dictionary.  State files carry a "version" and the
+ * "info_hash" of the torrent they belong to, so one written by another
+ * version, or left behind by another torrent of the same name, is thrown
+ * out without looking any further.  Returns NULL if there is no usable
+ * file.
+ */
+struct benc_node *
+torrent_state_load(struct torrent *tp, const char *ext, struct benc_node *troot)
+{
+	struct benc_node *dict, *node;
+	struct stat sb;
+	char path[MAXPATHLEN];
+	BUF *buf;
+
+	torrent_state_name(tp, ext, path, sizeof(path));
+	if (stat(path, &sb) == -1 || sb.st_size == 0)
+		return (NULL);
+	if ((buf = buf_load(path, 0)) == NULL)
+		return (NULL);
+	if (benc_check(buf_get(buf), buf_len(buf), STATE_MAX_DEPTH) == -1) {
+		trace("torrent_state_load() %s is malformed", path);
+		buf_free(buf);
+		return (NULL);
+	}
+	if (benc_parse_buf(buf, troot) == NULL)
+		return (NULL);
+	dict = TAILQ_FIRST(&troot->children);
+
+	node = benc_dict_get(dict, "version", BINT);
+	if (node == NULL || node->body.number != STATE_VERSION) {
+		trace("torrent_state_load() %s is of another version", path);
+		return (NULL);
+	}
+	node = benc_dict_get(dict, "info_hash", BSTRING);
+	if (node == NULL || node->body.string.len != SHA1_DIGEST_LENGTH
+	    || memcmp(node->body.string.value, tp->info_hash,
+	    SHA1_DIGEST_LENGTH) != 0) {
+		trace("torrent_state_load() %s is for another torrent", path);
+		return (NULL);
+	}
+
+	return (dict);
+}
+
+/*
+ * torrent_state_save()
+ *
+ * Write <b> out as the state file with suffix <ext>.  It is written to a
+ * temporary file first, which is synced and renamed over the old one, so
+ * a crash never leaves a torn file.  Returns -1 if it can't be written.
+ */
+int
+torrent_state_save(struct torrent *tp, const char *ext, BUF *b)
+{
+	char path[MAXPATHLEN], tmpext[32], tmppath[MAXPATHLEN];
+	int fd, l, saved;
+
+	l = snprintf(tmpext, sizeof(tmpext), "%s.tmp", ext);
+	if (l == -1 || l >= (int)sizeof(tmpext))
+		errx(1, "torrent_state_save: snprintf truncation");
+	torrent_state_name(tp, ext, path, sizeof(path));
+	torrent_state_name(tp, tmpext, tmppath, sizeof(tmppath));
+
+	if ((fd = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC, 0600)) == -1)
+		return (-1);
+	if (buf_write_fd(b, fd) == -1 || fsync(fd) == -1) {
+		saved = errno;
+		(void)close(fd);
+		(void)unlink(tmppath);
+		errno = saved;
+		return (-1);
+	}
+	(void)close(fd);
+	if (rename(tmppath, path) == -1) {
+		saved = errno;
+		(void)unlink(tmppath);
+		errno = saved;
+		return (-1);
+	}
+
+	return (0);
+}
+
 /*
  * torrent_fastresume_dump()
  *
- * Write out the bitfield and some other metadata to a file in the same
- * dir as the torrent file, named <torrent_file>.funresume.
+ * Write out a snapshot of our progress to the state file
+ * <torrent_file>.funresume: the bitfield, the size and modification time
+ * of each file, so we can tell if they are changed behind our back, and
+ * which blocks we have of each partial piece.  Everything in the journal
+ * is now in the snapshot, so the journal is thrown away.
  */
 void
 torrent_fastresume_dump(struct torrent *tp)
 {
-	char resumename[MAXPATHLEN];
-	FILE *fp;
-	u_int32_t bitfieldlen;
+	struct torrent_piece *tpp;
+	struct torrent_file *tfp;
+	struct stat sb;
+	char journalname[MAXPATHLEN], path[MAXPATHLEN];
+	u_int32_t i, bitfieldlen, partial;
 	u_int8_t *bitfield;
-	size_t bytes;
-	int l;
+	BUF *b;
 
 	bitfieldlen = (tp->num_pieces + 7u) / 8u;
 	bitfield = torrent_bitfield_get(tp);
 
-	l = snprintf(resumename, sizeof(resumename), "%s.funresume", tp->name);
-	if (l == -1 || l >= (int)sizeof(resumename))
-		errx(1, "torrent_fastresume_dump: snprintf truncation");
+	/* the partial blocks we list had better be on disk */
+	partial = 0;
+	for (i = 0; i < tp->num_pieces; i++) {
+		tpp = &tp->piece_array[i];
+		if (tpp->blockmap == NULL || tpp->flags & TORRENT_PIECE_CKSUMOK)
+			continue;
+		torrent_piece_blocks_sync(tpp);
+		partial++;
+	}
+	/* as had every piece the bitfield says is good */
+	torrent_files_sync(tp);
+
+	b = buf_alloc(bitfieldlen + 128, BUF_AUTOEXT);
+	benc_put_dict(b);
+	if (tp->num_files > 0) {
+		benc_put_key(b, "files");
+		benc_put_list(b);
+		for (i = 0; i < tp->num_files; i++) {
+			tfp = tp->file_table[i];
+			if (tfp->fd != 0) {
+				if (fstat(tfp->fd, &sb) == -1)
+					err(1, "torrent_fastresume_dump: fstat");
+			} else {
+				torrent_file_path(tp, tfp, path, sizeof(path));
+				if (stat(path, &sb) == -1)
+					memset(&sb, 0, sizeof(sb));
+			}
+			benc_put_dict(b);
+			benc_put_key(b, "length");
+			benc_put_int(b, sb.st_size);
+			benc_put_key(b, "mtime");
+			benc_put_int(b, sb.st_mtime);
+			benc_put_end(b);
+		}
+		benc_put_end(b);
+	}
+	benc_put_key(b, "info_hash");
+	benc_put_str(b, tp->info_hash, SHA1_DIGEST_LENGTH);
+	if (partial > 0) {
+		benc_put_key(b, "partial");
+		benc_put_list(b);
+		for (i = 0; i < tp->num_pieces; i++) {
+			tpp = &tp->piece_array[i];
+			if (tpp->blockmap == NULL
+			    || tpp->flags & TORRENT_PIECE_CKSUMOK)
+				continue;
+			benc_put_dict(b);
+			benc_put_key(b, "blocks");
+			benc_put_str(b, tpp->blockmap,
+			    TORRENT_PIECE_BLOCKMAP_LEN(tpp));
+			benc_put_key(b, "index");
+			benc_put_int(b, i);
+			benc_put_end(b);
+		}
+		benc_put_end(b);
+	}
+	benc_put_key(b, "pieces");
+	benc_put_str(b, bitfield, bitfieldlen);
+	benc_put_key(b, "version");
+	benc_put_int(b, STATE_VERSION);
+	benc_put_end(b);
+	xfree(bitfield);
 
-	if ((fp = fopen(resumename, "w")) == NULL)
-		err(1, "torrent_fastresume_dump: fopen");
+	if (torrent_state_save(tp, ".funresume", b) == -1)
+		err(1, "torrent_fastresume_dump: torrent_state_save");
+	buf_free(b);
 
-	bytes = fwrite(bitfield, bitfieldlen, 1, fp);
-	if (bytes != bitfieldlen
-	    && ferror(fp))
-		errx(1, "torrent_fastresume_dump: fwrite failure");
-	fclose(fp);
-	xfree(bitfield);
+	torrent_state_name(tp, ".funjournal", journalname,
+	    sizeof(journalname));
+	if (tp->resume_fd != 0) {
+		(void)close(tp->resume_fd);
+		tp->resume_fd = 0;
+	}
+	if (unlink(journalname) == -1 && errno != ENOENT)
+		err(1, "torrent_fastresume_dump: unlink");
+	tp->resume_logged = 0;
+	tp->resume_unsynced = 0;
+}
+
+/*
+ * torrent_fastresume_changed()
+ *
+ * Compare the file sizes and modification times in the fast resume
+ * snapshot <dict> with the files on disk, and mark each piece of a file
+ * which no longer matches in <changed>.  Returns -1 if they can't be
+ * read, in which case every file must be assumed to have changed.
+ */
+static int
+torrent_fastresume_changed(struct torrent *tp, struct benc_node *dict,
+    u_int8_t *changed)
+{
+	struct torrent_file *tfp;
+	struct benc_node *files, *node, *size, *mtime;
+	struct stat sb;
+	char path[MAXPATHLEN];
+	u_int32_t i, first, last;
+
+	files = benc_dict_get(dict, "files", BLIST);
+	node = files != NULL ? TAILQ_FIRST(&files->children) : NULL;
+	for (i = 0; i < tp->num_files; i++) {
+		if (node == NULL)
+			return (-1);
+		size = benc_dict_get(node, "length", BINT);
+		mtime = benc_dict_get(node, "mtime", BINT);
+		if (size == NULL || mtime == NULL)
+			return (-1);
+		node = TAILQ_NEXT(node, benc_nodes);
+		tfp = tp->file_table[i];
+		torrent_file_path(tp, tfp, path, sizeof(path));
+		if (stat(path, &sb) == -1)
+			memset(&sb, 0, sizeof(sb));
+		if (sb.st_size == size->body.number
+		    && sb.st_mtime == mtime->body.number)
+			continue;
+		trace("torrent_fastresume_changed() %s has changed", tfp->path);
+		first = tfp->offset / tp->piece_length;
+		last = (tfp->offset + tfp->file_length - 1) / tp->piece_length;
+		for (; first <= last; first++)
+			util_setbit(changed, first);
+	}
+	if (node != NULL)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * torrent_fastresume_partial()
+ *
+ * Pick up which blocks we have of each partial piece from the fast resume
+ * snapshot <dict>, ignoring those of pieces which are changed.
+ */
+static void
+torrent_fastresume_partial(struct torrent *tp, struct benc_node *dict,
+    u_int8_t *changed)
+{
+	struct torrent_piece *tpp;
+	struct benc_node *list, *node, *idx, *blocks;
+
+	if ((list = benc_dict_get(dict, "partial", BLIST)) == NULL)
+		return;
+	TAILQ_FOREACH(node, &list->children, benc_nodes) {
+		idx = benc_dict_get(node, "index", BINT);
+		blocks = benc_dict_get(node, "blocks", BSTRING);
+		if (idx == NULL || blocks == NULL || idx->body.number < 0
+		    || idx->body.number >= tp->num_pieces
+		    || util_getbit(changed, idx->body.number))
+			continue;
+		tpp = &tp->piece_array[idx->body.number];
+		if (blocks->body.string.len != TORRENT_PIECE_BLOCKMAP_LEN(tpp))
+			continue;
+		torrent_piece_blocks_clear(tpp);
+		tpp->blockmap = xmalloc(blocks->body.string.len);
+		memcpy(tpp->blockmap, blocks->body.string.value,
+		    blocks->body.string.len);
+	}
+}
+
+/*
+ * torrent_fastresume_record()
+ *
+ * Note that piece <idx> is good.  It is appended to the fast resume
+ * journal by torrent_fastresume_sync() once its data is synced, every
+ * RESUME_SYNC_PIECES pieces, and the journal is folded into a fresh
+ * snapshot every RESUME_COMPACT_PIECES.
+ */
+void
+torrent_fastresume_record(struct torrent *tp, u_int32_t idx)
+{
+	if (++tp->resume_logged >= RESUME_COMPACT_PIECES) {
+		torrent_fastresume_dump(tp);
+		return;
+	}
+	tp->resume_pending[tp->resume_unsynced] = htonl(idx);
+	if (++tp->resume_unsynced >= RESUME_SYNC_PIECES)
+		torrent_fastresume_sync(tp);
+}
+
+/*
+ * torrent_fastresume_sync()
+ *
+ * Sync the data of the pieces noted by torrent_fastresume_record(), then
+ * append them to the fast resume journal, <torrent_file>.funjournal, which
+ * starts with the info hash of the torrent it belongs to, and sync that.
+ * So the journal never lists a piece which isn't on disk.
+ */
+void
+torrent_fastresume_sync(struct torrent *tp)
+{
+	char journalname[MAXPATHLEN];
+	ssize_t len;
+
+	if (tp->resume_unsynced == 0)
+		return;
+	torrent_files_sync(tp);
+	if (tp->resume_fd == 0) {
+		torrent_state_name(tp, ".funjournal", journalname,
+		    sizeof(journalname));
+		if ((tp->resume_fd = open(journalname,
+		    O_WRONLY|O_CREAT|O_APPEND, 0600)) == -1)
+			err(1, "torrent_fastresume_sync: open");
+		if (lseek(tp->resume_fd, 0, SEEK_END) == 0
+		    && write(tp->resume_fd, tp->info_hash, SHA1_DIGEST_LENGTH)
+		    != SHA1_DIGEST_LENGTH)
+			err(1, "torrent_fastresume_sync: write");
+	}
+	len = tp->resume_unsynced * sizeof(*tp->resume_pending);
+	if (write(tp->resume_fd, tp->resume_pending, len) != len)
+		err(1, "torrent_fastresume_sync: write");
+	if (fsync(tp->resume_fd) == -1)
+		err(1, "torrent_fastresume_sync: fsync");
+	tp->resume_unsynced = 0;
 }
 
 /*
  * torrent_fastresume_load()
  *
- * Load the fast resume data produced by torrent_fastresume_dump().
- * Returns -1 if it could not load the fast resume data, 0 otherwise.
+ * Load the fast resume data produced by torrent_fastresume_dump(), then
+ * replay the journal written since by torrent_fastresume_sync().  Pieces
+ * of files which have changed since, or every piece if there is no fast
+ * resume data, are marked TORRENT_PIECE_RECHECK.  Once there is a
+ * journal we have written to the files ourselves since the snapshot, so
+ * their sizes and times no longer tell us anything and aren't checked.
+ * Returns -1 if there is no fast resume data, 0 otherwise.
  */
 int
 torrent_fastresume_load(struct torrent *tp)
 {
 	struct torrent_piece *tpp;
-	char resumename[MAXPATHLEN];
+	struct benc_node *troot, *dict, *node;
+	char journalname[MAXPATHLEN];
+	u_int8_t hash[SHA1_DIGEST_LENGTH];
 	FILE *fp;
-	u_int32_t i, bitfieldlen;
-	u_int8_t *bitfield;
-	size_t bytes;
-	int l;
+	u_int32_t i, bitfieldlen, rec;
+	u_int8_t *bitfield, *changed;
+	int found = 0, journal = 0;
 
 	bitfieldlen = (tp->num_pieces + 7u) / 8u;
+	bitfield = xcalloc(bitfieldlen, 1);
+	changed = xcalloc(bitfieldlen, 1);
+
+	torrent_state_name(tp, ".funjournal", journalname,
+	    sizeof(journalname));
+	if ((fp = fopen(journalname, "r")) != NULL) {
+		if (fread(hash, sizeof(hash), 1, fp) == 1
+		    && memcmp(hash, tp->info_hash, sizeof(hash)) == 0)
+			journal = 1;
+		else if (ferror(fp))
+			errx(1, "torrent_fastresume_load: fread failure");
+	}
 
-	l = snprintf(resumename, sizeof(resumename), "%s.funresume", tp->name);
-	if (l == -1 || l >= (int)sizeof(resumename))
-		errx(1, "torrent_fastresume_load: snprintf truncation");
-
-	if ((fp = fopen(resumename, "r")) == NULL)
-		return (-1);
-
-	bitfield = xmalloc(bitfieldlen);
-	memset(bitfield, 0, bitfieldlen);
-
-	bytes = fread(bitfield, bitfieldlen, 1, fp);
-	if (bytes != bitfieldlen
-	    && ferror(fp))
-		errx(1, "torrent_fastresume_load: fread failure");
-	fclose(fp);
+	troot = benc_root_create();
+	if ((dict = torrent_state_load(tp, ".funresume", troot)) != NULL
+	    && (node = benc_dict_get(dict, "pieces", BSTRING)) != NULL
+	    && node->body.string.len == bitfieldlen) {
+		memcpy(bitfield, node->body.string.value, bitfieldlen);
+		if (!journal
+		    && torrent_fastresume_changed(tp, dict, changed) == -1)
+			memset(changed, 0xff, bitfieldlen);
+		else
+			torrent_fastresume_partial(tp, dict, changed);
+		found = 1;
+	}
+	benc_node_freeall(troot);
+
+	/* a record cut short by a crash is simply dropped */
+	if (journal) {
+		while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+			rec = ntohl(rec);
+			if (rec < tp->num_pieces)
+				util_setbit(bitfield, rec);
+		}
+		if (ferror(fp))
+			errx(1, "torrent_fastresume_load: fread failure");
+		found = 1;
+	}
+	if (fp != NULL)
+		fclose(fp);
 	/* there are faster ways to do this, but this is pretty readable */
 	for (i = 0; i < tp->num_pieces; i++) {
 		tpp = torrent_piece_find(tp, i);
-		if (util_getbit(bitfield, i) == 1) {
+		if (!found || util_getbit(changed, i)) {
+			tpp->flags |= TORRENT_PIECE_RECHECK;
+		} else if (util_getbit(bitfield, i) == 1) {
 			tpp->flags |= TORRENT_PIECE_CKSUMOK;
 			tp->good_pieces++;
 			tp->downloaded += tpp->len;
+			torrent_piece_blocks_clear(tpp);
 		}
 	}
 	xfree(bitfield);
+	xfree(changed);
 
-	return (0);
+	return (found ? 0 : -1);
+}
+
+/*
+ * torrent_swarm_update()
+ *
+ * Pick up seeder (complete) and leecher (incomplete) counts from a tracker
+ * announce or scrape response.
+ */
+void
+torrent_swarm_update(struct torrent *tp, struct benc_node *node, time_t now)
+{
+	struct benc_node *n;
+	int found = 0;
+
+	if ((n = benc_node_find(node, "complete")) != NULL
+	    && n->flags & BINT && n->body.number >= 0) {
+		tp->complete = n->body.number;
+		found = 1;
+	}
+	if ((n = benc_node_find(node, "incomplete")) != NULL
+	    && n->flags & BINT && n->body.number >= 0) {
+		tp->incomplete = n->body.number;
+		found = 1;
+	}
+	/* a response without counts says nothing about the swarm */
+	if (found)
+		tp->last_swarm_update = now;
+}
+
+/*
+ * torrent_file_first()
+ *
+ * First file of the torrent, whether single or multi-file.
+ */
+static struct torrent_file *
+torrent_file_first(struct torrent *tp)
+{
+	if (tp->type == SINGLEFILE)
+		return (&tp->body.singlefile.tfp);
+	return (TAILQ_FIRST(&tp->body.multifile.files));
+}
+
+/*
+ * torrent_files_index()
+ *
+ * Note where each file starts in the torrent's data, and build the table
+ * of non-empty files used to find them by offset.
+ */
+static void
+torrent_files_index(struct torrent *tp)
+{
+	struct torrent_file *tfp;
+	off_t off;
+	u_int32_t n;
+
+	n = 0;
+	for (tfp = torrent_file_first(tp); tfp != NULL;
+	    tfp = torrent_file_next(tp, tfp))
+		n++;
+	tp->file_table = xcalloc(MAX(n, 1), sizeof(*tp->file_table));
+	tp->num_files = 0;
+	off = 0;
+	for (tfp = torrent_file_first(tp); tfp != NULL;
+	    tfp = torrent_file_next(tp, tfp)) {
+		tfp->offset = off;
+		off += tfp->file_length;
+		if (tfp->file_length > 0)
+			tp->file_table[tp->num_files++] = tfp;
+	}
+}
+
+/*
+ * torrent_extents()
+ *
+ * Split the <len> bytes of torrent data at offset <off> into a run within
+ * each file they overlap.  The array of runs is returned in <ext> and must
+ * be freed by the caller.  Returns the number of runs.
+ */
+u_int32_t
+torrent_extents(struct torrent *tp, off_t off, u_int32_t len,
+    struct torrent_extent **ext)
+{
+	struct torrent_file *tfp;
+	off_t end;
+	u_int32_t lo, hi, mid, i, n;
+
+	/* last file starting at or before <off> */
+	lo = 0;
+	hi = tp->num_files;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (tp->file_table[mid]->offset <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	end = off + len;
+	n = 0;
+	for (i = lo; i < tp->num_files && tp->file_table[i]->offset < end; i++)
+		n++;
+	*ext = xcalloc(MAX(n, 1), sizeof(**ext));
+	for (i = 0; i < n; i++) {
+		tfp = tp->file_table[lo + i];
+		(*ext)[i].tfp = tfp;
+		(*ext)[i].off = MAX(off, tfp->offset) - tfp->offset;
+		(*ext)[i].len = MIN(end, tfp->offset + tfp->file_length)
+		    - MAX(off, tfp->offset);
+	}
+
+	return (n);
+}
+
+/*
+ * torrent_file_path()
+ *
+ * Write the path of the supplied torrent file into <buf>.
+ */
+static void
+torrent_file_path(struct torrent *tp, struct torrent_file *tfp, char *buf,
+    size_t len)
+{
+	int l;
+
+	if (tp->type == SINGLEFILE)
+		l = snprintf(buf, len, "%s", tfp->path);
+	else
+		l = snprintf(buf, len, "%s/%s", tp->body.multifile.name,
+		    tfp->path);
+	if (l == -1 || l >= (int)len)
+		errx(1, "torrent_file_path: path too long");
+}
+
+/*
+ * torrent_file_open()
+ *
+ * Open and lock the supplied torrent file, creating it and the directories
+ * leading to it if need be, and making room for it as alloc_mode says.
+ */
+static void
+torrent_file_open(struct torrent *tp, struct torrent_file *tfp)
+{
+	char buf[MAXPATHLEN], *buf2, *basedir;
+	int openflags, fd;
+
+	torrent_file_path(tp, tfp, buf, sizeof(buf));
+	if (tp->type == MULTIFILE) {
+		/* Linux dirname() modifies the buffer, so make a copy */
+		buf2 = xstrdup(buf);
+		if ((basedir = dirname(buf2)) == NULL)
+			err(1, "torrent_file_open: basename");
+		if (mkpath(basedir, 0755) == -1)
+			if (errno != EEXIST)
+				err(1, "torrent_file_open \"%s\": mkdir", basedir);
+		xfree(buf2);
+	}
+	openflags = (tp->good_pieces == tp->num_pieces ? O_RDONLY : O_RDWR|O_CREAT);
+	if ((fd = open(buf, openflags, 0600)) == -1)
+		err(1, "torrent_file_open: open `%s'", buf);
+
+	if (flock(fd, LOCK_EX | LOCK_NB) == -1)
+		err(1, "torrent_file_open: flock()");
+	tfp->fd = fd;
+	TAILQ_INSERT_TAIL(&tp->open_files, tfp, open_files);
+	tp->num_open_files++;
+	/* skipped files only grow as far as the wanted pieces need */
+	if (openflags != O_RDONLY && tfp->priority != TORRENT_PRIORITY_SKIP)
+		torrent_file_allocate(tfp);
+}
+
+/*
+ * torrent_file_get()
+ *
+ * Make sure the supplied torrent file is open, closing the least recently
+ * used of the others which nothing has mapped if too many are.
+ */
+static void
+torrent_file_get(struct torrent *tp, struct torrent_file *tfp)
+{
+	struct torrent_file *old, *next;
+
+	if (tfp->fd != 0) {
+		TAILQ_REMOVE(&tp->open_files, tfp, open_files);
+		TAILQ_INSERT_TAIL(&tp->open_files, tfp, open_files);
+		return;
+	}
+	for (old = TAILQ_FIRST(&tp->open_files);
+	    old != NULL && tp->num_open_files >= tp->max_open_files;
+	    old = next) {
+		next = TAILQ_NEXT(old, open_files);
+		if (old->refs == 0)
+			torrent_file_close(tp, old);
+	}
+	torrent_file_open(tp, tfp);
+}
+
+/*
+ * torrent_file_close()
+ *
+ * Sync, unlock and close the supplied torrent file.
+ */
+static void
+torrent_file_close(struct torrent *tp, struct torrent_file *tfp)
+{
+	if (tfp->dirty && fsync(tfp->fd) == -1)
+		err(1, "torrent_file_close: fsync `%s'", tfp->path);
+	tfp->dirty = 0;
+	flock(tfp->fd, LOCK_UN);
+	(void)close(tfp->fd);
+	tfp->fd = 0;
+	TAILQ_REMOVE(&tp->open_files, tfp, open_files);
+	tp->num_open_files--;
+}
+
+/*
+ * torrent_files_sync()
+ *
+ * Sync every open file written to since it was last synced.
+ */
+static void
+torrent_files_sync(struct torrent *tp)
+{
+	struct torrent_file *tfp;
+
+	TAILQ_FOREACH(tfp, &tp->open_files, open_files) {
+		if (!tfp->dirty)
+			continue;
+		if (fsync(tfp->fd) == -1)
+			err(1, "torrent_files_sync: fsync `%s'", tfp->path);
+		tfp->dirty = 0;
+	}
+}
+
+/*
+ * torrent_file_allocate()
+ *
+ * Make room for all of the supplied open file, if it is short.  Sparse
+ * allocation just sets its length, leaving the filesystem to find the
+ * blocks as they are written; full allocation reserves them now where the
+ * system can.  With no allocation, files grow only as data is written.
+ */
+static void
+torrent_file_allocate(struct torrent_file *tfp)
+{
+	struct stat sb;
+#if defined(__linux__) || defined(__FreeBSD__)
+	int error;
+#endif
+
+	if (alloc_mode == ALLOC_NONE)
+		return;
+	if (fstat(tfp->fd, &sb) == -1)
+		err(1, "torrent_file_allocate: fstat `%s'", tfp->path);
+	if (sb.st_size >= tfp->file_length)
+		return;
+#if defined(__linux__) || defined(__FreeBSD__)
+	if (alloc_mode == ALLOC_FULL) {
+		/* returns the error rather than setting errno */
+		error = posix_fallocate(tfp->fd, 0, tfp->file_length);
+		if (error == 0)
+			return;
+		/* not every filesystem can; make do with a sparse file */
+		if (error != EOPNOTSUPP && error != EINVAL) {
+			errno = error;
+			err(1, "torrent_file_allocate: posix_fallocate `%s'",
+			    tfp->path);
+		}
+	}
+#endif
+	if (ftruncate(tfp->fd, tfp->file_length) == -1)
+		err(1, "torrent_file_allocate: ftruncate `%s'", tfp->path);
+}
+
+/*
+ * torrent_allocate()
+ *
+ * With full allocation, create every file we want up front, rather than
+ * as the first data for each arrives, so the filesystem can lay them out
+ * in one go.
+ */
+void
+torrent_allocate(struct torrent *tp)
+{
+	struct torrent_file *tfp;
+	u_int32_t i;
+
+	if (alloc_mode != ALLOC_FULL || tp->good_pieces == tp->num_pieces)
+		return;
+	for (i = 0; i < tp->num_files; i++) {
+		tfp = tp->file_table[i];
+		if (tfp->priority == TORRENT_PRIORITY_SKIP || tfp->fd != 0)
+			continue;
+		torrent_file_get(tp, tfp);
+	}
+}
+
+/*
+ * torrent_file_next()
+ *
+ * File after <tfp>, or NULL if it is the last one.
+ */
+static struct torrent_file *
+torrent_file_next(struct torrent *tp, struct torrent_file *tfp)
+{
+	if (tp->type == SINGLEFILE)
+		return (NULL);
+	return (TAILQ_NEXT(tfp, files));
+}
+
+/*
+ * torrent_priority_level()
+ *
+ * Parse a priority level, either by name or number.  Returns -1 if it
+ * isn't one.
+ */
+static int
+torrent_priority_level(const char *level)
+{
+	static const char *names[] = { "skip", "low", "normal", "high" };
+	const char *errstr;
+	int i;
+
+	for (i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++)
+		if (strcmp(level, names[i]) == 0)
+			return (i);
+	i = strtonum(level, TORRENT_PRIORITY_SKIP, TORRENT_PRIORITY_HIGH,
+	    &errstr);
+	if (errstr != NULL)
+		return (-1);
+
+	return (i);
+}
+
+/*
+ * torrent_priority_set()
+ *
+ * Set file priorities from <spec>, a comma-separated list of
+ * <files>=<level> items.  <files> is a file number counting from 0 in the
+ * order of the torrent's file list, a range of them like 2-5, or * for
+ * all of them, and <level> one of skip, low, normal or high.  Later items
+ * override earlier ones.  The whole of <spec> is checked before any of it
+ * is applied.  Returns -1 if <spec> is malformed, 0 otherwise.
+ */
+int
+torrent_priority_set(struct torrent *tp, const char *spec)
+{
+	struct torrent_file *tfp;
+	const char *errstr;
+	char *buf, *s, *item, *level, *dash;
+	u_int32_t i, first, last, nfiles;
+	int *priorities, priority, ret;
+
+	nfiles = 0;
+	for (tfp = torrent_file_first(tp); tfp != NULL;
+	    tfp = torrent_file_next(tp, tfp))
+		nfiles++;
+	priorities = xcalloc(nfiles, sizeof(*priorities));
+	i = 0;
+	for (tfp = torrent_file_first(tp); tfp != NULL;
+	    tfp = torrent_file_next(tp, tfp), i++)
+		priorities[i] = tfp->priority;
+
+	ret = -1;
+	buf = s = xstrdup(spec);
+	while ((item = strsep(&s, ",")) != NULL) {
+		if ((level = strchr(item, '=')) == NULL)
+			goto out;
+		*level++ = '\0';
+		if ((priority = torrent_priority_level(level)) == -1)
+			goto out;
+		if (strcmp(item, "*") == 0) {
+			first = 0;
+			last = nfiles - 1;
+		} else {
+			if ((dash = strchr(item, '-')) != NULL)
+				*dash++ = '\0';
+			first = strtonum(item, 0, nfiles - 1, &errstr);
+			if (errstr != NULL)
+				goto out;
+			last = first;
+			if (dash != NULL) {
+				last = strtonum(dash, first, nfiles - 1,
+				    &errstr);
+				if (errstr != NULL)
+					goto out;
+			}
+		}
+		for (i = first; i <= last; i++)
+			priorities[i] = priority;
+	}
+	i = 0;
+	for (tfp = torrent_file_first(tp); tfp != NULL;
+	    tfp = torrent_file_next(tp, tfp), i++)
+		tfp->priority = priorities[i];
+	torrent_priorities_update(tp);
+	ret = 0;
+out:
+	xfree(buf);
+	xfree(priorities);
+
+	return (ret);
+}
+
+/*
+ * torrent_priorities_update()
+ *
+ * Work out piece priorities from file priorities: a piece gets the
+ * highest priority of the files it overlaps, so pieces straddling a
+ * skipped file and a wanted one are still fetched.  Then count how many
+ * pieces we still want.
+ */
+void
+torrent_priorities_update(struct torrent *tp)
+{
+	struct torrent_file *tfp;
+	struct torrent_piece *tpp;
+	u_int32_t i, last;
+	off_t off;
+
+	for (i = 0; i < tp->num_pieces; i++)
+		tp->piece_array[i].priority = TORRENT_PRIORITY_SKIP;
+	off = 0;
+	for (tfp = torrent_file_first(tp); tfp != NULL;
+	    tfp = torrent_file_next(tp, tfp)) {
+		if (tfp->file_length == 0)
+			continue;
+		last = (off + tfp->file_length - 1) / tp->piece_length;
+		for (i = off / tp->piece_length; i <= last; i++) {
+			tpp = tp->piece_array + i;
+			if (tfp->priority > tpp->priority)
+				tpp->priority = tfp->priority;
+		}
+		off += tfp->file_length;
+	}
+	tp->wanted_left = 0;
+	for (i = 0; i < tp->num_pieces; i++) {
+		tpp = tp->piece_array + i;
+		if (tpp->priority != TORRENT_PRIORITY_SKIP
+		    && !(tpp->flags & TORRENT_PIECE_CKSUMOK))
+			tp->wanted_left++;
+	}
 }
@@ -64,8 +64,13 @@ vtrace(const char *fmt, va_list vap)
 int
 terminate_handler(void)
 {
+	struct session *sc;
+
 	if (mytorrent != NULL)
 		torrent_fastresume_dump(mytorrent);
+	TAILQ_FOREACH(sc, &sessions, session_list)
+		network_peercache_save(sc);
+	dht_save();
 	if (out != NULL)
 		fclose(out);
 
@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Working out who sends us bad data, and banning them.
+ *
+ * Every block remembers which host its data came from.  When a piece
+ * fails its hash check, each block's SHA-1 and sender are kept, and the
+ * piece is fetched again from a single peer.  If all the bad piece came
+ * from one host, that host is banned there and then.  Otherwise, once the
+ * piece passes, the kept hashes are compared with the good blocks: whoever
+ * sent a block which differs is banned, and whoever sent a matching one is
+ * cleared of that failure.  A host with TRUST_MAX_BAD failures it has not
+ * been cleared of, and more failed pieces than good ones, is banned too.
+ *
+ * Banned hosts are disconnected and not talked to again for
+ * TRUST_BAN_TIME seconds.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/tree.h>
+
+#include <netinet/in.h>
+
+#include <sha1.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "includes.h"
+
+/* a block of a piece which failed its hash check, and who sent it */
+struct suspect_block {
+	TAILQ_ENTRY(suspect_block) blocks;
+	u_int32_t off;
+	struct peer_trust *src;
+	u_int8_t hash[SHA1_DIGEST_LENGTH];
+};
+
+struct suspect_piece {
+	TAILQ_ENTRY(suspect_piece) suspect_pieces;
+	u_int32_t idx;
+	TAILQ_HEAD(suspect_blocks, suspect_block) blocks;
+};
+
+static int	trust_block_hash(struct torrent_piece *, u_int32_t, u_int32_t,
+		    u_int8_t *);
+static void	trust_ban(struct session *, struct peer_trust *);
+static void	trust_failed(struct session *, struct torrent_piece *);
+static void	trust_passed(struct session *, struct torrent_piece *);
+static u_int32_t trust_senders(struct session *, struct torrent_piece *,
+		    struct peer_trust **, int *);
+
+RB_GENERATE(trust_by_host, peer_trust, entry, trust_cmp)
+
+/*
+ * trust_cmp()
+ *
+ * Order trust records by address family, then address.
+ */
+int
+trust_cmp(struct peer_trust *a, struct peer_trust *b)
+{
+	if (a->sa.ss_family != b->sa.ss_family)
+		return (a->sa.ss_family - b->sa.ss_family);
+	if (a->sa.ss_family == AF_INET6)
+		return (memcmp(&((struct sockaddr_in6 *)&a->sa)->sin6_addr,
+		    &((struct sockaddr_in6 *)&b->sa)->sin6_addr,
+		    sizeof(struct in6_addr)));
+	return (memcmp(&((struct sockaddr_in *)&a->sa)->sin_addr,
+	    &((struct sockaddr_in *)&b->sa)->sin_addr,
+	    sizeof(struct in_addr)));
+}
+
+/*
+ * trust_get()
+ *
+ * Find the trust record for the host of <sa>, creating it if need be.
+ */
+struct peer_trust *
+trust_get(struct session *sc, const struct sockaddr_storage *sa)
+{
+	struct peer_trust find, *t;
+
+	memcpy(&find.sa, sa, sizeof(find.sa));
+	if ((t = RB_FIND(trust_by_host, &sc->trust_by_host, &find)) != NULL)
+		return (t);
+	t = xmalloc(sizeof(*t));
+	memset(t, 0, sizeof(*t));
+	memcpy(&t->sa, sa, sizeof(t->sa));
+	RB_INSERT(trust_by_host, &sc->trust_by_host, t);
+
+	return (t);
+}
+
+/*
+ * trust_banned()
+ *
+ * Is the host of <sa> banned?  Bans which have run out are lifted, with
+ * a clean slate.
+ */
+int
+trust_banned(struct session *sc, const struct sockaddr_storage *sa)
+{
+	struct peer_trust find, *t;
+
+	memcpy(&find.sa, sa, sizeof(find.sa));
+	if ((t = RB_FIND(trust_by_host, &sc->trust_by_host, &find)) == NULL
+	    || t->banned == 0)
+		return (0);
+	if (t->banned > time(NULL))
+		return (1);
+	trace("trust_banned() lifting ban on %s", print_host(&t->sa));
+	t->banned = 0;
+	t->bad = 0;
+	ctl_server_notify_bans(sc);
+
+	return (0);
+}
+
+/*
+ * trust_ban()
+ *
+ * Ban a host and drop any connections to it.
+ */
+static void
+trust_ban(struct session *sc, struct peer_trust *t)
+{
+	struct peer *p;
+
+	if (t->banned > time(NULL))
+		return;
+	trace("trust_ban() banning %s, %u good and %u bad pieces",
+	    print_host(&t->sa), t->good, t->bad);
+	t->banned = time(NULL) + TRUST_BAN_TIME;
+	TAILQ_FOREACH(p, &sc->peers, peer_list) {
+		if (util_hostcmp(&p->sa, &t->sa) == 0) {
+			p->state = 0;
+			p->state |= PEER_STATE_DEAD;
+		}
+	}
+	ctl_server_notify_bans(sc);
+}
+
+/*
+ * trust_block_hash()
+ *
+ * SHA-1 of the <len> bytes at <off> in a mapped piece.  Returns -1 if they
+ * could not be read.
+ */
+static int
+trust_block_hash(struct torrent_piece *tpp, u_int32_t off, u_int32_t len,
+    u_int8_t *hash)
+{
+	SHA1_CTX sha;
+	u_int8_t *d;
+	int hint;
+
+	if ((d = torrent_block_read(tpp, off, len, &hint)) == NULL)
+		return (-1);
+	SHA1Init(&sha);
+	SHA1Update(&sha, d, len);
+	SHA1Final(hash, &sha);
+	if (hint == 1)
+		xfree(d);
+
+	return (0);
+}
+
+/*
+ * trust_piece_checked()
+ *
+ * Piece <tpp>, still mapped and with all its piece dls, just passed its
+ * hash check if <good>, or failed it.  Judge the hosts which sent it.
+ */
+void
+trust_piece_checked(struct session *sc, struct torrent_piece *tpp, int good)
+{
+	if (good)
+		trust_passed(sc, tpp);
+	else
+		trust_failed(sc, tpp);
+}
+
+/*
+ * trust_senders()
+ *
+ * Fill <out>, which has room for one entry per block, with the distinct
+ * hosts which sent blocks of <tpp>, and return how many there are.
+ * <*unknown> is set if some blocks came from nobody we know of, such as
+ * those resumed from before a restart.
+ */
+static u_int32_t
+trust_senders(struct session *sc, struct torrent_piece *tpp,
+    struct peer_trust **out, int *unknown)
+{
+	struct piece_dl *pd;
+	u_int32_t i, n, off;
+
+	n = 0;
+	*unknown = 0;
+	for (off = 0; off < tpp->len; off += BLOCK_SIZE) {
+		pd = network_piece_dl_find(sc, NULL, tpp->index, off);
+		if (pd == NULL || pd->src == NULL) {
+			*unknown = 1;
+			continue;
+		}
+		for (i = 0; i < n; i++)
+			if (out[i] == pd->src)
+				break;
+		if (i == n)
+			out[n++] = pd->src;
+	}
+
+	return (n);
+}
+
+/*
+ * trust_failed()
+ *
+ * Keep the hash and sender of each block of a failed piece, and count the
+ * failure against every sender.  If there was just one, and no blocks of
+ * unknown origin, it is to blame.
+ */
+static void
+trust_failed(struct session *sc, struct torrent_piece *tpp)
+{
+	struct suspect_piece *sp;
+	struct suspect_block *sb;
+	struct piece_dl *pd;
+	struct peer_trust **senders;
+	u_int32_t i, n, off;
+	int unknown;
+
+	TAILQ_FOREACH(sp, &sc->suspect_pieces, suspect_pieces)
+		if (sp->idx == tpp->index)
+			break;
+	if (sp == NULL) {
+		sp = xmalloc(sizeof(*sp));
+		memset(sp, 0, sizeof(*sp));
+		sp->idx = tpp->index;
+		TAILQ_INIT(&sp->blocks);
+		TAILQ_INSERT_TAIL(&sc->suspect_pieces, sp, suspect_pieces);
+	}
+	for (off = 0; off < tpp->len; off += BLOCK_SIZE) {
+		pd = network_piece_dl_find(sc, NULL, tpp->index, off);
+		if (pd == NULL || pd->src == NULL)
+			continue;
+		sb = xmalloc(sizeof(*sb));
+		memset(sb, 0, sizeof(*sb));
+		sb->off = off;
+		sb->src = pd->src;
+		if (trust_block_hash(tpp, off, pd->len, sb->hash) == -1) {
+			xfree(sb);
+			continue;
+		}
+		TAILQ_INSERT_TAIL(&sp->blocks, sb, blocks);
+	}
+	tpp->flags |= TORRENT_PIECE_SUSPECT;
+
+	senders = xcalloc((tpp->len + BLOCK_SIZE - 1) / BLOCK_SIZE,
+	    sizeof(*senders));
+	n = trust_senders(sc, tpp, senders, &unknown);
+	trace("trust_failed() piece %u had %u senders%s", tpp->index, n,
+	    unknown ? " and blocks of unknown origin" : "");
+	for (i = 0; i < n; i++) {
+		senders[i]->bad++;
+		if ((n == 1 && !unknown) || (senders[i]->bad >= TRUST_MAX_BAD
+		    && senders[i]->bad > senders[i]->good))
+			trust_ban(sc, senders[i]);
+	}
+	xfree(senders);
+}
+
+/*
+ * trust_passed()
+ *
+ * Credit every sender of a good piece.  If it failed before, blame the
+ * senders of blocks which differ from the good ones, and take the failure
+ * back from those whose blocks were all fine, once each.
+ */
+static void
+trust_passed(struct session *sc, struct torrent_piece *tpp)
+{
+	struct suspect_piece *sp;
+	struct suspect_block *sb;
+	struct peer_trust **senders, **liars;
+	u_int8_t hash[SHA1_DIGEST_LENGTH];
+	u_int32_t i, j, n, nliars, nblocks, len;
+	int unknown;
+
+	senders = xcalloc((tpp->len + BLOCK_SIZE - 1) / BLOCK_SIZE,
+	    sizeof(*senders));
+	n = trust_senders(sc, tpp, senders, &unknown);
+	for (i = 0; i < n; i++)
+		senders[i]->good++;
+	xfree(senders);
+
+	TAILQ_FOREACH(sp, &sc->suspect_pieces, suspect_pieces)
+		if (sp->idx == tpp->index)
+			break;
+	if (sp == NULL)
+		return;
+	nblocks = 0;
+	TAILQ_FOREACH(sb, &sp->blocks, blocks)
+		nblocks++;
+	senders = xcalloc(nblocks + 1, sizeof(*senders));
+	liars = xcalloc(nblocks + 1, sizeof(*liars));
+	n = nliars = 0;
+	while ((sb = TAILQ_FIRST(&sp->blocks)) != NULL) {
+		TAILQ_REMOVE(&sp->blocks, sb, blocks);
+		len = MIN(BLOCK_SIZE, tpp->len - sb->off);
+		if (trust_block_hash(tpp, sb->off, len, hash) == 0) {
+			if (memcmp(hash, sb->hash, sizeof(hash)) != 0) {
+				trace("trust_passed() piece %u off %u was bad"
+				    " data from %s", tpp->index, sb->off,
+				    print_host(&sb->src->sa));
+				trust_ban(sc, sb->src);
+				liars[nliars++] = sb->src;
+			} else {
+				for (i = 0; i < n; i++)
+					if (senders[i] == sb->src)
+						break;
+				if (i == n)
+					senders[n++] = sb->src;
+			}
+		}
+		xfree(sb);
+	}
+	/* the failure wasn't theirs, so it no longer counts against them */
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < nliars; j++)
+			if (liars[j] == senders[i])
+				break;
+		if (j == nliars && senders[i]->bad > 0)
+			senders[i]->bad--;
+	}
+	xfree(senders);
+	xfree(liars);
+	TAILQ_REMOVE(&sc->suspect_pieces, sp, suspect_pieces);
+	xfree(sp);
+	tpp->flags &= ~TORRENT_PIECE_SUSPECT;
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The UDP sockets, bound to the same port number as the peer listener,
+ * which the DHT and uTP share.  Incoming datagrams are told apart by their
+ * first byte: DHT messages are b-encoded dictionaries, so start with 'd',
+ * while uTP packets carry protocol version 1 in the low nibble.  UDP
+ * tracker responses would start with a zero byte.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "includes.h"
+
+/* IPv4 and IPv6 sockets */
+static int		udp_fd[2] = { -1, -1 };
+static u_int16_t	udp_portnum;
+static struct event	udp_ev[2];
+
+static int	udp_socket(int, const char *);
+static void	udp_handle_read(int, short, void *);
+
+/*
+ * udp_open()
+ *
+ * Open the shared UDP sockets on <port>, one for each address family,
+ * unless they are already open.  Returns 0 if at least one could be
+ * opened, -1 otherwise.
+ */
+int
+udp_open(const char *port)
+{
+	int i;
+
+	if (udp_fd[0] != -1 || udp_fd[1] != -1)
+		return (0);
+	udp_fd[0] = udp_socket(AF_INET, port);
+	udp_fd[1] = udp_socket(AF_INET6, port);
+	if (udp_fd[0] == -1 && udp_fd[1] == -1)
+		return (-1);
+	udp_portnum = atoi(port);
+	for (i = 0; i < 2; i++) {
+		if (udp_fd[i] == -1)
+			continue;
+		event_set(&udp_ev[i], udp_fd[i], EV_READ|EV_PERSIST,
+		    udp_handle_read, NULL);
+		event_add(&udp_ev[i], NULL);
+	}
+
+	return (0);
+}
+
+/*
+ * udp_socket()
+ *
+ * Open and bind one non-blocking UDP socket of family <af>.  IPv6
+ * sockets only take IPv6, leaving IPv4 to the other one.
+ */
+static int
+udp_socket(int af, const char *port)
+{
+	struct addrinfo hints, *res;
+	int fd, error, on = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = af;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((error = getaddrinfo(NULL, port, &hints, &res)) != 0) {
+		trace("udp_socket() getaddrinfo: %s", gai_strerror(error));
+		return (-1);
+	}
+	if ((fd = socket(res->ai_family, res->ai_socktype,
+	    res->ai_protocol)) == -1) {
+		trace("udp_socket() socket: %s", strerror(errno));
+		freeaddrinfo(res);
+		return (-1);
+	}
+	if ((af == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on,
+	    sizeof(on)) == -1)
+	    || fcntl(fd, F_SETFL, O_NONBLOCK) == -1
+	    || bind(fd, res->ai_addr, res->ai_addrlen) == -1) {
+		trace("udp_socket() %s", strerror(errno));
+		(void)close(fd);
+		freeaddrinfo(res);
+		return (-1);
+	}
+	freeaddrinfo(res);
+	trace("udp_socket() listening on UDP port %s, %s", port,
+	    af == AF_INET6 ? "IPv6" : "IPv4");
+
+	return (fd);
+}
+
+/*
+ * udp_port()
+ *
+ * Port the shared UDP sockets are bound to, in host byte order.
+ */
+u_int16_t
+udp_port(void)
+{
+	return (udp_portnum);
+}
+
+/*
+ * udp_family()
+ *
+ * Can we send to and receive from addresses of family <af>?
+ */
+int
+udp_family(int af)
+{
+	return (udp_fd[af == AF_INET6] != -1);
+}
+
+/*
+ * udp_send()
+ *
+ * Send a datagram.  Failures are only traced; everything sent over UDP
+ * copes with loss anyway.
+ */
+void
+udp_send(const void *buf, size_t len, const struct sockaddr_storage *sa)
+{
+	int fd;
+
+	if ((fd = udp_fd[sa->ss_family == AF_INET6]) == -1)
+		return;
+	if (sendto(fd, buf, len, 0, (const struct sockaddr *)sa,
+	    util_addrlen(sa)) == -1)
+		trace("udp_send() sendto %s: %s", print_host(sa),
+		    strerror(errno));
+}
+
+/*
+ * udp_handle_read()
+ *
+ * Read whatever datagrams are waiting, and hand each to its protocol.
+ */
+static void
+udp_handle_read(int fd, short type, void *arg)
+{
+	struct sockaddr_storage sa;
+	socklen_t salen;
+	u_int8_t buf[UDP_MAX_MSG];
+	ssize_t len;
+
+	for (;;) {
+		salen = sizeof(sa);
+		len = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&sa,
+		    &salen);
+		if (len == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				trace("udp_handle_read() recvfrom: %s",
+				    strerror(errno));
+			return;
+		}
+		if (len == 0 || (sa.ss_family != AF_INET
+		    && sa.ss_family != AF_INET6) || util_addrport(&sa) == 0)
+			continue;
+		if (buf[0] == 'd') {
+			if (dht_enabled)
+				dht_input(buf, len, &sa);
+		} else if ((buf[0] & 0x0f) == UTP_VERSION) {
+			if (utp_enabled)
+				utp_input(buf, len, &sa);
+		}
+	}
+}
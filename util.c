@@ -16,8 +16,12 @@
  */
 
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
 #include <errno.h>
 #include <libgen.h>
 #include <stdio.h>
@@ -150,3 +154,176 @@ util_getbit(u_int8_t *bitfield, u_int32_t bit)
 
 	return ((bitfield[byte] & (1u << (7u - (bit & 7u)))) != 0);
 }
+
+/*
+ * print_host()
+ *
+ * Printable "address:port", or "[address]:port" for IPv6, form of a
+ * socket address.  Uses a few static buffers in turn, so that more than
+ * one can be passed to the same trace() call.
+ */
+const char *
+print_host(const struct sockaddr_storage *ss)
+{
+	static char bufs[4][INET6_ADDRSTRLEN + 9];
+	static int idx;
+	const struct sockaddr_in *sin;
+	const struct sockaddr_in6 *sin6;
+	char host[INET6_ADDRSTRLEN], *buf;
+
+	buf = bufs[idx];
+	idx = (idx + 1) % 4;
+	if (ss->ss_family == AF_INET6) {
+		sin6 = (const struct sockaddr_in6 *)ss;
+		if (inet_ntop(AF_INET6, &sin6->sin6_addr, host,
+		    sizeof(host)) == NULL)
+			strlcpy(host, "?", sizeof(host));
+		snprintf(buf, sizeof(bufs[0]), "[%s]:%d", host,
+		    ntohs(sin6->sin6_port));
+	} else {
+		sin = (const struct sockaddr_in *)ss;
+		if (inet_ntop(AF_INET, &sin->sin_addr, host,
+		    sizeof(host)) == NULL)
+			strlcpy(host, "?", sizeof(host));
+		snprintf(buf, sizeof(bufs[0]), "%s:%d", host,
+		    ntohs(sin->sin_port));
+	}
+
+	return (buf);
+}
+
+/*
+ * util_addrlen()
+ *
+ * Length of the sockaddr actually stored in <ss>, for connect() and
+ * friends.
+ */
+socklen_t
+util_addrlen(const struct sockaddr_storage *ss)
+{
+	if (ss->ss_family == AF_INET6)
+		return (sizeof(struct sockaddr_in6));
+	return (sizeof(struct sockaddr_in));
+}
+
+/*
+ * util_addrport()
+ *
+ * Port of a socket address, in network byte order.
+ */
+u_int16_t
+util_addrport(const struct sockaddr_storage *ss)
+{
+	if (ss->ss_family == AF_INET6)
+		return (((const struct sockaddr_in6 *)ss)->sin6_port);
+	return (((const struct sockaddr_in *)ss)->sin_port);
+}
+
+/*
+ * util_setport()
+ *
+ * Set the port, in network byte order, of a socket address.
+ */
+void
+util_setport(struct sockaddr_storage *ss, u_int16_t port)
+{
+	if (ss->ss_family == AF_INET6)
+		((struct sockaddr_in6 *)ss)->sin6_port = port;
+	else
+		((struct sockaddr_in *)ss)->sin_port = port;
+}
+
+/*
+ * util_hostcmp()
+ *
+ * Do two socket addresses have the same family and address, ignoring the
+ * port?  Returns 0 if so.
+ */
+int
+util_hostcmp(const struct sockaddr_storage *a,
+    const struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family)
+		return (1);
+	if (a->ss_family == AF_INET6)
+		return (memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr,
+		    &((const struct sockaddr_in6 *)b)->sin6_addr,
+		    sizeof(struct in6_addr)));
+	return (memcmp(&((const struct sockaddr_in *)a)->sin_addr,
+	    &((const struct sockaddr_in *)b)->sin_addr,
+	    sizeof(struct in_addr)));
+}
+
+/*
+ * util_addrcmp()
+ *
+ * Are two socket addresses the same, port included?  Returns 0 if so.
+ */
+int
+util_addrcmp(const struct sockaddr_storage *a,
+    const struct sockaddr_storage *b)
+{
+	if (util_hostcmp(a, b) != 0)
+		return (1);
+	return (util_addrport(a) != util_addrport(b));
+}
+
+/*
+ * util_addr_compact()
+ *
+ * Write the compact form of a socket address, address followed by port
+ * in network byte order, to <out>.  Returns its length: 6 for IPv4 and
+ * 18 for IPv6.
+ */
+size_t
+util_addr_compact(const struct sockaddr_storage *ss, u_int8_t *out)
+{
+	const struct sockaddr_in *sin;
+	const struct sockaddr_in6 *sin6;
+
+	if (ss->ss_family == AF_INET6) {
+		sin6 = (const struct sockaddr_in6 *)ss;
+		memcpy(out, &sin6->sin6_addr, 16);
+		memcpy(out + 16, &sin6->sin6_port, 2);
+		return (COMPACT_LEN6);
+	}
+	sin = (const struct sockaddr_in *)ss;
+	memcpy(out, &sin->sin_addr, 4);
+	memcpy(out + 4, &sin->sin_port, 2);
+	return (COMPACT_LEN);
+}
+
+/*
+ * util_addr_uncompact()
+ *
+ * Fill in a socket address from its compact form of <len> bytes, 6 for
+ * IPv4 or 18 for IPv6.  Returns -1 if the address is unusable.
+ */
+int
+util_addr_uncompact(struct sockaddr_storage *ss, const u_int8_t *data,
+    size_t len)
+{
+	struct sockaddr_in *sin;
+	struct sockaddr_in6 *sin6;
+
+	memset(ss, 0, sizeof(*ss));
+	if (len == COMPACT_LEN6) {
+		sin6 = (struct sockaddr_in6 *)ss;
+		sin6->sin6_family = AF_INET6;
+		memcpy(&sin6->sin6_addr, data, 16);
+		memcpy(&sin6->sin6_port, data + 16, 2);
+		if (IN6_IS_ADDR_UNSPECIFIED(&sin6->sin6_addr)
+		    || IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+			return (-1);
+		return (sin6->sin6_port == 0 ? -1 : 0);
+	}
+	if (len != COMPACT_LEN)
+		return (-1);
+	sin = (struct sockaddr_in *)ss;
+	sin->sin_family = AF_INET;
+	memcpy(&sin->sin_addr, data, 4);
+	memcpy(&sin->sin_port, data + 4, 2);
+	if (sin->sin_addr.s_addr == INADDR_ANY)
+		return (-1);
+	return (sin->sin_port == 0 ? -1 : 0);
+}
@@ -0,0 +1,1013 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * uTP (BEP 29) transport.
+ *
+ * Each uTP connection is handed to the rest of the program as one end of
+ * a socketpair, so peers get a bufferevent exactly as they would with
+ * TCP.  We read what they write to it, and send it as uTP packets; what
+ * arrives is put back in order and written to it for them to read.
+ *
+ * Congestion control is LEDBAT: the send window grows while the one-way
+ * delay reported by the other side stays under UTP_TARGET_DELAY above the
+ * lowest delay seen lately, and shrinks as it goes over, so that we back
+ * off before TCP traffic sharing the link notices any queueing.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "includes.h"
+
+/* packet types */
+#define UTP_ST_DATA		0
+#define UTP_ST_FIN		1
+#define UTP_ST_STATE		2
+#define UTP_ST_RESET		3
+#define UTP_ST_SYN		4
+
+#define UTP_EXT_SACK		1
+#define UTP_SACK_BYTES		4
+
+/* connection states */
+#define UTP_SYN_SENT		1
+#define UTP_CONNECTED		2
+#define UTP_FIN_SENT		3
+
+#define UTP_SEQ_MASK		(UTP_MAX_PACKETS - 1)
+#define UTP_MAX_PAYLOAD		(UTP_PACKET_SIZE - UTP_HEADER_LEN)
+
+/* a packet we sent and may have to send again, or one received early */
+struct utp_packet {
+	u_int16_t		seq;
+	u_int8_t		type;
+	int			transmissions;
+	int			need_resend;
+	u_int64_t		sent;
+	size_t			len;	/* of the payload */
+	u_int8_t		buf[UTP_PACKET_SIZE];
+};
+
+struct utp_conn {
+	TAILQ_ENTRY(utp_conn)	conn_list;
+	struct sockaddr_storage	sa;
+	int			state;
+	/* our end of the socketpair */
+	int			fd;
+	struct event		rev;
+	struct event		wev;
+	/* in order data, waiting to be written to fd */
+	struct evbuffer		*rxbuf;
+	u_int16_t		recv_id;
+	u_int16_t		send_id;
+	/* next sequence number we send */
+	u_int16_t		seq_nr;
+	/* last of our packets acked by the other side */
+	u_int16_t		acked;
+	/* last packet received in order */
+	u_int16_t		ack_nr;
+	u_int16_t		fin_seq;
+	int			got_fin;
+	int			fin_delivered;
+	int			app_eof;
+	int			ack_pending;
+	int			retries;
+	struct utp_packet	*out[UTP_MAX_PACKETS];
+	struct utp_packet	*in[UTP_MAX_PACKETS];
+	size_t			in_flight;
+	size_t			max_window;
+	size_t			peer_window;
+	/* for timestamp_difference_microseconds in what we send */
+	u_int32_t		reply_micro;
+	/* lowest delay seen in each of the last few minutes */
+	u_int32_t		delay_base[UTP_DELAY_HISTORY];
+	time_t			delay_minute;
+	u_int32_t		our_delay;
+	/* milliseconds */
+	int			rtt;
+	int			rtt_var;
+	int			rto;
+	/* when the oldest unacked packet times out, 0 if none */
+	u_int64_t		timeout;
+	/* called if the connection could not be set up */
+	void			(*failcb)(void *);
+	void			*arg;
+};
+
+int utp_enabled = 1;
+
+static TAILQ_HEAD(utp_conns, utp_conn) utp_conns =
+    TAILQ_HEAD_INITIALIZER(utp_conns);
+static struct event	utp_timer;
+static int		utp_timer_running;
+static void		(*utp_acceptcb)(int, const struct sockaddr_storage *, void *);
+static void		*utp_acceptarg;
+
+static u_int64_t	 utp_now(void);
+static u_int16_t	 utp_random16(void);
+static int		 utp_socketpair(int *);
+static struct utp_conn	*utp_conn_create(const struct sockaddr_storage *, int);
+static void		 utp_conn_free(struct utp_conn *);
+static struct utp_conn	*utp_conn_find(const struct sockaddr_storage *, u_int16_t);
+static void		 utp_fail(struct utp_conn *);
+static void		 utp_header(struct utp_conn *, u_int8_t *, int,
+			    u_int16_t, u_int64_t);
+static u_int32_t	 utp_rcv_window(struct utp_conn *);
+static void		 utp_transmit(struct utp_conn *, struct utp_packet *);
+static void		 utp_queue(struct utp_conn *, struct utp_packet *);
+static int		 utp_window_open(struct utp_conn *, size_t);
+static void		 utp_flush(struct utp_conn *);
+static void		 utp_send_state(struct utp_conn *);
+static void		 utp_send_reset(const struct sockaddr_storage *, u_int16_t,
+			    u_int16_t);
+static void		 utp_accept(const struct sockaddr_storage *, u_int16_t,
+			    u_int16_t, u_int32_t);
+static size_t		 utp_packet_acked(struct utp_conn *,
+			    struct utp_packet *, u_int64_t);
+static int		 utp_ack(struct utp_conn *, u_int16_t,
+			    const u_int8_t *, size_t, u_int64_t);
+static void		 utp_delay_sample(struct utp_conn *, u_int32_t);
+static void		 utp_cwnd(struct utp_conn *, size_t);
+static void		 utp_receive(struct utp_conn *, int, u_int16_t,
+			    const u_int8_t *, size_t);
+static void		 utp_deliver(struct utp_conn *);
+static void		 utp_handle_app_read(int, short, void *);
+static void		 utp_handle_app_write(int, short, void *);
+static void		 utp_tick(int, short, void *);
+
+/*
+ * utp_now()
+ *
+ * Current time in microseconds.
+ */
+static u_int64_t
+utp_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((u_int64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+/*
+ * utp_random16()
+ *
+ * Random connection id or initial sequence number.
+ */
+static u_int16_t
+utp_random16(void)
+{
+#ifdef __OpenBSD__
+	return (arc4random() & 0xffff);
+#else
+	return (random() & 0xffff);
+#endif
+}
+
+/*
+ * utp_socketpair()
+ *
+ * Make the non-blocking socketpair standing in for a connection.
+ * sv[0] is ours, sv[1] the application's.
+ */
+static int
+utp_socketpair(int *sv)
+{
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		trace("utp_socketpair() %s", strerror(errno));
+		return (-1);
+	}
+	if (fcntl(sv[0], F_SETFL, O_NONBLOCK) == -1
+	    || fcntl(sv[1], F_SETFL, O_NONBLOCK) == -1) {
+		trace("utp_socketpair() fcntl: %s", strerror(errno));
+		(void)close(sv[0]);
+		(void)close(sv[1]);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * utp_conn_create()
+ *
+ * Allocate a connection to <sa>, with <fd> as our end of its socketpair.
+ */
+static struct utp_conn *
+utp_conn_create(const struct sockaddr_storage *sa, int fd)
+{
+	struct utp_conn *c;
+	struct timeval tv;
+	int i;
+
+	c = xmalloc(sizeof(*c));
+	memset(c, 0, sizeof(*c));
+	c->sa = *sa;
+	c->fd = fd;
+	if ((c->rxbuf = evbuffer_new()) == NULL)
+		errx(1, "utp_conn_create: evbuffer_new failure");
+	c->max_window = UTP_MAX_CWND_INCREASE;
+	c->peer_window = UTP_MAX_PAYLOAD;
+	c->rto = UTP_INITIAL_RTO;
+	for (i = 0; i < UTP_DELAY_HISTORY; i++)
+		c->delay_base[i] = UINT32_MAX;
+	event_set(&c->rev, fd, EV_READ|EV_PERSIST, utp_handle_app_read, c);
+	event_set(&c->wev, fd, EV_WRITE, utp_handle_app_write, c);
+	TAILQ_INSERT_TAIL(&utp_conns, c, conn_list);
+
+	if (!utp_timer_running) {
+		utp_timer_running = 1;
+		evtimer_set(&utp_timer, utp_tick, NULL);
+		timerclear(&tv);
+		tv.tv_usec = UTP_TICK * 1000;
+		evtimer_add(&utp_timer, &tv);
+	}
+
+	return (c);
+}
+
+/*
+ * utp_conn_free()
+ *
+ * Tear down a connection.  Closing our end of the socketpair tells the
+ * application, if it is still there.
+ */
+static void
+utp_conn_free(struct utp_conn *c)
+{
+	int i;
+
+	trace("utp_conn_free() connection to %s",
+	    print_host(&c->sa));
+	event_del(&c->rev);
+	event_del(&c->wev);
+	(void)close(c->fd);
+	for (i = 0; i < UTP_MAX_PACKETS; i++) {
+		if (c->out[i] != NULL)
+			xfree(c->out[i]);
+		if (c->in[i] != NULL)
+			xfree(c->in[i]);
+	}
+	evbuffer_free(c->rxbuf);
+	TAILQ_REMOVE(&utp_conns, c, conn_list);
+	xfree(c);
+}
+
+/*
+ * utp_conn_find()
+ *
+ * Find the connection with <sa> which we know as <id>.
+ */
+static struct utp_conn *
+utp_conn_find(const struct sockaddr_storage *sa, u_int16_t id)
+{
+	struct utp_conn *c;
+
+	TAILQ_FOREACH(c, &utp_conns, conn_list)
+		if (c->recv_id == id && util_addrcmp(&c->sa, sa) == 0)
+			return (c);
+	return (NULL);
+}
+
+/*
+ * utp_connect()
+ *
+ * Start connecting to <sa>.  Returns the application's end of the
+ * connection, which can be written to straight away, or -1.  If the other
+ * side never answers, the connection is closed and <cb> is called with
+ * <arg>, unless the application closed its end first.
+ */
+int
+utp_connect(const struct sockaddr_storage *sa, void (*cb)(void *), void *arg)
+{
+	struct utp_conn *c;
+	struct utp_packet *pkt;
+	int sv[2];
+
+	if (!utp_enabled || !udp_family(sa->ss_family)
+	    || utp_socketpair(sv) == -1)
+		return (-1);
+	trace("utp_connect() to %s", print_host(sa));
+	c = utp_conn_create(sa, sv[0]);
+	c->state = UTP_SYN_SENT;
+	c->recv_id = utp_random16();
+	c->send_id = c->recv_id + 1;
+	c->seq_nr = 1;
+	c->acked = 0;
+	c->failcb = cb;
+	c->arg = arg;
+
+	pkt = xmalloc(sizeof(*pkt));
+	memset(pkt, 0, sizeof(*pkt));
+	pkt->type = UTP_ST_SYN;
+	utp_queue(c, pkt);
+
+	return (sv[1]);
+}
+
+/*
+ * utp_listen()
+ *
+ * Accept incoming connections, handing each one's end of the socketpair
+ * and address to <cb>.
+ */
+void
+utp_listen(void (*cb)(int, const struct sockaddr_storage *, void *), void *arg)
+{
+	utp_acceptcb = cb;
+	utp_acceptarg = arg;
+}
+
+/*
+ * utp_fail()
+ *
+ * Connection setup failed.  Let the application know, so it can try some
+ * other way, unless it has already closed its end.
+ */
+static void
+utp_fail(struct utp_conn *c)
+{
+	void (*cb)(void *) = c->failcb;
+	void *arg = c->arg;
+	u_int8_t buf[512];
+	ssize_t n;
+
+	trace("utp_fail() could not connect to %s",
+	    print_host(&c->sa));
+	/* whatever it wrote will have to be sent again anyway */
+	while ((n = read(c->fd, buf, sizeof(buf))) > 0)
+		;
+	utp_conn_free(c);
+	if (n == -1 && cb != NULL)
+		cb(arg);
+}
+
+/*
+ * utp_rcv_window()
+ *
+ * How much more we are willing to receive.
+ */
+static u_int32_t
+utp_rcv_window(struct utp_conn *c)
+{
+	size_t len = EVBUFFER_LENGTH(c->rxbuf);
+
+	return (len >= UTP_RCV_WINDOW ? 0 : UTP_RCV_WINDOW - len);
+}
+
+/*
+ * utp_header()
+ *
+ * Fill in a packet header.
+ */
+static void
+utp_header(struct utp_conn *c, u_int8_t *buf, int type, u_int16_t seq,
+    u_int64_t now)
+{
+	u_int32_t l;
+	u_int16_t s;
+
+	buf[0] = (type << 4) | UTP_VERSION;
+	buf[1] = 0;
+	s = htons(type == UTP_ST_SYN ? c->recv_id : c->send_id);
+	memcpy(buf + 2, &s, sizeof(s));
+	l = htonl((u_int32_t)now);
+	memcpy(buf + 4, &l, sizeof(l));
+	l = htonl(c->reply_micro);
+	memcpy(buf + 8, &l, sizeof(l));
+	l = htonl(utp_rcv_window(c));
+	memcpy(buf + 12, &l, sizeof(l));
+	s = htons(seq);
+	memcpy(buf + 16, &s, sizeof(s));
+	s = htons(c->ack_nr);
+	memcpy(buf + 18, &s, sizeof(s));
+}
+
+/*
+ * utp_transmit()
+ *
+ * Send, or send again, one of our packets.
+ */
+static void
+utp_transmit(struct utp_conn *c, struct utp_packet *pkt)
+{
+	u_int64_t now;
+
+	now = utp_now();
+	if (pkt->need_resend) {
+		pkt->need_resend = 0;
+		c->in_flight += pkt->len;
+	}
+	pkt->transmissions++;
+	pkt->sent = now;
+	utp_header(c, pkt->buf, pkt->type, pkt->seq, now);
+	udp_send(pkt->buf, UTP_HEADER_LEN + pkt->len, &c->sa);
+	c->ack_pending = 0;
+	if (c->timeout == 0)
+		c->timeout = now + (u_int64_t)c->rto * 1000;
+}
+
+/*
+ * utp_queue()
+ *
+ * Give a new packet the next sequence number, keep it until it is acked,
+ * and send it.
+ */
+static void
+utp_queue(struct utp_conn *c, struct utp_packet *pkt)
+{
+	pkt->seq = c->seq_nr++;
+	c->out[pkt->seq & UTP_SEQ_MASK] = pkt;
+	c->in_flight += pkt->len;
+	utp_transmit(c, pkt);
+}
+
+/*
+ * utp_window_open()
+ *
+ * May we put another <len> bytes on the wire?  One packet at a time is
+ * always allowed, so a closed window gets probed.
+ */
+static int
+utp_window_open(struct utp_conn *c, size_t len)
+{
+	if ((u_int16_t)(c->seq_nr - c->acked) >= UTP_MAX_PACKETS)
+		return (0);
+	if (c->in_flight == 0)
+		return (1);
+	return (c->in_flight + len <= MIN(c->max_window, c->peer_window));
+}
+
+/*
+ * utp_flush()
+ *
+ * Send whatever the window allows: first anything presumed lost, then new
+ * data from the application.
+ */
+static void
+utp_flush(struct utp_conn *c)
+{
+	struct utp_packet *pkt;
+	u_int16_t s;
+	ssize_t n;
+
+	if (c->state == UTP_SYN_SENT)
+		return;
+	for (s = c->acked + 1; s != c->seq_nr; s++) {
+		if ((pkt = c->out[s & UTP_SEQ_MASK]) == NULL
+		    || !pkt->need_resend)
+			continue;
+		if (c->in_flight != 0
+		    && c->in_flight + pkt->len > MIN(c->max_window,
+		    c->peer_window))
+			break;
+		utp_transmit(c, pkt);
+	}
+	while (c->state == UTP_CONNECTED
+	    && utp_window_open(c, UTP_MAX_PAYLOAD)) {
+		pkt = xmalloc(sizeof(*pkt));
+		memset(pkt, 0, sizeof(*pkt));
+		n = read(c->fd, pkt->buf + UTP_HEADER_LEN, UTP_MAX_PAYLOAD);
+		if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+			xfree(pkt);
+			break;
+		}
+		if (n <= 0) {
+			/* the application is done; say goodbye */
+			trace("utp_flush() closing connection to %s",
+			    print_host(&c->sa));
+			c->app_eof = 1;
+			c->state = UTP_FIN_SENT;
+			c->fin_seq = c->seq_nr;
+			pkt->type = UTP_ST_FIN;
+			utp_queue(c, pkt);
+			break;
+		}
+		pkt->type = UTP_ST_DATA;
+		pkt->len = n;
+		utp_queue(c, pkt);
+	}
+	/* only listen to the application while we can send what it says */
+	if (c->state == UTP_CONNECTED && utp_window_open(c, UTP_MAX_PAYLOAD))
+		event_add(&c->rev, NULL);
+	else
+		event_del(&c->rev);
+}
+
+/*
+ * utp_send_state()
+ *
+ * Send an ack, selectively acking anything received beyond a gap.
+ */
+static void
+utp_send_state(struct utp_conn *c)
+{
+	u_int8_t buf[UTP_HEADER_LEN + 2 + UTP_SACK_BYTES], *sack;
+	struct utp_packet *pkt;
+	u_int16_t s;
+	size_t len;
+	int i, any;
+
+	utp_header(c, buf, UTP_ST_STATE, c->seq_nr, utp_now());
+	len = UTP_HEADER_LEN;
+	sack = buf + UTP_HEADER_LEN + 2;
+	memset(sack, 0, UTP_SACK_BYTES);
+	any = 0;
+	/* bit 0 is ack_nr + 2; ack_nr + 1 is what we are missing */
+	for (i = 0; i < UTP_SACK_BYTES * 8; i++) {
+		s = c->ack_nr + 2 + i;
+		if ((pkt = c->in[s & UTP_SEQ_MASK]) != NULL && pkt->seq == s) {
+			sack[i / 8] |= 1 << (i % 8);
+			any = 1;
+		}
+	}
+	if (any) {
+		buf[1] = UTP_EXT_SACK;
+		buf[len++] = 0;
+		buf[len++] = UTP_SACK_BYTES;
+		len += UTP_SACK_BYTES;
+	}
+	udp_send(buf, len, &c->sa);
+	c->ack_pending = 0;
+}
+
+/*
+ * utp_send_reset()
+ *
+ * Tell the sender of a packet for a connection we don't know to go away.
+ */
+static void
+utp_send_reset(const struct sockaddr_storage *sa, u_int16_t id, u_int16_t seq)
+{
+	u_int8_t buf[UTP_HEADER_LEN];
+	u_int32_t l;
+	u_int16_t s;
+
+	memset(buf, 0, sizeof(buf));
+	buf[0] = (UTP_ST_RESET << 4) | UTP_VERSION;
+	s = htons(id);
+	memcpy(buf + 2, &s, sizeof(s));
+	l = htonl((u_int32_t)utp_now());
+	memcpy(buf + 4, &l, sizeof(l));
+	s = htons(utp_random16());
+	memcpy(buf + 16, &s, sizeof(s));
+	s = htons(seq);
+	memcpy(buf + 18, &s, sizeof(s));
+	udp_send(buf, sizeof(buf), sa);
+}
+
+/*
+ * utp_accept()
+ *
+ * Handle a SYN.
+ */
+static void
+utp_accept(const struct sockaddr_storage *sa, u_int16_t id, u_int16_t seq,
+    u_int32_t reply_micro)
+{
+	struct utp_conn *c;
+	int sv[2];
+
+	/* a repeated SYN means our reply got lost */
+	if ((c = utp_conn_find(sa, id + 1)) != NULL) {
+		utp_send_state(c);
+		return;
+	}
+	if (utp_acceptcb == NULL || utp_socketpair(sv) == -1)
+		return;
+	trace("utp_accept() connection from %s", print_host(sa));
+	c = utp_conn_create(sa, sv[0]);
+	c->state = UTP_CONNECTED;
+	c->recv_id = id + 1;
+	c->send_id = id;
+	c->seq_nr = utp_random16();
+	c->acked = c->seq_nr - 1;
+	c->ack_nr = seq;
+	c->reply_micro = reply_micro;
+	utp_send_state(c);
+	utp_acceptcb(sv[1], sa, utp_acceptarg);
+	utp_flush(c);
+}
+
+/*
+ * utp_packet_acked()
+ *
+ * One of our packets got through.  Returns its payload length.
+ */
+static size_t
+utp_packet_acked(struct utp_conn *c, struct utp_packet *pkt, u_int64_t now)
+{
+	size_t len = pkt->len;
+	int ms, delta;
+
+	/* only unambiguous round trips count */
+	if (pkt->transmissions == 1) {
+		ms = (now - pkt->sent) / 1000;
+		if (c->rtt == 0) {
+			c->rtt = ms;
+			c->rtt_var = ms / 2;
+		} else {
+			delta = c->rtt - ms;
+			c->rtt_var += (abs(delta) - c->rtt_var) / 4;
+			c->rtt += (ms - c->rtt) / 8;
+		}
+		c->rto = MAX(c->rtt + 4 * c->rtt_var, UTP_MIN_RTO);
+	}
+	if (!pkt->need_resend)
+		c->in_flight -= len;
+	c->out[pkt->seq & UTP_SEQ_MASK] = NULL;
+	xfree(pkt);
+
+	return (len);
+}
+
+/*
+ * utp_ack()
+ *
+ * Process the ack number and selective acks of an incoming packet.
+ * Returns -1 if that finished off the connection.
+ */
+static int
+utp_ack(struct utp_conn *c, u_int16_t ack, const u_int8_t *sack,
+    size_t sacklen, u_int64_t now)
+{
+	struct utp_packet *pkt;
+	size_t bytes = 0;
+	u_int16_t s, old;
+	int i, nsacked = 0;
+
+	old = c->acked;
+	/* ignore acks for anything we haven't sent */
+	if ((u_int16_t)(ack - c->acked) < (u_int16_t)(c->seq_nr - c->acked)) {
+		while (c->acked != ack) {
+			c->acked++;
+			if ((pkt = c->out[c->acked & UTP_SEQ_MASK]) != NULL)
+				bytes += utp_packet_acked(c, pkt, now);
+		}
+	}
+	for (i = 0; sack != NULL && i < (int)sacklen * 8; i++) {
+		if (!(sack[i / 8] & (1 << (i % 8))))
+			continue;
+		s = ack + 2 + i;
+		if ((u_int16_t)(s - c->acked) >= (u_int16_t)(c->seq_nr - c->acked))
+			continue;
+		nsacked++;
+		if ((pkt = c->out[s & UTP_SEQ_MASK]) != NULL && pkt->seq == s)
+			bytes += utp_packet_acked(c, pkt, now);
+	}
+	/* enough got through after a gap that it must be a loss */
+	if (nsacked >= UTP_DUP_ACKS) {
+		s = c->acked + 1;
+		if ((pkt = c->out[s & UTP_SEQ_MASK]) != NULL
+		    && pkt->transmissions == 1) {
+			trace("utp_ack() fast retransmit of %u to %s", s,
+			    print_host(&c->sa));
+			c->max_window = MAX(c->max_window / 2, UTP_MIN_WINDOW);
+			utp_transmit(c, pkt);
+		}
+	}
+	if (c->acked != old || bytes > 0) {
+		c->retries = 0;
+		c->timeout = c->acked + 1 == c->seq_nr ? 0
+		    : now + (u_int64_t)c->rto * 1000;
+		utp_cwnd(c, bytes);
+	}
+	if (c->state == UTP_FIN_SENT && c->acked == c->fin_seq) {
+		utp_conn_free(c);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * utp_delay_sample()
+ *
+ * The other side says our last packet took <delay> microseconds to get
+ * there.  Clocks are not synchronised, so only the difference from the
+ * lowest such figure lately means anything.
+ */
+static void
+utp_delay_sample(struct utp_conn *c, u_int32_t delay)
+{
+	u_int32_t base;
+	time_t minute;
+	int i, slot;
+
+	minute = time(NULL) / 60;
+	slot = minute % UTP_DELAY_HISTORY;
+	if (minute != c->delay_minute) {
+		c->delay_minute = minute;
+		c->delay_base[slot] = delay;
+	} else if (delay < c->delay_base[slot])
+		c->delay_base[slot] = delay;
+	base = UINT32_MAX;
+	for (i = 0; i < UTP_DELAY_HISTORY; i++)
+		base = MIN(base, c->delay_base[i]);
+	c->our_delay = delay - base;
+}
+
+/*
+ * utp_cwnd()
+ *
+ * LEDBAT: grow or shrink the window in proportion to how far the queueing
+ * delay is from target, scaled by how much of the window was just acked.
+ */
+static void
+utp_cwnd(struct utp_conn *c, size_t bytes)
+{
+	int64_t off_target, gain, window;
+
+	if (bytes == 0)
+		return;
+	off_target = (int64_t)UTP_TARGET_DELAY - c->our_delay;
+	gain = (int64_t)UTP_MAX_CWND_INCREASE * off_target / UTP_TARGET_DELAY
+	    * (int64_t)MIN(bytes, c->max_window)
+	    / (int64_t)MAX(bytes, c->max_window);
+	window = (int64_t)c->max_window + gain;
+	if (window < UTP_MIN_WINDOW)
+		window = UTP_MIN_WINDOW;
+	if (window > UTP_RCV_WINDOW)
+		window = UTP_RCV_WINDOW;
+	c->max_window = window;
+}
+
+/*
+ * utp_receive()
+ *
+ * Handle a DATA or FIN packet, keeping it aside if it arrived early.
+ */
+static void
+utp_receive(struct utp_conn *c, int type, u_int16_t seq,
+    const u_int8_t *payload, size_t len)
+{
+	struct utp_packet *pkt;
+	u_int16_t d;
+
+	c->ack_pending = 1;
+	if (c->got_fin)
+		return;
+	d = seq - c->ack_nr - 1;
+	/* old duplicate, or too far ahead to keep */
+	if (d >= UTP_MAX_PACKETS)
+		return;
+	if (d > 0) {
+		if (c->in[seq & UTP_SEQ_MASK] != NULL || len > UTP_MAX_PAYLOAD)
+			return;
+		pkt = xmalloc(sizeof(*pkt));
+		pkt->seq = seq;
+		pkt->type = type;
+		pkt->len = len;
+		memcpy(pkt->buf, payload, len);
+		c->in[seq & UTP_SEQ_MASK] = pkt;
+		return;
+	}
+	pkt = NULL;
+	for (;;) {
+		c->ack_nr = seq;
+		if (len > 0 && evbuffer_add(c->rxbuf, payload, len) == -1)
+			errx(1, "utp_receive: evbuffer_add failure");
+		if (pkt != NULL)
+			xfree(pkt);
+		if (type == UTP_ST_FIN) {
+			c->got_fin = 1;
+			break;
+		}
+		/* and whatever was waiting for it */
+		seq = c->ack_nr + 1;
+		if ((pkt = c->in[seq & UTP_SEQ_MASK]) == NULL || pkt->seq != seq)
+			break;
+		c->in[seq & UTP_SEQ_MASK] = NULL;
+		type = pkt->type;
+		payload = pkt->buf;
+		len = pkt->len;
+	}
+}
+
+/*
+ * utp_deliver()
+ *
+ * Write in order data to the application, and pass on end of stream.
+ */
+static void
+utp_deliver(struct utp_conn *c)
+{
+	ssize_t n;
+
+	while (EVBUFFER_LENGTH(c->rxbuf) > 0) {
+		n = write(c->fd, EVBUFFER_DATA(c->rxbuf),
+		    EVBUFFER_LENGTH(c->rxbuf));
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EINTR) {
+				event_add(&c->wev, NULL);
+				return;
+			}
+			/* nobody to read it */
+			evbuffer_drain(c->rxbuf, EVBUFFER_LENGTH(c->rxbuf));
+			break;
+		}
+		evbuffer_drain(c->rxbuf, n);
+	}
+	if (c->got_fin && !c->fin_delivered) {
+		c->fin_delivered = 1;
+		(void)shutdown(c->fd, SHUT_WR);
+	}
+}
+
+/*
+ * utp_handle_app_read()
+ *
+ * The application wrote something for us to send.
+ */
+static void
+utp_handle_app_read(int fd, short type, void *arg)
+{
+	utp_flush(arg);
+}
+
+/*
+ * utp_handle_app_write()
+ *
+ * The application read some of what we had for it; carry on, and tell
+ * the other side about the room that made.
+ */
+static void
+utp_handle_app_write(int fd, short type, void *arg)
+{
+	struct utp_conn *c = arg;
+
+	utp_deliver(c);
+	utp_send_state(c);
+}
+
+/*
+ * utp_input()
+ *
+ * Handle a uTP packet from the shared UDP socket.
+ */
+void
+utp_input(u_int8_t *buf, size_t len, const struct sockaddr_storage *sa)
+{
+	struct utp_conn *c;
+	const u_int8_t *sack = NULL;
+	u_int64_t now;
+	u_int32_t ts, diff, wnd;
+	u_int16_t id, seq, ack;
+	size_t off, sacklen = 0;
+	int type, ext, next;
+
+	if (len < UTP_HEADER_LEN || (type = buf[0] >> 4) > UTP_ST_SYN)
+		return;
+	memcpy(&id, buf + 2, sizeof(id));
+	id = ntohs(id);
+	memcpy(&ts, buf + 4, sizeof(ts));
+	ts = ntohl(ts);
+	memcpy(&diff, buf + 8, sizeof(diff));
+	diff = ntohl(diff);
+	memcpy(&wnd, buf + 12, sizeof(wnd));
+	wnd = ntohl(wnd);
+	memcpy(&seq, buf + 16, sizeof(seq));
+	seq = ntohs(seq);
+	memcpy(&ack, buf + 18, sizeof(ack));
+	ack = ntohs(ack);
+	now = utp_now();
+
+	if (type == UTP_ST_SYN) {
+		utp_accept(sa, id, seq, (u_int32_t)now - ts);
+		return;
+	}
+	if ((c = utp_conn_find(sa, id)) == NULL) {
+		if (type != UTP_ST_RESET)
+			utp_send_reset(sa, id, seq);
+		return;
+	}
+	for (ext = buf[1], off = UTP_HEADER_LEN; ext != 0;
+	    off += 2 + buf[off + 1]) {
+		if (off + 2 > len || off + 2 + buf[off + 1] > len)
+			return;
+		if (ext == UTP_EXT_SACK) {
+			sack = buf + off + 2;
+			sacklen = buf[off + 1];
+		}
+		next = buf[off];
+		ext = next;
+	}
+
+	c->reply_micro = (u_int32_t)now - ts;
+	c->peer_window = wnd;
+	if (type == UTP_ST_RESET) {
+		trace("utp_input() reset from %s", print_host(sa));
+		if (c->state == UTP_SYN_SENT)
+			utp_fail(c);
+		else
+			utp_conn_free(c);
+		return;
+	}
+	if (c->state == UTP_SYN_SENT) {
+		if (type != UTP_ST_STATE)
+			return;
+		trace("utp_input() connected to %s",
+		    print_host(sa));
+		c->state = UTP_CONNECTED;
+		c->ack_nr = seq - 1;
+	}
+	if (diff != 0)
+		utp_delay_sample(c, diff);
+	if (utp_ack(c, ack, sack, sacklen, now) == -1)
+		return;
+	if (type == UTP_ST_DATA || type == UTP_ST_FIN)
+		utp_receive(c, type, seq, buf + off, len - off);
+	utp_deliver(c);
+	utp_flush(c);
+	if (c->ack_pending)
+		utp_send_state(c);
+}
+
+/*
+ * utp_tick()
+ *
+ * Called every UTP_TICK milliseconds while there are connections, to
+ * retransmit after timeouts and give up on dead connections.
+ */
+static void
+utp_tick(int fd, short type, void *arg)
+{
+	struct utp_conn *c, *nxt;
+	struct utp_packet *pkt;
+	struct timeval tv;
+	u_int64_t now;
+	u_int16_t s;
+
+	now = utp_now();
+	for (c = TAILQ_FIRST(&utp_conns); c != NULL; c = nxt) {
+		nxt = TAILQ_NEXT(c, conn_list);
+		if (c->timeout == 0 || now < c->timeout)
+			continue;
+		if (c->state == UTP_SYN_SENT && c->retries >= UTP_SYN_RETRIES) {
+			utp_fail(c);
+			continue;
+		}
+		if (c->retries >= UTP_MAX_RETRIES) {
+			trace("utp_tick() connection to %s timed out",
+			    print_host(&c->sa));
+			utp_conn_free(c);
+			continue;
+		}
+		c->retries++;
+		c->rto = MIN(c->rto * 2, UTP_MAX_RTO);
+		c->max_window = UTP_MIN_WINDOW;
+		/* everything in flight is presumed lost */
+		for (s = c->acked + 1; s != c->seq_nr; s++) {
+			if ((pkt = c->out[s & UTP_SEQ_MASK]) != NULL
+			    && !pkt->need_resend) {
+				pkt->need_resend = 1;
+				c->in_flight -= pkt->len;
+			}
+		}
+		c->timeout = now + (u_int64_t)c->rto * 1000;
+		/* the oldest goes now; utp_flush() doesn't send SYNs */
+		for (s = c->acked + 1; s != c->seq_nr; s++) {
+			if ((pkt = c->out[s & UTP_SEQ_MASK]) != NULL) {
+				utp_transmit(c, pkt);
+				break;
+			}
+		}
+		utp_flush(c);
+	}
+
+	if (TAILQ_EMPTY(&utp_conns)) {
+		utp_timer_running = 0;
+		return;
+	}
+	timerclear(&tv);
+	tv.tv_usec = UTP_TICK * 1000;
+	evtimer_add(&utp_timer, &tv);
+}